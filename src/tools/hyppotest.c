@@ -1,15 +1,23 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "hyppotrace.h"
 
 int do_screen_shot_ascii(FILE *f);
 int do_screen_shot(char *filename);
+int expect_screen_image(char *filename, int tolerance);
+int expect_screen_text(char *filename);
 void get_video_state(void);
 
 #define MEM_WRITE16(CPU, ADDR, VALUE)                                                                                       \
@@ -79,6 +87,32 @@ struct cpu {
   struct termination_conditions term;
   bool stack_overflow;
   bool stack_underflow;
+
+  // 28-bit base address of each 4KB page of the 16-bit address space, for
+  // the current $00/$01, MAP and $D030/$D031 state.  Cleared map_valid
+  // causes addr_to_28bit() to rebuild them.
+  bool map_valid;
+  unsigned int read_page[16];
+  unsigned int write_page[16];
+
+  // $00 = $41 forces full CPU speed, $00 = $40 releases it
+  bool force_fast;
+  // Cycles and elapsed time since the routine was called, including
+  // badline stalls.  See cpu_account_cycles().
+  unsigned long long cycles;
+  unsigned long long time_ps;
+  // Raster position, which restarts at the top of the frame with each call
+  unsigned int raster_line;
+  unsigned long long raster_ps;
+
+  // SD card and F011 model state (see io_write()).  io_job is the sector
+  // transfer in progress, if any, which completes after io_job_cycles.
+  unsigned char sd_status;
+  unsigned char sd_write_gate;
+  bool sd_buffer_mapped;
+  unsigned char io_job;
+  unsigned int io_job_sector;
+  unsigned int io_job_cycles;
 };
 
 #define FLAG_N 0x80
@@ -93,18 +127,72 @@ struct cpu {
 // By default we log to stderr
 FILE *logfile = NULL;
 char logfilename[8192] = "";
-#define TESTLOGFILE "/tmp/hyppotest.tmp"
+// Per-process, so that parallel test workers don't collide
+#define TESTLOGFILE_PATTERN "/tmp/hyppotest.%d.tmp"
+#define TESTTRACEFILE_PATTERN "/tmp/hyppotest.%d.trace"
+char testlogfile[1024] = "";
 
 bool fail_on_stack_overflow = true;
 bool fail_on_stack_underflow = true;
 bool log_on_failure = false;
+// Set by "expect failure", for tests of the checks themselves: the test only
+// passes if it fails with this text in its log.
+char expected_failure[1024] = "";
+
+// Binary instruction trace being written, if any.  Unless trace_keep is set,
+// it is only kept if the test fails.
+FILE *trace_file = NULL;
+char trace_filename[1024] = "";
+bool trace_keep = false;
+// "trace on failure" outside of a test traces every test that follows.  Each
+// test opens its own trace, so that forked test workers never share one.
+bool trace_every_test = false;
+bool in_test = false;
+// 28-bit effective address of the current instruction, while tracing
+unsigned int trace_ea = 0;
+void trace_close(bool failed);
+int trace_open_for_test(void);
+int expect_trace_contains(char *filename, char *text);
+int expect_file_contains(char *filename, char *text);
 int test_passes = 0;
 int test_fails = 0;
+
+// Number of tests to run concurrently in forked workers, and the number
+// currently running.  test_worker is set in the worker processes.
+int max_jobs = 1;
+int running_jobs = 0;
+bool test_worker = false;
+// Where hyppotest was run from, so that we can find hyppotrace beside it
+char tool_dir[1024] = "";
 char test_name[1024] = "unnamed test";
 char safe_name[1024] = "unnamed_test";
 
 unsigned char breakpoints[65536];
 
+// Watchpoints on 28-bit addresses.  watch_pages[] has the WATCH_* bits of
+// all watchpoints on each 4KB page, so that accesses to unwatched pages only
+// cost a table lookup.  They only trigger while the CPU is executing an
+// instruction (including any DMA it starts), not for the test script's own
+// accesses.
+#define WATCH_READ 0x01
+#define WATCH_WRITE 0x02
+#define WATCH_VALUE 0x04
+#define WATCH_PAGE_BITS 12
+#define WATCH_PAGES (1 << (28 - WATCH_PAGE_BITS))
+#define WATCH_PAGE(ADDR) (((ADDR) >> WATCH_PAGE_BITS) & (WATCH_PAGES - 1))
+typedef struct watchpoint {
+  unsigned int first;
+  unsigned int last;
+  int type;
+  unsigned char value; // For WATCH_VALUE
+} watchpoint;
+#define MAX_WATCHPOINTS 64
+watchpoint watchpoints[MAX_WATCHPOINTS];
+int watchpoint_count = 0;
+unsigned char watch_pages[WATCH_PAGES];
+bool cpu_executing = false;
+void decode_cache_flush(void);
+
 #define COLOURRAM_SIZE (32 * 1024)
 #define CHIPRAM_SIZE (384 * 1024)
 #define HYPPORAM_SIZE (16 * 1024)
@@ -127,6 +215,20 @@ unsigned int hypporam_blame[HYPPORAM_SIZE];
 unsigned int colourram_blame[COLOURRAM_SIZE];
 unsigned int ffdram_blame[65536];
 
+// Pages where the current and expected memory contents may differ, i.e.,
+// that have been written to since they were last known to match.  Stashing
+// and comparing RAM only needs to look at these.  DIRTY_SNAPSHOT separately
+// marks pages written since the last snapshot was saved or restored.
+#define DIRTY_PAGE_BITS 8
+#define DIRTY_PAGE_SIZE (1 << DIRTY_PAGE_BITS)
+#define DIRTY_EXPECTED 0x01
+#define DIRTY_SNAPSHOT 0x02
+#define DIRTY_ALL (DIRTY_EXPECTED | DIRTY_SNAPSHOT)
+unsigned char chipram_dirty[CHIPRAM_SIZE >> DIRTY_PAGE_BITS];
+unsigned char hypporam_dirty[HYPPORAM_SIZE >> DIRTY_PAGE_BITS];
+unsigned char colourram_dirty[COLOURRAM_SIZE >> DIRTY_PAGE_BITS];
+unsigned char ffdram_dirty[65536 >> DIRTY_PAGE_BITS];
+
 #define MAX_HYPPO_SYMBOLS HYPPORAM_SIZE
 typedef struct hyppo_symbol {
   char *name;
@@ -141,10 +243,160 @@ int symbol_count = 0;
 
 hyppo_symbol *sym_by_addr[CHIPRAM_SIZE] = { NULL };
 
+// Name hash and address-sorted index over a symbol table, so that label
+// lookups don't need to scan every symbol.  Both are rebuilt lazily on the
+// next lookup after the table has been modified.
+typedef struct symbol_index {
+  hyppo_symbol *symbols;
+  int *count;
+  int max_symbols;
+  bool hash_valid;
+  bool sorted_valid;
+  // Open addressing table of symbol number + 1 (0 = empty slot)
+  unsigned int hash_size;
+  int *hash;
+  // Symbol numbers in order of address (and then of symbol number)
+  int *by_addr;
+} symbol_index;
+
+symbol_index hyppo_symbol_index = { hyppo_symbols, &hyppo_symbol_count, MAX_HYPPO_SYMBOLS };
+symbol_index symbol_index_all = { symbols, &symbol_count, MAX_SYMBOLS };
+
+unsigned int symbol_name_hash(const char *name)
+{
+  // FNV-1a
+  unsigned int h = 2166136261u;
+  while (*name) {
+    h ^= (unsigned char)*name++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+void symbol_index_invalidate(symbol_index *idx)
+{
+  idx->hash_valid = false;
+  idx->sorted_valid = false;
+}
+
+void symbol_index_hash_insert(symbol_index *idx, int n)
+{
+  unsigned int slot = symbol_name_hash(idx->symbols[n].name) & (idx->hash_size - 1);
+  while (idx->hash[slot]) {
+    // Like a linear search, the first symbol of a given name wins
+    if (!strcmp(idx->symbols[idx->hash[slot] - 1].name, idx->symbols[n].name))
+      return;
+    slot = (slot + 1) & (idx->hash_size - 1);
+  }
+  idx->hash[slot] = n + 1;
+}
+
+void symbol_index_add(symbol_index *idx, int n)
+{
+  // Call before incrementing the symbol count
+  if (idx->hash_valid)
+    symbol_index_hash_insert(idx, n);
+  idx->sorted_valid = false;
+}
+
+void symbol_index_build_hash(symbol_index *idx)
+{
+  if (!idx->hash) {
+    // Keep the table at most half full
+    idx->hash_size = 1;
+    while (idx->hash_size < 2 * idx->max_symbols)
+      idx->hash_size <<= 1;
+    idx->hash = malloc(idx->hash_size * sizeof(int));
+    if (!idx->hash) {
+      fprintf(stderr, "ERROR: Could not allocate memory for symbol index.\n");
+      exit(-2);
+    }
+  }
+  bzero(idx->hash, idx->hash_size * sizeof(int));
+  for (int i = 0; i < *idx->count; i++)
+    symbol_index_hash_insert(idx, i);
+  idx->hash_valid = true;
+}
+
+hyppo_symbol *symbol_index_find(symbol_index *idx, const char *name)
+{
+  if (!*idx->count)
+    return NULL;
+  if (!idx->hash_valid)
+    symbol_index_build_hash(idx);
+  unsigned int slot = symbol_name_hash(name) & (idx->hash_size - 1);
+  while (idx->hash[slot]) {
+    if (!strcmp(idx->symbols[idx->hash[slot] - 1].name, name))
+      return &idx->symbols[idx->hash[slot] - 1];
+    slot = (slot + 1) & (idx->hash_size - 1);
+  }
+  return NULL;
+}
+
+hyppo_symbol *symbol_sort_base;
+int symbol_addr_compare(const void *a, const void *b)
+{
+  int sa = *(const int *)a, sb = *(const int *)b;
+  if (symbol_sort_base[sa].addr != symbol_sort_base[sb].addr)
+    return symbol_sort_base[sa].addr < symbol_sort_base[sb].addr ? -1 : 1;
+  return sa - sb;
+}
+
+void symbol_index_build_sorted(symbol_index *idx)
+{
+  if (!idx->by_addr) {
+    idx->by_addr = malloc(idx->max_symbols * sizeof(int));
+    if (!idx->by_addr) {
+      fprintf(stderr, "ERROR: Could not allocate memory for symbol index.\n");
+      exit(-2);
+    }
+  }
+  for (int i = 0; i < *idx->count; i++)
+    idx->by_addr[i] = i;
+  symbol_sort_base = idx->symbols;
+  qsort(idx->by_addr, *idx->count, sizeof(int), symbol_addr_compare);
+  idx->sorted_valid = true;
+}
+
+hyppo_symbol *symbol_index_nearest(symbol_index *idx, unsigned int addr)
+{
+  // Find the symbol at, or else closest below, addr.  Where several symbols
+  // share that address, return the first one defined.
+  if (!*idx->count)
+    return NULL;
+  if (!idx->sorted_valid)
+    symbol_index_build_sorted(idx);
+  int lo = 0, hi = *idx->count;
+  // Find the first symbol above addr
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (idx->symbols[idx->by_addr[mid]].addr <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (!lo)
+    return NULL;
+  // Then step back to the first symbol with the same address as the one before it
+  unsigned int match_addr = idx->symbols[idx->by_addr[lo - 1]].addr;
+  lo--;
+  int first = 0;
+  hi = lo;
+  while (first < hi) {
+    int mid = (first + hi) / 2;
+    if (idx->symbols[idx->by_addr[mid]].addr < match_addr)
+      first = mid + 1;
+    else
+      hi = mid;
+  }
+  return &idx->symbols[idx->by_addr[first]];
+}
+
 struct cpu cpu;
 struct cpu cpu_expected;
 
 // Instruction log
+// (Fields are ordered so that a record packs into 64 bytes)
 typedef struct instruction_log {
   unsigned int pc;
   unsigned char bytes[6];
@@ -152,22 +404,70 @@ typedef struct instruction_log {
   unsigned char dup;
   unsigned char zp16;
   unsigned char zp32;
+  unsigned char pops;
   unsigned int zp_pointer;
   unsigned int zp_pointer_addr;
   struct regs regs;
   unsigned int count;
 
 #define MAX_POPS 4
-  unsigned char pops;
   unsigned int pop_blame[MAX_POPS];
 } instruction_log;
 #define MAX_LOG_LENGTH (32 * 1024 * 1024)
-instruction_log *cpulog[MAX_LOG_LENGTH];
+
+// With a log limit, the log wraps, and a routine can run until the
+// instruction numbers would overflow
+#define MAX_LOG_LIMIT (1024 * 1024 * 1024)
+#define MAX_INSTRUCTION_COUNT 0x7fffffff
+
+// Log records live in fixed-size chunks that are allocated on first use and
+// then recycled by cpu_log_reset(), instead of one malloc() per instruction.
+#define CPULOG_CHUNK_BITS 16
+#define CPULOG_CHUNK_SIZE (1 << CPULOG_CHUNK_BITS)
+#define CPULOG_CHUNK_MASK (CPULOG_CHUNK_SIZE - 1)
+instruction_log **cpulog_chunks = NULL;
 int cpulog_len = 0;
 
+// If non-zero, only the most recent this-many instructions are kept, with the
+// log used as a ring buffer.  cpulog_limit is what the user asked for, and
+// cpulog_ring what is in force for the current log (it only changes on reset).
+unsigned int cpulog_limit = 0;
+unsigned int cpulog_ring = 0;
+
+int cpulog_capacity(void)
+{
+  // Number of instructions a routine may run before the log is full
+  return cpulog_ring ? MAX_INSTRUCTION_COUNT : MAX_LOG_LENGTH;
+}
+
 #define INFINITE_LOOP_THRESHOLD 65536
 
-instruction_log *lastataddr[65536] = { NULL };
+// Index of most recent log entry at each address (0 = none), and the
+// cpustate_hash() of that entry
+int lastataddr[65536] = { 0 };
+unsigned long long lastathash[65536];
+
+// Per-address number of identical iterations before a loop counts as
+// infinite (0 = INFINITE_LOOP_THRESHOLD), for loops that legitimately
+// wait for a long time, like polling for the SD card to become ready.
+unsigned int loop_threshold[65536];
+
+typedef bool (*opcode_handler)(struct cpu *cpu, struct instruction_log *log, unsigned int addr);
+
+typedef struct opcode_info {
+  const char *mnemonic;
+  unsigned char mode;
+  unsigned char len;
+  // Base cycle counts, as in cycle_count_lut in src/vhdl/gs4510.vhdl: the
+  // 4502 count, and the 6502 count that applies at 1MHz and 2MHz
+  unsigned char cycles;
+  unsigned char cycles6502;
+  // NULL for opcodes that hyppotest does not implement yet
+  opcode_handler handler;
+} opcode_info;
+
+// Indexed by opcode, and shared by the disassembler and the CPU
+extern const opcode_info opcode_table[256];
 
 char *describe_address(unsigned int addr);
 char *describe_address_label(struct cpu *cpu, unsigned int addr);
@@ -177,6 +477,145 @@ void disassemble_instruction(FILE *f, struct instruction_log *log);
 int write_mem28(struct cpu *cpu, unsigned int addr, unsigned char value);
 unsigned int memory_blame(struct cpu *cpu, unsigned int addr16);
 
+struct instruction_log *cpulog_entry(int i)
+{
+  // Returns NULL if the instruction is not (or no longer) in the log
+  if (i < 0 || i >= cpulog_len)
+    return NULL;
+  if (cpulog_ring) {
+    if (i < cpulog_len - (int)cpulog_ring)
+      return NULL;
+    i %= cpulog_ring;
+  }
+  return &cpulog_chunks[i >> CPULOG_CHUNK_BITS][i & CPULOG_CHUNK_MASK];
+}
+
+struct instruction_log *cpulog_append(void)
+{
+  int slot = cpulog_len;
+  if (cpulog_ring)
+    slot %= cpulog_ring;
+  if (!cpulog_chunks) {
+    unsigned int size = cpulog_limit > MAX_LOG_LENGTH ? cpulog_limit : MAX_LOG_LENGTH;
+    cpulog_chunks = calloc((size + CPULOG_CHUNK_SIZE - 1) / CPULOG_CHUNK_SIZE, sizeof(instruction_log *));
+    if (!cpulog_chunks) {
+      fprintf(stderr, "ERROR: Could not allocate memory for instruction log.\n");
+      exit(-2);
+    }
+  }
+  instruction_log **chunk = &cpulog_chunks[slot >> CPULOG_CHUNK_BITS];
+  if (!*chunk) {
+    *chunk = malloc(CPULOG_CHUNK_SIZE * sizeof(instruction_log));
+    if (!*chunk) {
+      fprintf(stderr, "ERROR: Could not allocate memory for instruction log.\n");
+      exit(-2);
+    }
+  }
+  instruction_log *log = &(*chunk)[slot & CPULOG_CHUNK_MASK];
+  bzero(log, sizeof(instruction_log));
+  cpulog_len++;
+  return log;
+}
+
+// Undo log: what each memory write overwrote, so that "rewind" can take the
+// machine back to how it was before any instruction still in the log.
+// Entries are kept in the order the writes happened, in chunks like the
+// instruction log.  It is only kept after "undo log on", and entries for
+// instructions that have left a -l instruction log ring are dropped, as
+// nothing can rewind to those any more.
+typedef struct undo_entry {
+  unsigned int instruction; // cpu.instruction_count when written
+  unsigned int addr;        // 28-bit address, or UNDO_FORCE_FAST
+  unsigned int blame;       // Previous *_blame[] value
+  unsigned char value;      // Previous contents
+} undo_entry;
+#define UNDO_FORCE_FAST 0xffffffff
+#define MAX_UNDO_LENGTH (64 * 1024 * 1024)
+#define UNDO_CHUNK_BITS 16
+#define UNDO_CHUNK_SIZE (1 << UNDO_CHUNK_BITS)
+#define UNDO_CHUNK_MASK (UNDO_CHUNK_SIZE - 1)
+undo_entry *undo_chunks[MAX_UNDO_LENGTH / UNDO_CHUNK_SIZE];
+bool undo_logging = false;
+// Entries undo_first to undo_len - 1 are kept, and cover the instructions
+// from undo_since on
+int undo_first = 0;
+int undo_len = 0;
+int undo_since = 0;
+// Set once the undo log has filled, after which older state can't be restored
+bool undo_overflow = false;
+
+void undo_log_reset(void)
+{
+  undo_first = 0;
+  undo_len = 0;
+  undo_since = cpulog_len;
+  undo_overflow = false;
+}
+
+undo_entry *undo_log_entry(int i)
+{
+  i &= MAX_UNDO_LENGTH - 1;
+  return &undo_chunks[i >> UNDO_CHUNK_BITS][i & UNDO_CHUNK_MASK];
+}
+
+void undo_log_trim(void)
+{
+  // Drop the entries for instructions that the instruction log ring no
+  // longer holds, freeing each chunk once all of it has been dropped
+  if (!cpulog_ring)
+    return;
+  int oldest = cpulog_len - (int)cpulog_ring;
+  if (undo_since < oldest)
+    undo_since = oldest;
+  while (undo_first < undo_len && (int)undo_log_entry(undo_first)->instruction < oldest) {
+    undo_first++;
+    if (!(undo_first & UNDO_CHUNK_MASK)) {
+      int chunk = ((undo_first - 1) & (MAX_UNDO_LENGTH - 1)) >> UNDO_CHUNK_BITS;
+      free(undo_chunks[chunk]);
+      undo_chunks[chunk] = NULL;
+    }
+  }
+}
+
+void undo_record(struct cpu *cpu, unsigned int addr, unsigned char old_value, unsigned int old_blame)
+{
+  if (!undo_logging || undo_overflow)
+    return;
+  undo_log_trim();
+  if (undo_len - undo_first == MAX_UNDO_LENGTH) {
+    fprintf(logfile, "WARNING: Undo log filled at instruction #%d, rewinding is no longer possible.\n",
+        cpu->instruction_count);
+    undo_overflow = true;
+    return;
+  }
+  undo_entry **chunk = &undo_chunks[(undo_len & (MAX_UNDO_LENGTH - 1)) >> UNDO_CHUNK_BITS];
+  if (!*chunk) {
+    *chunk = malloc(UNDO_CHUNK_SIZE * sizeof(undo_entry));
+    if (!*chunk) {
+      fprintf(stderr, "ERROR: Could not allocate memory for undo log.\n");
+      exit(-2);
+    }
+  }
+  undo_entry *u = &(*chunk)[undo_len & UNDO_CHUNK_MASK];
+  u->instruction = cpu->instruction_count;
+  u->addr = addr;
+  u->blame = old_blame;
+  u->value = old_value;
+  undo_len++;
+}
+
+void disassemble_logged_instruction(FILE *f, unsigned int i, bool show_pc)
+{
+  struct instruction_log *log = cpulog_entry(i);
+  if (!log) {
+    fprintf(f, "<I%d no longer in log>", i);
+    return;
+  }
+  if (show_pc)
+    fprintf(f, "$%04X ", log->pc);
+  disassemble_instruction(f, log);
+}
+
 int rel8_delta(unsigned char c)
 {
   if (c < 0x80)
@@ -198,7 +637,7 @@ void disassemble_rel8(FILE *f, struct instruction_log *log)
 
 void disassemble_rel16(FILE *f, struct instruction_log *log)
 {
-  fprintf(f, "$%04X", log->pc + 2 + rel16_delta(log->bytes[1] + (log->bytes[1] << 8)));
+  fprintf(f, "$%04X", log->pc + 2 + rel16_delta(log->bytes[1] + (log->bytes[2] << 8)));
 }
 
 void disassemble_imm(FILE *f, struct instruction_log *log)
@@ -206,6 +645,11 @@ void disassemble_imm(FILE *f, struct instruction_log *log)
   fprintf(f, "#$%02X", log->bytes[1]);
 }
 
+void disassemble_imm16(FILE *f, struct instruction_log *log)
+{
+  fprintf(f, "#$%02X%02X", log->bytes[2], log->bytes[1]);
+}
+
 void disassemble_abs(FILE *f, struct instruction_log *log)
 {
   fprintf(f, "$%02X%02X", log->bytes[2], log->bytes[1]);
@@ -230,14 +674,14 @@ void disassemble_iabs(FILE *f, struct instruction_log *log)
   // historical memory mappings.
   if (memory_blame(&fakecpu, log->zp_pointer + 0)) {
     fprintf(f, "I%d: ", memory_blame(&fakecpu, log->zp_pointer + 0));
-    disassemble_instruction(f, cpulog[memory_blame(&fakecpu, log->zp_pointer + 0)]);
+    disassemble_logged_instruction(f, memory_blame(&fakecpu, log->zp_pointer + 0), false);
   }
   else
     fprintf(f, "<uninitialised memory>");
   fprintf(f, " and ");
   if (memory_blame(&fakecpu, log->zp_pointer + 1)) {
     fprintf(f, "I%d: ", memory_blame(&fakecpu, log->zp_pointer + 1));
-    disassemble_instruction(f, cpulog[memory_blame(&fakecpu, log->zp_pointer + 1)]);
+    disassemble_logged_instruction(f, memory_blame(&fakecpu, log->zp_pointer + 1), false);
   }
   else
     fprintf(f, "<uninitialised memory>");
@@ -289,6 +733,11 @@ void disassemble_zp_rel8(FILE *f, struct instruction_log *log)
   fprintf(f, "$%02X,$%04X", log->bytes[1], log->pc + 2 + rel8_delta(log->bytes[2]));
 }
 
+void disassemble_ispy(FILE *f, struct instruction_log *log)
+{
+  fprintf(f, "($%02X,SP),Y", log->bytes[1]);
+}
+
 void disassemble_izpz(FILE *f, struct instruction_log *log)
 {
   fprintf(f, "($%02X),Z {PTR=$%04X,ADDR16=$%04X}", log->bytes[1], log->zp_pointer, log->zp_pointer_addr);
@@ -303,3706 +752,4001 @@ void disassemble_stack_source(FILE *f, struct instruction_log *log)
 {
   fprintf(f, "  {Pushed by ");
   if (log->pop_blame[0]) {
-    fprintf(f, "$%04X ", cpulog[log->pop_blame[0]]->pc);
-    disassemble_instruction(f, cpulog[log->pop_blame[0]]);
+    disassemble_logged_instruction(f, log->pop_blame[0], true);
   }
   else
     fprintf(f, "<unitialised stack location>");
   fprintf(f, "}");
 }
 
-void disassemble_instruction(FILE *f, struct instruction_log *log)
+void disassemble_return_source(FILE *f, struct instruction_log *log)
 {
+  fprintf(f, " {Address pushed by ");
+  if (log->pop_blame[0] != log->pop_blame[1]) {
+    fprintf(f, " two different instructions: ");
+    if (log->pop_blame[0]) {
+      disassemble_logged_instruction(f, log->pop_blame[0], true);
+    }
+    else
+      fprintf(f, "<unitialised stack location>");
+    fprintf(f, " and ");
+    if (log->pop_blame[1]) {
+      disassemble_logged_instruction(f, log->pop_blame[1], true);
+    }
+    else
+      fprintf(f, "<unitialised stack location>");
+  }
+  else if (log->pop_blame[0]) {
+    disassemble_logged_instruction(f, log->pop_blame[0], true);
+  }
+  else
+    fprintf(f, "<unitialised stack location>");
+  fprintf(f, "}");
+}
 
+void disassemble_instruction(FILE *f, struct instruction_log *log)
+{
   if (!log->len)
     return;
-  switch (log->bytes[0]) {
-  case 0x00:
-    fprintf(f, "BRK  ");
-    disassemble_imm(f, log);
-    break;
-  case 0x01:
-    fprintf(f, "ORA  ");
-    disassemble_izpx(f, log);
-    break;
-  case 0x03:
-    fprintf(f, "SEE");
-    break;
-  case 0x04:
-    fprintf(f, "TSB  ");
-    disassemble_zp(f, log);
-    break;
-  case 0x05:
-    fprintf(f, "ORA  ");
-    disassemble_zp(f, log);
-    break;
-  case 0x06:
-    fprintf(f, "ASL  ");
-    disassemble_zp(f, log);
-    break;
-  case 0x07:
-    fprintf(f, "RMB0 ");
-    disassemble_zp(f, log);
-    break;
-  case 0x08:
-    fprintf(f, "PHP");
-    break;
-  case 0x09:
-    fprintf(f, "ORA  ");
+
+  const opcode_info *op = &opcode_table[log->bytes[0]];
+  switch (op->mode) {
+  case MODE_IMP:
+    fprintf(f, "%s", op->mnemonic);
+    // Pulls and returns show which instructions pushed what they took
+    if (!strncmp(op->mnemonic, "PL", 2))
+      disassemble_stack_source(f, log);
+    else if (!strcmp(op->mnemonic, "RTS"))
+      disassemble_return_source(f, log);
+    return;
+  case MODE_ACC:
+    fprintf(f, "%-4s A", op->mnemonic);
+    return;
+  }
+
+  fprintf(f, "%-4s ", op->mnemonic);
+  switch (op->mode) {
+  case MODE_IMM:
     disassemble_imm(f, log);
     break;
-  case 0x0A:
-    fprintf(f, "ASL  A");
-    break;
-  case 0x0c:
-    fprintf(f, "TSB  ");
-    disassemble_abs(f, log);
-    break;
-  case 0x0d:
-    fprintf(f, "ORA  ");
-    disassemble_abs(f, log);
-    break;
-  case 0x0E:
-    fprintf(f, "ASL  ");
-    disassemble_abs(f, log);
-    break;
-  case 0x0F:
-    fprintf(f, "BBR0 ");
-    disassemble_zp_rel8(f, log);
-    break;
-  case 0x10:
-    fprintf(f, "BPL  ");
-    disassemble_rel8(f, log);
-    break;
-  case 0x11:
-    fprintf(f, "ORA  ");
-    disassemble_izpy(f, log);
-    break;
-  case 0x12:
-    fprintf(f, "ORA  ");
-    disassemble_izpz(f, log);
-    break;
-  case 0x13:
-    fprintf(f, "BPL  ");
-    disassemble_rel16(f, log);
+  case MODE_IMM16:
+    disassemble_imm16(f, log);
     break;
-  case 0x14:
-    fprintf(f, "TRB  ");
+  case MODE_ZP:
     disassemble_zp(f, log);
     break;
-  case 0x15:
-    fprintf(f, "ORA  ");
+  case MODE_ZPX:
     disassemble_zpx(f, log);
     break;
-  case 0x16:
-    fprintf(f, "ASL  ");
-    disassemble_zpx(f, log);
-    break;
-  case 0x17:
-    fprintf(f, "RMB1 ");
-    disassemble_zp(f, log);
-    break;
-  case 0x18:
-    fprintf(f, "CLC");
-    break;
-  case 0x19:
-    fprintf(f, "ORA  ");
-    disassemble_absy(f, log);
-    break;
-  case 0x1A:
-    fprintf(f, "INC");
-    break;
-  case 0x1B:
-    fprintf(f, "INZ");
+  case MODE_ZPY:
+    disassemble_zpy(f, log);
     break;
-  case 0x1c:
-    fprintf(f, "TRB  ");
+  case MODE_ABS:
     disassemble_abs(f, log);
     break;
-  case 0x1D:
-    fprintf(f, "ORA  ");
-    disassemble_absx(f, log);
-    break;
-  case 0x1E:
-    fprintf(f, "ASL  ");
+  case MODE_ABSX:
     disassemble_absx(f, log);
     break;
-  case 0x1F:
-    fprintf(f, "BBR1 ");
-    disassemble_zp_rel8(f, log);
-    break;
-  case 0x20:
-    fprintf(f, "JSR  ");
-    disassemble_abs(f, log);
+  case MODE_ABSY:
+    disassemble_absy(f, log);
     break;
-  case 0x21:
-    fprintf(f, "AND  ");
+  case MODE_IZPX:
     disassemble_izpx(f, log);
     break;
-  case 0x22:
-    fprintf(f, "JSR  ");
-    disassemble_iabs(f, log);
-    break;
-  case 0x24:
-    fprintf(f, "BIT  ");
-    disassemble_zp(f, log);
-    break;
-  case 0x25:
-    fprintf(f, "AND  ");
-    disassemble_zp(f, log);
-    break;
-  case 0x26:
-    fprintf(f, "ROL  ");
-    disassemble_zp(f, log);
-    break;
-  case 0x27:
-    fprintf(f, "RMB2 ");
-    disassemble_zp(f, log);
-    break;
-  case 0x28:
-    fprintf(f, "PLP");
-    disassemble_stack_source(f, log);
-    break;
-  case 0x29:
-    fprintf(f, "AND  ");
-    disassemble_imm(f, log);
-    break;
-  case 0x2A:
-    fprintf(f, "ROL  A");
-    break;
-  case 0x2B:
-    fprintf(f, "TYS");
-    break;
-  case 0x2C:
-    fprintf(f, "BIT  ");
-    disassemble_abs(f, log);
-    break;
-  case 0x2D:
-    fprintf(f, "AND  ");
-    disassemble_abs(f, log);
-    break;
-  case 0x2E:
-    fprintf(f, "ROL  ");
-    disassemble_abs(f, log);
-    break;
-  case 0x2F:
-    fprintf(f, "BBR2 ");
-    disassemble_zp_rel8(f, log);
-    break;
-  case 0x30:
-    fprintf(f, "BMI  ");
-    disassemble_rel8(f, log);
-    break;
-  case 0x31:
-    fprintf(f, "AND  ");
+  case MODE_IZPY:
     disassemble_izpy(f, log);
     break;
-  case 0x32:
-    fprintf(f, "AND  ");
-    disassemble_izpz(f, log);
-    break;
-  case 0x33:
-    fprintf(f, "BMI  ");
-    disassemble_rel16(f, log);
-    break;
-  case 0x34:
-    fprintf(f, "BIT  ");
-    disassemble_zpx(f, log);
-    break;
-  case 0x35:
-    fprintf(f, "AND  ");
-    disassemble_zpx(f, log);
-    break;
-  case 0x36:
-    fprintf(f, "ROL  ");
-    disassemble_zpx(f, log);
-    break;
-  case 0x37:
-    fprintf(f, "RMB3 ");
-    disassemble_zp(f, log);
-    break;
-  case 0x38:
-    fprintf(f, "SEC");
-    break;
-  case 0x39:
-    fprintf(f, "AND  ");
-    disassemble_absy(f, log);
-    break;
-  case 0x3A:
-    fprintf(f, "DEC");
-    break;
-  case 0x3C:
-    fprintf(f, "BIT  ");
-    disassemble_absx(f, log);
-    break;
-  case 0x3D:
-    fprintf(f, "AND  ");
-    disassemble_absx(f, log);
-    break;
-  case 0x3E:
-    fprintf(f, "ROL  ");
-    disassemble_absx(f, log);
-    break;
-  case 0x3F:
-    fprintf(f, "BBR3 ");
-    disassemble_zp_rel8(f, log);
-    break;
-  case 0x40:
-    fprintf(f, "RTI");
-    break;
-  case 0x41:
-    fprintf(f, "EOR  ");
-    disassemble_zpx(f, log);
-    break;
-  case 0x45:
-    fprintf(f, "EOR  ");
-    disassemble_zp(f, log);
-    break;
-  case 0x46:
-    fprintf(f, "LSR  ");
-    disassemble_zp(f, log);
-    break;
-  case 0x47:
-    fprintf(f, "RMB4 ");
-    disassemble_zp(f, log);
-    break;
-  case 0x48:
-    fprintf(f, "PHA");
-    break;
-  case 0x49:
-    fprintf(f, "EOR  ");
-    disassemble_imm(f, log);
-    break;
-  case 0x4A:
-    fprintf(f, "LSR  A");
-    break;
-  case 0x4B:
-    fprintf(f, "TAZ");
-    break;
-  case 0x4C:
-    fprintf(f, "JMP  ");
-    disassemble_abs(f, log);
+  case MODE_IZPZ:
+    if (log->zp32)
+      disassemble_izpz32(f, log);
+    else
+      disassemble_izpz(f, log);
     break;
-  case 0x4D:
-    fprintf(f, "EOR  ");
-    disassemble_abs(f, log);
+  case MODE_ISPY:
+    disassemble_ispy(f, log);
     break;
-  case 0x4E:
-    fprintf(f, "LSR  ");
-    disassemble_abs(f, log);
+  case MODE_IABS:
+    disassemble_iabs(f, log);
     break;
-  case 0x4F:
-    fprintf(f, "BBR4 ");
-    disassemble_zp_rel8(f, log);
+  case MODE_IABSX:
+    disassemble_iabsx(f, log);
     break;
-  case 0x50:
-    fprintf(f, "BVC  ");
+  case MODE_REL8:
     disassemble_rel8(f, log);
     break;
-  case 0x51:
-    fprintf(f, "EOR  ");
-    disassemble_izpy(f, log);
-    break;
-  case 0x52:
-    fprintf(f, "EOR  ");
-    disassemble_izpz(f, log);
-    break;
-  case 0x56:
-    fprintf(f, "LSR  ");
-    disassemble_zpx(f, log);
-    break;
-  case 0x55:
-    fprintf(f, "EOR  ");
-    disassemble_zpx(f, log);
-    break;
-  case 0x57:
-    fprintf(f, "RMB5 ");
-    disassemble_zp(f, log);
-    break;
-  case 0x58:
-    fprintf(f, "CLI");
-    break;
-  case 0x59:
-    fprintf(f, "EOR  ");
-    disassemble_absy(f, log);
-    break;
-  case 0x5a:
-    fprintf(f, "PHY");
-    break;
-  case 0x5b:
-    fprintf(f, "TAB");
-    break;
-  case 0x5c:
-    fprintf(f, "MAP");
-    break;
-  case 0x5d:
-    fprintf(f, "EOR  ");
-    disassemble_absx(f, log);
-    break;
-  case 0x5e:
-    fprintf(f, "LSR  ");
-    disassemble_absx(f, log);
+  case MODE_REL16:
+    disassemble_rel16(f, log);
     break;
-  case 0x5F:
-    fprintf(f, "BBR5 ");
+  case MODE_ZPREL8:
     disassemble_zp_rel8(f, log);
     break;
-  case 0x60:
-    fprintf(f, "RTS {Address pushed by ");
-    if (log->pop_blame[0] != log->pop_blame[1]) {
-      fprintf(f, " two different instructions: ");
-      if (log->pop_blame[0]) {
-        fprintf(f, "$%04X ", cpulog[log->pop_blame[0]]->pc);
-        disassemble_instruction(f, cpulog[log->pop_blame[0]]);
-      }
-      else
-        fprintf(f, "<unitialised stack location>");
-      fprintf(f, " and ");
-      if (log->pop_blame[1]) {
-        fprintf(f, "$%04X ", cpulog[log->pop_blame[1]]->pc);
-        disassemble_instruction(f, cpulog[log->pop_blame[1]]);
-      }
-      else
-        fprintf(f, "<unitialised stack location>");
+  }
+}
+
+int show_recent_instructions(
+    FILE *f, char *title, struct cpu *cpu, int first_instruction, int count, unsigned int highlight_address)
+{
+  int last_was_dup = 0;
+  fprintf(f, "INFO: %s\n", title);
+  if (!first_instruction) {
+    fprintf(f, " --- No relevant instruction history available (location not written?) ---\n");
+    return 0;
+  }
+  if (first_instruction < 0) {
+    count -= -first_instruction;
+    first_instruction = 0;
+  }
+  for (int i = first_instruction; count > 0 && i < cpulog_len; count--, i++) {
+    if (!i) {
+      fprintf(f, "I0        -- Machine reset --\n");
+      continue;
     }
-    else if (log->pop_blame[0]) {
-      fprintf(f, "$%04X ", cpulog[log->pop_blame[0]]->pc);
-      disassemble_instruction(f, cpulog[log->pop_blame[0]]);
+    struct instruction_log *l = cpulog_entry(i);
+    if (!l) {
+      if (!last_was_dup)
+        fprintf(f, "                 ... older instructions no longer in log ...\n");
+      last_was_dup = 1;
+      continue;
     }
+    if (l->dup && (i > first_instruction)) {
+      if (!last_was_dup)
+        fprintf(f, "                 ... duplicated instructions omitted ...\n");
+      last_was_dup = 1;
+    }
+    else {
+      last_was_dup = 0;
+      if (cpulog_len - i - 1)
+        fprintf(f, "I%-7d ", i);
+      else
+        fprintf(f, "     >>> ");
+      if (l->count > 1)
+        fprintf(f, "$%04X x%-6d : ", l->pc, l->count);
+      else
+        fprintf(f, "$%04X         : ", l->pc);
+      fprintf(f, "A:%02X ", l->regs.a);
+      fprintf(f, "X:%02X ", l->regs.x);
+      fprintf(f, "Y:%02X ", l->regs.y);
+      fprintf(f, "Z:%02X ", l->regs.z);
+      fprintf(f, "SP:%02X%02X ", l->regs.sph, l->regs.spl);
+      fprintf(f, "B:%02X ", l->regs.b);
+      fprintf(f, "M:%04x+%02x/%04x+%02x ", l->regs.maplo, l->regs.maplomb, l->regs.maphi,
+          l->regs.maphimb);
+      fprintf(f, "%c%c%c%c%c%c%c%c ", l->regs.flags & FLAG_N ? 'N' : '.', l->regs.flags & FLAG_V ? 'V' : '.',
+          l->regs.flags & FLAG_E ? 'E' : '.', l->regs.flags & 0x10 ? 'B' : '.',
+          l->regs.flags & FLAG_D ? 'D' : '.', l->regs.flags & FLAG_I ? 'I' : '.',
+          l->regs.flags & FLAG_Z ? 'Z' : '.', l->regs.flags & FLAG_C ? 'C' : '.');
+      fprintf(f, " : ");
+
+      fprintf(f, "%32s : ", describe_address_label28(cpu, addr_to_28bit(cpu, l->regs.pc, 0)));
+
+      for (int j = 0; j < 3; j++) {
+        if (j < l->len)
+          fprintf(f, "%02X ", l->bytes[j]);
+        else
+          fprintf(f, "   ");
+      }
+      fprintf(f, " : ");
+      // XXX - Show instruction disassembly
+      disassemble_instruction(f, l);
+      fprintf(f, "\n");
+    }
+  }
+
+  return 0;
+}
+
+unsigned long long cpustate_hash(struct instruction_log *log)
+{
+  // Hashes the registers and the instruction, which are what make one
+  // iteration of a loop the same as the last.  Each word packs its fields
+  // without overlap, so only the final mixing can collide.
+  struct regs *r = &log->regs;
+  unsigned long long w1 = (r->pc & 0xffff) | (r->a << 16) | ((unsigned long long)r->x << 24)
+                        | ((unsigned long long)r->y << 32) | ((unsigned long long)r->z << 40)
+                        | ((unsigned long long)r->flags << 48) | ((unsigned long long)r->b << 56);
+  unsigned long long w2 = r->sp | (r->in_hyper << 16) | ((unsigned long long)r->map_irq_inhibit << 24)
+                        | ((unsigned long long)r->maplo << 32) | ((unsigned long long)r->maphi << 48);
+  unsigned long long w3 = r->maplomb | (r->maphimb << 8) | ((unsigned long long)log->bytes[0] << 16)
+                        | ((unsigned long long)log->bytes[1] << 24) | ((unsigned long long)log->bytes[2] << 32)
+                        | ((unsigned long long)log->len << 40);
+  unsigned long long h = w1 * 0x9e3779b97f4a7c15ULL;
+  h = (h ^ (h >> 29) ^ w2) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 32) ^ w3) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+char addr_description[8192];
+char *describe_address(unsigned int addr)
+{
+  struct hyppo_symbol *s = symbol_index_nearest(&hyppo_symbol_index, addr);
+
+  if (s) {
+    if (s->addr == addr)
+      snprintf(addr_description, 8192, "$%04X (first instruction in %s)", addr, s->name);
     else
-      fprintf(f, "<unitialised stack location>");
-    fprintf(f, "}");
-    break;
-  case 0x61:
-    fprintf(f, "ADC  ");
-    disassemble_izpx(f, log);
-    break;
-  case 0x64:
-    fprintf(f, "STZ  ");
-    disassemble_zp(f, log);
-    break;
-  case 0x65:
-    fprintf(f, "ADC  ");
-    disassemble_zp(f, log);
-    break;
-  case 0x66:
-    fprintf(f, "ROR  ");
-    disassemble_zp(f, log);
-    break;
-  case 0x67:
-    fprintf(f, "RMB6 ");
-    disassemble_zp(f, log);
-    break;
-  case 0x68:
-    fprintf(f, "PLA");
-    disassemble_stack_source(f, log);
-    break;
-  case 0x69:
-    fprintf(f, "ADC  ");
-    disassemble_imm(f, log);
-    break;
-  case 0x6A:
-    fprintf(f, "ROR  A");
-    break;
-  case 0x6B:
-    fprintf(f, "TZA");
-    break;
-  case 0x6C:
-    fprintf(f, "JMP  ");
-    disassemble_iabs(f, log);
-    break;
-  case 0x6D:
-    fprintf(f, "ADC  ");
-    disassemble_abs(f, log);
-    break;
-  case 0x6E:
-    fprintf(f, "ROR  ");
-    disassemble_abs(f, log);
-    break;
-  case 0x6F:
-    fprintf(f, "BBR6 ");
-    disassemble_zp_rel8(f, log);
-    break;
-  case 0x70:
-    fprintf(f, "BVS  ");
-    disassemble_rel8(f, log);
-    break;
-  case 0x71:
-    fprintf(f, "ADC  ");
-    disassemble_izpy(f, log);
-    break;
-  case 0x72:
-    fprintf(f, "ADC  ");
-    disassemble_izpz(f, log);
-    break;
-  case 0x74:
-    fprintf(f, "STZ  ");
-    disassemble_zpx(f, log);
-    break;
-  case 0x75:
-    fprintf(f, "ADC  ");
-    disassemble_zpx(f, log);
-    break;
-  case 0x76:
-    fprintf(f, "ROR  ");
-    disassemble_zpx(f, log);
-    break;
-  case 0x77:
-    fprintf(f, "RMB7 ");
-    disassemble_zp(f, log);
-    break;
-  case 0x78:
-    fprintf(f, "SEI");
-    break;
-  case 0x79:
-    fprintf(f, "ADC  ");
-    disassemble_absy(f, log);
-    break;
-  case 0x7A:
-    fprintf(f, "PLY");
-    disassemble_stack_source(f, log);
-    break;
-  case 0x7B:
-    fprintf(f, "TBA");
-    break;
-  case 0x7D:
-    fprintf(f, "ADC  ");
-    disassemble_absx(f, log);
-    break;
-  case 0x7C:
-    fprintf(f, "JMP  ");
-    disassemble_iabsx(f, log);
-    break;
-  case 0x7E:
-    fprintf(f, "ROR  ");
-    disassemble_absx(f, log);
-    break;
-  case 0x7F:
-    fprintf(f, "BBR7 ");
-    disassemble_zp_rel8(f, log);
-    break;
-  case 0x80:
-    fprintf(f, "BRA  ");
-    disassemble_rel8(f, log);
-    break;
-  case 0x81:
-    fprintf(f, "STA  ");
-    disassemble_izpx(f, log);
-    break;
-  case 0x83:
-    fprintf(f, "BRA  ");
-    disassemble_rel16(f, log);
-    break;
-  case 0x84:
-    fprintf(f, "STY  ");
-    disassemble_zp(f, log);
-    break;
-  case 0x85:
-    fprintf(f, "STA  ");
-    disassemble_zp(f, log);
-    break;
-  case 0x86:
-    fprintf(f, "STX  ");
-    disassemble_zp(f, log);
-    break;
-  case 0x87:
-    fprintf(f, "SMB0 ");
-    disassemble_zp(f, log);
-    break;
-  case 0x88:
-    fprintf(f, "DEY");
-    break;
-  case 0x89:
-    fprintf(f, "BIT  ");
-    disassemble_imm(f, log);
-    break;
-  case 0x8A:
-    fprintf(f, "TXA");
-    break;
-  case 0x8c:
-    fprintf(f, "STY  ");
-    disassemble_abs(f, log);
-    break;
-  case 0x8d:
-    fprintf(f, "STA  ");
-    disassemble_abs(f, log);
-    break;
-  case 0x8e:
-    fprintf(f, "STX  ");
-    disassemble_abs(f, log);
-    break;
-  case 0x8F:
-    fprintf(f, "BBS0 ");
-    disassemble_zp_rel8(f, log);
-    break;
-  case 0x90:
-    fprintf(f, "BCC  ");
-    disassemble_rel8(f, log);
-    break;
-  case 0x91:
-    fprintf(f, "STA  ");
-    disassemble_izpy(f, log);
-    break;
-  case 0x92:
-    fprintf(f, "STA  ");
-    if (log->zp32)
-      disassemble_izpz32(f, log);
-    else
-      disassemble_izpz(f, log);
-    break;
-  case 0x93:
-    fprintf(f, "BCC  ");
-    disassemble_rel16(f, log);
-    break;
-  case 0x94:
-    fprintf(f, "STY  ");
-    disassemble_zpx(f, log);
-    break;
-  case 0x95:
-    fprintf(f, "STA  ");
-    disassemble_zpx(f, log);
-    break;
-  case 0x96:
-    fprintf(f, "STX  ");
-    disassemble_zpy(f, log);
-    break;
-  case 0x97:
-    fprintf(f, "SMB1 ");
-    disassemble_zp(f, log);
-    break;
-  case 0x98:
-    fprintf(f, "TYA");
-    break;
-  case 0x99:
-    fprintf(f, "STA  ");
-    disassemble_absy(f, log);
-    break;
-  case 0x9A:
-    fprintf(f, "TXS");
-    break;
-  case 0x9C:
-    fprintf(f, "STZ  ");
-    disassemble_abs(f, log);
-    break;
-  case 0x9d:
-    fprintf(f, "STA  ");
-    disassemble_absx(f, log);
-    break;
-  case 0x9E:
-    fprintf(f, "STZ  ");
-    disassemble_absx(f, log);
-    break;
-  case 0x9F:
-    fprintf(f, "BBS1 ");
-    disassemble_zp_rel8(f, log);
-    break;
-  case 0xa0:
-    fprintf(f, "LDY  ");
-    disassemble_imm(f, log);
-    break;
-  case 0xa1:
-    fprintf(f, "LDA  ");
-    disassemble_izpx(f, log);
-    break;
-  case 0xa2:
-    fprintf(f, "LDX  ");
-    disassemble_imm(f, log);
-    break;
-  case 0xa3:
-    fprintf(f, "LDZ  ");
-    disassemble_imm(f, log);
-    break;
-  case 0xa4:
-    fprintf(f, "LDY  ");
-    disassemble_zp(f, log);
-    break;
-  case 0xa5:
-    fprintf(f, "LDA  ");
-    disassemble_zp(f, log);
-    break;
-  case 0xa6:
-    fprintf(f, "LDX  ");
-    disassemble_zp(f, log);
-    break;
-  case 0xa7:
-    fprintf(f, "SMB2 ");
-    disassemble_zp(f, log);
-    break;
-  case 0xA8:
-    fprintf(f, "TAY");
-    break;
-  case 0xa9:
-    fprintf(f, "LDA  ");
-    disassemble_imm(f, log);
-    break;
-  case 0xAA:
-    fprintf(f, "TAX");
-    break;
-  case 0xac:
-    fprintf(f, "LDY  ");
-    disassemble_abs(f, log);
-    break;
-  case 0xad:
-    fprintf(f, "LDA  ");
-    disassemble_abs(f, log);
-    break;
-  case 0xae:
-    fprintf(f, "LDX  ");
-    disassemble_abs(f, log);
-    break;
-  case 0xAF:
-    fprintf(f, "BBS2 ");
-    disassemble_zp_rel8(f, log);
-    break;
-  case 0xB0:
-    fprintf(f, "BCS  ");
-    disassemble_rel8(f, log);
-    break;
-  case 0xB1:
-    fprintf(f, "LDA  ");
-    disassemble_izpy(f, log);
-    break;
-  case 0xB2:
-    fprintf(f, "LDA  ");
-    disassemble_izpz(f, log);
-    break;
-  case 0xb4:
-    fprintf(f, "LDY  ");
-    disassemble_zpx(f, log);
-    break;
-  case 0xb5:
-    fprintf(f, "LDA  ");
-    disassemble_zpx(f, log);
-    break;
-  case 0xb6:
-    fprintf(f, "LDX  ");
-    disassemble_zpy(f, log);
-    break;
-  case 0xb7:
-    fprintf(f, "SMB3 ");
-    disassemble_zp(f, log);
-    break;
-  case 0xb8:
-    fprintf(f, "CLV");
-    break;
-  case 0xb9:
-    fprintf(f, "LDA  ");
-    disassemble_absy(f, log);
-    break;
-  case 0xba:
-    fprintf(f, "TSX");
-    break;
-  case 0xbc:
-    fprintf(f, "LDY  ");
-    disassemble_absx(f, log);
-    break;
-  case 0xbd:
-    fprintf(f, "LDA  ");
-    disassemble_absx(f, log);
-    break;
-  case 0xbe:
-    fprintf(f, "LDX  ");
-    disassemble_absy(f, log);
-    break;
-  case 0xBF:
-    fprintf(f, "BBS3 ");
-    disassemble_zp_rel8(f, log);
-    break;
-  case 0xC0:
-    fprintf(f, "CPY  ");
-    disassemble_imm(f, log);
-    break;
-  case 0xC1:
-    fprintf(f, "CMP  ");
-    disassemble_izpx(f, log);
-    break;
-  case 0xC4:
-    fprintf(f, "CPY  ");
-    disassemble_zp(f, log);
-    break;
-  case 0xC5:
-    fprintf(f, "CMP  ");
-    disassemble_zp(f, log);
-    break;
-  case 0xC6:
-    fprintf(f, "DEC  ");
-    disassemble_zp(f, log);
-    break;
-  case 0xC7:
-    fprintf(f, "SMB4 ");
-    disassemble_zp(f, log);
-    break;
-  case 0xC8:
-    fprintf(f, "INY");
-    break;
-  case 0xC9:
-    fprintf(f, "CMP  ");
-    disassemble_imm(f, log);
-    break;
-  case 0xCA:
-    fprintf(f, "DEX");
-    break;
-  case 0xCC:
-    fprintf(f, "CPY  ");
-    disassemble_abs(f, log);
-    break;
-  case 0xCD:
-    fprintf(f, "CMP  ");
-    disassemble_abs(f, log);
-    break;
-  case 0xce:
-    fprintf(f, "DEC  ");
-    disassemble_abs(f, log);
-    break;
-  case 0xCF:
-    fprintf(f, "BBS4 ");
-    disassemble_zp_rel8(f, log);
-    break;
-  case 0xd0:
-    fprintf(f, "BNE  ");
-    disassemble_rel8(f, log);
-    break;
-  case 0xD1:
-    fprintf(f, "CMP  ");
-    disassemble_izpy(f, log);
-    break;
-  case 0xD2:
-    fprintf(f, "CMP  ");
-    disassemble_izpz(f, log);
-    break;
-  case 0xD5:
-    fprintf(f, "CMP  ");
-    disassemble_zpx(f, log);
-    break;
-  case 0xD6:
-    fprintf(f, "DEC  ");
-    disassemble_zpx(f, log);
-    break;
-  case 0xD7:
-    fprintf(f, "SMB5 ");
-    disassemble_zp(f, log);
-    break;
-  case 0xD8:
-    fprintf(f, "CLD");
-    break;
-  case 0xD9:
-    fprintf(f, "CMP  ");
-    disassemble_absy(f, log);
-    break;
-  case 0xDA:
-    fprintf(f, "PHX");
-    break;
-  case 0xDB:
-    fprintf(f, "PHZ");
-    break;
-  case 0xDD:
-    fprintf(f, "CMP  ");
-    disassemble_absx(f, log);
-    break;
-  case 0xDE:
-    fprintf(f, "DEC  ");
-    disassemble_absx(f, log);
-    break;
-  case 0xDF:
-    fprintf(f, "BBS5 ");
-    disassemble_zp_rel8(f, log);
-    break;
-  case 0xE0:
-    fprintf(f, "CPX  ");
-    disassemble_imm(f, log);
-    break;
-  case 0xE1:
-    fprintf(f, "SBC  ");
-    disassemble_izpx(f, log);
-    break;
-  case 0xE4:
-    fprintf(f, "CPX  ");
-    disassemble_zp(f, log);
-    break;
-  case 0xE5:
-    fprintf(f, "SBC  ");
-    disassemble_zp(f, log);
-    break;
-  case 0xE6:
-    fprintf(f, "INC  ");
-    disassemble_zp(f, log);
-    break;
-  case 0xE7:
-    fprintf(f, "SMB6 ");
-    disassemble_zp(f, log);
-    break;
-  case 0xE8:
-    fprintf(f, "INX");
-    break;
-  case 0xE9:
-    fprintf(f, "SBC  ");
-    disassemble_imm(f, log);
-    break;
-  case 0xea:
-    fprintf(f, "EOM");
-    break;
-  case 0xEC:
-    fprintf(f, "CPX  ");
-    disassemble_abs(f, log);
-    break;
-  case 0xED:
-    fprintf(f, "SBC  ");
-    disassemble_abs(f, log);
-    break;
-  case 0xee:
-    fprintf(f, "INC  ");
-    disassemble_abs(f, log);
-    break;
-  case 0xEF:
-    fprintf(f, "BBS6 ");
-    disassemble_zp_rel8(f, log);
-    break;
-  case 0xf0:
-    fprintf(f, "BEQ  ");
-    disassemble_rel8(f, log);
-    break;
-  case 0xf1:
-    fprintf(f, "SBC  ");
-    disassemble_izpy(f, log);
-    break;
-  case 0xf2:
-    fprintf(f, "SBC  ");
-    disassemble_izpz(f, log);
-    break;
-  case 0xf3:
-    fprintf(f, "BEQ  ");
-    disassemble_rel16(f, log);
-    break;
-  case 0xf5:
-    fprintf(f, "SBC  ");
-    disassemble_zpx(f, log);
-    break;
-  case 0xf6:
-    fprintf(f, "INC  ");
-    disassemble_zpx(f, log);
-    break;
-  case 0xf7:
-    fprintf(f, "SMB7 ");
-    disassemble_zp(f, log);
-    break;
-  case 0xf8:
-    fprintf(f, "SED");
+      snprintf(addr_description, 8192, "$%04X (at %s+%d)", addr, s->name, addr - s->addr);
+  }
+  else
+    snprintf(addr_description, 8192, "$%04X", addr);
+  return addr_description;
+}
+
+char *describe_address_label28(struct cpu *cpu, unsigned int addr)
+{
+  struct hyppo_symbol *match = NULL;
+
+  addr_description[0] = 0;
+
+  if (addr >= 0xfff8000 && addr < 0xfffc000) {
+    // Hypervisor sits at $FFF8000-$FFFBFFF
+    addr -= 0xfff0000; // The symbol table addresses are for $8000-$BFFF
+    match = symbol_index_nearest(&hyppo_symbol_index, addr);
+  }
+  else
+    match = symbol_index_nearest(&symbol_index_all, addr);
+
+  if (match) {
+    if (match->addr == addr)
+      snprintf(addr_description, 8192, "%s", match->name);
+    else {
+      const int delta = addr - match->addr;
+      const char *const fmt = delta > 0xff ? "%s+$%x" : "%s+%d";
+      snprintf(addr_description, 8192, fmt, match->name, delta);
+    }
+  }
+
+  return addr_description;
+}
+
+char *describe_address_label(struct cpu *cpu, unsigned int addr)
+{
+  return describe_address_label28(cpu, addr_to_28bit(cpu, addr, 1));
+}
+
+void cpu_log_reset(void)
+{
+  // Recycle the existing log records, and pick up any new log size limit
+  cpulog_len = 0;
+  cpulog_ring = cpulog_limit;
+  cpulog_append();
+  bzero(lastataddr, sizeof(lastataddr));
+  undo_log_reset();
+}
+
+void cpu_stash_ram(void)
+{
+  // Remember the RAM contents before calling a routine
+  for (int page = 0; page < (CHIPRAM_SIZE >> DIRTY_PAGE_BITS); page++) {
+    if (chipram_dirty[page] & DIRTY_EXPECTED) {
+      bcopy(&chipram[page << DIRTY_PAGE_BITS], &chipram_expected[page << DIRTY_PAGE_BITS], DIRTY_PAGE_SIZE);
+      // The expected values changed, so snapshots need this page again
+      chipram_dirty[page] = (chipram_dirty[page] & ~DIRTY_EXPECTED) | DIRTY_SNAPSHOT;
+    }
+  }
+  for (int page = 0; page < (HYPPORAM_SIZE >> DIRTY_PAGE_BITS); page++) {
+    if (hypporam_dirty[page] & DIRTY_EXPECTED) {
+      bcopy(&hypporam[page << DIRTY_PAGE_BITS], &hypporam_expected[page << DIRTY_PAGE_BITS], DIRTY_PAGE_SIZE);
+      // The expected values changed, so snapshots need this page again
+      hypporam_dirty[page] = (hypporam_dirty[page] & ~DIRTY_EXPECTED) | DIRTY_SNAPSHOT;
+    }
+  }
+}
+
+unsigned int page_to_28bit(struct cpu *cpu, unsigned int page, int writeP)
+{
+  // XXX -- Royally stupid banking emulation for now
+  unsigned int addr = page << 12;
+  unsigned int addr_in = addr;
+
+  int lnc = chipram[1] & 7;
+  lnc |= (~(chipram[0])) & 7;
+  unsigned int bank = page;
+  unsigned int zone = page >> 1;
+  if (bank == 13) {
+    switch (lnc) {
+    case 0:
+    case 4:
+      // RAM -- no mapping required
+      break;
+    case 1:
+    case 2:
+    case 3:
+      // CharROM
+      if (!writeP)
+        addr = 0x2d000;
+      break;
+    case 5:
+    case 6:
+    case 7:
+      // IO bank
+      addr = 0xffd3000;
+      break;
+    }
+  }
+  if (!writeP) {
+    // C64 BASIC ROM
+    if (bank == 10 || bank == 11) {
+      if (lnc == 3 || lnc == 7)
+        addr = 0x2a000 | (addr_in & 0x1000);
+    }
+    // C64 KERNAL ROM
+    if (bank == 14 || bank == 15) {
+      switch (lnc) {
+      case 2:
+      case 3:
+      case 6:
+      case 7:
+        addr = 0x2e000 | (addr_in & 0x1000);
+        break;
+      }
+    }
+  }
+
+  // $D031 banking takes priority over C64 banking
+
+  // MAP takes priority over all else
+  if (zone < 4) {
+    if ((cpu->regs.maplo >> (12 + zone)) & 1) {
+      // This 8KB area is mapped
+      addr = addr_in;
+      addr += (cpu->regs.maplo & 0xfff) << 8;
+      addr += cpu->regs.maplomb << 20;
+    }
+  }
+  else if (zone > 3) {
+    if ((cpu->regs.maphi >> (12 + zone - 4)) & 1) {
+      // This 8KB area is mapped
+      addr = addr_in;
+      addr += (cpu->regs.maphi & 0xfff) << 8;
+      addr += cpu->regs.maphimb << 20;
+    }
+  }
+
+  return addr;
+}
+
+void cpu_rebuild_map(struct cpu *cpu)
+{
+  for (int page = 0; page < 16; page++) {
+    cpu->read_page[page] = page_to_28bit(cpu, page, 0);
+    cpu->write_page[page] = page_to_28bit(cpu, page, 1);
+  }
+  cpu->map_valid = true;
+}
+
+unsigned int addr_to_28bit(struct cpu *cpu, unsigned int addr, int writeP)
+{
+  if (addr > 0xffff) {
+    fprintf(logfile, "ERROR: Asked to map %s of non-16 bit address $%x\n", writeP ? "write" : "read", addr);
+    show_recent_instructions(logfile, "Instructions leading up to the request", cpu, cpulog_len - 6, 6, cpu->regs.pc);
+    cpu->term.error = true;
+    return -1;
+  }
+  if (!cpu->map_valid)
+    cpu_rebuild_map(cpu);
+  if (writeP)
+    return cpu->write_page[addr >> 12] + (addr & 0xfff);
+  return cpu->read_page[addr >> 12] + (addr & 0xfff);
+}
+
+void watch_clear_all(void)
+{
+  watchpoint_count = 0;
+  bzero(watch_pages, sizeof(watch_pages));
+}
+
+int watch_add(int type, unsigned int first, unsigned int last, unsigned char value)
+{
+  if (watchpoint_count >= MAX_WATCHPOINTS) {
+    fprintf(logfile, "ERROR: Too many watchpoints. Increase MAX_WATCHPOINTS.\n");
+    return -1;
+  }
+  if (last < first) {
+    fprintf(logfile, "ERROR: Watchpoint range $%07x to $%07x is backwards.\n", first, last);
+    return -1;
+  }
+  watchpoint *w = &watchpoints[watchpoint_count++];
+  w->first = first;
+  w->last = last;
+  w->type = type;
+  w->value = value;
+  for (unsigned int page = WATCH_PAGE(first); page <= WATCH_PAGE(last); page++)
+    watch_pages[page] |= type;
+  // Instruction fetches from cached code don't go through read_memory(), so
+  // drop the cache, to see them as reads from here on
+  if (type & WATCH_READ)
+    decode_cache_flush();
+  return 0;
+}
+
+bool watch_range(unsigned int first, unsigned int count, int type)
+{
+  // Is any page from first to first+count-1 watched for any of type?
+  for (unsigned int page = WATCH_PAGE(first); page <= WATCH_PAGE(first + count - 1); page++)
+    if (watch_pages[page] & type)
+      return true;
+  return false;
+}
+
+void watch_check(struct cpu *cpu, unsigned int addr, int access, unsigned char value)
+{
+  // Called for reads and writes of watched pages.  A triggered watchpoint
+  // stops execution once the current instruction completes.
+  if (!cpu_executing)
+    return;
+  for (int i = 0; i < watchpoint_count; i++) {
+    watchpoint *w = &watchpoints[i];
+    if (addr < w->first || addr > w->last)
+      continue;
+    if (!(w->type & access) && !(access == WATCH_WRITE && w->type == WATCH_VALUE && value == w->value))
+      continue;
+    // (cpu->regs.pc has already moved past the instruction)
+    struct instruction_log *log = cpulog_entry(cpu->instruction_count);
+    unsigned int pc = log ? log->pc : cpu->regs.pc;
+    fprintf(logfile, "INFO: Watchpoint triggered: I%d at %s @ $%04x %s $%02x %s %s ($%07x)\n", cpu->instruction_count,
+        describe_address_label(cpu, pc), pc, access == WATCH_READ ? "read" : "wrote", value,
+        access == WATCH_READ ? "from" : "to", describe_address_label28(cpu, addr), addr);
+    cpu->term.done = true;
+    return;
+  }
+}
+
+// The bytes of instructions already fetched, by 28-bit address of the opcode,
+// so that code in chip and hypervisor RAM is only read through read_memory()
+// again after something writes to it.  It is only a cache of the bytes: the
+// PC is still translated to 28 bits, and the operand resolved, every time.
+// decode_pages[] marks the pages that have instructions in the cache, so that
+// writes to other pages only cost a table lookup.
+#define DECODE_CACHE_BITS 16
+#define DECODE_CACHE_SIZE (1 << DECODE_CACHE_BITS)
+#define DECODE_CACHE_MASK (DECODE_CACHE_SIZE - 1)
+#define DECODE_PAGE_BITS 8
+#define DECODE_PAGE(ADDR) (((ADDR) >> DECODE_PAGE_BITS) & ((1 << (28 - DECODE_PAGE_BITS)) - 1))
+#define DECODE_EMPTY 0xffffffff
+typedef struct decoded_instruction {
+  unsigned int pc28; // DECODE_EMPTY if unused
+  unsigned char bytes[3];
+  unsigned char len;
+} decoded_instruction;
+decoded_instruction decode_cache[DECODE_CACHE_SIZE];
+unsigned char decode_pages[1 << (28 - DECODE_PAGE_BITS)];
+
+void decode_cache_flush(void)
+{
+  memset(decode_cache, 0xff, sizeof(decode_cache));
+  bzero(decode_pages, sizeof(decode_pages));
+}
+
+void decode_invalidate(unsigned int addr)
+{
+  // Drops any cached instruction that includes the byte at addr
+  for (int i = 0; i < 3; i++) {
+    decoded_instruction *d = &decode_cache[(addr - i) & DECODE_CACHE_MASK];
+    if (d->pc28 == addr - i && i < d->len)
+      d->pc28 = DECODE_EMPTY;
+  }
+}
+
+void decode_invalidate_range(unsigned int addr, unsigned int count)
+{
+  for (unsigned int i = 0; i < count; i++)
+    if (decode_pages[DECODE_PAGE(addr + i)])
+      decode_invalidate(addr + i);
+}
+
+// Models of the SD card controller at $FFD3680 and the F011 floppy controller
+// at $FFD3080, backed by a host disk image that stands in for the SD card.
+// They only come into play once "sdcard image" has attached an image; until
+// then their registers are plain memory.  Sectors read from the image are kept
+// in a direct-mapped cache, and transfers can be given a latency in CPU
+// cycles, during which the controller reports that it is busy.  Writes go
+// straight through to the image, and are not undone by rewinding.
+#define SECTOR_SIZE 512
+#define SECTOR_CACHE_BITS 10
+#define SECTOR_CACHE_SIZE (1 << SECTOR_CACHE_BITS)
+#define SECTOR_NONE 0xffffffff
+// Sector buffers, as offsets in ffdram[]
+#define SD_BUFFER 0x6e00
+#define F011_BUFFER 0x6c00
+// $D680 status bits
+#define SD_STATUS_BUSY 0x03
+#define SD_STATUS_RESET 0x04
+#define SD_STATUS_SDHC 0x10
+#define SD_STATUS_ERROR 0x40
+// $D680 write gates
+#define SD_GATE_CLOSED 0
+#define SD_GATE_OPEN 1
+#define SD_GATE_MBR 2
+// $D082 status bits
+#define F011_BUSY 0x80
+#define F011_RNF 0x10
+#define F011_PROT 0x02
+// 80 tracks x 2 sides x 10 sectors
+#define D81_SECTORS 1600
+
+#define IO_JOB_NONE 0
+#define IO_JOB_SD_READ 1
+#define IO_JOB_SD_WRITE 2
+#define IO_JOB_F011_READ 3
+#define IO_JOB_F011_WRITE 4
+
+typedef struct sector_cache_entry {
+  unsigned int sector; // SECTOR_NONE if unused
+  unsigned char data[SECTOR_SIZE];
+} sector_cache_entry;
+
+struct disk_image {
+  int fd; // -1 if no image is attached
+  char name[1024];
+  bool writable;
+  unsigned int sectors;
+  unsigned int latency;
+  sector_cache_entry *cache;
+  // Counted per test
+  unsigned int reads;
+  unsigned int cache_hits;
+  unsigned int writes;
+} sdcard = { .fd = -1 };
+
+void sdcard_detach(void)
+{
+  if (sdcard.fd == -1)
+    return;
+  close(sdcard.fd);
+  free(sdcard.cache);
+  sdcard.fd = -1;
+  sdcard.cache = NULL;
+}
+
+int sdcard_attach(char *filename, bool writable, unsigned int create_sectors)
+{
+  // Attaches a disk image as the SD card, first creating it full of zeroes if
+  // create_sectors is non-zero
+  sdcard_detach();
+
+  int flags = writable ? O_RDWR : O_RDONLY;
+  if (create_sectors)
+    flags |= O_CREAT | O_TRUNC;
+  int fd = open(filename, flags, 0644);
+  if (fd == -1) {
+    fprintf(logfile, "ERROR: Could not open SD card image '%s': %s\n", filename, strerror(errno));
+    return -1;
+  }
+  if (create_sectors && ftruncate(fd, (off_t)create_sectors * SECTOR_SIZE)) {
+    fprintf(logfile, "ERROR: Could not create SD card image '%s': %s\n", filename, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st)) {
+    fprintf(logfile, "ERROR: Could not stat SD card image '%s': %s\n", filename, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  sdcard.cache = malloc(SECTOR_CACHE_SIZE * sizeof(sector_cache_entry));
+  if (!sdcard.cache) {
+    fprintf(logfile, "ERROR: Could not allocate SD card sector cache.\n");
+    close(fd);
+    return -1;
+  }
+  for (int i = 0; i < SECTOR_CACHE_SIZE; i++)
+    sdcard.cache[i].sector = SECTOR_NONE;
+  sdcard.fd = fd;
+  snprintf(sdcard.name, sizeof(sdcard.name), "%s", filename);
+  sdcard.writable = writable;
+  sdcard.sectors = st.st_size / SECTOR_SIZE;
+  fprintf(logfile, "INFO: Attached SD card image '%s' (%u sectors%s)\n", filename, sdcard.sectors,
+      writable ? "" : ", read-only");
+  return 0;
+}
+
+unsigned char *sdcard_read_sector(struct cpu *cpu, unsigned int sector)
+{
+  // Returns the sector from the cache, reading it from the image if need be,
+  // or NULL if it could not be read
+  if (sector >= sdcard.sectors)
+    return NULL;
+  sector_cache_entry *e = &sdcard.cache[sector & (SECTOR_CACHE_SIZE - 1)];
+  sdcard.reads++;
+  if (e->sector == sector) {
+    sdcard.cache_hits++;
+    return e->data;
+  }
+  if (pread(sdcard.fd, e->data, SECTOR_SIZE, (off_t)sector * SECTOR_SIZE) != SECTOR_SIZE) {
+    fprintf(logfile, "ERROR: Could not read sector %u of SD card image '%s'\n", sector, sdcard.name);
+    cpu->term.error = true;
+    e->sector = SECTOR_NONE;
+    return NULL;
+  }
+  e->sector = sector;
+  return e->data;
+}
+
+int sdcard_write_sector(struct cpu *cpu, unsigned int sector, unsigned char *data)
+{
+  if (sector >= sdcard.sectors)
+    return -1;
+  if (!sdcard.writable) {
+    fprintf(logfile, "ERROR: Writing sector %u of read-only SD card image '%s'\n", sector, sdcard.name);
+    cpu->term.error = true;
+    return -1;
+  }
+  sdcard.writes++;
+  if (pwrite(sdcard.fd, data, SECTOR_SIZE, (off_t)sector * SECTOR_SIZE) != SECTOR_SIZE) {
+    fprintf(logfile, "ERROR: Could not write sector %u of SD card image '%s'\n", sector, sdcard.name);
+    cpu->term.error = true;
+    return -1;
+  }
+  // Write through the cache
+  sector_cache_entry *e = &sdcard.cache[sector & (SECTOR_CACHE_SIZE - 1)];
+  e->sector = sector;
+  bcopy(data, e->data, SECTOR_SIZE);
+  return 0;
+}
+
+void io_store(struct cpu *cpu, unsigned int offset, unsigned char value)
+{
+  // Stores a byte that a device model wrote into IO memory, so that it is
+  // blamed on, and undone with, the current instruction
+  undo_record(cpu, 0xffd0000 + offset, ffdram[offset], ffdram_blame[offset]);
+  ffdram[offset] = value;
+  ffdram_blame[offset] = cpu->instruction_count;
+  ffdram_dirty[offset >> DIRTY_PAGE_BITS] = DIRTY_ALL;
+}
+
+static inline unsigned int io_alias(struct cpu *cpu, unsigned int addr)
+{
+  // $D680 = $81 maps a sector buffer at $DE00-$DFFF: the SD card buffer if
+  // $D689 bit 7 is set, otherwise the F011 buffer
+  if (cpu && cpu->sd_buffer_mapped && (addr & 0xffffe00) == 0xffd3e00)
+    return 0xffd0000 + ((ffdram[0x3689] & 0x80) ? SD_BUFFER : F011_BUFFER) + (addr & 0x1ff);
+  return addr;
+}
+
+void io_complete(struct cpu *cpu)
+{
+  // Does the data transfer of the job in progress, and drops the busy flags
+  unsigned char *data;
+  bool ok;
+
+  switch (cpu->io_job) {
+  case IO_JOB_SD_READ:
+  case IO_JOB_F011_READ:
+    data = sdcard_read_sector(cpu, cpu->io_job_sector);
+    ok = data != NULL;
+    if (ok) {
+      unsigned int buffer = cpu->io_job == IO_JOB_SD_READ ? SD_BUFFER : F011_BUFFER;
+      for (int i = 0; i < SECTOR_SIZE; i++)
+        io_store(cpu, buffer + i, data[i]);
+    }
     break;
-  case 0xF9:
-    fprintf(f, "SBC  ");
-    disassemble_absy(f, log);
+  case IO_JOB_SD_WRITE:
+    ok = !sdcard_write_sector(cpu, cpu->io_job_sector, &ffdram[SD_BUFFER]);
     break;
-  case 0xFA:
-    fprintf(f, "PLX");
-    disassemble_stack_source(f, log);
-    break;
-  case 0xFB:
-    fprintf(f, "PLZ");
-    disassemble_stack_source(f, log);
-    break;
-  case 0xFD:
-    fprintf(f, "SBC  ");
-    disassemble_absx(f, log);
-    break;
-  case 0xFE:
-    fprintf(f, "INC  ");
-    disassemble_absx(f, log);
-    break;
-  case 0xFF:
-    fprintf(f, "BBS7 ");
-    disassemble_zp_rel8(f, log);
+  case IO_JOB_F011_WRITE:
+    ok = !sdcard_write_sector(cpu, cpu->io_job_sector, &ffdram[F011_BUFFER]);
     break;
+  default:
+    return;
+  }
+
+  if (cpu->io_job == IO_JOB_SD_READ || cpu->io_job == IO_JOB_SD_WRITE) {
+    cpu->sd_status &= ~SD_STATUS_BUSY;
+    if (!ok)
+      cpu->sd_status |= SD_STATUS_ERROR;
+    io_store(cpu, 0x3680, cpu->sd_status);
+  }
+  else
+    io_store(cpu, 0x3082, (ffdram[0x3082] & ~F011_BUSY) | (ok ? 0 : F011_RNF));
+  cpu->io_job = IO_JOB_NONE;
+}
+
+void io_tick(struct cpu *cpu, unsigned int cycles)
+{
+  // Called after each instruction while a job is in progress
+  if (cpu->io_job_cycles > cycles)
+    cpu->io_job_cycles -= cycles;
+  else
+    io_complete(cpu);
+}
+
+void io_start(struct cpu *cpu, int job, unsigned int sector)
+{
+  cpu->io_job = job;
+  cpu->io_job_sector = sector;
+  cpu->io_job_cycles = sdcard.latency;
+  if (!sdcard.latency)
+    io_complete(cpu);
+}
+
+void sd_write(struct cpu *cpu, unsigned int addr, unsigned char value)
+{
+  // Only the command register at $D680 has side effects
+  if (addr != 0xffd3680)
+    return;
+  unsigned int sector = ffdram[0x3681] | (ffdram[0x3682] << 8) | (ffdram[0x3683] << 16) | (ffdram[0x3684] << 24);
+
+  if (cpu->io_job && value > 0x01) {
+    // Busy, so only a reset does anything
+  }
+  else
+    switch (value) {
+    case 0x00: // Assert reset
+      cpu->io_job = IO_JOB_NONE;
+      cpu->sd_status = (cpu->sd_status & SD_STATUS_SDHC) | SD_STATUS_RESET;
+      break;
+    case 0x01: // Release reset
+      cpu->sd_status &= SD_STATUS_SDHC;
+      break;
+    case 0x02: // Read sector
+      cpu->sd_status = (cpu->sd_status & ~SD_STATUS_ERROR) | SD_STATUS_BUSY;
+      io_start(cpu, IO_JOB_SD_READ, sector);
+      break;
+    case 0x03: // Write sector, once the matching write gate has been opened
+      if (cpu->sd_write_gate != (sector ? SD_GATE_OPEN : SD_GATE_MBR)) {
+        fprintf(logfile, "WARNING: SD card write to sector %u at instruction #%d ignored: %s write gate closed\n", sector,
+            cpu->instruction_count, sector ? "$57" : "$4D");
+        cpu->sd_status |= SD_STATUS_ERROR;
+        break;
+      }
+      cpu->sd_write_gate = SD_GATE_CLOSED;
+      cpu->sd_status = (cpu->sd_status & ~SD_STATUS_ERROR) | SD_STATUS_BUSY;
+      io_start(cpu, IO_JOB_SD_WRITE, sector);
+      break;
+    case 0x40: // Clear SDHC flag
+      cpu->sd_status &= ~SD_STATUS_SDHC;
+      break;
+    case 0x41: // Set SDHC flag
+      cpu->sd_status |= SD_STATUS_SDHC;
+      break;
+    case 0x4d: // Open the write gate for the MBR
+      cpu->sd_write_gate = SD_GATE_MBR;
+      break;
+    case 0x57: // Open the write gate for any other sector
+      cpu->sd_write_gate = SD_GATE_OPEN;
+      break;
+    case 0x81: // Map sector buffer at $DE00
+      cpu->sd_buffer_mapped = true;
+      break;
+    case 0x82: // Unmap sector buffer
+      cpu->sd_buffer_mapped = false;
+      break;
+    }
+  // The command register reads back as the status
+  ffdram[0x3680] = cpu->sd_status;
+}
+
+void f011_write(struct cpu *cpu, unsigned int addr, unsigned char value)
+{
+  // Reads and writes of drives 0 and 1 that have a disk image mounted from the
+  // SD card via $D68B-$D693.  Anything else leaves the registers as written.
+  if (addr != 0xffd3081 || ((value & 0xf0) != 0x40 && (value & 0xf0) != 0x80))
+    return;
+  unsigned int drive = ffdram[0x3080] & 7;
+  if (drive > 1 || cpu->io_job)
+    return;
+  unsigned int flags = ffdram[0x368b] >> (drive * 3);
+  if (!(flags & 1))
+    return;
+  unsigned int track = ffdram[0x3084];
+  unsigned int sector = ffdram[0x3085];
+  unsigned int side = ffdram[0x3086] & 1;
+  unsigned int base = 0x368c + drive * 4;
+  unsigned int image_start =
+      ffdram[base] | (ffdram[base + 1] << 8) | (ffdram[base + 2] << 16) | (ffdram[base + 3] << 24);
+  unsigned int image_sector = track * 20 + side * 10 + sector - 1;
+  unsigned char status = ffdram[0x3082] & ~(F011_RNF | F011_PROT);
+
+  if (sector < 1 || sector > 10 || image_sector >= D81_SECTORS) {
+    io_store(cpu, 0x3082, status | F011_RNF);
+    return;
+  }
+  if ((value & 0xf0) == 0x80 && !(flags & 4)) {
+    io_store(cpu, 0x3082, status | F011_PROT);
+    return;
+  }
+  io_store(cpu, 0x3082, status | F011_BUSY);
+  io_start(cpu, (value & 0xf0) == 0x40 ? IO_JOB_F011_READ : IO_JOB_F011_WRITE, image_start + image_sector);
+}
+
+typedef struct io_device {
+  unsigned int first;
+  unsigned int last;
+  void (*write)(struct cpu *cpu, unsigned int addr, unsigned char value);
+} io_device;
+const io_device io_devices[] = {
+  { 0xffd3080, 0xffd308f, f011_write },
+  { 0xffd3680, 0xffd36ff, sd_write },
+};
+
+void io_write(struct cpu *cpu, unsigned int addr, unsigned char value)
+{
+  // Called for writes to IO space while an SD card image is attached
+  for (int i = 0; i < sizeof(io_devices) / sizeof(io_devices[0]); i++)
+    if (addr >= io_devices[i].first && addr <= io_devices[i].last)
+      io_devices[i].write(cpu, addr, value);
+}
+
+void sdcard_report(FILE *f)
+{
+  if (sdcard.fd == -1) {
+    fprintf(f, "INFO: No SD card image attached\n");
+    return;
+  }
+  fprintf(f, "INFO: SD card image '%s': %u sector reads (%u from cache), %u sector writes, latency %u cycles\n",
+      sdcard.name, sdcard.reads, sdcard.cache_hits, sdcard.writes, sdcard.latency);
+}
+
+unsigned char read_memory28(struct cpu *cpu, unsigned int addr)
+{
+  unsigned char value;
+
+  if (addr >= 0xfff8000 && addr < 0xfffc000) {
+    // Hypervisor sits at $FFF8000-$FFFBFFF
+    value = hypporam[addr - 0xfff8000];
+  }
+  else if (addr < CHIPRAM_SIZE) {
+    // Chipram at base of address space
+    value = chipram[addr];
+  }
+  else if (addr >= 0xff80000 && addr < (0xff80000 + COLOURRAM_SIZE)) {
+    // $FF8xxxx = colour RAM
+    value = colourram[addr - 0xff80000];
+  }
+  else if ((addr & 0xfff0000) == 0xffd0000) {
+    // $FFDxxxx IO space
+    value = ffdram[io_alias(cpu, addr) - 0xffd0000];
+  }
+  else {
+    // Otherwise unmapped RAM
+    value = 0xbd;
+  }
+
+  if (watch_pages[WATCH_PAGE(addr)] & WATCH_READ)
+    watch_check(cpu, addr, WATCH_READ, value);
+  return value;
+}
+
+unsigned char read_memory(struct cpu *cpu, unsigned int addr16)
+{
+  unsigned int addr = addr_to_28bit(cpu, addr16, 0);
+
+  return read_memory28(cpu, addr);
+}
+
+unsigned int memory_blame(struct cpu *cpu, unsigned int addr16)
+{
+  unsigned int addr = addr_to_28bit(cpu, addr16, 0);
+  if (addr >= 0xfff8000 && addr < 0xfffc000) {
+    // Hypervisor sits at $FFF8000-$FFFBFFF
+    return hypporam_blame[addr - 0xfff8000];
+  }
+  else if (addr < CHIPRAM_SIZE) {
+    // Chipram at base of address space
+    return chipram_blame[addr];
+  }
+  else if (addr >= 0xff80000 && addr < (0xff80000 + COLOURRAM_SIZE)) {
+    // $FF8xxxx = colour RAM
+    return colourram_blame[addr - 0xff80000];
+  }
+  else if ((addr & 0xfff0000) == 0xffd0000) {
+    // $FFDxxxx IO space
+    return ffdram_blame[addr - 0xffd0000];
+  }
+  // Otherwise unmapped RAM, no one to blame
+  return 0;
+}
+
+// Accounting of the DMA jobs run during the current test, for "report dma"
+#define MAX_DMA_JOBS 65536
+#define MAX_DMA_JOB_OPTIONS 16
+typedef struct dma_job {
+  unsigned int instruction; // Instruction that triggered the DMA
+  unsigned int trigger_pc;  // 28-bit address of that instruction, or -1 if triggered by the test script
+  unsigned int list_addr;   // 28-bit address of the job, including its options
+  unsigned int cmd;
+  unsigned int src;
+  unsigned int dest;
+  unsigned int count;
+  bool enhanced;
+  bool fast;
+  int option_count;
+  unsigned char options[MAX_DMA_JOB_OPTIONS];
+} dma_job;
+dma_job dma_jobs[MAX_DMA_JOBS];
+int dma_job_count = 0;
+int dma_jobs_lost = 0;
+
+void dma_job_record(struct cpu *cpu, dma_job *job)
+{
+  struct instruction_log *l = cpulog_entry(cpu->instruction_count);
+
+  if (dma_job_count == MAX_DMA_JOBS) {
+    dma_jobs_lost++;
+    return;
+  }
+  job->instruction = cpu->instruction_count;
+  job->trigger_pc = l ? addr_to_28bit(cpu, l->pc, 0) : -1;
+  dma_jobs[dma_job_count++] = *job;
+}
+
+const char *memory_region_name(unsigned int addr)
+{
+  if (addr >= 0xfff8000 && addr < 0xfffc000)
+    return "hyppo";
+  else if (addr < CHIPRAM_SIZE)
+    return "chip";
+  else if (addr >= 0xff80000 && addr < (0xff80000 + COLOURRAM_SIZE))
+    return "colour";
+  else if ((addr & 0xfff0000) == 0xffd0000)
+    return "io";
+  return "unmapped";
+}
+
+const char *dma_operation_name(unsigned int cmd)
+{
+  switch (cmd & 3) {
+  case 0:
+    return "copy";
+  case 3:
+    return "fill";
+  }
+  return "unsupported";
+}
+
+char *dma_trigger_name(unsigned int trigger_pc)
+{
+  static char name[1024];
+
+  if (trigger_pc == -1)
+    return "(test script)";
+  snprintf(name, sizeof(name), "%s", describe_address_label28(&cpu, trigger_pc));
+  if (!name[0])
+    snprintf(name, sizeof(name), "$%07X", trigger_pc);
+  return name;
+}
+
+typedef struct dma_trigger_stats {
+  unsigned int trigger_pc;
+  unsigned int jobs;
+  unsigned int copies;
+  unsigned int fills;
+  unsigned int chained;
+  unsigned int small;
+  unsigned int fast;
+  unsigned long long bytes;
+} dma_trigger_stats;
+
+// Jobs this short spend more time being set up than moving data
+#define DMA_SMALL_JOB 16
+
+int compare_dma_trigger_stats(const void *a, const void *b)
+{
+  const dma_trigger_stats *sa = a;
+  const dma_trigger_stats *sb = b;
+
+  if (sa->jobs != sb->jobs)
+    return sa->jobs < sb->jobs ? 1 : -1;
+  return sa->trigger_pc < sb->trigger_pc ? -1 : sa->trigger_pc > sb->trigger_pc;
+}
+
+void dma_report(FILE *f)
+{
+  dma_trigger_stats *stats = calloc(dma_job_count + 1, sizeof(dma_trigger_stats));
+  int trigger_count = 0;
+  unsigned long long bytes = 0;
+
+  if (!stats) {
+    fprintf(f, "ERROR: Could not allocate memory for DMA report\n");
+    cpu.term.error = true;
+    return;
+  }
+
+  for (int i = 0; i < dma_job_count; i++) {
+    dma_job *job = &dma_jobs[i];
+    int t;
+    for (t = 0; t < trigger_count; t++)
+      if (stats[t].trigger_pc == job->trigger_pc)
+        break;
+    if (t == trigger_count)
+      stats[trigger_count++].trigger_pc = job->trigger_pc;
+    stats[t].jobs++;
+    stats[t].bytes += job->count;
+    if ((job->cmd & 3) == 0)
+      stats[t].copies++;
+    else if ((job->cmd & 3) == 3)
+      stats[t].fills++;
+    if (job->cmd & 4)
+      stats[t].chained++;
+    if (job->count < DMA_SMALL_JOB)
+      stats[t].small++;
+    if (job->fast)
+      stats[t].fast++;
+    bytes += job->count;
+  }
+  qsort(stats, trigger_count, sizeof(dma_trigger_stats), compare_dma_trigger_stats);
+
+  fprintf(f, "INFO: %d DMA jobs moved %llu bytes", dma_job_count, bytes);
+  if (dma_jobs_lost)
+    fprintf(f, " (and %d more jobs were not recorded)", dma_jobs_lost);
+  fprintf(f, ":\n");
+  fprintf(f, "  %8s %10s %9s %8s %8s %8s %8s %8s  %s\n", "Jobs", "Bytes", "Avg bytes", "Copies", "Fills", "Chained",
+      "Small", "Fast", "Triggered by");
+  for (int t = 0; t < trigger_count; t++)
+    fprintf(f, "  %8u %10llu %9.1f %8u %8u %8u %8u %8u  %s\n", stats[t].jobs, stats[t].bytes,
+        (double)stats[t].bytes / stats[t].jobs, stats[t].copies, stats[t].fills, stats[t].chained, stats[t].small,
+        stats[t].fast, dma_trigger_name(stats[t].trigger_pc));
+
+  free(stats);
+}
+
+int dma_export(char *filename)
+{
+  // One row per job, as JSON if the file name ends in .json, otherwise as CSV
+  int len = strlen(filename);
+  bool json = len > 5 && !strcasecmp(filename + len - 5, ".json");
+  FILE *f = fopen(filename, "w");
+
+  if (!f) {
+    fprintf(logfile, "ERROR: Could not write DMA jobs to '%s'\n", filename);
+    return -1;
+  }
+  if (json)
+    fprintf(f, "[\n");
+  else
+    fprintf(f, "instruction,trigger,trigger_pc,list,enhanced,operation,cmd,src_region,src,dest_region,dest,count,"
+               "chained,fast,options\n");
+  for (int i = 0; i < dma_job_count; i++) {
+    dma_job *job = &dma_jobs[i];
+    char options[MAX_DMA_JOB_OPTIONS * 4 + 1] = "";
+    char trigger_pc[16] = "";
+    if (job->trigger_pc != -1)
+      snprintf(trigger_pc, sizeof(trigger_pc), json ? "%u" : "$%07X", job->trigger_pc);
+    for (int o = 0; o < job->option_count; o++)
+      snprintf(options + strlen(options), sizeof(options) - strlen(options), "%s$%02X", o ? " " : "",
+          job->options[o]);
+    if (json) {
+      fprintf(f,
+          "  { \"instruction\": %u, \"trigger\": \"%s\", \"trigger_pc\": %s, \"list\": %u, \"enhanced\": %s, "
+          "\"operation\": \"%s\", \"cmd\": %u, \"src_region\": \"%s\", \"src\": %u, \"dest_region\": \"%s\", "
+          "\"dest\": %u, \"count\": %u, \"chained\": %s, \"fast\": %s, \"options\": \"%s\" }%s\n",
+          job->instruction, dma_trigger_name(job->trigger_pc), trigger_pc[0] ? trigger_pc : "null", job->list_addr,
+          job->enhanced ? "true" : "false", dma_operation_name(job->cmd), job->cmd, memory_region_name(job->src),
+          job->src, memory_region_name(job->dest), job->dest, job->count, job->cmd & 4 ? "true" : "false",
+          job->fast ? "true" : "false", options, i < dma_job_count - 1 ? "," : "");
+    }
+    else {
+      fprintf(f, "%u,%s,%s,$%07X,%d,%s,$%04X,%s,$%07X,%s,$%07X,%u,%d,%d,%s\n", job->instruction,
+          dma_trigger_name(job->trigger_pc), trigger_pc, job->list_addr, job->enhanced,
+          dma_operation_name(job->cmd), job->cmd, memory_region_name(job->src), job->src,
+          memory_region_name(job->dest), job->dest, job->count, (job->cmd & 4) != 0, job->fast, options);
+    }
+  }
+  if (json)
+    fprintf(f, "]\n");
+  fclose(f);
+  fprintf(logfile, "INFO: Wrote %d DMA jobs to '%s'\n", dma_job_count, filename);
+  return 0;
+}
+
+// The RAM regions of the 28-bit address space, for DMA jobs that can be done
+// with memmove()/memset() instead of byte by byte
+typedef struct ram_region {
+  unsigned int base;
+  unsigned int size;
+  unsigned char *mem;
+  unsigned int *blame;
+  unsigned char *dirty;
+} ram_region;
+const ram_region ram_regions[] = {
+  { 0, CHIPRAM_SIZE, chipram, chipram_blame, chipram_dirty },
+  { 0xfff8000, HYPPORAM_SIZE, hypporam, hypporam_blame, hypporam_dirty },
+  { 0xff80000, COLOURRAM_SIZE, colourram, colourram_blame, colourram_dirty },
+};
+
+const ram_region *ram_region_for(unsigned long long addr, unsigned int len)
+{
+  // Returns the RAM region that holds all of addr to addr+len-1, if any
+  for (int i = 0; i < sizeof(ram_regions) / sizeof(ram_regions[0]); i++)
+    if (addr >= ram_regions[i].base && addr + len <= ram_regions[i].base + ram_regions[i].size)
+      return &ram_regions[i];
+  return NULL;
+}
+
+bool dma_linear_job(struct cpu *cpu, int dma_cmd, unsigned int src, unsigned int dest, unsigned int count,
+    unsigned char fill_value)
+{
+  // Does a plain forward copy or fill within RAM in one go.  Returns false if
+  // the job has to be done byte by byte instead.
+  const ram_region *d = ram_region_for(dest, count);
+  const ram_region *s = NULL;
+  unsigned int offset;
+
+  // Writes to $00 and $01 have side effects
+  if (!d || (d->base == 0 && dest < 2))
+    return false;
+  // Watchpoints are checked byte by byte
+  if (watch_range(dest, count, WATCH_WRITE | WATCH_VALUE) || ((dma_cmd & 3) == 0 && watch_range(src, count, WATCH_READ)))
+    return false;
+  offset = dest - d->base;
+
+  if ((dma_cmd & 3) == 0) {
+    s = ram_region_for(src, count);
+    if (!s)
+      return false;
+    // A forward copy to just above its source repeats the first bytes along
+    // the destination, which memmove() would not do.
+    if (s == d && dest > src && dest < src + count)
+      return false;
+  }
+
+  decode_invalidate_range(dest, count);
+  for (unsigned int i = 0; i < count; i++) {
+    undo_record(cpu, dest + i, d->mem[offset + i], d->blame[offset + i]);
+    d->blame[offset + i] = cpu->instruction_count;
+  }
+  if ((dma_cmd & 3) == 0)
+    memmove(&d->mem[offset], &s->mem[src - s->base], count);
+  else
+    memset(&d->mem[offset], fill_value, count);
+  memset(&d->dirty[offset >> DIRTY_PAGE_BITS], DIRTY_ALL,
+      ((offset + count - 1) >> DIRTY_PAGE_BITS) - (offset >> DIRTY_PAGE_BITS) + 1);
+  return true;
+}
+
+int do_dma(struct cpu *cpu, int eDMA, unsigned int addr)
+{
+  int f011b = 0;
+  int with_transparency = 0;
+  int floppy_mode = 0;
+  int floppy_ignore_ff = 0;
+  int spiral_mode = 0;
+  int spiral_len = 0;
+  int spiral_len_remaining = 0;
+  int src_mb = 0;
+  int dst_mb = 0;
+  int src_skip = 0;
+  int dst_skip = 0;
+  int transparent_value = 0;
+  int x8_offset = 0;
+  int y8_offset = 0;
+  int slope = 0;
+  int slope_overflow_toggle = 0;
+  int slope_fraction_start = 0;
+  int line_mode = 0;
+  int line_x_or_y = 0;
+  int line_slope_negative = 0;
+  int dma_count = 0;
+  int s_x8_offset = 0;
+  int s_y8_offset = 0;
+  int s_slope = 0;
+  int s_slope_overflow_toggle = 0;
+  int s_slope_fraction_start = 0;
+  int s_line_mode = 0;
+  int s_line_x_or_y = 0;
+  int s_line_slope_negative = 0;
+
+  int spiral_phase = 0;
+
+  if (cpu->term.log_dma) {
+    fprintf(logfile, "NOTE: %sDMA dispatched with list address $%07x\n", eDMA ? "E" : "", addr);
+    fprintf(logfile, "      DMA addr regs contain $%02X $%02X $%02X $%02X $%02X $%02X\n", ffdram[0x3700], ffdram[0x3701],
+        ffdram[0x3702], ffdram[0x3703], ffdram[0x3704], ffdram[0x3705]);
+    show_recent_instructions(logfile, "Instructions leading up to the DMA request", cpu, cpulog_len - 32, 32, cpu->regs.pc);
+  }
+
+  int more_jobs = 1;
+
+  while (more_jobs) {
+    dma_job job;
+    more_jobs = 0;
+
+    bzero(&job, sizeof(job));
+    job.list_addr = addr;
+    job.enhanced = eDMA;
+
+    dma_count = 0;
+
+    src_skip = 0x0100;
+    dst_skip = 0x0100;
+
+    if (eDMA) {
+      // Read DMA option bytes
+      while (read_memory28(cpu, addr)) {
+        int option = read_memory28(cpu, addr++);
+        int arg = 0;
+        if (option & 0x80)
+          arg = read_memory28(cpu, addr++);
+        if (cpu->term.log_dma)
+          fprintf(logfile, "INFO: DMA option $%02X $%02X\n", option, arg);
+        if (job.option_count < MAX_DMA_JOB_OPTIONS)
+          job.options[job.option_count++] = option;
+        switch (option) {
+        case 0x06:
+          with_transparency = 0;
+          break;
+        case 0x07:
+          with_transparency = 0;
+          break;
+        case 0x0a:
+          f011b = 0;
+          break;
+        case 0x0b:
+          f011b = 1;
+          break;
+        case 0x0d:
+          floppy_mode = 1;
+          break;
+        case 0x0e:
+          floppy_mode = 1;
+          floppy_ignore_ff = 1;
+          break;
+        case 0x0f:
+          floppy_mode = 1;
+          floppy_ignore_ff = 0;
+          break;
+        case 0x53:
+          spiral_mode = 1;
+          spiral_len = 39;
+          spiral_len_remaining = 38;
+          break;
+        case 0x80:
+          src_mb = arg;
+          break;
+        case 0x81:
+          dst_mb = arg;
+          break;
+        case 0x82:
+          src_skip |= arg;
+          break;
+        case 0x83:
+          src_skip |= arg << 8;
+          break;
+        case 0x84:
+          dst_skip |= arg;
+          break;
+        case 0x85:
+          dst_skip |= arg << 8;
+          break;
+        case 0x86:
+          transparent_value = arg;
+          break;
+        case 0x87:
+          x8_offset |= arg;
+          break;
+        case 0x88:
+          x8_offset |= arg << 8;
+          break;
+        case 0x89:
+          y8_offset |= arg;
+          break;
+        case 0x8a:
+          y8_offset |= arg << 8;
+          break;
+        case 0x8b:
+          slope |= arg;
+          break;
+        case 0x8c:
+          slope |= arg << 8;
+          break;
+        case 0x8d:
+          slope_fraction_start |= arg;
+          break;
+        case 0x8e:
+          slope_fraction_start |= arg << 8;
+          break;
+        case 0x8f:
+          line_mode = arg & 0x80;
+          line_x_or_y = arg & 0x40;
+          line_slope_negative = arg & 0x20;
+          break;
+        case 0x90:
+          dma_count |= arg << 16;
+          break;
+        case 0x97:
+          s_x8_offset |= arg;
+          break;
+        case 0x98:
+          s_x8_offset |= arg << 8;
+          break;
+        case 0x99:
+          s_y8_offset |= arg;
+          break;
+        case 0x9a:
+          s_y8_offset |= arg << 8;
+          break;
+        case 0x9b:
+          s_slope |= arg;
+          break;
+        case 0x9c:
+          s_slope |= arg << 8;
+          break;
+        case 0x9d:
+          s_slope_fraction_start |= arg;
+          break;
+        case 0x9e:
+          s_slope_fraction_start |= arg << 8;
+          break;
+        case 0x9f:
+          s_line_mode = arg & 0x80;
+          s_line_x_or_y = arg & 0x40;
+          s_line_slope_negative = arg & 0x20;
+          break;
+        default:
+          fprintf(logfile, "ERROR: Unknown DMA option $%02X used.\n", option);
+          cpu->term.error = true;
+          break;
+        }
+      }
+      addr++; // skip final $00 option byte
+      if (cpu->term.log_dma)
+        fprintf(logfile, "INFO: End of DMA Options found. DMA list proper begins at $%07X (%s)\n", addr,
+            describe_address_label28(cpu, addr));
+    }
+    else {
+      if (cpu->term.log_dma)
+        fprintf(
+            logfile, "INFO: Non-enhanced DMA list proper begins at $%07X (%s)\n", addr, describe_address_label28(cpu, addr));
+    }
+
+    // Read DMA list bytes
+    int dma_cmd = read_memory28(cpu, addr++);
+    dma_count |= read_memory28(cpu, addr++);
+    dma_count |= read_memory28(cpu, addr++) << 8;
+    unsigned int dma_src = read_memory28(cpu, addr++);
+    dma_src |= read_memory28(cpu, addr++) << 8;
+    dma_src |= read_memory28(cpu, addr++) << 16;
+    unsigned int dma_dst = read_memory28(cpu, addr++);
+    dma_dst |= read_memory28(cpu, addr++) << 8;
+    dma_dst |= read_memory28(cpu, addr++) << 16;
+    if (f011b)
+      dma_cmd |= read_memory28(cpu, addr++) << 8;
+    unsigned int dma_modulo = read_memory28(cpu, addr++);
+    dma_modulo |= read_memory28(cpu, addr++) << 8;
+
+    int src_direction, src_hold, src_modulo;
+    int dest_direction, dest_hold, dest_modulo;
+    if (f011b) {
+      src_direction = (dma_cmd >> 4) & 1;
+      src_hold = (dma_cmd >> 9) & 1;
+      src_modulo = (dma_cmd >> 8) & 1;
+      dest_direction = (dma_cmd >> 5) & 1;
+      dest_hold = (dma_cmd >> 11) & 1;
+      dest_modulo = (dma_cmd >> 10) & 1;
+    }
+    else {
+      src_direction = (dma_src >> 22) & 1;
+      src_modulo = (dma_src >> 21) & 1;
+      src_hold = (dma_src >> 20) & 1;
+      dest_direction = (dma_dst >> 22) & 1;
+      dest_modulo = (dma_dst >> 21) & 1;
+      dest_hold = (dma_dst >> 20) & 1;
+    }
+    // int src_io=dma_src&0x800000;
+    // int dest_io=dma_dst&0x800000;
+    dma_src &= 0xfffff;
+    unsigned long long src_addr = (dma_src << 8) | (((unsigned long long)src_mb) << 28);
+    dma_dst &= 0xfffff;
+    unsigned long long dest_addr = (dma_dst << 8) | (((unsigned long long)dst_mb) << 28);
+
+    // Is it chained?
+    more_jobs = dma_cmd & 4;
+
+    if (cpu->term.log_dma)
+      fprintf(logfile, "INFO: DMA cmd=$%04X, src=$%07X, dst=$%07X, count=$%06X, modulo=$%04X\n", dma_cmd, dma_src, dma_dst,
+          dma_count, dma_modulo);
+
+    if (!dma_count)
+      dma_count = 0x10000;
+
+    switch (dma_cmd & 3) {
+    case 0:
+      /* Copy operation: Clone symbols from source region to destination region. */
+      {
+        int symbols_copied = 0;
+        int pre_symbol_count = symbol_count; // don't duplicate duplicates!
+        for (int i = 0; i < pre_symbol_count; i++) {
+          if (symbols[i].addr >= (src_addr >> 8) && symbols[i].addr < ((src_addr >> 8) + dma_count)) {
+            /*      fprintf(stderr,"NOTE: Copying symbol #%d '%s' from $%07X to $%07X due to DMA copy.\n",
+                    i,symbols[i].name,
+                    symbols[i].addr,
+                    dest_addr + (symbols[i].addr-src_addr)); */
+            symbols_copied++;
+
+            if (symbol_count >= MAX_SYMBOLS) {
+              fprintf(logfile, "ERROR: Too many symbols. Increase MAX_SYMBOLS.\n");
+              cpu->term.error = true;
+              cpu->term.done = true;
+              return -1;
+            }
+            symbols[symbol_count].name = strdup(symbols[i].name);
+            symbols[symbol_count].addr = (dest_addr >> 8) + (symbols[i].addr - (src_addr >> 8));
+            if (((dest_addr >> 8) + (symbols[i].addr - (src_addr >> 8))) < CHIPRAM_SIZE) {
+              sym_by_addr[(dest_addr >> 8) + (symbols[i].addr - (src_addr >> 8))] = &symbols[symbol_count];
+            }
+            symbol_index_add(&symbol_index_all, symbol_count);
+            symbol_count++;
+          }
+        }
+        if (symbols_copied)
+          fprintf(logfile, "NOTE: Duplicated %d symbols due to DMA copy from $%07llX-$%07llX to $%07llX-$%07llX.\n",
+              symbols_copied, src_addr >> 8, (src_addr >> 8) + dma_count - 1, dest_addr >> 8,
+              (dest_addr >> 8) + dma_count - 1);
+      }
+      break;
+    case 3:
+      /* Fill operation: Erase symbols from destination region */
+      {
+        int symbols_erased = 0;
+        for (int i = 0; i < symbol_count; i++) {
+          if (symbols[i].addr >= (dest_addr >> 8) && symbols[i].addr < ((dest_addr >> 8) + dma_count)) {
+            symbols_erased++;
+            symbols[i].addr = symbols[symbol_count - 1].addr;
+            free(symbols[i].name);
+            symbols[i].name = symbols[symbol_count - 1].name;
+            symbol_count--;
+            symbol_index_invalidate(&symbol_index_all);
+          }
+        }
+        if (symbols_erased)
+          fprintf(logfile, "NOTE: Erased %d symbols due to DMA fill from $%07llX to $%07llX.\n", symbols_erased,
+              dest_addr >> 8, (dest_addr >> 8) + dma_count - 1);
+      }
+      break;
+    }
+
+    // Fill jobs use the low byte of the source address, which doesn't move
+    unsigned char fill_value = (src_addr >> 8) & 0xff;
+
+    // Simple linear jobs don't need to go byte by byte
+    if ((dma_cmd & 3) == 0 || (dma_cmd & 3) == 3) {
+      if (!spiral_mode && !line_mode && !s_line_mode && !with_transparency && !floppy_mode && src_skip == 0x100
+          && dst_skip == 0x100 && !src_hold && !dest_hold && !src_direction && !dest_direction && !src_modulo
+          && !dest_modulo)
+        job.fast = dma_linear_job(cpu, dma_cmd, src_addr >> 8, dest_addr >> 8, dma_count, fill_value);
+    }
+
+    job.cmd = dma_cmd;
+    job.src = src_addr >> 8;
+    job.dest = dest_addr >> 8;
+    job.count = dma_count;
+    dma_job_record(cpu, &job);
+    if (job.fast)
+      continue;
+
+    while (dma_count--) {
+
+      // Do operation before updating addresses
+      switch (dma_cmd & 3) {
+      case 0: // copy
+      {
+        // XXX - Doesn't simulate the 4 cycle DMA pipeline
+        int value = read_memory28(cpu, src_addr >> 8);
+        MEM_WRITE28(cpu, dest_addr >> 8, value);
+        //      fprintf(stderr,"DEBUG: Copying $%02X from $%07X to $%07X\n",value,src_addr>>8,dest_addr>>8);
+      } break;
+      case 3: // fill
+        MEM_WRITE28(cpu, dest_addr >> 8, fill_value);
+        break;
+      default:
+        fprintf(logfile, "ERROR: Unsupported DMA operation %d requested.\n", dma_cmd & 3);
+        cpu->term.error = true;
+        cpu->term.done = true;
+        return 0;
+      }
+
+      // Update source address
+      {
+        if (!s_line_mode) {
+          // Normal fill / copy
+          if (!src_hold) {
+            if (!src_direction)
+              src_addr += src_skip;
+            else
+              src_addr -= src_skip;
+          }
+        }
+        else {
+          // We are in line mode.
+
+          // Add fractional position
+          s_slope_fraction_start += s_slope;
+          // Check if we have accumulated a whole pixel of movement?
+          int line_x_move = 0;
+          int line_x_move_negative = 0;
+          int line_y_move = 0;
+          int line_y_move_negative = 0;
+          if (s_slope_overflow_toggle /= (s_slope_fraction_start & 0x10000)) {
+            s_slope_overflow_toggle = (s_slope_fraction_start & 0x10000);
+            // Yes: Advance in minor axis
+            if (!s_line_x_or_y) {
+              line_y_move = 1;
+              line_y_move_negative = s_line_slope_negative;
+            }
+            else {
+              line_x_move = 1;
+              line_x_move_negative = s_line_slope_negative;
+            }
+          }
+          // Also move major axis (which is always in the forward direction)
+          if (!s_line_x_or_y)
+            line_x_move = 1;
+          else
+            line_y_move = 1;
+          if ((!line_x_move) && line_y_move && (!line_y_move_negative)) {
+            // Y = Y + 1
+            if (((src_addr >> 11) & 7) == 7) {
+              // Will overflow between Y cards
+              src_addr |= (256 * 8) + (s_y8_offset << 8);
+            }
+            else {
+              // No overflow, so just add 8 bytes (with 8-bit pixel resolution)
+              src_addr |= (256 * 8);
+            }
+          }
+          else if ((!line_x_move) && line_y_move && line_y_move_negative) {
+            // Y = Y - 1
+            if (((src_addr >> 11) & 7) == 0) {
+              // Will overflow between X cards
+              src_addr -= (256 * 8) + (s_y8_offset << 8);
+            }
+            else {
+              // No overflow, so just subtract 8 bytes (with 8-bit pixel resolution)
+              src_addr -= (256 * 8);
+            }
+          }
+          else if (line_x_move && (!line_x_move_negative) && (!line_y_move)) {
+            // X = X + 1
+            if (((src_addr >> 8) & 7) == 7) {
+              // Will overflow between X cards
+              src_addr += 256 + (s_x8_offset << 8);
+            }
+            else {
+              // No overflow, so just add 1 pixel (with 8-bit pixel resolution)
+              src_addr += 256;
+            }
+          }
+          else if (line_x_move && line_x_move_negative && (!line_y_move)) {
+            // X = X - 1
+            if (((src_addr >> 8) & 7) == 0) {
+              // Will overflow between X cards
+              src_addr -= 256 + (s_x8_offset << 8);
+            }
+            else {
+              // No overflow, so just subtract 1 pixel (with 8-bit pixel resolution)
+              src_addr -= 256;
+            }
+          }
+          else if (line_x_move && (!line_x_move_negative) && line_y_move && (!line_y_move_negative)) {
+            // X = X + 1, Y = Y + 1
+            if (((src_addr >> 8) & 0x3f) == 0x3f) {
+              // positive overflow on both
+              src_addr += (256 * 9) + (s_x8_offset << 8) + (s_y8_offset << 8);
+            }
+            else if (((src_addr >> 8) & 0x3f) == 0x38) {
+              // positive card overflow on Y only
+              src_addr += (256 * 9) + (s_y8_offset << 8);
+            }
+            else if (((src_addr >> 8) & 0x3f) == 0x07) {
+              // positive card overflow on X only
+              src_addr += (256 * 9) + (s_x8_offset << 8);
+            }
+            else {
+              // no card overflow
+              src_addr += (256 * 9);
+            }
+          }
+          else if (line_x_move && (!line_x_move_negative) && line_y_move && line_y_move_negative) {
+            // X = X + 1, Y = Y - 1
+            if (((src_addr >> 8) & 0x3f) == 0x07) {
+              // positive card overflow on X, negative on Y
+              src_addr += (256 * 1) - (256 * 8) + (s_x8_offset << 8) - (s_y8_offset << 8);
+            }
+            else if (((src_addr >> 8) & 0x3f) < 0x08) {
+              // negative card overflow on Y only
+              src_addr += (256 * 1) - (256 * 8) - (s_y8_offset << 8);
+            }
+            if (((src_addr >> 8) & 0x07) == 0x07) {
+              // positive overflow on X only
+              src_addr += (256 * 1) - (256 * 8) + (s_x8_offset << 8);
+            }
+            else {
+              src_addr += (256 * 1) - (256 * 8);
+            }
+          }
+          else if (line_x_move && line_x_move_negative && line_y_move && (!line_y_move_negative)) {
+            // X = X - 1, Y = Y + 1
+            if (((src_addr >> 8) & 0x3f) == 0x38) {
+              // negative card overflow on X, positive on Y
+              src_addr += -(256 * 1) + (256 * 8) - (s_x8_offset << 8) + (s_y8_offset << 8);
+            }
+            else if (((src_addr >> 11) & 0x07) == 0x07) {
+              // positive card overflow on Y only
+              src_addr += -(256 * 1) + (256 * 8) + (s_y8_offset << 8);
+            }
+            else if (((src_addr >> 8) & 7) == 0) {
+              // negative overflow on X only
+              src_addr += -(256 * 1) + (256 * 8) - (s_x8_offset << 8);
+            }
+            else {
+              src_addr += -(256 * 1) + (256 * 8);
+            }
+          }
+          else if (line_x_move && line_x_move_negative && line_y_move && line_y_move_negative) {
+            // X = X - 1, Y = Y - 1
+            if (((src_addr >> 8) & 0x3f) == 0x00) {
+              // negative card overflow on X, negative on Y
+              src_addr += -(256 * 1) - (256 * 8) - (s_x8_offset << 8) - (s_y8_offset << 8);
+            }
+            else if (((src_addr >> 11) & 0x7) == 0x00) {
+              // negative card overflow on Y only
+              src_addr += -(256 * 1) - (256 * 8) - (s_y8_offset << 8);
+            }
+            else if (((src_addr >> 8) & 0x7) == 0x00) {
+              // negative overflow on X only
+              src_addr += -(256 * 1) - (256 * 8) - (s_x8_offset << 8);
+            }
+            else {
+              src_addr += -(256 * 1) - (256 * 8);
+            }
+          }
+        }
+      }
+
+      // Update destination address
+      {
+        if (spiral_mode) {
+          // Draw the dreaded Shallan Spriral
+          switch (spiral_phase) {
+          case 0:
+            dest_addr = dest_addr + 0x100;
+            break;
+          case 1:
+            dest_addr = dest_addr + 0x2800;
+            break;
+          case 2:
+            dest_addr = dest_addr - 0x100;
+            break;
+          case 3:
+            dest_addr = dest_addr - 0x2800;
+            break;
+          }
+          if (spiral_len_remaining)
+            spiral_len_remaining -= 1;
+          else {
+            // Calculate details for next phase of the spiral
+            if (!(spiral_phase & 1)) {
+              // Next phase is vertical, so reduce spiral length by 40 - 24 = 17
+              spiral_len_remaining = spiral_len - 16;
+            }
+            else {
+              spiral_len_remaining = spiral_len;
+            }
+            if (spiral_len)
+              spiral_len--;
+          }
+          spiral_phase++;
+          spiral_phase &= 3;
+        }
+        else if (!line_mode) {
+          // Normal fill / copy
+          if (!dest_hold) {
+            if (!dest_direction)
+              dest_addr += dst_skip;
+            else
+              dest_addr -= dst_skip;
+          }
+        }
+        else {
+          // We are in line mode.
+
+          // Add fractional position
+          slope_fraction_start += slope;
+          // Check if we have accumulated a whole pixel of movement?
+          int line_x_move = 0;
+          int line_x_move_negative = 0;
+          int line_y_move = 0;
+          int line_y_move_negative = 0;
+          if (slope_overflow_toggle /= (slope_fraction_start & 0x10000)) {
+            slope_overflow_toggle = (slope_fraction_start & 0x10000);
+            // Yes: Advance in minor axis
+            if (!line_x_or_y) {
+              line_y_move = 1;
+              line_y_move_negative = line_slope_negative;
+            }
+            else {
+              line_x_move = 1;
+              line_x_move_negative = line_slope_negative;
+            }
+          }
+          // Also move major axis (which is always in the forward direction)
+          if (!line_x_or_y)
+            line_x_move = 1;
+          else
+            line_y_move = 1;
+          if ((!line_x_move) && line_y_move && (!line_y_move_negative)) {
+            // Y = Y + 1
+            if (((dest_addr >> 11) & 7) == 7) {
+              // Will overflow between Y cards
+              dest_addr |= (256 * 8) + (y8_offset << 8);
+            }
+            else {
+              // No overflow, so just add 8 bytes (with 8-bit pixel resolution)
+              dest_addr |= (256 * 8);
+            }
+          }
+          else if ((!line_x_move) && line_y_move && line_y_move_negative) {
+            // Y = Y - 1
+            if (((dest_addr >> 11) & 7) == 0) {
+              // Will overflow between X cards
+              dest_addr -= (256 * 8) + (y8_offset << 8);
+            }
+            else {
+              // No overflow, so just subtract 8 bytes (with 8-bit pixel resolution)
+              dest_addr -= (256 * 8);
+            }
+          }
+          else if (line_x_move && (!line_x_move_negative) && (!line_y_move)) {
+            // X = X + 1
+            if (((dest_addr >> 8) & 7) == 7) {
+              // Will overflow between X cards
+              dest_addr += 256 + (x8_offset << 8);
+            }
+            else {
+              // No overflow, so just add 1 pixel (with 8-bit pixel resolution)
+              dest_addr += 256;
+            }
+          }
+          else if (line_x_move && line_x_move_negative && (!line_y_move)) {
+            // X = X - 1
+            if (((dest_addr >> 8) & 7) == 0) {
+              // Will overflow between X cards
+              dest_addr -= 256 + (x8_offset << 8);
+            }
+            else {
+              // No overflow, so just subtract 1 pixel (with 8-bit pixel resolution)
+              dest_addr -= 256;
+            }
+          }
+          else if (line_x_move && (!line_x_move_negative) && line_y_move && (!line_y_move_negative)) {
+            // X = X + 1, Y = Y + 1
+            if (((dest_addr >> 8) & 0x3f) == 0x3f) {
+              // positive overflow on both
+              dest_addr += (256 * 9) + (x8_offset << 8) + (y8_offset << 8);
+            }
+            else if (((dest_addr >> 8) & 0x3f) == 0x38) {
+              // positive card overflow on Y only
+              dest_addr += (256 * 9) + (y8_offset << 8);
+            }
+            else if (((dest_addr >> 8) & 0x3f) == 0x07) {
+              // positive card overflow on X only
+              dest_addr += (256 * 9) + (x8_offset << 8);
+            }
+            else {
+              // no card overflow
+              dest_addr += (256 * 9);
+            }
+          }
+          else if (line_x_move && (!line_x_move_negative) && line_y_move && line_y_move_negative) {
+            // X = X + 1, Y = Y - 1
+            if (((dest_addr >> 8) & 0x3f) == 0x07) {
+              // positive card overflow on X, negative on Y
+              dest_addr += (256 * 1) - (256 * 8) + (x8_offset << 8) - (y8_offset << 8);
+            }
+            else if (((dest_addr >> 8) & 0x3f) < 0x08) {
+              // negative card overflow on Y only
+              dest_addr += (256 * 1) - (256 * 8) - (y8_offset << 8);
+            }
+            if (((dest_addr >> 8) & 0x07) == 0x07) {
+              // positive overflow on X only
+              dest_addr += (256 * 1) - (256 * 8) + (x8_offset << 8);
+            }
+            else {
+              dest_addr += (256 * 1) - (256 * 8);
+            }
+          }
+          else if (line_x_move && line_x_move_negative && line_y_move && (!line_y_move_negative)) {
+            // X = X - 1, Y = Y + 1
+            if (((dest_addr >> 8) & 0x3f) == 0x38) {
+              // negative card overflow on X, positive on Y
+              dest_addr += -(256 * 1) + (256 * 8) - (x8_offset << 8) + (y8_offset << 8);
+            }
+            else if (((dest_addr >> 11) & 0x07) == 0x07) {
+              // positive card overflow on Y only
+              dest_addr += -(256 * 1) + (256 * 8) + (y8_offset << 8);
+            }
+            else if (((dest_addr >> 8) & 7) == 0) {
+              // negative overflow on X only
+              dest_addr += -(256 * 1) + (256 * 8) - (x8_offset << 8);
+            }
+            else {
+              dest_addr += -(256 * 1) + (256 * 8);
+            }
+          }
+          else if (line_x_move && line_x_move_negative && line_y_move && line_y_move_negative) {
+            // X = X - 1, Y = Y - 1
+            if (((dest_addr >> 8) & 0x3f) == 0x00) {
+              // negative card overflow on X, negative on Y
+              dest_addr += -(256 * 1) - (256 * 8) - (x8_offset << 8) - (y8_offset << 8);
+            }
+            else if (((dest_addr >> 11) & 0x7) == 0x00) {
+              // negative card overflow on Y only
+              dest_addr += -(256 * 1) - (256 * 8) - (y8_offset << 8);
+            }
+            else if (((dest_addr >> 8) & 0x7) == 0x00) {
+              // negative overflow on X only
+              dest_addr += -(256 * 1) - (256 * 8) - (x8_offset << 8);
+            }
+            else {
+              dest_addr += -(256 * 1) - (256 * 8);
+            }
+          }
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+int write_mem28(struct cpu *cpu, unsigned int addr, unsigned char value)
+{
+  unsigned int dma_addr;
+
+  if (watch_pages[WATCH_PAGE(addr)] & (WATCH_WRITE | WATCH_VALUE))
+    watch_check(cpu, addr, WATCH_WRITE, value);
+  if (decode_pages[DECODE_PAGE(addr)])
+    decode_invalidate(addr);
+
+  if (addr >= 0xfff8000 && addr < 0xfffc000) {
+    // Hypervisor sits at $FFF8000-$FFFBFFF
+    undo_record(cpu, addr, hypporam[addr - 0xfff8000], hypporam_blame[addr - 0xfff8000]);
+    hypporam_blame[addr - 0xfff8000] = cpu->instruction_count;
+    hypporam[addr - 0xfff8000] = value;
+    hypporam_dirty[(addr - 0xfff8000) >> DIRTY_PAGE_BITS] = DIRTY_ALL;
+  }
+  else if (addr < CHIPRAM_SIZE) {
+    // Chipram at base of address space
+    if (addr == 0 && value == 0x41) {
+      // Set fast CPU
+      undo_record(cpu, UNDO_FORCE_FAST, cpu->force_fast, 0);
+      cpu->force_fast = true;
+    }
+    else if (addr == 0 && value == 0x40) {
+      // Clear fast CPU
+      undo_record(cpu, UNDO_FORCE_FAST, cpu->force_fast, 0);
+      cpu->force_fast = false;
+    }
+    else {
+      undo_record(cpu, addr, chipram[addr], chipram_blame[addr]);
+      chipram_blame[addr] = cpu->instruction_count;
+      chipram[addr] = value;
+      chipram_dirty[addr >> DIRTY_PAGE_BITS] = DIRTY_ALL;
+      if (addr < 2)
+        // CPU port changes C64 ROM/IO banking
+        cpu->map_valid = false;
+    }
+  }
+  else if (addr >= 0xff80000 && addr < (0xff80000 + COLOURRAM_SIZE)) {
+    undo_record(cpu, addr, colourram[addr - 0xff80000], colourram_blame[addr - 0xff80000]);
+    colourram_blame[addr - 0xff80000] = cpu->instruction_count;
+    colourram[addr - 0xff80000] = value;
+    colourram_dirty[(addr - 0xff80000) >> DIRTY_PAGE_BITS] = DIRTY_ALL;
+  }
+  else if ((addr & 0xfff0000) == 0xffd0000) {
+    // $FFDxxxx IO space
+    addr = io_alias(cpu, addr);
+    undo_record(cpu, addr, ffdram[addr - 0xffd0000], ffdram_blame[addr - 0xffd0000]);
+    ffdram[addr - 0xffd0000] = value;
+    ffdram_blame[addr - 0xffd0000] = cpu->instruction_count;
+    // (This also covers the side effects on $D700-$D705 below)
+    ffdram_dirty[(addr - 0xffd0000) >> DIRTY_PAGE_BITS] = DIRTY_ALL;
+
+    // Now check for special address actions
+    switch (addr) {
+    case 0xffd3030: // VIC-III ROM banking
+    case 0xffd3031:
+      cpu->map_valid = false;
+      break;
+    case 0xffd3700: // Trigger DMA
+      if (cpu->term.log_dma)
+        fprintf(logfile, "NOTE: DMA triggered via write to $%07x at instruction #%d\n", addr, cpulog_len);
+      undo_record(cpu, 0xffd3705, ffdram[0x3705], ffdram_blame[0x3705]);
+      ffdram[0x3705] = value;
+      ffdram_blame[0x3705] = cpu->instruction_count;
+      dma_addr = (ffdram[0x3700] + (ffdram[0x3701] << 8) + ((ffdram[0x3702] & 0x7f) << 16)) | (ffdram[0x3704] << 20);
+      do_dma(cpu, 0, dma_addr);
+      break;
+    case 0xffd3702: // Set bits 22 to 16 of DMA address
+      undo_record(cpu, 0xffd3704, ffdram[0x3704], ffdram_blame[0x3704]);
+      ffdram[0x3704] &= 0xf1;
+      ffdram[0x3704] |= (value >> 4) & 7;
+      ffdram_blame[0x3704] = cpu->instruction_count;
+      break;
+    case 0xffd3705: // Trigger EDMA
+      if (cpu->term.log_dma)
+        fprintf(logfile, "NOTE: DMA triggered via write to $%07x at instruction #%d\n", addr, cpulog_len);
+      undo_record(cpu, 0xffd3700, ffdram[0x3700], ffdram_blame[0x3700]);
+      ffdram[0x3700] = value;
+      ffdram_blame[0x3700] = cpu->instruction_count;
+      dma_addr = (ffdram[0x3700] + (ffdram[0x3701] << 8) + ((ffdram[0x3702] & 0x7f) << 16)) | (ffdram[0x3704] << 20);
+      do_dma(cpu, 1, dma_addr);
+      break;
+    }
+    if (sdcard.fd != -1)
+      io_write(cpu, addr, value);
+    if (!cpu->regs.in_hyper) {
+      if (addr >= 0xffd3640 && addr <= 0xffd367f) {
+        // Enter hypervisor
+        fprintf(logfile, "NOTE: CPU Entered Hypervisor via write to $%07x at instruction #%d\n", addr, cpulog_len);
+      }
+    }
+    else {
+      if (addr == 0xffd367f) {
+        // Exit hypervisor
+        fprintf(logfile, "NOTE: CPU Exited Hypervisor via write to $%07x at instruction #%d\n", addr, cpulog_len);
+      }
+    }
+  }
+  else {
+    // Otherwise unmapped RAM
+    fprintf(logfile, "ERROR: Writing to unmapped address $%07x\n", addr);
+    show_recent_instructions(logfile, "Instructions leading up to the request", cpu, cpulog_len - 6, 6, cpu->regs.pc);
+    cpu->term.error = true;
+  }
+
+  return 0;
+}
+
+int write_mem16(struct cpu *cpu, unsigned int addr16, unsigned char value)
+{
+  unsigned int addr = addr_to_28bit(cpu, addr16, 1);
+  return write_mem28(cpu, addr, value);
+}
+
+int write_mem_expected28(unsigned int addr, unsigned char value)
+{
+  if (addr >= 0xfff8000 && addr < 0xfffc000) {
+    // Hypervisor sits at $FFF8000-$FFFBFFF
+    hypporam_expected[addr - 0xfff8000] = value;
+    hypporam_dirty[(addr - 0xfff8000) >> DIRTY_PAGE_BITS] = DIRTY_ALL;
+    fprintf(logfile, "NOTE: Writing to hypervisor RAM @ $%07x\n", addr);
+  }
+  else if (addr < CHIPRAM_SIZE) {
+    // Chipram at base of address space
+    chipram_expected[addr] = value;
+    chipram_dirty[addr >> DIRTY_PAGE_BITS] = DIRTY_ALL;
+  }
+  else if (addr >= 0xff80000 && addr < (0xff80000 + COLOURRAM_SIZE)) {
+    colourram_expected[addr - 0xff80000] = value;
+    colourram_dirty[(addr - 0xff80000) >> DIRTY_PAGE_BITS] = DIRTY_ALL;
+  }
+  else if ((addr & 0xfff0000) == 0xffd0000) {
+    // $FFDxxxx IO space
+    ffdram_expected[addr - 0xffd0000] = value;
+    ffdram_dirty[(addr - 0xffd0000) >> DIRTY_PAGE_BITS] = DIRTY_ALL;
+  }
+  else {
+    // Otherwise unmapped RAM
+    fprintf(logfile, "ERROR: Writing to unmapped address $%07x\n", addr);
+  }
+  return 0;
+}
+
+unsigned int addr_abs(struct instruction_log *log)
+{
+  return log->bytes[1] + (log->bytes[2] << 8);
+}
+
+unsigned int addr_zp(struct cpu *cpu, struct instruction_log *log)
+{
+  return log->bytes[1] + (log->regs.b << 8);
+}
+
+unsigned int addr_zpx(struct cpu *cpu, struct instruction_log *log)
+{
+  return (log->bytes[1] + (log->regs.b << 8) + cpu->regs.x) & 0xff;
+}
+
+unsigned int addr_zpy(struct cpu *cpu, struct instruction_log *log)
+{
+  return (log->bytes[1] + (log->regs.b << 8) + cpu->regs.y) & 0xff;
+}
+
+unsigned int addr_izpy(struct cpu *cpu, struct instruction_log *log)
+{
+  log->zp_pointer = (log->bytes[1] + (log->regs.b << 8));
+  log->zp_pointer_addr = (read_memory(cpu, log->zp_pointer + 0) + (read_memory(cpu, log->zp_pointer + 1) << 8) + cpu->regs.y)
+                       & 0xffff;
+  return log->zp_pointer_addr;
+}
+
+unsigned int addr_izpx(struct cpu *cpu, struct instruction_log *log)
+{
+  // Note that we allow the pointer to cross ZP boundary, i.e.,
+  // "The ($xx,X) bug" is purposely not fixed in the MEGA65 for
+  // backwards compatibility.
+  log->zp_pointer = ((log->bytes[1] + cpu->regs.x) & 0xff) + (log->regs.b << 8);
+  log->zp_pointer_addr = (read_memory(cpu, log->zp_pointer + 0) + (read_memory(cpu, log->zp_pointer + 1) << 8)) & 0xffff;
+  return log->zp_pointer_addr;
+}
+
+unsigned int addr_deref16(struct cpu *cpu, struct instruction_log *log)
+{
+  log->zp_pointer = (log->bytes[1] + (log->bytes[2] << 8));
+  log->zp_pointer_addr = (read_memory(cpu, log->zp_pointer + 0) + (read_memory(cpu, log->zp_pointer + 1) << 8)) & 0xffff;
+  return log->zp_pointer_addr;
+}
+
+unsigned int addr_izpz(struct cpu *cpu, struct instruction_log *log)
+{
+  log->zp_pointer = (log->bytes[1] + (log->regs.b << 8));
+  log->zp_pointer_addr = (read_memory(cpu, log->zp_pointer + 0) + (read_memory(cpu, log->zp_pointer + 1) << 8) + cpu->regs.z)
+                       & 0xffff;
+  return log->zp_pointer_addr;
+}
+
+unsigned int addr_izpz32(struct cpu *cpu, struct instruction_log *log)
+{
+  log->zp_pointer = (log->bytes[1] + (log->regs.b << 8));
+  log->zp_pointer_addr = (read_memory(cpu, log->zp_pointer + 0) + (read_memory(cpu, log->zp_pointer + 1) << 8)
+                             + (read_memory(cpu, log->zp_pointer + 2) << 16) + (read_memory(cpu, log->zp_pointer + 3) << 24)
+                             + cpu->regs.z)
+                       & 0xffff;
+  return log->zp_pointer_addr;
+}
+
+unsigned int addr_absx(struct cpu *cpu, struct instruction_log *log)
+{
+  return (log->bytes[1] + (log->bytes[2] << 8) + cpu->regs.x) & 0xffff;
+}
+
+unsigned int addr_absy(struct cpu *cpu, struct instruction_log *log)
+{
+  return (log->bytes[1] + (log->bytes[2] << 8) + cpu->regs.y) & 0xffff;
+}
+
+unsigned int addr_iabsx(struct cpu *cpu, struct instruction_log *log)
+{
+  log->zp_pointer = addr_absx(cpu, log);
+  log->zp_pointer_addr = (read_memory(cpu, log->zp_pointer + 0) + (read_memory(cpu, log->zp_pointer + 1) << 8)) & 0xffff;
+  return log->zp_pointer_addr;
+}
+
+void update_nz(unsigned char v)
+{
+  cpu.regs.flag_n = v >= 0x80; // Bit 7 is set
+  cpu.regs.flag_z = v == 0;
+}
+
+void update_bit_flags(unsigned char v)
+{
+  cpu.regs.flags &= ~(FLAG_N | FLAG_V | FLAG_Z);
+  cpu.regs.flags |= v & (FLAG_N | FLAG_V);
+  v &= cpu.regs.a;
+  if (!v)
+    cpu.regs.flags |= FLAG_Z;
+}
+
+void update_cmp_flags(unsigned char v)
+{
+  update_nz(v);
+  cpu.regs.flag_c = !cpu.regs.flag_n;
+}
+
+void adc(struct cpu *cpu, unsigned char v)
+{
+  if (cpu->regs.flag_d) {
+    // XXX TODO - Implement decimal mode
+    fprintf(logfile, "ERROR: ADC with decimal mode is not implemented\n");
+    cpu->term.error = true;
+  }
+  else {
+    unsigned r = ((unsigned)v) + cpu->regs.a + cpu->regs.flag_c;
+    update_nz(r);
+    cpu->regs.flag_c = r > 0xff;
+    cpu->regs.flag_v = ((cpu->regs.a ^ r) & (v ^ r) & 0x80) > 0;
+    cpu->regs.a = r;
   }
 }
 
-int show_recent_instructions(
-    FILE *f, char *title, struct cpu *cpu, int first_instruction, int count, unsigned int highlight_address)
+static inline void sbc(struct cpu *cpu, unsigned char v)
 {
-  int last_was_dup = 0;
-  fprintf(f, "INFO: %s\n", title);
-  if (!first_instruction) {
-    fprintf(f, " --- No relevant instruction history available (location not written?) ---\n");
-    return 0;
+  adc(cpu, ~v);
+}
+
+unsigned char stack_pop_ext(struct cpu *cpu, unsigned short amount, struct instruction_log *log)
+{
+  if (cpu->regs.flag_e) {
+    unsigned char new_spl = cpu->regs.spl + amount;
+    if (new_spl < cpu->regs.spl)
+      cpu->stack_underflow = true;
+    cpu->regs.spl = new_spl;
   }
-  if (first_instruction < 0) {
-    count -= -first_instruction;
-    first_instruction = 0;
+  else {
+    unsigned short new_sp = cpu->regs.sp + amount;
+    if (new_sp < cpu->regs.sp)
+      cpu->stack_underflow = true;
+    cpu->regs.sp = new_sp;
   }
-  for (int i = first_instruction; count > 0 && i < cpulog_len; count--, i++) {
-    if (!i) {
-      fprintf(f, "I0        -- Machine reset --\n");
-      continue;
-    }
-    if (cpulog[i]->dup && (i > first_instruction)) {
-      if (!last_was_dup)
-        fprintf(f, "                 ... duplicated instructions omitted ...\n");
-      last_was_dup = 1;
-    }
-    else {
-      last_was_dup = 0;
-      if (cpulog_len - i - 1)
-        fprintf(f, "I%-7d ", i);
-      else
-        fprintf(f, "     >>> ");
-      if (cpulog[i]->count > 1)
-        fprintf(f, "$%04X x%-6d : ", cpulog[i]->pc, cpulog[i]->count);
-      else
-        fprintf(f, "$%04X         : ", cpulog[i]->pc);
-      fprintf(f, "A:%02X ", cpulog[i]->regs.a);
-      fprintf(f, "X:%02X ", cpulog[i]->regs.x);
-      fprintf(f, "Y:%02X ", cpulog[i]->regs.y);
-      fprintf(f, "Z:%02X ", cpulog[i]->regs.z);
-      fprintf(f, "SP:%02X%02X ", cpulog[i]->regs.sph, cpulog[i]->regs.spl);
-      fprintf(f, "B:%02X ", cpulog[i]->regs.b);
-      fprintf(f, "M:%04x+%02x/%04x+%02x ", cpulog[i]->regs.maplo, cpulog[i]->regs.maplomb, cpulog[i]->regs.maphi,
-          cpulog[i]->regs.maphimb);
-      fprintf(f, "%c%c%c%c%c%c%c%c ", cpulog[i]->regs.flags & FLAG_N ? 'N' : '.', cpulog[i]->regs.flags & FLAG_V ? 'V' : '.',
-          cpulog[i]->regs.flags & FLAG_E ? 'E' : '.', cpulog[i]->regs.flags & 0x10 ? 'B' : '.',
-          cpulog[i]->regs.flags & FLAG_D ? 'D' : '.', cpulog[i]->regs.flags & FLAG_I ? 'I' : '.',
-          cpulog[i]->regs.flags & FLAG_Z ? 'Z' : '.', cpulog[i]->regs.flags & FLAG_C ? 'C' : '.');
-      fprintf(f, " : ");
+  log->pop_blame[log->pops++] = memory_blame(cpu, cpu->regs.sp);
+  return read_memory(cpu, cpu->regs.sp);
+}
 
-      fprintf(f, "%32s : ", describe_address_label28(cpu, addr_to_28bit(cpu, cpulog[i]->regs.pc, 0)));
+static inline unsigned char stack_pop(struct cpu *cpu, struct instruction_log *log)
+{
+  return stack_pop_ext(cpu, 1, log);
+}
 
-      for (int j = 0; j < 3; j++) {
-        if (j < cpulog[i]->len)
-          fprintf(f, "%02X ", cpulog[i]->bytes[j]);
-        else
-          fprintf(f, "   ");
-      }
-      fprintf(f, " : ");
-      // XXX - Show instruction disassembly
-      disassemble_instruction(f, cpulog[i]);
-      fprintf(f, "\n");
-    }
+bool stack_push(struct cpu *cpu, unsigned char v)
+{
+  MEM_WRITE16(cpu, cpu->regs.sp, v);
+  if (cpu->regs.flag_e) {
+    unsigned char new_spl = cpu->regs.spl - 1;
+    if (new_spl > cpu->regs.spl)
+      cpu->stack_overflow = true;
+    cpu->regs.spl = new_spl;
   }
+  else {
+    unsigned short new_sp = cpu->regs.sp - 1;
+    if (new_sp > cpu->regs.sp)
+      cpu->stack_overflow = true;
+    cpu->regs.sp = new_sp;
+  }
+  return true;
+}
 
+// The operand address of every instruction is resolved exactly once by
+// resolve_operand(), before the operation runs.  The addressing modes are
+// defined in hyppotrace.h, as traces record them.
+
+// Stands in for the operand address of immediate operands, so that the same
+// handlers serve both immediate and memory operands
+#define OPERAND_IMMEDIATE 0x10000
+
+unsigned int resolve_operand(struct cpu *cpu, struct instruction_log *log, int mode)
+{
+  switch (mode) {
+  case MODE_IMM:
+    return OPERAND_IMMEDIATE;
+  case MODE_ZP:
+  case MODE_ZPREL8:
+    return addr_zp(cpu, log);
+  case MODE_ZPX:
+    return addr_zpx(cpu, log);
+  case MODE_ZPY:
+    return addr_zpy(cpu, log);
+  case MODE_ABS:
+    return addr_abs(log);
+  case MODE_ABSX:
+    return addr_absx(cpu, log);
+  case MODE_ABSY:
+    return addr_absy(cpu, log);
+  case MODE_IZPX:
+    log->zp16 = 1;
+    return addr_izpx(cpu, log);
+  case MODE_IZPY:
+    log->zp16 = 1;
+    return addr_izpy(cpu, log);
+  case MODE_IZPZ:
+    log->zp16 = 1;
+    return addr_izpz(cpu, log);
+  case MODE_IABS:
+    return addr_deref16(cpu, log);
+  case MODE_IABSX:
+    return addr_iabsx(cpu, log);
+  case MODE_REL8:
+    return (cpu->regs.pc + 2 + rel8_delta(log->bytes[1])) & 0xffff;
+  case MODE_REL16:
+    return (cpu->regs.pc + 2 + rel16_delta(log->bytes[1] + (log->bytes[2] << 8))) & 0xffff;
+  }
   return 0;
 }
 
-int identical_cpustates(struct instruction_log *a, struct instruction_log *b)
+unsigned char op_asl_value(struct cpu *cpu, unsigned char v)
+{
+  cpu->regs.flag_c = v >= 0x80;
+  v <<= 1;
+  update_nz(v);
+  return v;
+}
+
+unsigned char op_lsr_value(struct cpu *cpu, unsigned char v)
+{
+  cpu->regs.flag_c = v & 1;
+  v >>= 1;
+  update_nz(v);
+  return v;
+}
+
+unsigned char op_rol_value(struct cpu *cpu, unsigned char v)
+{
+  unsigned int r = (v << 1) | cpu->regs.flag_c;
+  cpu->regs.flag_c = r >= 0x100;
+  update_nz(r);
+  return r;
+}
+
+unsigned char op_ror_value(struct cpu *cpu, unsigned char v)
+{
+  unsigned int r = v | (cpu->regs.flag_c << 8);
+  cpu->regs.flag_c = r & 1;
+  r >>= 1;
+  update_nz(r);
+  return r;
+}
+
+// Operations.  By the time a handler runs, PC already points at the next
+// instruction and addr holds the resolved operand address (or branch target).
+
+unsigned char read_operand(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  // Immediate operands were fetched along with the opcode, and reading them
+  // again would trigger read watchpoints a second time
+  if (addr == OPERAND_IMMEDIATE)
+    return log->bytes[1];
+  return read_memory(cpu, addr);
+}
+
+bool op_brk(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  // Leave PC pointing at the BRK
+  cpu->regs.pc = log->pc;
+  cpu->term.error = true;
+  cpu->term.brk = true;
+  cpu->term.done = true;
+  return true;
+}
+
+bool op_ora(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.a |= read_operand(cpu, log, addr);
+  update_nz(cpu->regs.a);
+  return true;
+}
+
+bool op_and(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.a &= read_operand(cpu, log, addr);
+  update_nz(cpu->regs.a);
+  return true;
+}
+
+bool op_eor(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.a ^= read_operand(cpu, log, addr);
+  update_nz(cpu->regs.a);
+  return true;
+}
+
+bool op_adc(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  adc(cpu, read_operand(cpu, log, addr));
+  return true;
+}
+
+bool op_sbc(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  sbc(cpu, read_operand(cpu, log, addr));
+  return true;
+}
+
+bool op_cmp(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  update_cmp_flags(cpu->regs.a - read_operand(cpu, log, addr));
+  return true;
+}
+
+bool op_cpx(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  update_cmp_flags(cpu->regs.x - read_operand(cpu, log, addr));
+  return true;
+}
+
+bool op_cpy(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  update_cmp_flags(cpu->regs.y - read_operand(cpu, log, addr));
+  return true;
+}
+
+bool op_bit(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  update_bit_flags(read_memory(cpu, addr));
+  return true;
+}
+
+bool op_bit_imm(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  // NOTE: Bit # does NOT alter the N and V flags, unlike BIT's other addressing modes.
+  //       http://forum.6502.org/viewtopic.php?f=2&t=2241&p=27243#p27239
+  cpu->regs.flag_z = (log->bytes[1] & cpu->regs.a) == 0;
+  return true;
+}
+
+bool op_lda(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.a = read_operand(cpu, log, addr);
+  update_nz(cpu->regs.a);
+  return true;
+}
+
+bool op_ldx(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.x = read_operand(cpu, log, addr);
+  update_nz(cpu->regs.x);
+  return true;
+}
+
+bool op_ldy(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.y = read_operand(cpu, log, addr);
+  update_nz(cpu->regs.y);
+  return true;
+}
+
+bool op_ldz(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
 {
-  unsigned int count = a->count;
-  a->count = b->count;
-  int r = memcmp(a, b, sizeof(struct instruction_log));
-  a->count = count;
-
-  if (r)
-    return 0;
-  else
-    return 1;
+  cpu->regs.z = read_operand(cpu, log, addr);
+  update_nz(cpu->regs.z);
+  return true;
 }
 
-char addr_description[8192];
-char *describe_address(unsigned int addr)
+bool op_sta(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
 {
-  struct hyppo_symbol *s = NULL;
+  MEM_WRITE16(cpu, addr, cpu->regs.a);
+  return true;
+}
 
-  for (int i = 0; i < hyppo_symbol_count; i++) {
-    // Check for exact address match
-    if (addr == hyppo_symbols[i].addr)
-      s = &hyppo_symbols[i];
-    // Check for best approximate match
-    if (s && s->addr < hyppo_symbols[i].addr && addr > hyppo_symbols[i].addr)
-      s = &hyppo_symbols[i];
+bool op_sta_izpz(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  if ((cpulog_len > 1) && cpulog_entry(cpulog_len - 2)->bytes[0] == 0xEA) {
+    // NOP prefix means 32-bit ZP pointer
+    addr = addr_izpz32(cpu, log);
+    fprintf(logfile, "ZP32 address = $%07x\n", addr);
+    log->zp16 = 0;
+    log->zp32 = 1;
+    MEM_WRITE28(cpu, addr, cpu->regs.a);
+    return true;
   }
+  // Normal 16-bit ZP pointer
+  return op_sta(cpu, log, addr);
+}
 
-  if (s) {
-    if (s->addr == addr)
-      snprintf(addr_description, 8192, "$%04X (first instruction in %s)", addr, s->name);
-    else
-      snprintf(addr_description, 8192, "$%04X (at %s+%d)", addr, s->name, addr - s->addr);
-  }
-  else
-    snprintf(addr_description, 8192, "$%04X", addr);
-  return addr_description;
+bool op_stx(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  MEM_WRITE16(cpu, addr, cpu->regs.x);
+  return true;
 }
 
-char *describe_address_label28(struct cpu *cpu, unsigned int addr)
+bool op_sty(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
 {
-  int num_symbols;
-  struct hyppo_symbol *s;
-  struct hyppo_symbol *match = NULL;
-  bool exact = false;
+  MEM_WRITE16(cpu, addr, cpu->regs.y);
+  return true;
+}
 
-  addr_description[0] = 0;
+bool op_stz(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  MEM_WRITE16(cpu, addr, cpu->regs.z);
+  return true;
+}
 
-  if (addr >= 0xfff8000 && addr < 0xfffc000) {
-    // Hypervisor sits at $FFF8000-$FFFBFFF
-    s = hyppo_symbols;
-    num_symbols = hyppo_symbol_count;
-    addr -= 0xfff0000; // The symbol table addresses are for $8000-$BFFF
-  }
-  else {
-    s = symbols;
-    num_symbols = symbol_count;
-  }
+bool op_asl(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  MEM_WRITE16(cpu, addr, op_asl_value(cpu, read_memory(cpu, addr)));
+  return true;
+}
 
-  for (int i = 0; i < num_symbols; i++, s++) {
-    // Check for exact address match
-    if (addr == (s->addr)) {
-      match = s;
-      exact = true;
-      break;
-    }
-    // Check for best approximate match
-    if (match && match->addr < s->addr && addr > s->addr)
-      match = s;
-    if ((!match) && addr > s->addr)
-      match = s;
-  }
+bool op_lsr(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  MEM_WRITE16(cpu, addr, op_lsr_value(cpu, read_memory(cpu, addr)));
+  return true;
+}
 
-  if (match) {
-    if (exact)
-      snprintf(addr_description, 8192, "%s", match->name);
-    else {
-      const int delta = addr - match->addr;
-      const char *const fmt = delta > 0xff ? "%s+$%x" : "%s+%d";
-      snprintf(addr_description, 8192, fmt, match->name, delta);
-    }
-  }
+bool op_rol(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  MEM_WRITE16(cpu, addr, op_rol_value(cpu, read_memory(cpu, addr)));
+  return true;
+}
 
-  return addr_description;
+bool op_ror(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  MEM_WRITE16(cpu, addr, op_ror_value(cpu, read_memory(cpu, addr)));
+  return true;
 }
 
-char *describe_address_label(struct cpu *cpu, unsigned int addr)
+bool op_inc(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
 {
-  return describe_address_label28(cpu, addr_to_28bit(cpu, addr, 1));
+  unsigned char v = read_memory(cpu, addr) + 1;
+  MEM_WRITE16(cpu, addr, v);
+  update_nz(v);
+  return true;
 }
 
-void cpu_log_reset(void)
+bool op_dec(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
 {
-  for (int i = 0; i < cpulog_len; i++)
-    free(cpulog[i]);
-  cpulog_len = 1;
-  cpulog[0] = NULL;
+  unsigned char v = read_memory(cpu, addr) - 1;
+  MEM_WRITE16(cpu, addr, v);
+  update_nz(v);
+  return true;
 }
 
-void cpu_stash_ram(void)
+bool op_tsb(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
 {
-  // Remember the RAM contents before calling a routine
-  bcopy(chipram, chipram_expected, CHIPRAM_SIZE);
-  bcopy(hypporam, hypporam_expected, HYPPORAM_SIZE);
+  unsigned char v = read_memory(cpu, addr);
+  cpu->regs.flag_z = (v & cpu->regs.a) == 0;
+  MEM_WRITE16(cpu, addr, v | cpu->regs.a);
+  return true;
 }
 
-unsigned int addr_to_28bit(struct cpu *cpu, unsigned int addr, int writeP)
+bool op_trb(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
 {
-  // XXX -- Royally stupid banking emulation for now
-  unsigned int addr_in = addr;
+  unsigned char v = read_memory(cpu, addr);
+  cpu->regs.flag_z = (v & cpu->regs.a) == 0;
+  MEM_WRITE16(cpu, addr, v & ~cpu->regs.a);
+  return true;
+}
 
-  if (addr > 0xffff) {
-    fprintf(logfile, "ERROR: Asked to map %s of non-16 bit address $%x\n", writeP ? "write" : "read", addr);
-    show_recent_instructions(logfile, "Instructions leading up to the request", cpu, cpulog_len - 6, 6, cpu->regs.pc);
-    cpu->term.error = true;
-    return -1;
-  }
-  int lnc = chipram[1] & 7;
-  lnc |= (~(chipram[0])) & 7;
-  unsigned int bank = addr >> 12;
-  unsigned int zone = addr >> 13;
-  if (bank > 15)
-    bank = 0;
-  if (zone > 7)
-    zone = 0;
-  if (bank == 13) {
-    switch (lnc) {
-    case 0:
-    case 4:
-      // RAM -- no mapping required
-      break;
-    case 1:
-    case 2:
-    case 3:
-      // CharROM
-      if (!writeP) {
-        addr &= 0xfff;
-        addr |= 0x2d000;
-      }
-      break;
-    case 5:
-    case 6:
-    case 7:
-      // IO bank
-      addr &= 0xfff;
-      addr |= 0xffd3000;
-      break;
-    }
-  }
-  if (!writeP) {
-    // C64 BASIC ROM
-    if (bank == 10 || bank == 11) {
-      if (lnc == 3 || lnc == 7) {
-        addr &= 0x1fff;
-        addr |= 0x2a000;
-      }
-    }
-    // C64 KERNAL ROM
-    if (bank == 14 || bank == 15) {
-      switch (lnc) {
-      case 2:
-      case 3:
-      case 6:
-      case 7:
-        addr &= 0x1fff;
-        addr |= 0x2e000;
-        break;
-      }
-    }
-  }
+// RMBn/SMBn/BBRn/BBSn encode the bit number in bits 4-6 of the opcode
+bool op_rmb(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  MEM_WRITE16(cpu, addr, read_memory(cpu, addr) & ~(1 << ((log->bytes[0] >> 4) & 7)));
+  return true;
+}
 
-  // $D031 banking takes priority over C64 banking
+bool op_smb(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  MEM_WRITE16(cpu, addr, read_memory(cpu, addr) | (1 << ((log->bytes[0] >> 4) & 7)));
+  return true;
+}
 
-  // MAP takes priority over all else
-  if (zone < 4) {
-    if ((cpu->regs.maplo >> (12 + zone)) & 1) {
-      // This 8KB area is mapped
-      addr = addr_in;
-      addr += (cpu->regs.maplo & 0xfff) << 8;
-      addr += cpu->regs.maplomb << 20;
-    }
-  }
-  else if (zone > 3) {
-    if ((cpu->regs.maphi >> (12 + zone - 4)) & 1) {
-      // This 8KB area is mapped
-      addr = addr_in;
-      addr += (cpu->regs.maphi & 0xfff) << 8;
-      addr += cpu->regs.maphimb << 20;
-    }
-  }
+bool op_bbr(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  if (!(read_memory(cpu, addr) & (1 << ((log->bytes[0] >> 4) & 7))))
+    cpu->regs.pc += rel8_delta(log->bytes[2]);
+  return true;
+}
 
-  //  fprintf(stderr,"NOTE: Address $%04x mapped to $%07x (lnc=%d)\n",addr_in,addr,lnc);
-  //  fprintf(stderr,"      chipram[0]=$%02x, chipram[1]=$%02x\n",chipram[0],chipram[1]);
+bool op_bbs(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  if (read_memory(cpu, addr) & (1 << ((log->bytes[0] >> 4) & 7)))
+    cpu->regs.pc += rel8_delta(log->bytes[2]);
+  return true;
+}
 
-  return addr;
+bool op_asl_a(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.a = op_asl_value(cpu, cpu->regs.a);
+  return true;
 }
 
-unsigned char read_memory28(struct cpu *cpu, unsigned int addr)
+bool op_lsr_a(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
 {
-  if (addr >= 0xfff8000 && addr < 0xfffc000) {
-    // Hypervisor sits at $FFF8000-$FFFBFFF
-    return hypporam[addr - 0xfff8000];
-  }
-  else if (addr < CHIPRAM_SIZE) {
-    // Chipram at base of address space
-    return chipram[addr];
-  }
-  else if (addr >= 0xff80000 && addr < (0xff80000 + COLOURRAM_SIZE)) {
-    // $FF8xxxx = colour RAM
-    return colourram[addr - 0xff80000];
-  }
-  else if ((addr & 0xfff0000) == 0xffd0000) {
-    // $FFDxxxx IO space
-    return ffdram[addr - 0xffd0000];
-  }
-  // Otherwise unmapped RAM
-  return 0xbd;
+  cpu->regs.a = op_lsr_value(cpu, cpu->regs.a);
+  return true;
 }
 
-unsigned char read_memory(struct cpu *cpu, unsigned int addr16)
+bool op_rol_a(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
 {
-  unsigned int addr = addr_to_28bit(cpu, addr16, 0);
+  cpu->regs.a = op_rol_value(cpu, cpu->regs.a);
+  return true;
+}
 
-  return read_memory28(cpu, addr);
+bool op_ror_a(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.a = op_ror_value(cpu, cpu->regs.a);
+  return true;
 }
 
-unsigned int memory_blame(struct cpu *cpu, unsigned int addr16)
+bool op_inc_a(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
 {
-  unsigned int addr = addr_to_28bit(cpu, addr16, 0);
-  if (addr >= 0xfff8000 && addr < 0xfffc000) {
-    // Hypervisor sits at $FFF8000-$FFFBFFF
-    return hypporam_blame[addr - 0xfff8000];
-  }
-  else if (addr < CHIPRAM_SIZE) {
-    // Chipram at base of address space
-    return chipram_blame[addr];
-  }
-  else if (addr >= 0xff80000 && addr < (0xff80000 + COLOURRAM_SIZE)) {
-    // $FF8xxxx = colour RAM
-    return colourram_blame[addr - 0xff80000];
-  }
-  else if ((addr & 0xfff0000) == 0xffd0000) {
-    // $FFDxxxx IO space
-    return ffdram_blame[addr - 0xffd0000];
-  }
-  // Otherwise unmapped RAM, no one to blame
-  return 0;
+  cpu->regs.a++;
+  update_nz(cpu->regs.a);
+  return true;
 }
 
-int do_dma(struct cpu *cpu, int eDMA, unsigned int addr)
+bool op_dec_a(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
 {
-  int f011b = 0;
-  int with_transparency = 0;
-  int floppy_mode = 0;
-  int floppy_ignore_ff = 0;
-  int spiral_mode = 0;
-  int spiral_len = 0;
-  int spiral_len_remaining = 0;
-  int src_mb = 0;
-  int dst_mb = 0;
-  int src_skip = 0;
-  int dst_skip = 0;
-  int transparent_value = 0;
-  int x8_offset = 0;
-  int y8_offset = 0;
-  int slope = 0;
-  int slope_overflow_toggle = 0;
-  int slope_fraction_start = 0;
-  int line_mode = 0;
-  int line_x_or_y = 0;
-  int line_slope_negative = 0;
-  int dma_count = 0;
-  int s_x8_offset = 0;
-  int s_y8_offset = 0;
-  int s_slope = 0;
-  int s_slope_overflow_toggle = 0;
-  int s_slope_fraction_start = 0;
-  int s_line_mode = 0;
-  int s_line_x_or_y = 0;
-  int s_line_slope_negative = 0;
+  cpu->regs.a--;
+  update_nz(cpu->regs.a);
+  return true;
+}
 
-  int spiral_phase = 0;
+bool op_inx(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.x++;
+  update_nz(cpu->regs.x);
+  return true;
+}
 
-  if (cpu->term.log_dma) {
-    fprintf(logfile, "NOTE: %sDMA dispatched with list address $%07x\n", eDMA ? "E" : "", addr);
-    fprintf(logfile, "      DMA addr regs contain $%02X $%02X $%02X $%02X $%02X $%02X\n", ffdram[0x3700], ffdram[0x3701],
-        ffdram[0x3702], ffdram[0x3703], ffdram[0x3704], ffdram[0x3705]);
-    show_recent_instructions(logfile, "Instructions leading up to the DMA request", cpu, cpulog_len - 32, 32, cpu->regs.pc);
-  }
+bool op_dex(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.x--;
+  update_nz(cpu->regs.x);
+  return true;
+}
 
-  int more_jobs = 1;
+bool op_iny(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.y++;
+  update_nz(cpu->regs.y);
+  return true;
+}
 
-  while (more_jobs) {
-    more_jobs = 0;
+bool op_dey(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.y--;
+  update_nz(cpu->regs.y);
+  return true;
+}
 
-    dma_count = 0;
+bool op_inz(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.z++;
+  update_nz(cpu->regs.z);
+  return true;
+}
 
-    src_skip = 0x0100;
-    dst_skip = 0x0100;
+bool op_tax(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.x = cpu->regs.a;
+  update_nz(cpu->regs.x);
+  return true;
+}
 
-    if (eDMA) {
-      // Read DMA option bytes
-      while (read_memory28(cpu, addr)) {
-        int option = read_memory28(cpu, addr++);
-        int arg = 0;
-        if (option & 0x80)
-          arg = read_memory28(cpu, addr++);
-        if (cpu->term.log_dma)
-          fprintf(logfile, "INFO: DMA option $%02X $%02X\n", option, arg);
-        switch (option) {
-        case 0x06:
-          with_transparency = 0;
-          break;
-        case 0x07:
-          with_transparency = 0;
-          break;
-        case 0x0a:
-          f011b = 0;
-          break;
-        case 0x0b:
-          f011b = 1;
-          break;
-        case 0x0d:
-          floppy_mode = 1;
-          break;
-        case 0x0e:
-          floppy_mode = 1;
-          floppy_ignore_ff = 1;
-          break;
-        case 0x0f:
-          floppy_mode = 1;
-          floppy_ignore_ff = 0;
-          break;
-        case 0x53:
-          spiral_mode = 1;
-          spiral_len = 39;
-          spiral_len_remaining = 38;
-          break;
-        case 0x80:
-          src_mb = arg;
-          break;
-        case 0x81:
-          dst_mb = arg;
-          break;
-        case 0x82:
-          src_skip |= arg;
-          break;
-        case 0x83:
-          src_skip |= arg << 8;
-          break;
-        case 0x84:
-          dst_skip |= arg;
-          break;
-        case 0x85:
-          dst_skip |= arg << 8;
-          break;
-        case 0x86:
-          transparent_value = arg;
-          break;
-        case 0x87:
-          x8_offset |= arg;
-          break;
-        case 0x88:
-          x8_offset |= arg << 8;
-          break;
-        case 0x89:
-          y8_offset |= arg;
-          break;
-        case 0x8a:
-          y8_offset |= arg << 8;
-          break;
-        case 0x8b:
-          slope |= arg;
-          break;
-        case 0x8c:
-          slope |= arg << 8;
-          break;
-        case 0x8d:
-          slope_fraction_start |= arg;
-          break;
-        case 0x8e:
-          slope_fraction_start |= arg << 8;
-          break;
-        case 0x8f:
-          line_mode = arg & 0x80;
-          line_x_or_y = arg & 0x40;
-          line_slope_negative = arg & 0x20;
-          break;
-        case 0x90:
-          dma_count |= arg << 16;
-          break;
-        case 0x97:
-          s_x8_offset |= arg;
-          break;
-        case 0x98:
-          s_x8_offset |= arg << 8;
-          break;
-        case 0x99:
-          s_y8_offset |= arg;
-          break;
-        case 0x9a:
-          s_y8_offset |= arg << 8;
-          break;
-        case 0x9b:
-          s_slope |= arg;
-          break;
-        case 0x9c:
-          s_slope |= arg << 8;
-          break;
-        case 0x9d:
-          s_slope_fraction_start |= arg;
-          break;
-        case 0x9e:
-          s_slope_fraction_start |= arg << 8;
-          break;
-        case 0x9f:
-          s_line_mode = arg & 0x80;
-          s_line_x_or_y = arg & 0x40;
-          s_line_slope_negative = arg & 0x20;
-          break;
-        default:
-          fprintf(logfile, "ERROR: Unknown DMA option $%02X used.\n", option);
-          cpu->term.error = true;
-          break;
-        }
-      }
-      addr++; // skip final $00 option byte
-      if (cpu->term.log_dma)
-        fprintf(logfile, "INFO: End of DMA Options found. DMA list proper begins at $%07X (%s)\n", addr,
-            describe_address_label28(cpu, addr));
-    }
-    else {
-      if (cpu->term.log_dma)
-        fprintf(
-            logfile, "INFO: Non-enhanced DMA list proper begins at $%07X (%s)\n", addr, describe_address_label28(cpu, addr));
-    }
+bool op_tay(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.y = cpu->regs.a;
+  update_nz(cpu->regs.y);
+  return true;
+}
 
-    // Read DMA list bytes
-    int dma_cmd = read_memory28(cpu, addr++);
-    dma_count |= read_memory28(cpu, addr++);
-    dma_count |= read_memory28(cpu, addr++) << 8;
-    unsigned int dma_src = read_memory28(cpu, addr++);
-    dma_src |= read_memory28(cpu, addr++) << 8;
-    dma_src |= read_memory28(cpu, addr++) << 16;
-    unsigned int dma_dst = read_memory28(cpu, addr++);
-    dma_dst |= read_memory28(cpu, addr++) << 8;
-    dma_dst |= read_memory28(cpu, addr++) << 16;
-    if (f011b)
-      dma_cmd |= read_memory28(cpu, addr++) << 8;
-    unsigned int dma_modulo = read_memory28(cpu, addr++);
-    dma_modulo |= read_memory28(cpu, addr++) << 8;
+bool op_taz(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.z = cpu->regs.a;
+  update_nz(cpu->regs.z);
+  return true;
+}
 
-    int src_direction, src_hold, src_modulo;
-    int dest_direction, dest_hold, dest_modulo;
-    if (f011b) {
-      src_direction = (dma_cmd >> 4) & 1;
-      src_hold = (dma_cmd >> 9) & 1;
-      src_modulo = (dma_cmd >> 8) & 1;
-      dest_direction = (dma_cmd >> 5) & 1;
-      dest_hold = (dma_cmd >> 11) & 1;
-      dest_modulo = (dma_cmd >> 10) & 1;
-    }
-    else {
-      src_direction = (dma_src >> 22) & 1;
-      src_modulo = (dma_src >> 21) & 1;
-      src_hold = (dma_src >> 20) & 1;
-      dest_direction = (dma_dst >> 22) & 1;
-      dest_modulo = (dma_dst >> 21) & 1;
-      dest_hold = (dma_dst >> 20) & 1;
-    }
-    // int src_io=dma_src&0x800000;
-    // int dest_io=dma_dst&0x800000;
-    dma_src &= 0xfffff;
-    unsigned long long src_addr = (dma_src << 8) | (((unsigned long long)src_mb) << 28);
-    dma_dst &= 0xfffff;
-    unsigned long long dest_addr = (dma_dst << 8) | (((unsigned long long)dst_mb) << 28);
+bool op_txa(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.a = cpu->regs.x;
+  update_nz(cpu->regs.a);
+  return true;
+}
 
-    // Is it chained?
-    more_jobs = dma_cmd & 4;
+bool op_tya(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.a = cpu->regs.y;
+  update_nz(cpu->regs.a);
+  return true;
+}
 
-    if (cpu->term.log_dma)
-      fprintf(logfile, "INFO: DMA cmd=$%04X, src=$%07X, dst=$%07X, count=$%06X, modulo=$%04X\n", dma_cmd, dma_src, dma_dst,
-          dma_count, dma_modulo);
+bool op_tza(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.a = cpu->regs.z;
+  update_nz(cpu->regs.a);
+  return true;
+}
 
-    if (!dma_count)
-      dma_count = 0x10000;
+bool op_tab(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.b = cpu->regs.a;
+  return true;
+}
 
-    switch (dma_cmd & 3) {
-    case 0:
-      /* Copy operation: Clone symbols from source region to destination region. */
-      {
-        int symbols_copied = 0;
-        int pre_symbol_count = symbol_count; // don't duplicate duplicates!
-        for (int i = 0; i < pre_symbol_count; i++) {
-          if (symbols[i].addr >= (src_addr >> 8) && symbols[i].addr < ((src_addr >> 8) + dma_count)) {
-            /*      fprintf(stderr,"NOTE: Copying symbol #%d '%s' from $%07X to $%07X due to DMA copy.\n",
-                    i,symbols[i].name,
-                    symbols[i].addr,
-                    dest_addr + (symbols[i].addr-src_addr)); */
-            symbols_copied++;
+bool op_tba(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.a = cpu->regs.b;
+  update_nz(cpu->regs.a);
+  return true;
+}
 
-            if (symbol_count >= MAX_SYMBOLS) {
-              fprintf(logfile, "ERROR: Too many symbols. Increase MAX_SYMBOLS.\n");
-              cpu->term.error = true;
-              cpu->term.done = true;
-              return -1;
-            }
-            symbols[symbol_count].name = symbols[i].name;
-            symbols[symbol_count].addr = (dest_addr >> 8) + (symbols[i].addr - (src_addr >> 8));
-            if (((dest_addr >> 8) + (symbols[i].addr - (src_addr >> 8))) < CHIPRAM_SIZE) {
-              sym_by_addr[(dest_addr >> 8) + (symbols[i].addr - (src_addr >> 8))] = &symbols[symbol_count];
-            }
-            symbol_count++;
-          }
-        }
-        if (symbols_copied)
-          fprintf(logfile, "NOTE: Duplicated %d symbols due to DMA copy from $%07llX-$%07llX to $%07llX-$%07llX.\n",
-              symbols_copied, src_addr >> 8, (src_addr >> 8) + dma_count - 1, dest_addr >> 8,
-              (dest_addr >> 8) + dma_count - 1);
-      }
-      break;
-    case 3:
-      /* Fill operation: Erase symbols from destination region */
-      {
-        int symbols_erased = 0;
-        for (int i = 0; i < symbol_count; i++) {
-          if (symbols[i].addr >= (dest_addr >> 8) && symbols[i].addr < ((dest_addr >> 8) + dma_count)) {
-            symbols_erased++;
-            symbols[i].addr = symbols[symbol_count - 1].addr;
-            free(symbols[i].name);
-            symbols[i].name = symbols[symbol_count - 1].name;
-            symbol_count--;
-          }
-        }
-        if (symbols_erased)
-          fprintf(logfile, "NOTE: Erased %d symbols due to DMA fill from $%07llX to $%07llX.\n", symbols_erased,
-              dest_addr >> 8, (dest_addr >> 8) + dma_count - 1);
-      }
-      break;
-    }
+bool op_tsx(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.x = cpu->regs.spl;
+  update_nz(cpu->regs.x);
+  return true;
+}
 
-    while (dma_count--) {
+bool op_txs(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.spl = cpu->regs.x;
+  return true;
+}
 
-      // Do operation before updating addresses
-      switch (dma_cmd & 3) {
-      case 0: // copy
-      {
-        // XXX - Doesn't simulate the 4 cycle DMA pipeline
-        int value = read_memory28(cpu, src_addr >> 8);
-        MEM_WRITE28(cpu, dest_addr >> 8, value);
-        //      fprintf(stderr,"DEBUG: Copying $%02X from $%07X to $%07X\n",value,src_addr>>8,dest_addr>>8);
-      } break;
-      case 3: // fill
-        MEM_WRITE28(cpu, dest_addr >> 8, (src_addr >> 8) & 0xff);
-        break;
-      default:
-        fprintf(logfile, "ERROR: Unsupported DMA operation %d requested.\n", dma_cmd & 3);
-        cpu->term.error = true;
-        cpu->term.done = true;
-        return 0;
-      }
+bool op_tys(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.sph = cpu->regs.y;
+  return true;
+}
 
-      // Update source address
-      {
-        if (!s_line_mode) {
-          // Normal fill / copy
-          if (!src_hold) {
-            if (!src_direction)
-              src_addr += src_skip;
-            else
-              src_addr -= src_skip;
-          }
-        }
-        else {
-          // We are in line mode.
+bool op_clc(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.flags &= ~FLAG_C;
+  return true;
+}
 
-          // Add fractional position
-          s_slope_fraction_start += s_slope;
-          // Check if we have accumulated a whole pixel of movement?
-          int line_x_move = 0;
-          int line_x_move_negative = 0;
-          int line_y_move = 0;
-          int line_y_move_negative = 0;
-          if (s_slope_overflow_toggle /= (s_slope_fraction_start & 0x10000)) {
-            s_slope_overflow_toggle = (s_slope_fraction_start & 0x10000);
-            // Yes: Advance in minor axis
-            if (!s_line_x_or_y) {
-              line_y_move = 1;
-              line_y_move_negative = s_line_slope_negative;
-            }
-            else {
-              line_x_move = 1;
-              line_x_move_negative = s_line_slope_negative;
-            }
-          }
-          // Also move major axis (which is always in the forward direction)
-          if (!s_line_x_or_y)
-            line_x_move = 1;
-          else
-            line_y_move = 1;
-          if ((!line_x_move) && line_y_move && (!line_y_move_negative)) {
-            // Y = Y + 1
-            if (((src_addr >> 11) & 7) == 7) {
-              // Will overflow between Y cards
-              src_addr |= (256 * 8) + (s_y8_offset << 8);
-            }
-            else {
-              // No overflow, so just add 8 bytes (with 8-bit pixel resolution)
-              src_addr |= (256 * 8);
-            }
-          }
-          else if ((!line_x_move) && line_y_move && line_y_move_negative) {
-            // Y = Y - 1
-            if (((src_addr >> 11) & 7) == 0) {
-              // Will overflow between X cards
-              src_addr -= (256 * 8) + (s_y8_offset << 8);
-            }
-            else {
-              // No overflow, so just subtract 8 bytes (with 8-bit pixel resolution)
-              src_addr -= (256 * 8);
-            }
-          }
-          else if (line_x_move && (!line_x_move_negative) && (!line_y_move)) {
-            // X = X + 1
-            if (((src_addr >> 8) & 7) == 7) {
-              // Will overflow between X cards
-              src_addr += 256 + (s_x8_offset << 8);
-            }
-            else {
-              // No overflow, so just add 1 pixel (with 8-bit pixel resolution)
-              src_addr += 256;
-            }
-          }
-          else if (line_x_move && line_x_move_negative && (!line_y_move)) {
-            // X = X - 1
-            if (((src_addr >> 8) & 7) == 0) {
-              // Will overflow between X cards
-              src_addr -= 256 + (s_x8_offset << 8);
-            }
-            else {
-              // No overflow, so just subtract 1 pixel (with 8-bit pixel resolution)
-              src_addr -= 256;
-            }
-          }
-          else if (line_x_move && (!line_x_move_negative) && line_y_move && (!line_y_move_negative)) {
-            // X = X + 1, Y = Y + 1
-            if (((src_addr >> 8) & 0x3f) == 0x3f) {
-              // positive overflow on both
-              src_addr += (256 * 9) + (s_x8_offset << 8) + (s_y8_offset << 8);
-            }
-            else if (((src_addr >> 8) & 0x3f) == 0x38) {
-              // positive card overflow on Y only
-              src_addr += (256 * 9) + (s_y8_offset << 8);
-            }
-            else if (((src_addr >> 8) & 0x3f) == 0x07) {
-              // positive card overflow on X only
-              src_addr += (256 * 9) + (s_x8_offset << 8);
-            }
-            else {
-              // no card overflow
-              src_addr += (256 * 9);
-            }
-          }
-          else if (line_x_move && (!line_x_move_negative) && line_y_move && line_y_move_negative) {
-            // X = X + 1, Y = Y - 1
-            if (((src_addr >> 8) & 0x3f) == 0x07) {
-              // positive card overflow on X, negative on Y
-              src_addr += (256 * 1) - (256 * 8) + (s_x8_offset << 8) - (s_y8_offset << 8);
-            }
-            else if (((src_addr >> 8) & 0x3f) < 0x08) {
-              // negative card overflow on Y only
-              src_addr += (256 * 1) - (256 * 8) - (s_y8_offset << 8);
-            }
-            if (((src_addr >> 8) & 0x07) == 0x07) {
-              // positive overflow on X only
-              src_addr += (256 * 1) - (256 * 8) + (s_x8_offset << 8);
-            }
-            else {
-              src_addr += (256 * 1) - (256 * 8);
-            }
-          }
-          else if (line_x_move && line_x_move_negative && line_y_move && (!line_y_move_negative)) {
-            // X = X - 1, Y = Y + 1
-            if (((src_addr >> 8) & 0x3f) == 0x38) {
-              // negative card overflow on X, positive on Y
-              src_addr += -(256 * 1) + (256 * 8) - (s_x8_offset << 8) + (s_y8_offset << 8);
-            }
-            else if (((src_addr >> 11) & 0x07) == 0x07) {
-              // positive card overflow on Y only
-              src_addr += -(256 * 1) + (256 * 8) + (s_y8_offset << 8);
-            }
-            else if (((src_addr >> 8) & 7) == 0) {
-              // negative overflow on X only
-              src_addr += -(256 * 1) + (256 * 8) - (s_x8_offset << 8);
-            }
-            else {
-              src_addr += -(256 * 1) + (256 * 8);
-            }
-          }
-          else if (line_x_move && line_x_move_negative && line_y_move && line_y_move_negative) {
-            // X = X - 1, Y = Y - 1
-            if (((src_addr >> 8) & 0x3f) == 0x00) {
-              // negative card overflow on X, negative on Y
-              src_addr += -(256 * 1) - (256 * 8) - (s_x8_offset << 8) - (s_y8_offset << 8);
-            }
-            else if (((src_addr >> 11) & 0x7) == 0x00) {
-              // negative card overflow on Y only
-              src_addr += -(256 * 1) - (256 * 8) - (s_y8_offset << 8);
-            }
-            else if (((src_addr >> 8) & 0x7) == 0x00) {
-              // negative overflow on X only
-              src_addr += -(256 * 1) - (256 * 8) - (s_x8_offset << 8);
-            }
-            else {
-              src_addr += -(256 * 1) - (256 * 8);
-            }
-          }
-        }
-      }
+bool op_sec(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.flags |= FLAG_C;
+  return true;
+}
 
-      // Update destination address
-      {
-        if (spiral_mode) {
-          // Draw the dreaded Shallan Spriral
-          switch (spiral_phase) {
-          case 0:
-            dest_addr = dest_addr + 0x100;
-            break;
-          case 1:
-            dest_addr = dest_addr + 0x2800;
-            break;
-          case 2:
-            dest_addr = dest_addr - 0x100;
-            break;
-          case 3:
-            dest_addr = dest_addr - 0x2800;
-            break;
-          }
-          if (spiral_len_remaining)
-            spiral_len_remaining -= 1;
-          else {
-            // Calculate details for next phase of the spiral
-            if (!(spiral_phase & 1)) {
-              // Next phase is vertical, so reduce spiral length by 40 - 24 = 17
-              spiral_len_remaining = spiral_len - 16;
-            }
-            else {
-              spiral_len_remaining = spiral_len;
-            }
-            if (spiral_len)
-              spiral_len--;
-          }
-          spiral_phase++;
-          spiral_phase &= 3;
-        }
-        else if (!line_mode) {
-          // Normal fill / copy
-          if (!dest_hold) {
-            if (!dest_direction)
-              dest_addr += dst_skip;
-            else
-              dest_addr -= dst_skip;
-          }
-        }
-        else {
-          // We are in line mode.
+bool op_cli(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.flags &= ~FLAG_I;
+  return true;
+}
+
+bool op_sei(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.flags |= FLAG_I;
+  return true;
+}
+
+bool op_cld(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.flags &= ~FLAG_D;
+  return true;
+}
+
+bool op_sed(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.flags |= FLAG_D;
+  return true;
+}
+
+bool op_clv(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.flags &= ~FLAG_V;
+  return true;
+}
+
+bool op_see(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.flags |= FLAG_E;
+  return true;
+}
 
-          // Add fractional position
-          slope_fraction_start += slope;
-          // Check if we have accumulated a whole pixel of movement?
-          int line_x_move = 0;
-          int line_x_move_negative = 0;
-          int line_y_move = 0;
-          int line_y_move_negative = 0;
-          if (slope_overflow_toggle /= (slope_fraction_start & 0x10000)) {
-            slope_overflow_toggle = (slope_fraction_start & 0x10000);
-            // Yes: Advance in minor axis
-            if (!line_x_or_y) {
-              line_y_move = 1;
-              line_y_move_negative = line_slope_negative;
-            }
-            else {
-              line_x_move = 1;
-              line_x_move_negative = line_slope_negative;
-            }
-          }
-          // Also move major axis (which is always in the forward direction)
-          if (!line_x_or_y)
-            line_x_move = 1;
-          else
-            line_y_move = 1;
-          if ((!line_x_move) && line_y_move && (!line_y_move_negative)) {
-            // Y = Y + 1
-            if (((dest_addr >> 11) & 7) == 7) {
-              // Will overflow between Y cards
-              dest_addr |= (256 * 8) + (y8_offset << 8);
-            }
-            else {
-              // No overflow, so just add 8 bytes (with 8-bit pixel resolution)
-              dest_addr |= (256 * 8);
-            }
-          }
-          else if ((!line_x_move) && line_y_move && line_y_move_negative) {
-            // Y = Y - 1
-            if (((dest_addr >> 11) & 7) == 0) {
-              // Will overflow between X cards
-              dest_addr -= (256 * 8) + (y8_offset << 8);
-            }
-            else {
-              // No overflow, so just subtract 8 bytes (with 8-bit pixel resolution)
-              dest_addr -= (256 * 8);
-            }
-          }
-          else if (line_x_move && (!line_x_move_negative) && (!line_y_move)) {
-            // X = X + 1
-            if (((dest_addr >> 8) & 7) == 7) {
-              // Will overflow between X cards
-              dest_addr += 256 + (x8_offset << 8);
-            }
-            else {
-              // No overflow, so just add 1 pixel (with 8-bit pixel resolution)
-              dest_addr += 256;
-            }
-          }
-          else if (line_x_move && line_x_move_negative && (!line_y_move)) {
-            // X = X - 1
-            if (((dest_addr >> 8) & 7) == 0) {
-              // Will overflow between X cards
-              dest_addr -= 256 + (x8_offset << 8);
-            }
-            else {
-              // No overflow, so just subtract 1 pixel (with 8-bit pixel resolution)
-              dest_addr -= 256;
-            }
-          }
-          else if (line_x_move && (!line_x_move_negative) && line_y_move && (!line_y_move_negative)) {
-            // X = X + 1, Y = Y + 1
-            if (((dest_addr >> 8) & 0x3f) == 0x3f) {
-              // positive overflow on both
-              dest_addr += (256 * 9) + (x8_offset << 8) + (y8_offset << 8);
-            }
-            else if (((dest_addr >> 8) & 0x3f) == 0x38) {
-              // positive card overflow on Y only
-              dest_addr += (256 * 9) + (y8_offset << 8);
-            }
-            else if (((dest_addr >> 8) & 0x3f) == 0x07) {
-              // positive card overflow on X only
-              dest_addr += (256 * 9) + (x8_offset << 8);
-            }
-            else {
-              // no card overflow
-              dest_addr += (256 * 9);
-            }
-          }
-          else if (line_x_move && (!line_x_move_negative) && line_y_move && line_y_move_negative) {
-            // X = X + 1, Y = Y - 1
-            if (((dest_addr >> 8) & 0x3f) == 0x07) {
-              // positive card overflow on X, negative on Y
-              dest_addr += (256 * 1) - (256 * 8) + (x8_offset << 8) - (y8_offset << 8);
-            }
-            else if (((dest_addr >> 8) & 0x3f) < 0x08) {
-              // negative card overflow on Y only
-              dest_addr += (256 * 1) - (256 * 8) - (y8_offset << 8);
-            }
-            if (((dest_addr >> 8) & 0x07) == 0x07) {
-              // positive overflow on X only
-              dest_addr += (256 * 1) - (256 * 8) + (x8_offset << 8);
-            }
-            else {
-              dest_addr += (256 * 1) - (256 * 8);
-            }
-          }
-          else if (line_x_move && line_x_move_negative && line_y_move && (!line_y_move_negative)) {
-            // X = X - 1, Y = Y + 1
-            if (((dest_addr >> 8) & 0x3f) == 0x38) {
-              // negative card overflow on X, positive on Y
-              dest_addr += -(256 * 1) + (256 * 8) - (x8_offset << 8) + (y8_offset << 8);
-            }
-            else if (((dest_addr >> 11) & 0x07) == 0x07) {
-              // positive card overflow on Y only
-              dest_addr += -(256 * 1) + (256 * 8) + (y8_offset << 8);
-            }
-            else if (((dest_addr >> 8) & 7) == 0) {
-              // negative overflow on X only
-              dest_addr += -(256 * 1) + (256 * 8) - (x8_offset << 8);
-            }
-            else {
-              dest_addr += -(256 * 1) + (256 * 8);
-            }
-          }
-          else if (line_x_move && line_x_move_negative && line_y_move && line_y_move_negative) {
-            // X = X - 1, Y = Y - 1
-            if (((dest_addr >> 8) & 0x3f) == 0x00) {
-              // negative card overflow on X, negative on Y
-              dest_addr += -(256 * 1) - (256 * 8) - (x8_offset << 8) - (y8_offset << 8);
-            }
-            else if (((dest_addr >> 11) & 0x7) == 0x00) {
-              // negative card overflow on Y only
-              dest_addr += -(256 * 1) - (256 * 8) - (y8_offset << 8);
-            }
-            else if (((dest_addr >> 8) & 0x7) == 0x00) {
-              // negative overflow on X only
-              dest_addr += -(256 * 1) - (256 * 8) - (x8_offset << 8);
-            }
-            else {
-              dest_addr += -(256 * 1) - (256 * 8);
-            }
-          }
-        }
-      }
+bool op_pha(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  return stack_push(cpu, cpu->regs.a);
+}
+
+bool op_phx(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  return stack_push(cpu, cpu->regs.x);
+}
+
+bool op_phy(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  return stack_push(cpu, cpu->regs.y);
+}
+
+bool op_phz(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  return stack_push(cpu, cpu->regs.z);
+}
+
+bool op_php(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  // B flag always pushes as set
+  return stack_push(cpu, cpu->regs.flags | FLAG_B);
+}
+
+bool op_pla(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.a = stack_pop(cpu, log);
+  update_nz(cpu->regs.a);
+  return true;
+}
+
+bool op_plx(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.x = stack_pop(cpu, log);
+  update_nz(cpu->regs.x);
+  return true;
+}
+
+bool op_ply(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.y = stack_pop(cpu, log);
+  update_nz(cpu->regs.y);
+  return true;
+}
+
+bool op_plz(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.z = stack_pop(cpu, log);
+  update_nz(cpu->regs.z);
+  return true;
+}
+
+bool op_plp(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  // E & B flags cannot be set via PLP
+  cpu->regs.flags &= FLAG_E | FLAG_B;
+  cpu->regs.flags |= stack_pop(cpu, log) & ~(FLAG_E | FLAG_B);
+  return true;
+}
+
+bool op_jmp(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.pc = addr;
+  return true;
+}
+
+bool op_jsr(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  // The pushed return address is that of the last byte of the JSR
+  unsigned int ret = cpu->regs.pc - 1;
+  if (cpu->term.rts)
+    cpu->term.rts++;
+  if (!stack_push(cpu, ret >> 8))
+    return false;
+  if (!stack_push(cpu, ret))
+    return false;
+  cpu->regs.pc = addr;
+  return true;
+}
+
+bool op_rts(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  if (cpu->term.rts) {
+    cpu->term.rts--;
+    if (!cpu->term.rts) {
+      fprintf(logfile, "INFO: Terminating via RTS\n");
+      cpu->term.done = true;
     }
   }
-  return 0;
+  cpu->regs.pc = stack_pop(cpu, log);
+  cpu->regs.pc |= stack_pop(cpu, log) << 8;
+  cpu->regs.pc++;
+  return true;
 }
 
-int write_mem28(struct cpu *cpu, unsigned int addr, unsigned char value)
+bool op_rti(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
 {
-  unsigned int dma_addr;
+  // E & B flags cannot be set via RTI
+  cpu->regs.flags &= FLAG_E | FLAG_B;
+  cpu->regs.flags |= stack_pop(cpu, log) & ~(FLAG_E | FLAG_B);
+  cpu->regs.pc = stack_pop(cpu, log);
+  cpu->regs.pc |= stack_pop(cpu, log) << 8;
+  return true;
+}
 
-  if (addr >= 0xfff8000 && addr < 0xfffc000) {
-    // Hypervisor sits at $FFF8000-$FFFBFFF
-    hypporam_blame[addr - 0xfff8000] = cpu->instruction_count;
-    hypporam[addr - 0xfff8000] = value;
+bool op_bra(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.pc = addr;
+  return true;
+}
+
+bool op_bpl(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  if (!cpu->regs.flag_n)
+    cpu->regs.pc = addr;
+  return true;
+}
+
+bool op_bmi(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  if (cpu->regs.flag_n)
+    cpu->regs.pc = addr;
+  return true;
+}
+
+bool op_bvc(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  if (!cpu->regs.flag_v)
+    cpu->regs.pc = addr;
+  return true;
+}
+
+bool op_bvs(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  if (cpu->regs.flag_v)
+    cpu->regs.pc = addr;
+  return true;
+}
+
+bool op_bcc(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  if (!cpu->regs.flag_c)
+    cpu->regs.pc = addr;
+  return true;
+}
+
+bool op_bcs(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  if (cpu->regs.flag_c)
+    cpu->regs.pc = addr;
+  return true;
+}
+
+bool op_bne(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  if (!cpu->regs.flag_z)
+    cpu->regs.pc = addr;
+  return true;
+}
+
+bool op_beq(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  if (cpu->regs.flag_z)
+    cpu->regs.pc = addr;
+  return true;
+}
+
+bool op_map(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  if (cpu->regs.x == 0x0f)
+    cpu->regs.maplomb = cpu->regs.a;
+  else
+    cpu->regs.maplo = cpu->regs.a + (cpu->regs.x << 8);
+  if (!cpu->regs.in_hyper) {
+    if (cpu->regs.z == 0x0f)
+      cpu->regs.maphimb = cpu->regs.y;
+    else
+      cpu->regs.maplo = cpu->regs.y + (cpu->regs.z << 8);
   }
-  else if (addr < CHIPRAM_SIZE) {
-    // Chipram at base of address space
-    if (addr == 0 && value == 0x41) {
-      // Set fast CPU
-    }
-    else if (addr == 0 && value == 0x40) {
-      // Clear fast CPU
+  cpu->regs.map_irq_inhibit = 1;
+  cpu->map_valid = false;
+  return true;
+}
+
+bool op_eom(struct cpu *cpu, struct instruction_log *log, unsigned int addr)
+{
+  cpu->regs.map_irq_inhibit = 0;
+  return true;
+}
+
+// The 45GS02 opcode map.  Mnemonics and addressing modes match src/monitor/gen_dis.c.
+const opcode_info opcode_table[256] = {
+  { "BRK",  MODE_IMM,    2, 7, 7, op_brk       }, // $00
+  { "ORA",  MODE_IZPX,   2, 5, 6, op_ora       }, // $01
+  { "CLE",  MODE_IMP,    1, 2, 0, NULL         }, // $02
+  { "SEE",  MODE_IMP,    1, 2, 8, op_see       }, // $03
+  { "TSB",  MODE_ZP,     2, 4, 3, op_tsb       }, // $04
+  { "ORA",  MODE_ZP,     2, 3, 3, op_ora       }, // $05
+  { "ASL",  MODE_ZP,     2, 4, 5, op_asl       }, // $06
+  { "RMB0", MODE_ZP,     2, 4, 5, op_rmb       }, // $07
+  { "PHP",  MODE_IMP,    1, 3, 3, op_php       }, // $08
+  { "ORA",  MODE_IMM,    2, 2, 2, op_ora       }, // $09
+  { "ASL",  MODE_ACC,    1, 1, 2, op_asl_a     }, // $0A
+  { "TSY",  MODE_IMP,    1, 1, 2, NULL         }, // $0B
+  { "TSB",  MODE_ABS,    3, 5, 4, op_tsb       }, // $0C
+  { "ORA",  MODE_ABS,    3, 4, 4, op_ora       }, // $0D
+  { "ASL",  MODE_ABS,    3, 5, 6, op_asl       }, // $0E
+  { "BBR0", MODE_ZPREL8, 3, 4, 6, op_bbr       }, // $0F
+  { "BPL",  MODE_REL8,   2, 2, 2, op_bpl       }, // $10
+  { "ORA",  MODE_IZPY,   2, 5, 5, op_ora       }, // $11
+  { "ORA",  MODE_IZPZ,   2, 5, 0, op_ora       }, // $12
+  { "BPL",  MODE_REL16,  3, 3, 8, op_bpl       }, // $13
+  { "TRB",  MODE_ZP,     2, 4, 4, op_trb       }, // $14
+  { "ORA",  MODE_ZPX,    2, 3, 4, op_ora       }, // $15
+  { "ASL",  MODE_ZPX,    2, 4, 6, op_asl       }, // $16
+  { "RMB1", MODE_ZP,     2, 4, 6, op_rmb       }, // $17
+  { "CLC",  MODE_IMP,    1, 1, 2, op_clc       }, // $18
+  { "ORA",  MODE_ABSY,   3, 4, 4, op_ora       }, // $19
+  { "INC",  MODE_ACC,    1, 1, 2, op_inc_a     }, // $1A
+  { "INZ",  MODE_IMP,    1, 1, 7, op_inz       }, // $1B
+  { "TRB",  MODE_ABS,    3, 5, 4, op_trb       }, // $1C
+  { "ORA",  MODE_ABSX,   3, 4, 4, op_ora       }, // $1D
+  { "ASL",  MODE_ABSX,   3, 5, 7, op_asl       }, // $1E
+  { "BBR1", MODE_ZPREL8, 3, 4, 7, op_bbr       }, // $1F
+  { "JSR",  MODE_ABS,    3, 5, 6, op_jsr       }, // $20
+  { "AND",  MODE_IZPX,   2, 5, 6, op_and       }, // $21
+  { "JSR",  MODE_IABS,   3, 7, 0, op_jsr       }, // $22
+  { "JSR",  MODE_IABSX,  3, 7, 8, NULL         }, // $23
+  { "BIT",  MODE_ZP,     2, 3, 3, op_bit       }, // $24
+  { "AND",  MODE_ZP,     2, 3, 3, op_and       }, // $25
+  { "ROL",  MODE_ZP,     2, 4, 5, op_rol       }, // $26
+  { "RMB2", MODE_ZP,     2, 4, 5, op_rmb       }, // $27
+  { "PLP",  MODE_IMP,    1, 3, 4, op_plp       }, // $28
+  { "AND",  MODE_IMM,    2, 2, 2, op_and       }, // $29
+  { "ROL",  MODE_ACC,    1, 1, 2, op_rol_a     }, // $2A
+  { "TYS",  MODE_IMP,    1, 1, 2, op_tys       }, // $2B
+  { "BIT",  MODE_ABS,    3, 4, 4, op_bit       }, // $2C
+  { "AND",  MODE_ABS,    3, 4, 4, op_and       }, // $2D
+  { "ROL",  MODE_ABS,    3, 5, 6, op_rol       }, // $2E
+  { "BBR2", MODE_ZPREL8, 3, 4, 6, op_bbr       }, // $2F
+  { "BMI",  MODE_REL8,   2, 2, 2, op_bmi       }, // $30
+  { "AND",  MODE_IZPY,   2, 5, 5, op_and       }, // $31
+  { "AND",  MODE_IZPZ,   2, 5, 0, op_and       }, // $32
+  { "BMI",  MODE_REL16,  3, 3, 8, op_bmi       }, // $33
+  { "BIT",  MODE_ZPX,    2, 3, 4, op_bit       }, // $34
+  { "AND",  MODE_ZPX,    2, 3, 4, op_and       }, // $35
+  { "ROL",  MODE_ZPX,    2, 4, 6, op_rol       }, // $36
+  { "RMB3", MODE_ZP,     2, 4, 6, op_rmb       }, // $37
+  { "SEC",  MODE_IMP,    1, 1, 2, op_sec       }, // $38
+  { "AND",  MODE_ABSY,   3, 4, 4, op_and       }, // $39
+  { "DEC",  MODE_ACC,    1, 1, 2, op_dec_a     }, // $3A
+  { "DEZ",  MODE_IMP,    1, 1, 7, NULL         }, // $3B
+  { "BIT",  MODE_ABSX,   3, 4, 4, op_bit       }, // $3C
+  { "AND",  MODE_ABSX,   3, 4, 4, op_and       }, // $3D
+  { "ROL",  MODE_ABSX,   3, 5, 7, op_rol       }, // $3E
+  { "BBR3", MODE_ZPREL8, 3, 4, 7, op_bbr       }, // $3F
+  { "RTI",  MODE_IMP,    1, 5, 6, op_rti       }, // $40
+  { "EOR",  MODE_IZPX,   2, 5, 6, op_eor       }, // $41
+  { "NEG",  MODE_ACC,    1, 2, 0, NULL         }, // $42
+  { "ASR",  MODE_ACC,    1, 2, 8, NULL         }, // $43
+  { "ASR",  MODE_ZP,     2, 4, 3, NULL         }, // $44
+  { "EOR",  MODE_ZP,     2, 3, 3, op_eor       }, // $45
+  { "LSR",  MODE_ZP,     2, 4, 5, op_lsr       }, // $46
+  { "RMB4", MODE_ZP,     2, 4, 5, op_rmb       }, // $47
+  { "PHA",  MODE_IMP,    1, 3, 3, op_pha       }, // $48
+  { "EOR",  MODE_IMM,    2, 2, 2, op_eor       }, // $49
+  { "LSR",  MODE_ACC,    1, 1, 2, op_lsr_a     }, // $4A
+  { "TAZ",  MODE_IMP,    1, 1, 2, op_taz       }, // $4B
+  { "JMP",  MODE_ABS,    3, 3, 3, op_jmp       }, // $4C
+  { "EOR",  MODE_ABS,    3, 4, 4, op_eor       }, // $4D
+  { "LSR",  MODE_ABS,    3, 5, 6, op_lsr       }, // $4E
+  { "BBR4", MODE_ZPREL8, 3, 4, 6, op_bbr       }, // $4F
+  { "BVC",  MODE_REL8,   2, 2, 2, op_bvc       }, // $50
+  { "EOR",  MODE_IZPY,   2, 5, 5, op_eor       }, // $51
+  { "EOR",  MODE_IZPZ,   2, 5, 0, op_eor       }, // $52
+  { "BVC",  MODE_REL16,  3, 3, 8, NULL         }, // $53
+  { "ASR",  MODE_ZPX,    2, 4, 4, NULL         }, // $54
+  { "EOR",  MODE_ZPX,    2, 3, 4, op_eor       }, // $55
+  { "LSR",  MODE_ZPX,    2, 4, 6, op_lsr       }, // $56
+  { "RMB5", MODE_ZP,     2, 4, 6, op_rmb       }, // $57
+  { "CLI",  MODE_IMP,    1, 1, 2, op_cli       }, // $58
+  { "EOR",  MODE_ABSY,   3, 4, 4, op_eor       }, // $59
+  { "PHY",  MODE_IMP,    1, 3, 2, op_phy       }, // $5A
+  { "TAB",  MODE_IMP,    1, 3, 7, op_tab       }, // $5B
+  { "MAP",  MODE_IMP,    1, 4, 4, op_map       }, // $5C
+  { "EOR",  MODE_ABSX,   3, 4, 4, op_eor       }, // $5D
+  { "LSR",  MODE_ABSX,   3, 5, 7, op_lsr       }, // $5E
+  { "BBR5", MODE_ZPREL8, 3, 4, 7, op_bbr       }, // $5F
+  { "RTS",  MODE_IMP,    1, 4, 6, op_rts       }, // $60
+  { "ADC",  MODE_IZPX,   2, 5, 6, op_adc       }, // $61
+  { "RTN",  MODE_IMM,    2, 7, 0, NULL         }, // $62
+  { "BSR",  MODE_REL16,  3, 5, 8, NULL         }, // $63
+  { "STZ",  MODE_ZP,     2, 3, 3, op_stz       }, // $64
+  { "ADC",  MODE_ZP,     2, 3, 3, op_adc       }, // $65
+  { "ROR",  MODE_ZP,     2, 4, 5, op_ror       }, // $66
+  { "RMB6", MODE_ZP,     2, 4, 5, op_rmb       }, // $67
+  { "PLA",  MODE_IMP,    1, 3, 4, op_pla       }, // $68
+  { "ADC",  MODE_IMM,    2, 2, 2, op_adc       }, // $69
+  { "ROR",  MODE_ACC,    1, 1, 2, op_ror_a     }, // $6A
+  { "TZA",  MODE_IMP,    1, 1, 2, op_tza       }, // $6B
+  { "JMP",  MODE_IABS,   3, 5, 5, op_jmp       }, // $6C
+  { "ADC",  MODE_ABS,    3, 4, 4, op_adc       }, // $6D
+  { "ROR",  MODE_ABS,    3, 5, 6, op_ror       }, // $6E
+  { "BBR6", MODE_ZPREL8, 3, 4, 6, op_bbr       }, // $6F
+  { "BVS",  MODE_REL8,   2, 2, 2, op_bvs       }, // $70
+  { "ADC",  MODE_IZPY,   2, 5, 5, op_adc       }, // $71
+  { "ADC",  MODE_IZPZ,   2, 5, 0, op_adc       }, // $72
+  { "BVS",  MODE_REL16,  3, 3, 8, NULL         }, // $73
+  { "STZ",  MODE_ZPX,    2, 3, 4, op_stz       }, // $74
+  { "ADC",  MODE_ZPX,    2, 3, 4, op_adc       }, // $75
+  { "ROR",  MODE_ZPX,    2, 4, 6, op_ror       }, // $76
+  { "RMB7", MODE_ZP,     2, 4, 6, op_rmb       }, // $77
+  { "SEI",  MODE_IMP,    1, 2, 2, op_sei       }, // $78
+  { "ADC",  MODE_ABSY,   3, 4, 4, op_adc       }, // $79
+  { "PLY",  MODE_IMP,    1, 3, 2, op_ply       }, // $7A
+  { "TBA",  MODE_IMP,    1, 1, 7, op_tba       }, // $7B
+  { "JMP",  MODE_IABSX,  3, 5, 4, op_jmp       }, // $7C
+  { "ADC",  MODE_ABSX,   3, 4, 4, op_adc       }, // $7D
+  { "ROR",  MODE_ABSX,   3, 5, 7, op_ror       }, // $7E
+  { "BBR7", MODE_ZPREL8, 3, 4, 7, op_bbr       }, // $7F
+  { "BRA",  MODE_REL8,   2, 2, 2, op_bra       }, // $80
+  { "STA",  MODE_IZPX,   2, 5, 6, op_sta       }, // $81
+  { "STA",  MODE_ISPY,   2, 6, 2, NULL         }, // $82
+  { "BRA",  MODE_REL16,  3, 3, 6, op_bra       }, // $83
+  { "STY",  MODE_ZP,     2, 3, 3, op_sty       }, // $84
+  { "STA",  MODE_ZP,     2, 3, 3, op_sta       }, // $85
+  { "STX",  MODE_ZP,     2, 3, 3, op_stx       }, // $86
+  { "SMB0", MODE_ZP,     2, 4, 3, op_smb       }, // $87
+  { "DEY",  MODE_IMP,    1, 1, 2, op_dey       }, // $88
+  { "BIT",  MODE_IMM,    2, 2, 2, op_bit_imm   }, // $89
+  { "TXA",  MODE_IMP,    1, 1, 2, op_txa       }, // $8A
+  { "STY",  MODE_ABSX,   3, 4, 2, NULL         }, // $8B
+  { "STY",  MODE_ABS,    3, 4, 4, op_sty       }, // $8C
+  { "STA",  MODE_ABS,    3, 4, 4, op_sta       }, // $8D
+  { "STX",  MODE_ABS,    3, 4, 4, op_stx       }, // $8E
+  { "BBS0", MODE_ZPREL8, 3, 4, 4, op_bbs       }, // $8F
+  { "BCC",  MODE_REL8,   2, 2, 2, op_bcc       }, // $90
+  { "STA",  MODE_IZPY,   2, 5, 6, op_sta       }, // $91
+  { "STA",  MODE_IZPZ,   2, 5, 0, op_sta_izpz  }, // $92
+  { "BCC",  MODE_REL16,  3, 3, 6, op_bcc       }, // $93
+  { "STY",  MODE_ZPX,    2, 3, 4, op_sty       }, // $94
+  { "STA",  MODE_ZPX,    2, 3, 4, op_sta       }, // $95
+  { "STX",  MODE_ZPY,    2, 3, 4, op_stx       }, // $96
+  { "SMB1", MODE_ZP,     2, 4, 4, op_smb       }, // $97
+  { "TYA",  MODE_IMP,    1, 1, 2, op_tya       }, // $98
+  { "STA",  MODE_ABSY,   3, 4, 5, op_sta       }, // $99
+  { "TXS",  MODE_IMP,    1, 1, 2, op_txs       }, // $9A
+  { "STX",  MODE_ABSY,   3, 4, 5, NULL         }, // $9B
+  { "STZ",  MODE_ABS,    3, 4, 5, op_stz       }, // $9C
+  { "STA",  MODE_ABSX,   3, 4, 5, op_sta       }, // $9D
+  { "STZ",  MODE_ABSX,   3, 4, 5, op_stz       }, // $9E
+  { "BBS1", MODE_ZPREL8, 3, 4, 5, op_bbs       }, // $9F
+  { "LDY",  MODE_IMM,    2, 2, 2, op_ldy       }, // $A0
+  { "LDA",  MODE_IZPX,   2, 5, 6, op_lda       }, // $A1
+  { "LDX",  MODE_IMM,    2, 2, 2, op_ldx       }, // $A2
+  { "LDZ",  MODE_IMM,    2, 2, 6, op_ldz       }, // $A3
+  { "LDY",  MODE_ZP,     2, 3, 3, op_ldy       }, // $A4
+  { "LDA",  MODE_ZP,     2, 3, 3, op_lda       }, // $A5
+  { "LDX",  MODE_ZP,     2, 3, 3, op_ldx       }, // $A6
+  { "SMB2", MODE_ZP,     2, 4, 3, op_smb       }, // $A7
+  { "TAY",  MODE_IMP,    1, 1, 2, op_tay       }, // $A8
+  { "LDA",  MODE_IMM,    2, 2, 2, op_lda       }, // $A9
+  { "TAX",  MODE_IMP,    1, 1, 2, op_tax       }, // $AA
+  { "LDZ",  MODE_ABS,    3, 4, 2, NULL         }, // $AB
+  { "LDY",  MODE_ABS,    3, 4, 4, op_ldy       }, // $AC
+  { "LDA",  MODE_ABS,    3, 4, 4, op_lda       }, // $AD
+  { "LDX",  MODE_ABS,    3, 4, 4, op_ldx       }, // $AE
+  { "BBS2", MODE_ZPREL8, 3, 4, 4, op_bbs       }, // $AF
+  { "BCS",  MODE_REL8,   2, 2, 2, op_bcs       }, // $B0
+  { "LDA",  MODE_IZPY,   2, 5, 5, op_lda       }, // $B1
+  { "LDA",  MODE_IZPZ,   2, 5, 0, op_lda       }, // $B2
+  { "BCS",  MODE_REL16,  3, 3, 5, NULL         }, // $B3
+  { "LDY",  MODE_ZPX,    2, 3, 4, op_ldy       }, // $B4
+  { "LDA",  MODE_ZPX,    2, 3, 4, op_lda       }, // $B5
+  { "LDX",  MODE_ZPY,    2, 3, 4, op_ldx       }, // $B6
+  { "SMB3", MODE_ZP,     2, 4, 4, op_smb       }, // $B7
+  { "CLV",  MODE_IMP,    1, 1, 2, op_clv       }, // $B8
+  { "LDA",  MODE_ABSY,   3, 4, 4, op_lda       }, // $B9
+  { "TSX",  MODE_IMP,    1, 1, 2, op_tsx       }, // $BA
+  { "LDZ",  MODE_ABSX,   3, 4, 4, NULL         }, // $BB
+  { "LDY",  MODE_ABSX,   3, 4, 4, op_ldy       }, // $BC
+  { "LDA",  MODE_ABSX,   3, 4, 4, op_lda       }, // $BD
+  { "LDX",  MODE_ABSY,   3, 4, 4, op_ldx       }, // $BE
+  { "BBS3", MODE_ZPREL8, 3, 4, 4, op_bbs       }, // $BF
+  { "CPY",  MODE_IMM,    2, 2, 2, op_cpy       }, // $C0
+  { "CMP",  MODE_IZPX,   2, 5, 6, op_cmp       }, // $C1
+  { "CPZ",  MODE_IMM,    2, 2, 2, NULL         }, // $C2
+  { "DEW",  MODE_ZP,     2, 6, 8, NULL         }, // $C3
+  { "CPY",  MODE_ZP,     2, 3, 3, op_cpy       }, // $C4
+  { "CMP",  MODE_ZP,     2, 3, 3, op_cmp       }, // $C5
+  { "DEC",  MODE_ZP,     2, 4, 5, op_dec       }, // $C6
+  { "SMB4", MODE_ZP,     2, 4, 5, op_smb       }, // $C7
+  { "INY",  MODE_IMP,    1, 1, 2, op_iny       }, // $C8
+  { "CMP",  MODE_IMM,    2, 2, 2, op_cmp       }, // $C9
+  { "DEX",  MODE_IMP,    1, 1, 2, op_dex       }, // $CA
+  { "ASW",  MODE_ABS,    3, 7, 2, NULL         }, // $CB
+  { "CPY",  MODE_ABS,    3, 4, 4, op_cpy       }, // $CC
+  { "CMP",  MODE_ABS,    3, 4, 4, op_cmp       }, // $CD
+  { "DEC",  MODE_ABS,    3, 5, 6, op_dec       }, // $CE
+  { "BBS4", MODE_ZPREL8, 3, 4, 6, op_bbs       }, // $CF
+  { "BNE",  MODE_REL8,   2, 2, 2, op_bne       }, // $D0
+  { "CMP",  MODE_IZPY,   2, 5, 5, op_cmp       }, // $D1
+  { "CMP",  MODE_IZPZ,   2, 5, 0, op_cmp       }, // $D2
+  { "BNE",  MODE_REL16,  3, 3, 8, NULL         }, // $D3
+  { "CPZ",  MODE_ZP,     2, 3, 4, NULL         }, // $D4
+  { "CMP",  MODE_ZPX,    2, 3, 4, op_cmp       }, // $D5
+  { "DEC",  MODE_ZPX,    2, 4, 6, op_dec       }, // $D6
+  { "SMB5", MODE_ZP,     2, 4, 6, op_smb       }, // $D7
+  { "CLD",  MODE_IMP,    1, 1, 2, op_cld       }, // $D8
+  { "CMP",  MODE_ABSY,   3, 4, 4, op_cmp       }, // $D9
+  { "PHX",  MODE_IMP,    1, 3, 2, op_phx       }, // $DA
+  { "PHZ",  MODE_IMP,    1, 3, 7, op_phz       }, // $DB
+  { "CPZ",  MODE_ABS,    3, 4, 4, NULL         }, // $DC
+  { "CMP",  MODE_ABSX,   3, 4, 4, op_cmp       }, // $DD
+  { "DEC",  MODE_ABSX,   3, 5, 7, op_dec       }, // $DE
+  { "BBS5", MODE_ZPREL8, 3, 4, 7, op_bbs       }, // $DF
+  { "CPX",  MODE_IMM,    2, 2, 2, op_cpx       }, // $E0
+  { "SBC",  MODE_IZPX,   2, 5, 6, op_sbc       }, // $E1
+  { "LDA",  MODE_ISPY,   2, 6, 2, NULL         }, // $E2
+  { "INW",  MODE_ZP,     2, 6, 8, NULL         }, // $E3
+  { "CPX",  MODE_ZP,     2, 3, 3, op_cpx       }, // $E4
+  { "SBC",  MODE_ZP,     2, 3, 3, op_sbc       }, // $E5
+  { "INC",  MODE_ZP,     2, 4, 5, op_inc       }, // $E6
+  { "SMB6", MODE_ZP,     2, 4, 5, op_smb       }, // $E7
+  { "INX",  MODE_IMP,    1, 1, 2, op_inx       }, // $E8
+  { "SBC",  MODE_IMM,    2, 2, 2, op_sbc       }, // $E9
+  { "EOM",  MODE_IMP,    1, 1, 2, op_eom       }, // $EA
+  { "ROW",  MODE_ABS,    3, 6, 2, NULL         }, // $EB
+  { "CPX",  MODE_ABS,    3, 4, 4, op_cpx       }, // $EC
+  { "SBC",  MODE_ABS,    3, 4, 4, op_sbc       }, // $ED
+  { "INC",  MODE_ABS,    3, 5, 6, op_inc       }, // $EE
+  { "BBS6", MODE_ZPREL8, 3, 4, 6, op_bbs       }, // $EF
+  { "BEQ",  MODE_REL8,   2, 2, 2, op_beq       }, // $F0
+  { "SBC",  MODE_IZPY,   2, 5, 5, op_sbc       }, // $F1
+  { "SBC",  MODE_IZPZ,   2, 5, 0, op_sbc       }, // $F2
+  { "BEQ",  MODE_REL16,  3, 3, 8, op_beq       }, // $F3
+  { "PHW",  MODE_IMM16,  3, 5, 4, NULL         }, // $F4
+  { "SBC",  MODE_ZPX,    2, 3, 4, op_sbc       }, // $F5
+  { "INC",  MODE_ZPX,    2, 4, 6, op_inc       }, // $F6
+  { "SMB7", MODE_ZP,     2, 4, 6, op_smb       }, // $F7
+  { "SED",  MODE_IMP,    1, 1, 2, op_sed       }, // $F8
+  { "SBC",  MODE_ABSY,   3, 4, 4, op_sbc       }, // $F9
+  { "PLX",  MODE_IMP,    1, 3, 2, op_plx       }, // $FA
+  { "PLZ",  MODE_IMP,    1, 3, 7, op_plz       }, // $FB
+  { "PHW",  MODE_ABS,    3, 7, 4, NULL         }, // $FC
+  { "SBC",  MODE_ABSX,   3, 4, 4, op_sbc       }, // $FD
+  { "INC",  MODE_ABSX,   3, 5, 7, op_inc       }, // $FE
+  { "BBS7", MODE_ZPREL8, 3, 4, 7, op_bbs       }, // $FF
+};
+
+bool execute_instruction(struct cpu *cpu, struct instruction_log *log)
+{
+  const opcode_info *op;
+  unsigned int addr;
+
+  unsigned int pc28 = addr_to_28bit(cpu, cpu->regs.pc, 0);
+  decoded_instruction *d = &decode_cache[pc28 & DECODE_CACHE_MASK];
+  // The same 28-bit address can be reached near the end of a 4KB page of
+  // the 16-bit address space under another mapping, so check that again
+  if (d->pc28 == pc28 && (cpu->regs.pc & 0xfff) + d->len <= 0x1000) {
+    log->bytes[0] = d->bytes[0];
+    log->bytes[1] = d->bytes[1];
+    log->bytes[2] = d->bytes[2];
+    op = &opcode_table[log->bytes[0]];
+  }
+  else {
+    log->bytes[0] = read_memory(cpu, cpu->regs.pc);
+    op = &opcode_table[log->bytes[0]];
+    for (int i = 1; i < op->len; i++) {
+      log->bytes[i] = read_memory(cpu, cpu->regs.pc + i);
     }
-    else {
-      chipram_blame[addr] = cpu->instruction_count;
-      chipram[addr] = value;
+    // Only cache RAM code that doesn't run into the next 4KB of the 16-bit
+    // address space, which could be mapped elsewhere.  Fetches from pages
+    // with read watchpoints always go through read_memory().
+    if (((cpu->regs.pc & 0xfff) + op->len <= 0x1000)
+        && (pc28 < CHIPRAM_SIZE || (pc28 >= 0xfff8000 && pc28 < 0xfffc000))
+        && !watch_range(pc28, op->len, WATCH_READ)) {
+      d->pc28 = pc28;
+      bcopy(log->bytes, d->bytes, 3);
+      d->len = op->len;
+      decode_pages[DECODE_PAGE(pc28)] = 1;
+      decode_pages[DECODE_PAGE(pc28 + op->len - 1)] = 1;
     }
   }
-  else if (addr >= 0xff80000 && addr < (0xff80000 + COLOURRAM_SIZE)) {
-    colourram_blame[addr - 0xff80000] = cpu->instruction_count;
-    colourram[addr - 0xff80000] = value;
+  log->len = op->len;
+  if (!op->handler) {
+    fprintf(stderr, "ERROR: Unimplemented opcode $%02X (%s)\n", log->bytes[0], op->mnemonic);
+    return false;
   }
-  else if ((addr & 0xfff0000) == 0xffd0000) {
-    // $FFDxxxx IO space
-    ffdram[addr - 0xffd0000] = value;
-    ffdram_blame[addr - 0xffd0000] = cpu->instruction_count;
-
-    // Now check for special address actions
-    switch (addr) {
-    case 0xffd3700: // Trigger DMA
-      if (cpu->term.log_dma)
-        fprintf(logfile, "NOTE: DMA triggered via write to $%07x at instruction #%d\n", addr, cpulog_len);
-      ffdram[0x3705] = value;
-      ffdram_blame[0x3705] = cpu->instruction_count;
-      dma_addr = (ffdram[0x3700] + (ffdram[0x3701] << 8) + ((ffdram[0x3702] & 0x7f) << 16)) | (ffdram[0x3704] << 20);
-      do_dma(cpu, 0, dma_addr);
-      break;
-    case 0xffd3702: // Set bits 22 to 16 of DMA address
-      ffdram[0x3704] &= 0xf1;
-      ffdram[0x3704] |= (value >> 4) & 7;
-      ffdram_blame[0x3704] = cpu->instruction_count;
-      break;
-    case 0xffd3705: // Trigger EDMA
-      if (cpu->term.log_dma)
-        fprintf(logfile, "NOTE: DMA triggered via write to $%07x at instruction #%d\n", addr, cpulog_len);
-      ffdram[0x3700] = value;
-      ffdram_blame[0x3700] = cpu->instruction_count;
-      dma_addr = (ffdram[0x3700] + (ffdram[0x3701] << 8) + ((ffdram[0x3702] & 0x7f) << 16)) | (ffdram[0x3704] << 20);
-      do_dma(cpu, 1, dma_addr);
-      break;
-    }
-    if (!cpu->regs.in_hyper) {
-      if (addr >= 0xffd3640 && addr <= 0xffd367f) {
-        // Enter hypervisor
-        fprintf(logfile, "NOTE: CPU Entered Hypervisor via write to $%07x at instruction #%d\n", addr, cpulog_len);
-      }
-    }
-    else {
-      if (addr == 0xffd367f) {
-        // Exit hypervisor
-        fprintf(logfile, "NOTE: CPU Exited Hypervisor via write to $%07x at instruction #%d\n", addr, cpulog_len);
-      }
-    }
+  addr = resolve_operand(cpu, log, op->mode);
+  if (trace_file) {
+    if (op->mode == MODE_IMP || op->mode == MODE_ACC || op->mode == MODE_IMM || op->mode == MODE_IMM16
+        || op->mode == MODE_REL8 || op->mode == MODE_REL16)
+      trace_ea = TRACE_NO_EA;
+    else
+      trace_ea = addr_to_28bit(cpu, addr, 0);
   }
-  else {
-    // Otherwise unmapped RAM
-    fprintf(logfile, "ERROR: Writing to unmapped address $%07x\n", addr);
-    show_recent_instructions(logfile, "Instructions leading up to the request", cpu, cpulog_len - 6, 6, cpu->regs.pc);
-    cpu->term.error = true;
+  cpu->regs.pc += op->len;
+  return op->handler(cpu, log, addr);
+}
+
+// CPU speeds, encoded as cpuspeed in src/vhdl/gs4510.vhdl
+#define CPU_SPEED_1MHZ 0x01
+#define CPU_SPEED_2MHZ 0x02
+#define CPU_SPEED_3_5MHZ 0x04
+#define CPU_SPEED_40MHZ 0x40
+
+// PAL raster timing, used to place VIC-II badlines
+#define RASTER_LINE_PS 64000000ULL
+#define RASTER_LINES 312
+
+int cpu_speed(struct cpu *cpu)
+{
+  // The hypervisor always runs at full speed, as does anything after $00 = $41
+  if (cpu->regs.in_hyper || cpu->force_fast)
+    return CPU_SPEED_40MHZ;
+
+  // Otherwise C128 2MHz ($D030.0 in the VIC-II personality), VIC-III FAST
+  // ($D031.6) and VIC-IV VFAST ($D054.6) select the speed, exactly as
+  // gs4510.vhdl does.  viciv.vhdl inverts the 2MHz bit on its way to the
+  // CPU, so with all three clear, the CPU runs at 1MHz.
+  int vicii_2mhz = !(ffdram[0x0030] & 0x01);
+  int viciii_fast = (ffdram[0x3031] >> 6) & 1;
+  int viciv_fast = (ffdram[0x3054] >> 6) & 1;
+  switch ((vicii_2mhz << 2) | (viciii_fast << 1) | viciv_fast) {
+  case 4:
+  case 5:
+    return CPU_SPEED_1MHZ;
+  case 0:
+    return CPU_SPEED_2MHZ;
+  case 2:
+  case 6:
+    return CPU_SPEED_3_5MHZ;
   }
+  return CPU_SPEED_40MHZ;
+}
 
-  return 0;
+// Length of one CPU cycle in picoseconds at the given speed
+unsigned int cpu_cycle_ps(int speed)
+{
+  switch (speed) {
+  case CPU_SPEED_1MHZ:
+    return 1014973; // 0.985MHz
+  case CPU_SPEED_2MHZ:
+    return 507486; // 1.97MHz
+  case CPU_SPEED_3_5MHZ:
+    return 281937; // 3.55MHz
+  }
+  return 24691; // 40.5MHz
 }
 
-int write_mem16(struct cpu *cpu, unsigned int addr16, unsigned char value)
+int vicii_badline(unsigned int raster)
 {
-  unsigned int addr = addr_to_28bit(cpu, addr16, 1);
-  return write_mem28(cpu, addr, value);
+  // A badline is the first raster line of each character row, while the
+  // display is enabled
+  unsigned char d011 = ffdram[0x3011];
+  return (d011 & 0x10) && raster >= 0x30 && raster <= 0xf7 && (raster & 7) == (d011 & 7);
 }
 
-int write_mem_expected28(unsigned int addr, unsigned char value)
+unsigned int cpu_account_cycles(struct cpu *cpu, struct instruction_log *log)
 {
-  if (addr >= 0xfff8000 && addr < 0xfffc000) {
-    // Hypervisor sits at $FFF8000-$FFFBFFF
-    hypporam_expected[addr - 0xfff8000] = value;
-    fprintf(logfile, "NOTE: Writing to hypervisor RAM @ $%07x\n", addr);
-  }
-  else if (addr < CHIPRAM_SIZE) {
-    // Chipram at base of address space
-    chipram_expected[addr] = value;
-  }
-  else if (addr >= 0xff80000 && addr < (0xff80000 + COLOURRAM_SIZE)) {
-    colourram_expected[addr - 0xff80000] = value;
+  const opcode_info *op = &opcode_table[log->bytes[0]];
+  int speed = cpu_speed(cpu);
+  unsigned int cycle_ps = cpu_cycle_ps(speed);
+  unsigned int cycles = (speed == CPU_SPEED_1MHZ || speed == CPU_SPEED_2MHZ) ? op->cycles6502 : op->cycles;
+  // $D710 controls the slow-speed timing penalties
+  unsigned char cputiming = ffdram[0x3710];
+
+  // Taken branches cost an extra cycle at 1MHz and 2MHz, if $D710.3 is set
+  if ((speed == CPU_SPEED_1MHZ || speed == CPU_SPEED_2MHZ) && (cputiming & 0x08)
+      && (op->mode == MODE_REL8 || op->mode == MODE_REL16 || op->mode == MODE_ZPREL8)
+      && cpu->regs.pc != log->pc + log->len)
+    cycles++;
+
+  cpu->time_ps += cycles * cycle_ps;
+  cpu->raster_ps += cycles * cycle_ps;
+
+  // Below full speed, the CPU is paused for 40 + $D710.4-5 cycles at the start
+  // of each badline, if $D710.0 is set.  Like gs4510.vhdl, we let the
+  // instruction complete before applying the pause.
+  while (cpu->raster_ps >= RASTER_LINE_PS) {
+    cpu->raster_ps -= RASTER_LINE_PS;
+    cpu->raster_line = (cpu->raster_line + 1) % RASTER_LINES;
+    if (speed != CPU_SPEED_40MHZ && (cputiming & 0x01) && vicii_badline(cpu->raster_line)) {
+      unsigned int stall = 40 + ((cputiming >> 4) & 3);
+      cycles += stall;
+      cpu->time_ps += stall * cycle_ps;
+      cpu->raster_ps += stall * cycle_ps;
+    }
   }
-  else if ((addr & 0xfff0000) == 0xffd0000) {
-    // $FFDxxxx IO space
-    ffdram_expected[addr - 0xffd0000] = value;
+
+  cpu->cycles += cycles;
+  return cycles;
+}
+
+// Call-graph profiler.  Each node is one routine in one calling context,
+// so the tree of nodes is the call graph, and the nodes' exclusive counts
+// give the flat profile.  Node 0 is the root, for anything executed
+// outside of a known call.
+#define MAX_PROFILE_NODES 65536
+#define MAX_PROFILE_DEPTH 256
+#define PROFILE_ROOT 0
+
+typedef struct profile_node {
+  unsigned int addr; // 28-bit entry address of the routine
+  int parent;
+  int first_child;
+  int next_sibling;
+  unsigned long long calls;
+  unsigned long long instructions; // exclusive
+  unsigned long long cycles;       // exclusive
+} profile_node;
+
+bool profiling = false;
+profile_node profile_nodes[MAX_PROFILE_NODES];
+int profile_node_count = 0;
+int profile_stack[MAX_PROFILE_DEPTH];
+int profile_depth = 0;
+// Calls that were not recorded because the stack or node table was full
+int profile_lost_depth = 0;
+
+void profile_reset(void)
+{
+  bzero(&profile_nodes[PROFILE_ROOT], sizeof(profile_node));
+  profile_nodes[PROFILE_ROOT].parent = -1;
+  profile_nodes[PROFILE_ROOT].first_child = -1;
+  profile_nodes[PROFILE_ROOT].next_sibling = -1;
+  profile_node_count = 1;
+  profile_stack[0] = PROFILE_ROOT;
+  profile_depth = 1;
+  profile_lost_depth = 0;
+}
+
+void profile_enter(unsigned int addr)
+{
+  int parent = profile_stack[profile_depth - 1];
+  int node;
+
+  if (profile_lost_depth || profile_depth == MAX_PROFILE_DEPTH) {
+    profile_lost_depth++;
+    return;
   }
-  else {
-    // Otherwise unmapped RAM
-    fprintf(logfile, "ERROR: Writing to unmapped address $%07x\n", addr);
+  for (node = profile_nodes[parent].first_child; node != -1; node = profile_nodes[node].next_sibling)
+    if (profile_nodes[node].addr == addr)
+      break;
+  if (node == -1) {
+    if (profile_node_count == MAX_PROFILE_NODES) {
+      fprintf(logfile, "WARNING: Profile call graph is full. Increase MAX_PROFILE_NODES.\n");
+      profile_lost_depth++;
+      return;
+    }
+    node = profile_node_count++;
+    bzero(&profile_nodes[node], sizeof(profile_node));
+    profile_nodes[node].addr = addr;
+    profile_nodes[node].parent = parent;
+    profile_nodes[node].first_child = -1;
+    profile_nodes[node].next_sibling = profile_nodes[parent].first_child;
+    profile_nodes[parent].first_child = node;
   }
-  return 0;
+  profile_nodes[node].calls++;
+  profile_stack[profile_depth++] = node;
 }
 
-unsigned int addr_abs(struct instruction_log *log)
+void profile_leave(void)
 {
-  return log->bytes[1] + (log->bytes[2] << 8);
+  if (profile_lost_depth)
+    profile_lost_depth--;
+  else if (profile_depth > 1)
+    profile_depth--;
 }
 
-unsigned int addr_zp(struct cpu *cpu, struct instruction_log *log)
+void profile_instruction(struct cpu *cpu, struct instruction_log *log, unsigned int cycles)
 {
-  return log->bytes[1] + (log->regs.b << 8);
+  profile_node *n = &profile_nodes[profile_stack[profile_depth - 1]];
+
+  n->instructions++;
+  n->cycles += cycles;
+
+  switch (log->bytes[0]) {
+  case 0x20: // JSR $nnnn
+  case 0x22: // JSR ($nnnn)
+    profile_enter(addr_to_28bit(cpu, cpu->regs.pc, 0));
+    break;
+  case 0x60: // RTS
+    profile_leave();
+    break;
+  }
 }
 
-unsigned int addr_zpx(struct cpu *cpu, struct instruction_log *log)
+char *profile_node_name(int node)
 {
-  return (log->bytes[1] + (log->regs.b << 8) + cpu->regs.x) & 0xff;
+  static char name[1024];
+
+  if (node == PROFILE_ROOT)
+    return "<root>";
+  snprintf(name, sizeof(name), "%s", describe_address_label28(&cpu, profile_nodes[node].addr));
+  if (!name[0])
+    snprintf(name, sizeof(name), "$%07X", profile_nodes[node].addr);
+  return name;
 }
 
-unsigned int addr_zpy(struct cpu *cpu, struct instruction_log *log)
+typedef struct profile_routine {
+  unsigned int addr;
+  int node; // any node for this routine, for its name
+  unsigned long long calls;
+  unsigned long long instructions;
+  unsigned long long cycles;
+  unsigned long long total_instructions;
+  unsigned long long total_cycles;
+} profile_routine;
+
+int compare_profile_routines(const void *a, const void *b)
 {
-  return (log->bytes[1] + (log->regs.b << 8) + cpu->regs.y) & 0xff;
+  const profile_routine *ra = a;
+  const profile_routine *rb = b;
+
+  if (ra->cycles != rb->cycles)
+    return ra->cycles < rb->cycles ? 1 : -1;
+  return ra->addr < rb->addr ? -1 : ra->addr > rb->addr;
 }
 
-unsigned int addr_izpy(struct cpu *cpu, struct instruction_log *log)
+void profile_show_call_graph(FILE *f, int node, int depth, unsigned long long *total_instructions,
+    unsigned long long *total_cycles)
 {
-  log->zp_pointer = (log->bytes[1] + (log->regs.b << 8));
-  log->zp_pointer_addr = (read_memory(cpu, log->zp_pointer + 0) + (read_memory(cpu, log->zp_pointer + 1) << 8) + cpu->regs.y)
-                       & 0xffff;
-  return log->zp_pointer_addr;
+  fprintf(f, "  %12llu %12llu %12llu %12llu %8llu  %*s%s\n", total_instructions[node], total_cycles[node],
+      profile_nodes[node].instructions, profile_nodes[node].cycles, profile_nodes[node].calls, depth * 2, "",
+      profile_node_name(node));
+  for (int child = profile_nodes[node].first_child; child != -1; child = profile_nodes[child].next_sibling)
+    profile_show_call_graph(f, child, depth + 1, total_instructions, total_cycles);
 }
 
-unsigned int addr_izpx(struct cpu *cpu, struct instruction_log *log)
+void profile_write_stacks(FILE *f, int node)
 {
-  // Note that we allow the pointer to cross ZP boundary, i.e.,
-  // "The ($xx,X) bug" is purposely not fixed in the MEGA65 for
-  // backwards compatibility.
-  log->zp_pointer = ((log->bytes[1] + cpu->regs.x) & 0xff) + (log->regs.b << 8);
-  log->zp_pointer_addr = (read_memory(cpu, log->zp_pointer + 0) + (read_memory(cpu, log->zp_pointer + 1) << 8)) & 0xffff;
-  return log->zp_pointer_addr;
+  if (profile_nodes[node].parent > PROFILE_ROOT) {
+    profile_write_stacks(f, profile_nodes[node].parent);
+    fprintf(f, ";");
+  }
+  fprintf(f, "%s", profile_node_name(node));
 }
 
-unsigned int addr_deref16(struct cpu *cpu, struct instruction_log *log)
+void profile_report(FILE *f, char *stacks_file)
 {
-  log->zp_pointer = (log->bytes[1] + (log->bytes[2] << 8));
-  log->zp_pointer_addr = (read_memory(cpu, log->zp_pointer + 0) + (read_memory(cpu, log->zp_pointer + 1) << 8)) & 0xffff;
-  return log->zp_pointer_addr;
+  unsigned long long *total_instructions = calloc(profile_node_count, sizeof(unsigned long long));
+  unsigned long long *total_cycles = calloc(profile_node_count, sizeof(unsigned long long));
+  profile_routine *routines = calloc(profile_node_count, sizeof(profile_routine));
+  int routine_count = 0;
+
+  if (!total_instructions || !total_cycles || !routines) {
+    fprintf(f, "ERROR: Could not allocate memory for profile report\n");
+    cpu.term.error = true;
+    free(total_instructions);
+    free(total_cycles);
+    free(routines);
+    return;
+  }
+
+  // Children always come after their parents, so a reverse pass sums up
+  // the inclusive counts
+  for (int node = profile_node_count - 1; node >= 0; node--) {
+    total_instructions[node] += profile_nodes[node].instructions;
+    total_cycles[node] += profile_nodes[node].cycles;
+    if (profile_nodes[node].parent != -1) {
+      total_instructions[profile_nodes[node].parent] += total_instructions[node];
+      total_cycles[profile_nodes[node].parent] += total_cycles[node];
+    }
+  }
+
+  // Gather the flat profile.  A recursive routine's inclusive counts only
+  // come from its outermost calls.
+  for (int node = 1; node < profile_node_count; node++) {
+    int r;
+    for (r = 0; r < routine_count; r++)
+      if (routines[r].addr == profile_nodes[node].addr)
+        break;
+    if (r == routine_count) {
+      routines[r].addr = profile_nodes[node].addr;
+      routines[r].node = node;
+      routine_count++;
+    }
+    routines[r].calls += profile_nodes[node].calls;
+    routines[r].instructions += profile_nodes[node].instructions;
+    routines[r].cycles += profile_nodes[node].cycles;
+    int outer = profile_nodes[node].parent;
+    while (outer != -1 && profile_nodes[outer].addr != profile_nodes[node].addr)
+      outer = profile_nodes[outer].parent;
+    if (outer == -1 || outer == PROFILE_ROOT) {
+      routines[r].total_instructions += total_instructions[node];
+      routines[r].total_cycles += total_cycles[node];
+    }
+  }
+  qsort(routines, routine_count, sizeof(profile_routine), compare_profile_routines);
+
+  fprintf(f, "INFO: Flat profile (%llu instructions, %llu cycles, %llu outside any routine):\n",
+      total_instructions[PROFILE_ROOT], total_cycles[PROFILE_ROOT], profile_nodes[PROFILE_ROOT].instructions);
+  fprintf(f, "  %12s %12s %12s %12s %8s  %s\n", "Total instr", "Total cycles", "Self instr", "Self cycles", "Calls",
+      "Routine");
+  for (int r = 0; r < routine_count; r++)
+    fprintf(f, "  %12llu %12llu %12llu %12llu %8llu  %s\n", routines[r].total_instructions, routines[r].total_cycles,
+        routines[r].instructions, routines[r].cycles, routines[r].calls, profile_node_name(routines[r].node));
+
+  fprintf(f, "INFO: Call graph:\n");
+  fprintf(f, "  %12s %12s %12s %12s %8s  %s\n", "Total instr", "Total cycles", "Self instr", "Self cycles", "Calls",
+      "Routine");
+  profile_show_call_graph(f, PROFILE_ROOT, 0, total_instructions, total_cycles);
+
+  // Collapsed stacks, one line per calling context, weighted by cycles, as
+  // accepted by flamegraph.pl and similar tools
+  if (stacks_file) {
+    FILE *s = fopen(stacks_file, "w");
+    if (!s) {
+      fprintf(f, "ERROR: Could not write profile stacks to '%s'\n", stacks_file);
+      cpu.term.error = true;
+    }
+    else {
+      for (int node = 0; node < profile_node_count; node++) {
+        if (!profile_nodes[node].cycles)
+          continue;
+        profile_write_stacks(s, node);
+        fprintf(s, " %llu\n", profile_nodes[node].cycles);
+      }
+      fclose(s);
+      fprintf(f, "INFO: Wrote profile stacks to '%s'\n", stacks_file);
+    }
+  }
+
+  free(total_instructions);
+  free(total_cycles);
+  free(routines);
 }
 
-unsigned int addr_izpz(struct cpu *cpu, struct instruction_log *log)
+// Binary instruction trace, see hyppotrace.h.  Unlike the instruction log,
+// which only keeps what fits in memory and is slow to print, the trace is
+// streamed to disk as the instructions are executed.
+#define TRACE_BUFFER_SIZE (1024 * 1024)
+
+void trace_write(void *data, size_t len)
 {
-  log->zp_pointer = (log->bytes[1] + (log->regs.b << 8));
-  log->zp_pointer_addr = (read_memory(cpu, log->zp_pointer + 0) + (read_memory(cpu, log->zp_pointer + 1) << 8) + cpu->regs.z)
-                       & 0xffff;
-  return log->zp_pointer_addr;
+  if (fwrite(data, len, 1, trace_file) != 1) {
+    fprintf(logfile, "ERROR: Could not write instruction trace to '%s'\n", trace_filename);
+    fclose(trace_file);
+    trace_file = NULL;
+    cpu.term.error = true;
+  }
 }
 
-unsigned int addr_izpz32(struct cpu *cpu, struct instruction_log *log)
+void trace_record(char type, void *data, size_t len)
 {
-  log->zp_pointer = (log->bytes[1] + (log->regs.b << 8));
-  log->zp_pointer_addr = (read_memory(cpu, log->zp_pointer + 0) + (read_memory(cpu, log->zp_pointer + 1) << 8)
-                             + (read_memory(cpu, log->zp_pointer + 2) << 16) + (read_memory(cpu, log->zp_pointer + 3) << 24)
-                             + cpu->regs.z)
-                       & 0xffff;
-  return log->zp_pointer_addr;
+  trace_write(&type, 1);
+  if (trace_file && len)
+    trace_write(data, len);
 }
 
-unsigned int addr_absx(struct cpu *cpu, struct instruction_log *log)
+int trace_open(char *filename, bool keep)
 {
-  return (log->bytes[1] + (log->bytes[2] << 8) + cpu->regs.x) & 0xffff;
+  trace_header header;
+  trace_opcode opcodes[256];
+
+  if (trace_file)
+    trace_close(false);
+
+  snprintf(trace_filename, sizeof(trace_filename), "%s", filename);
+  trace_keep = keep;
+  trace_file = fopen(trace_filename, "wb");
+  if (!trace_file) {
+    fprintf(logfile, "ERROR: Could not write instruction trace to '%s'\n", trace_filename);
+    return -1;
+  }
+  setvbuf(trace_file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+  bzero(&header, sizeof(header));
+  bcopy(TRACE_MAGIC, header.magic, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  trace_write(&header, sizeof(header));
+
+  bzero(opcodes, sizeof(opcodes));
+  for (int i = 0; i < 256; i++) {
+    strncpy(opcodes[i].mnemonic, opcode_table[i].mnemonic, sizeof(opcodes[i].mnemonic));
+    opcodes[i].mode = opcode_table[i].mode;
+    opcodes[i].len = opcode_table[i].len;
+  }
+  if (trace_file)
+    trace_record(TRACE_OPCODES, opcodes, sizeof(opcodes));
+  return trace_file ? 0 : -1;
 }
 
-unsigned int addr_absy(struct cpu *cpu, struct instruction_log *log)
+void trace_symbols(hyppo_symbol *syms, int count, unsigned int offset)
 {
-  return (log->bytes[1] + (log->bytes[2] << 8) + cpu->regs.y) & 0xffff;
+  trace_symbol s;
+
+  for (int i = 0; i < count && trace_file; i++) {
+    s.addr = syms[i].addr + offset;
+    s.name_len = strlen(syms[i].name);
+    trace_record(TRACE_SYMBOL, &s, sizeof(s));
+    if (trace_file)
+      trace_write(syms[i].name, s.name_len);
+  }
 }
 
-unsigned int addr_iabsx(struct cpu *cpu, struct instruction_log *log)
+void trace_close(bool failed)
 {
-  log->zp_pointer = addr_absx(cpu, log);
-  log->zp_pointer_addr = (read_memory(cpu, log->zp_pointer + 0) + (read_memory(cpu, log->zp_pointer + 1) << 8)) & 0xffff;
-  return log->zp_pointer_addr;
+  char cmd[8192];
+
+  if (!trace_file)
+    return;
+
+  // The symbols go at the end, so that they include any loaded while tracing
+  trace_symbols(hyppo_symbols, hyppo_symbol_count, 0xfff0000);
+  trace_symbols(symbols, symbol_count, 0);
+  if (trace_file)
+    trace_record(TRACE_END, NULL, 0);
+  if (trace_file && fclose(trace_file)) {
+    fprintf(logfile, "ERROR: Could not write instruction trace to '%s'\n", trace_filename);
+    cpu.term.error = true;
+  }
+  trace_file = NULL;
+
+  if (trace_keep)
+    fprintf(logfile, "INFO: Wrote instruction trace to '%s'\n", trace_filename);
+  else if (failed) {
+    fprintf(logfile, "INFO: Instruction trace is in 'FAIL.%s.trace'\n", safe_name);
+    snprintf(cmd, 8192, "mv %s FAIL.%s.trace", trace_filename, safe_name);
+    system(cmd);
+  }
+  else
+    unlink(trace_filename);
 }
 
-void update_nz(unsigned char v)
+int trace_open_for_test(void)
 {
-  cpu.regs.flag_n = v >= 0x80; // Bit 7 is set
-  cpu.regs.flag_z = v == 0;
+  char filename[1024];
+  snprintf(filename, sizeof(filename), TESTTRACEFILE_PATTERN, (int)getpid());
+  return trace_open(filename, false);
 }
 
-void update_bit_flags(unsigned char v)
+// Read all of f, and report whether any line of it contains text
+bool output_contains(FILE *f, char *text)
 {
-  cpu.regs.flags &= ~(FLAG_N | FLAG_V | FLAG_Z);
-  cpu.regs.flags |= v & (FLAG_N | FLAG_V);
-  v &= cpu.regs.a;
-  if (!v)
-    cpu.regs.flags |= FLAG_Z;
+  char line[1024];
+  bool found = false;
+  while (fgets(line, sizeof(line), f))
+    if (strstr(line, text))
+      found = true;
+  return found;
 }
 
-void update_cmp_flags(unsigned char v)
+// Check that a file the test wrote (or its own log, if filename is NULL)
+// contains text
+int expect_file_contains(char *filename, char *text)
 {
-  update_nz(v);
-  cpu.regs.flag_c = !cpu.regs.flag_n;
+  char *name = filename ? filename : testlogfile;
+  if (!filename)
+    fflush(logfile);
+  FILE *f = fopen(name, "r");
+  if (!f) {
+    fprintf(logfile, "ERROR: Could not read '%s'\n", name);
+    return -1;
+  }
+  bool found = output_contains(f, text);
+  fclose(f);
+  if (!found) {
+    fprintf(logfile, "ERROR: %s does not contain \"%s\"\n", filename ? filename : "Test log", text);
+    return -1;
+  }
+  return 0;
 }
 
-void adc(struct cpu *cpu, unsigned char v)
+// Decode a trace with hyppotrace, and check that the listing contains text
+int expect_trace_contains(char *filename, char *text)
 {
-  if (cpu->regs.flag_d) {
-    // XXX TODO - Implement decimal mode
-    fprintf(logfile, "ERROR: ADC with decimal mode is not implemented\n");
-    cpu->term.error = true;
+  char cmd[8192];
+  snprintf(cmd, sizeof(cmd), "'%shyppotrace' '%s' 2>&1", tool_dir, filename);
+  FILE *f = popen(cmd, "r");
+  if (!f) {
+    fprintf(logfile, "ERROR: Could not run hyppotrace on '%s'\n", filename);
+    return -1;
   }
-  else {
-    unsigned r = ((unsigned)v) + cpu->regs.a + cpu->regs.flag_c;
-    update_nz(r);
-    cpu->regs.flag_c = r > 0xff;
-    cpu->regs.flag_v = ((cpu->regs.a ^ r) & (v ^ r) & 0x80) > 0;
-    cpu->regs.a = r;
+  bool found = output_contains(f, text);
+  if (pclose(f)) {
+    fprintf(logfile, "ERROR: hyppotrace could not decode '%s'\n", filename);
+    return -1;
+  }
+  if (!found) {
+    fprintf(logfile, "ERROR: Decoded trace '%s' does not contain \"%s\"\n", filename, text);
+    return -1;
   }
+  return 0;
 }
 
-static inline void sbc(struct cpu *cpu, unsigned char v)
+void trace_routine_call(unsigned int addr)
 {
-  adc(cpu, ~v);
+  trace_call call;
+
+  call.addr = addr;
+  trace_record(TRACE_CALL, &call, sizeof(call));
 }
 
-unsigned char stack_pop_ext(struct cpu *cpu, unsigned short amount, struct instruction_log *log)
+void trace_instruction(struct cpu *cpu, struct instruction_log *log, int index, unsigned int cycles)
 {
-  if (cpu->regs.flag_e) {
-    unsigned char new_spl = cpu->regs.spl + amount;
-    if (new_spl < cpu->regs.spl)
-      cpu->stack_underflow = true;
-    cpu->regs.spl = new_spl;
-  }
-  else {
-    unsigned short new_sp = cpu->regs.sp + amount;
-    if (new_sp < cpu->regs.sp)
-      cpu->stack_underflow = true;
-    cpu->regs.sp = new_sp;
+  trace_insn t;
+
+  t.instruction = index;
+  t.pc = log->pc;
+  t.pc28 = addr_to_28bit(cpu, log->pc, 0);
+  t.ea28 = log->zp32 ? log->zp_pointer_addr : trace_ea;
+  bcopy(log->bytes, t.bytes, sizeof(t.bytes));
+  t.len = log->len;
+  t.flags = (log->regs.in_hyper ? TRACE_IN_HYPER : 0) | (log->zp32 ? TRACE_ZP32 : 0);
+  t.cycles = cycles > 255 ? 255 : cycles;
+  t.a = log->regs.a;
+  t.x = log->regs.x;
+  t.y = log->regs.y;
+  t.z = log->regs.z;
+  t.b = log->regs.b;
+  t.p = log->regs.flags;
+  t.sp = log->regs.sp;
+  t.maplo = log->regs.maplo;
+  t.maphi = log->regs.maphi;
+  t.maplomb = log->regs.maplomb;
+  t.maphimb = log->regs.maphimb;
+  trace_record(TRACE_INSN, &t, sizeof(t));
+}
+
+// Code coverage.  For every byte of RAM that code can run from, coverage_exec
+// records whether it was part of an executed instruction, and for conditional
+// branches coverage_taken and coverage_not_taken which ways they went.  The
+// maps are shared with -j workers, so that coverage accumulates over all of
+// the tests in a run.  (Each byte is only ever set to 1, so workers can't
+// lose each other's updates.)
+#define COVERAGE_SIZE (CHIPRAM_SIZE + HYPPORAM_SIZE)
+bool coverage = false;
+unsigned char *coverage_exec = NULL;
+unsigned char *coverage_taken = NULL;
+unsigned char *coverage_not_taken = NULL;
+
+// Lines of assembler listings, to report coverage by source line and routine
+typedef struct coverage_line {
+  unsigned int addr; // 28-bit
+  int file;
+  int line;
+  int routine; // Index in coverage_routines[], or -1
+  bool code;   // Not a pseudo-op like !byte
+  bool branch; // Conditional branch
+} coverage_line;
+#define MAX_COVERAGE_FILES 256
+char *coverage_files[MAX_COVERAGE_FILES];
+int coverage_file_count = 0;
+coverage_line *coverage_lines = NULL;
+int coverage_line_count = 0;
+int coverage_line_max = 0;
+char **coverage_routines = NULL;
+int coverage_routine_count = 0;
+int coverage_routine_max = 0;
+
+void coverage_init(void)
+{
+  // Call before starting any workers
+  unsigned char *maps
+      = mmap(NULL, 3 * COVERAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (maps == MAP_FAILED) {
+    fprintf(stderr, "ERROR: Could not allocate memory for coverage maps.\n");
+    exit(-2);
   }
-  log->pop_blame[log->pops++] = memory_blame(cpu, cpu->regs.sp);
-  return read_memory(cpu, cpu->regs.sp);
+  coverage_exec = maps;
+  coverage_taken = maps + COVERAGE_SIZE;
+  coverage_not_taken = maps + 2 * COVERAGE_SIZE;
+}
+
+int coverage_offset(unsigned int addr)
+{
+  // Index in the coverage maps of a 28-bit address, or -1 if code can't run there
+  if (addr < CHIPRAM_SIZE)
+    return addr;
+  if (addr >= 0xfff8000 && addr < 0xfffc000)
+    return CHIPRAM_SIZE + addr - 0xfff8000;
+  return -1;
 }
 
-static inline unsigned char stack_pop(struct cpu *cpu, struct instruction_log *log)
+unsigned int coverage_address(int offset)
 {
-  return stack_pop_ext(cpu, 1, log);
+  if (offset < CHIPRAM_SIZE)
+    return offset;
+  return 0xfff8000 + offset - CHIPRAM_SIZE;
 }
 
-bool stack_push(struct cpu *cpu, unsigned char v)
+bool is_conditional_branch(unsigned char opcode)
 {
-  MEM_WRITE16(cpu, cpu->regs.sp, v);
-  if (cpu->regs.flag_e) {
-    unsigned char new_spl = cpu->regs.spl - 1;
-    if (new_spl > cpu->regs.spl)
-      cpu->stack_overflow = true;
-    cpu->regs.spl = new_spl;
-  }
-  else {
-    unsigned short new_sp = cpu->regs.sp - 1;
-    if (new_sp > cpu->regs.sp)
-      cpu->stack_overflow = true;
-    cpu->regs.sp = new_sp;
+  switch (opcode_table[opcode].mode) {
+  case MODE_REL8:
+  case MODE_REL16:
+    // BRA, BSR and LBRA always branch
+    return opcode != 0x80 && opcode != 0x63 && opcode != 0x83;
+  case MODE_ZPREL8:
+    return true;
   }
-  return true;
+  return false;
 }
 
-bool execute_instruction(struct cpu *cpu, struct instruction_log *log)
+void coverage_instruction(struct cpu *cpu, struct instruction_log *log, unsigned int pc28)
 {
-  int v;
-  for (int i = 0; i < 6; i++) {
-    log->bytes[i] = read_memory(cpu, cpu->regs.pc + i);
-  }
-  switch (log->bytes[0]) {
-  case 0x00: // BRK
-    log->len = 2;
-    cpu->term.error = true;
-    cpu->term.brk = true;
-    cpu->term.done = true;
-    break;
-  case 0x01: // ORA ($xx,X)
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_izpx(cpu, log));
-    v |= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    break;
-  case 0x03: // SEE
-    cpu->regs.flags |= FLAG_E;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x04: // TSB $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_zp(cpu, log));
-    cpu->regs.flag_z = (v & cpu->regs.a) == 0;
-    v |= cpu->regs.a;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    break;
-  case 0x05: // ORA $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_zp(cpu, log));
-    v |= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    break;
-  case 0x06: // ASL $nn
-    cpu->regs.flag_c = cpu->regs.a >= 0x80;
-    v = read_memory(cpu, addr_zp(cpu, log)) << 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x07: // RMB0 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) & ~1;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x08: // PHP
-    // B flag always pushes as set
-    stack_push(cpu, cpu->regs.flags | FLAG_B);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x09: // ORA #$nn
-    cpu->regs.a |= log->bytes[1];
-    update_nz(cpu->regs.a);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x0A: // ASL A
-    cpu->regs.flag_c = cpu->regs.a >= 0x80;
-    v = cpu->regs.a << 1;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 1;
-    cpu->regs.pc += 1;
-    break;
-  case 0x0c: // TSB $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    v = read_memory(cpu, addr_abs(log));
-    cpu->regs.flag_z = (v & cpu->regs.a) == 0;
-    v |= cpu->regs.a;
-    MEM_WRITE16(cpu, addr_abs(log), v);
-    break;
-  case 0x0d: // ORA $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    v = read_memory(cpu, addr_abs(log));
-    v |= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    break;
-  case 0x0e: // ASL $nnnn
-    cpu->regs.flag_c = cpu->regs.a >= 0x80;
-    v = read_memory(cpu, addr_abs(log)) << 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_abs(log), v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x0F: // BBR0 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 1) == 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
-    }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0x10: // BPL $rr
-    log->len = 2;
-    if (cpu->regs.flags & FLAG_N)
-      cpu->regs.pc += 2;
-    else
-      cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
-    break;
-  case 0x11: // ORA ($xx),Y
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_izpy(cpu, log));
-    v |= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    break;
-  case 0x12: // ORA ($xx),Z
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_izpz(cpu, log));
-    v |= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    break;
-  case 0x13: // BPL $rrrr
-    log->len = 3;
-    if (cpu->regs.flags & FLAG_N)
-      cpu->regs.pc += 3;
-    else
-      cpu->regs.pc += 2 + rel16_delta(log->bytes[1]);
-    break;
-  case 0x14: // TRB $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_zp(cpu, log));
-    cpu->regs.flag_z = (v & cpu->regs.a) == 0;
-    v &= ~cpu->regs.a;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    break;
-  case 0x15: // ORA $xx,X
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_zpx(cpu, log));
-    v |= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    break;
-  case 0x16: // ASL $nn,X
-    cpu->regs.flag_c = cpu->regs.a >= 0x80;
-    v = read_memory(cpu, addr_zpx(cpu, log)) << 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_zpx(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x17: // RMB1 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) & ~2;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x18: // CLC
-    cpu->regs.flags &= ~FLAG_C;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x19: // ORA $xxxx,Y
-    log->len = 3;
-    cpu->regs.pc += 3;
-    v = read_memory(cpu, addr_absy(cpu, log));
-    v |= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    break;
-  case 0x1A: // INC A
-    cpu->regs.a++;
-    update_nz(cpu->regs.a);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x1B: // INZ
-    cpu->regs.z++;
-    update_nz(cpu->regs.z);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x1d: // ORA $xxxx,X
-    log->len = 3;
-    cpu->regs.pc += 3;
-    v = read_memory(cpu, addr_absx(cpu, log));
-    v |= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    break;
-  case 0x1e: // ASL $nnnn,X
-    cpu->regs.flag_c = cpu->regs.a >= 0x80;
-    v = read_memory(cpu, addr_absx(cpu, log)) << 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_absx(cpu, log), v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x1c: // TRB $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    v = read_memory(cpu, addr_abs(log));
-    cpu->regs.flag_z = (v & cpu->regs.a) == 0;
-    v &= ~cpu->regs.a;
-    MEM_WRITE16(cpu, addr_abs(log), v);
-    break;
-  case 0x1F: // BBR1 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 2) == 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
-    }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0x20: // JSR $nnnn
-    if (cpu->term.rts)
-      cpu->term.rts++;
-    stack_push(cpu, (cpu->regs.pc + 2) >> 8);
-    stack_push(cpu, cpu->regs.pc + 2);
-    cpu->regs.pc = addr_abs(log);
-    log->len = 3;
-    break;
-  case 0x21: // AND ($nn,X)
-    v = read_memory(cpu, addr_izpx(cpu, log));
-    v &= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x22: // JSR ($nnnn)
-    if (cpu->term.rts)
-      cpu->term.rts++;
-    stack_push(cpu, (cpu->regs.pc + 2) >> 8);
-    stack_push(cpu, cpu->regs.pc + 2);
-    cpu->regs.pc = addr_deref16(cpu, log);
-    log->len = 3;
-    break;
-  case 0x24: // BIT $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    update_bit_flags(read_memory(cpu, addr_zp(cpu, log)));
-    break;
-  case 0x25: // AND $nn
-    v = read_memory(cpu, addr_zp(cpu, log));
-    v &= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x26: // ROL $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) << 1;
-    if (cpu->regs.flag_c)
-      v |= 0x1;
-    cpu->regs.flag_c = v >= 0x100;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x27: // RMB2 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) & ~4;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x28: // PLP
-    // E & B flags cannot be set via PLP
-    cpu->regs.flags &= FLAG_E | FLAG_B;
-    cpu->regs.flags |= stack_pop(cpu, log) & ~(FLAG_E | FLAG_B);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x29: // AND #$nn
-    cpu->regs.a &= log->bytes[1];
-    update_nz(cpu->regs.a);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x2A: // ROL A
-    v = cpu->regs.a << 1;
-    if (cpu->regs.flag_c)
-      v |= 0x1;
-    cpu->regs.flag_c = v >= 0x100;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 1;
-    cpu->regs.pc += 1;
-    break;
-  case 0x2b: // TYS
-    cpu->regs.sph = cpu->regs.y;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x2C: // BIT $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    update_bit_flags(read_memory(cpu, addr_abs(log)));
-    break;
-  case 0x2D: // AND $nnnn
-    v = read_memory(cpu, addr_abs(log));
-    v &= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x2e: // ROL $nnnn
-    v = read_memory(cpu, addr_abs(log)) << 1;
-    if (cpu->regs.flag_c)
-      v |= 0x1;
-    cpu->regs.flag_c = v >= 0x100;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_abs(log), v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x2F: // BBR2 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 4) == 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
-    }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0x30: // BMI $rr
-    log->len = 2;
-    if (!(cpu->regs.flags & FLAG_N))
-      cpu->regs.pc += 2;
-    else
-      cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
-    break;
-  case 0x31: // AND ($nn),Y
-    v = read_memory(cpu, addr_izpy(cpu, log));
-    v &= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x32: // AND ($nn),Z
-    v = read_memory(cpu, addr_izpz(cpu, log));
-    v &= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x33: // BMI $rrrr
-    log->len = 3;
-    if (!(cpu->regs.flags & FLAG_N))
-      cpu->regs.pc += 3;
-    else
-      cpu->regs.pc += 2 + rel16_delta(log->bytes[1]);
-    break;
-  case 0x34: // BIT $xx,X
-    log->len = 2;
-    cpu->regs.pc += 2;
-    update_bit_flags(read_memory(cpu, addr_zpx(cpu, log)));
-    break;
-  case 0x35: // AND $nn,X
-    v = read_memory(cpu, addr_zpx(cpu, log));
-    v &= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x36: // ROL $nn,X
-    v = read_memory(cpu, addr_zpx(cpu, log)) << 1;
-    if (cpu->regs.flag_c)
-      v |= 0x1;
-    cpu->regs.flag_c = v >= 0x100;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_zpx(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x37: // RMB3 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) & ~8;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x38: // SEC
-    cpu->regs.flags |= FLAG_C;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x39: // AND $nnnn,Y
-    v = read_memory(cpu, addr_absy(cpu, log));
-    v &= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x3A: // DEC A
-    cpu->regs.a--;
-    update_nz(cpu->regs.a);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x3C: // BIT $xxxx,X
-    log->len = 3;
-    cpu->regs.pc += 3;
-    update_bit_flags(read_memory(cpu, addr_absx(cpu, log)));
-    break;
-  case 0x3D: // AND $nnnn,X
-    v = read_memory(cpu, addr_absx(cpu, log));
-    v &= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x3e: // ROL $nnnn,X
-    v = read_memory(cpu, addr_absx(cpu, log)) << 1;
-    if (cpu->regs.flag_c)
-      v |= 0x1;
-    cpu->regs.flag_c = v >= 0x100;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_absx(cpu, log), v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x3F: // BBR3 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 8) == 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
-    }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0x40: // RTI
-    log->len = 1;
-    // E & B flags cannot be set via RTI
-    cpu->regs.flags &= FLAG_E | FLAG_B;
-    cpu->regs.flags |= stack_pop(cpu, log) & ~(FLAG_E | FLAG_B);
-    cpu->regs.pc = stack_pop(cpu, log);
-    cpu->regs.pc |= stack_pop(cpu, log) << 8;
-    break;
-  case 0x41: // EOR ($nn,X)
-    v = read_memory(cpu, addr_izpx(cpu, log));
-    v ^= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x45: // EOR $nn
-    v = read_memory(cpu, addr_zp(cpu, log));
-    v ^= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x46: // LSR $nn
-    v = read_memory(cpu, addr_zp(cpu, log));
-    cpu->regs.flag_c = v & 1;
-    v >>= 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x47: // RMB4 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) & ~16;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x48: // PHA
-    stack_push(cpu, cpu->regs.a);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x49: // EOR #$nn
-    cpu->regs.a ^= log->bytes[1];
-    update_nz(cpu->regs.a);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x4A: // LSR A
-    v = cpu->regs.a;
-    cpu->regs.flag_c = v & 1;
-    v >>= 1;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 1;
-    cpu->regs.pc++;
-    break;
-  case 0x4B: // TAZ
-    cpu->regs.z = cpu->regs.a;
-    update_nz(cpu->regs.z);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x4c: // JMP $nnnn
-    cpu->regs.pc = addr_abs(log);
-    log->len = 3;
-    break;
-  case 0x4d: // EOR $nnnn
-    v = read_memory(cpu, addr_abs(log));
-    v ^= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x4e: // LSR $nnnn
-    v = read_memory(cpu, addr_abs(log));
-    cpu->regs.flag_c = v & 1;
-    v >>= 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_abs(log), v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x4F: // BBR4 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 16) == 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
-    }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0x50: // BVC $rr
-    log->len = 2;
-    if (cpu->regs.flag_v)
-      cpu->regs.pc += 2;
+  int i = coverage_offset(pc28);
+  if (i < 0)
+    return;
+  for (int j = 0; j < log->len && i + j < COVERAGE_SIZE; j++)
+    coverage_exec[i + j] = 1;
+  if (is_conditional_branch(log->bytes[0])) {
+    if (cpu->regs.pc == ((log->pc + log->len) & 0xffff))
+      coverage_not_taken[i] = 1;
     else
-      cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
-    break;
-  case 0x51: // EOR ($nn),Y
-    v = read_memory(cpu, addr_izpy(cpu, log));
-    v ^= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x52: // EOR ($nn),Z
-    v = read_memory(cpu, addr_izpz(cpu, log));
-    v ^= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x55: // EOR $nn,X
-    v = read_memory(cpu, addr_zpx(cpu, log));
-    v ^= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x56: // LSR $nn,X
-    v = read_memory(cpu, addr_zpx(cpu, log));
-    cpu->regs.flag_c = v & 1;
-    v >>= 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_zpx(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x57: // RMB5 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) & ~32;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x58: // CLI
-    cpu->regs.flags &= ~FLAG_I;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x59: // EOR $nnnn,Y
-    v = read_memory(cpu, addr_absy(cpu, log));
-    v ^= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x5A: // PHY
-    stack_push(cpu, cpu->regs.y);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x5b: // TAB
-    cpu->regs.b = cpu->regs.a;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x5c: // MAP
-    cpu->regs.pc++;
+      coverage_taken[i] = 1;
+  }
+}
 
-    if (cpu->regs.x == 0x0f)
-      cpu->regs.maplomb = cpu->regs.a;
-    else
-      cpu->regs.maplo = cpu->regs.a + (cpu->regs.x << 8);
-    if (!cpu->regs.in_hyper) {
-      if (cpu->regs.z == 0x0f)
-        cpu->regs.maphimb = cpu->regs.y;
-      else
-        cpu->regs.maplo = cpu->regs.y + (cpu->regs.z << 8);
-    }
-    cpu->regs.map_irq_inhibit = 1;
-    log->len = 1;
-    break;
-  case 0x5d: // EOR $nnnn,X
-    v = read_memory(cpu, addr_absx(cpu, log));
-    v ^= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x5e: // LSR $nnnn,X
-    v = read_memory(cpu, addr_absx(cpu, log));
-    cpu->regs.flag_c = v & 1;
-    v >>= 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_absx(cpu, log), v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x5F: // BBR5 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 32) == 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
-    }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0x60: // RTS
-    log->len = 1;
-    if (cpu->term.rts) {
-      cpu->term.rts--;
-      if (!cpu->term.rts) {
-        fprintf(logfile, "INFO: Terminating via RTS\n");
-        cpu->term.done = true;
-      }
-    }
-    cpu->regs.pc = stack_pop(cpu, log);
-    cpu->regs.pc |= stack_pop(cpu, log) << 8;
-    cpu->regs.pc++;
-    break;
-  case 0x61: // ADC ($nn,X)
-    adc(cpu, read_memory(cpu, addr_izpx(cpu, log)));
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x64: // STZ $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), cpu->regs.z);
-    break;
-  case 0x65: // ADC $nn
-    adc(cpu, read_memory(cpu, addr_zp(cpu, log)));
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x66: // ROR $nn
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if (cpu->regs.flag_c)
-      v |= 0x100;
-    cpu->regs.flag_c = v & 1;
-    v = v >> 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x67: // RMB6 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) & ~64;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x68: // PLA
-    cpu->regs.a = stack_pop(cpu, log);
-    update_nz(cpu->regs.a);
-    log->len = 1;
-    cpu->regs.pc++;
-    break;
-  case 0x69: // ADC #$nn
-    adc(cpu, log->bytes[1]);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x6A: // ROR A
-    v = cpu->regs.a;
-    if (cpu->regs.flag_c)
-      v |= 0x100;
-    cpu->regs.flag_c = v & 1;
-    v = v >> 1;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 1;
-    cpu->regs.pc += 1;
-    break;
-  case 0x6B: // TZA
-    cpu->regs.a = cpu->regs.z;
-    update_nz(cpu->regs.a);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x6C: // JMP ($nnnn)
-    cpu->regs.pc = addr_deref16(cpu, log);
-    log->len = 3;
-    break;
-  case 0x6D: // ADC $nnnn
-    adc(cpu, read_memory(cpu, addr_abs(log)));
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x6E: // ROR $nnnn
-    v = read_memory(cpu, addr_abs(log));
-    if (cpu->regs.flag_c)
-      v |= 0x100;
-    cpu->regs.flag_c = v & 1;
-    v = v >> 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_abs(log), v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x6F: // BBR6 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 64) == 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
-    }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0x70: // BVS $rr-
-    log->len = 2;
-    if (!cpu->regs.flag_v)
-      cpu->regs.pc += 2;
-    else
-      cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
-    break;
-  case 0x71: // ADC ($nn),Y
-    adc(cpu, read_memory(cpu, addr_izpy(cpu, log)));
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x72: // ADC ($nn),Z
-    adc(cpu, read_memory(cpu, addr_izpz(cpu, log)));
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x74: // STZ $xx,X
-    log->len = 2;
-    cpu->regs.pc += 2;
-    MEM_WRITE16(cpu, addr_zpx(cpu, log), cpu->regs.z);
-    break;
-  case 0x75: // ADC $nn,X
-    adc(cpu, read_memory(cpu, addr_zpx(cpu, log)));
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x76: // ROR $nn,X
-    v = read_memory(cpu, addr_zpx(cpu, log));
-    if (cpu->regs.flag_c)
-      v |= 0x100;
-    cpu->regs.flag_c = v & 1;
-    v = v >> 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_zpx(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x77: // RMB7 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) & ~128;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x78: // SEI
-    cpu->regs.flags |= FLAG_I;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x79: // ADC $nnnn,Y
-    adc(cpu, read_memory(cpu, addr_absy(cpu, log)));
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x7a: // PLY
-    cpu->regs.pc++;
-    log->len = 1;
-    cpu->regs.y = stack_pop(cpu, log);
-    update_nz(cpu->regs.y);
-    break;
-  case 0x7b: // TBA
-    cpu->regs.a = cpu->regs.b;
-    update_nz(cpu->regs.a);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x7C: // JMP ($nnnn,X)
-    cpu->regs.pc = addr_iabsx(cpu, log);
-    log->len = 3;
-    break;
-  case 0x7D: // ADC $nnnn,X
-    adc(cpu, read_memory(cpu, addr_absx(cpu, log)));
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x7e: // ROR $nnnn,X
-    v = read_memory(cpu, addr_absx(cpu, log));
-    if (cpu->regs.flag_c)
-      v |= 0x100;
-    cpu->regs.flag_c = v & 1;
-    v = v >> 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_absx(cpu, log), v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x7F: // BBR7 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 128) == 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
-    }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0x80: // BRA $rr
-    log->len = 2;
-    cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
-    break;
-  case 0x81: // STA ($xx,X)
-    log->len = 2;
-    cpu->regs.pc += 2;
-    MEM_WRITE16(cpu, addr_izpx(cpu, log), cpu->regs.a);
-    break;
-  case 0x83: // BRA $rrrr
-    log->len = 3;
-    cpu->regs.pc += 2 + rel16_delta(log->bytes[1]);
-    break;
-  case 0x84: // STY $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), cpu->regs.y);
-    break;
-  case 0x85: // STA $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), cpu->regs.a);
-    break;
-  case 0x86: // STX $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), cpu->regs.x);
-    break;
-  case 0x87: // SMB0 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) | 1;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x88: // DEY
-    cpu->regs.y--;
-    update_nz(cpu->regs.y);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x89: // BIT #$xx
-    // NOTE: Bit # does NOT alter the N and V flags, unlike BIT's other addressing modes.
-    //       http://forum.6502.org/viewtopic.php?f=2&t=2241&p=27243#p27239
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = log->bytes[1] & cpu->regs.a;
-    cpu->regs.flag_z = (v == 0);
-    break;
-  case 0x8a: // TXA
-    cpu->regs.a = cpu->regs.x;
-    update_nz(cpu->regs.a);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x8c: // STY $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    MEM_WRITE16(cpu, addr_abs(log), cpu->regs.y);
-    break;
-  case 0x8d: // STA $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    MEM_WRITE16(cpu, addr_abs(log), cpu->regs.a);
-    break;
-  case 0x8e: // STX $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    MEM_WRITE16(cpu, addr_abs(log), cpu->regs.x);
-    break;
-  case 0x8F: // BBS0 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 1) != 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
-    }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0x90: // BCC $rr
-    log->len = 2;
-    if (cpu->regs.flags & FLAG_C)
-      cpu->regs.pc += 2;
-    else
-      cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
-    break;
-  case 0x91: // STA ($xx),Y
-    log->len = 2;
-    cpu->regs.pc += 2;
-    log->zp16 = 1;
-    MEM_WRITE16(cpu, addr_izpy(cpu, log), cpu->regs.a);
-    break;
-  case 0x92: // STA ($xx),Z
-    log->len = 2;
-    cpu->regs.pc += 2;
-    if ((cpulog_len > 1) && cpulog[cpulog_len - 2]->bytes[0] == 0xEA) {
-      // NOP prefix means 32-bit ZP pointer
-      fprintf(logfile, "ZP32 address = $%07x\n", addr_izpz32(cpu, log));
-      log->zp32 = 1;
-      MEM_WRITE28(cpu, addr_izpz32(cpu, log), cpu->regs.a);
-    }
-    else {
-      // Normal 16-bit ZP pointer
-      log->zp16 = 1;
-      MEM_WRITE16(cpu, addr_izpz(cpu, log), cpu->regs.a);
-    }
-    break;
-  case 0x93: // BCC $rrrr
-    log->len = 3;
-    if (cpu->regs.flags & FLAG_C)
-      cpu->regs.pc += 3;
-    else
-      cpu->regs.pc += 3 + rel16_delta(log->bytes[1] + (log->bytes[2] << 8));
-    break;
-  case 0x94: // STA $xx,X
-    log->len = 2;
-    cpu->regs.pc += 2;
-    MEM_WRITE16(cpu, addr_zpx(cpu, log), cpu->regs.y);
-    break;
-  case 0x95: // STA $xx,X
-    log->len = 2;
-    cpu->regs.pc += 2;
-    MEM_WRITE16(cpu, addr_zpx(cpu, log), cpu->regs.a);
-    break;
-  case 0x96: // STX $xx,Y
-    log->len = 2;
-    cpu->regs.pc += 2;
-    MEM_WRITE16(cpu, addr_zpy(cpu, log), cpu->regs.x);
-    break;
-  case 0x97: // SMB1 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) | 2;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x98: // TYA
-    cpu->regs.a = cpu->regs.y;
-    update_nz(cpu->regs.a);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x99: // STA $xxxx,Y
-    log->len = 3;
-    cpu->regs.pc += 3;
-    MEM_WRITE16(cpu, addr_absy(cpu, log), cpu->regs.a);
-    break;
-  case 0x9a: // TXS
-    cpu->regs.spl = cpu->regs.x;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x9c: // STZ $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    MEM_WRITE16(cpu, addr_abs(log), cpu->regs.z);
-    break;
-  case 0x9d: // STA $xxxx,X
-    log->len = 3;
-    cpu->regs.pc += 3;
-    MEM_WRITE16(cpu, addr_absx(cpu, log), cpu->regs.a);
-    break;
-  case 0x9E: // STZ $xxxx,X
-    log->len = 3;
-    cpu->regs.pc += 3;
-    MEM_WRITE16(cpu, addr_absx(cpu, log), cpu->regs.z);
-    break;
-  case 0x9F: // BBS1 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 2) != 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
-    }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0xa0: // LDY #$nn
-    cpu->regs.y = log->bytes[1];
-    update_nz(cpu->regs.y);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xA1: // LDA ($xx,X)
-    log->len = 2;
-    cpu->regs.pc += 2;
-    log->zp16 = 1;
-    cpu->regs.a = read_memory(cpu, addr_izpx(cpu, log));
-    update_nz(cpu->regs.a);
-    break;
-  case 0xa2: // LDX #$nn
-    cpu->regs.x = log->bytes[1];
-    update_nz(cpu->regs.x);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xa3: // LDZ #$nn
-    cpu->regs.z = log->bytes[1];
-    update_nz(cpu->regs.z);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xa4: // LDY $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    cpu->regs.y = read_memory(cpu, addr_zp(cpu, log));
-    update_nz(cpu->regs.y);
-    break;
-  case 0xa5: // LDA $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    cpu->regs.a = read_memory(cpu, addr_zp(cpu, log));
-    update_nz(cpu->regs.a);
-    break;
-  case 0xa6: // LDX $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    cpu->regs.x = read_memory(cpu, addr_zp(cpu, log));
-    update_nz(cpu->regs.x);
-    break;
-  case 0xa7: // SMB2 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) | 4;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xa8: // TAY
-    cpu->regs.y = cpu->regs.a;
-    update_nz(cpu->regs.a);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xa9: // LDA #$nn
-    cpu->regs.a = log->bytes[1];
-    update_nz(cpu->regs.a);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xaa: // TAX
-    cpu->regs.x = cpu->regs.a;
-    update_nz(cpu->regs.a);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xac: // LDY $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    cpu->regs.y = read_memory(cpu, addr_abs(log));
-    update_nz(cpu->regs.y);
-    break;
-  case 0xad: // LDA $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    cpu->regs.a = read_memory(cpu, addr_abs(log));
-    update_nz(cpu->regs.a);
-    break;
-  case 0xae: // LDX $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    cpu->regs.x = read_memory(cpu, addr_abs(log));
-    update_nz(cpu->regs.x);
-    break;
-  case 0xAF: // BBS2 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 4) != 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
-    }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0xB0: // BCS $rr
-    log->len = 2;
-    if (cpu->regs.flags & FLAG_C)
-      cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
-    else
-      cpu->regs.pc += 2;
-    break;
-  case 0xb1: // LDA ($xx),Y
-    log->len = 2;
-    cpu->regs.pc += 2;
-    log->zp16 = 1;
-    cpu->regs.a = read_memory(cpu, addr_izpy(cpu, log));
-    update_nz(cpu->regs.a);
-    break;
-  case 0xb2: // LDA ($xx),Z
-    log->len = 2;
-    cpu->regs.pc += 2;
-    log->zp16 = 1;
-    cpu->regs.a = read_memory(cpu, addr_izpz(cpu, log));
-    update_nz(cpu->regs.a);
-    break;
-  case 0xb4: // LDY $xx,X
-    log->len = 2;
-    cpu->regs.pc += 2;
-    cpu->regs.y = read_memory(cpu, addr_zpx(cpu, log));
-    update_nz(cpu->regs.y);
-    break;
-  case 0xb5: // LDA $xx,X
-    log->len = 2;
-    cpu->regs.pc += 2;
-    cpu->regs.a = read_memory(cpu, addr_zpx(cpu, log));
-    update_nz(cpu->regs.a);
-    break;
-  case 0xb6: // LDX $xx,Y
-    log->len = 2;
-    cpu->regs.pc += 2;
-    cpu->regs.x = read_memory(cpu, addr_zpy(cpu, log));
-    update_nz(cpu->regs.x);
-    break;
-  case 0xb7: // SMB3 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) | 8;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xb8: // CLV
-    cpu->regs.flags &= ~FLAG_V;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xb9: // LDA $xxxx,Y
-    log->len = 3;
-    cpu->regs.pc += 3;
-    cpu->regs.a = read_memory(cpu, addr_absy(cpu, log));
-    update_nz(cpu->regs.a);
-    break;
-  case 0xba: // TSX
-    log->len = 1;
-    cpu->regs.pc += 1;
-    cpu->regs.x = cpu->regs.spl;
-    update_nz(cpu->regs.x);
-    break;
-  case 0xbc: // LDY $xxxx,X
-    log->len = 3;
-    cpu->regs.pc += 3;
-    cpu->regs.y = read_memory(cpu, addr_absx(cpu, log));
-    update_nz(cpu->regs.y);
-    break;
-  case 0xbd: // LDA $xxxx,X
-    log->len = 3;
-    cpu->regs.pc += 3;
-    cpu->regs.a = read_memory(cpu, addr_absx(cpu, log));
-    update_nz(cpu->regs.a);
-    break;
-  case 0xbe: // LDX $xxxx,Y
-    log->len = 3;
-    cpu->regs.pc += 3;
-    cpu->regs.x = read_memory(cpu, addr_absy(cpu, log));
-    update_nz(cpu->regs.x);
-    break;
-  case 0xBF: // BBS3 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 8) != 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
+bool is_mnemonic(const char *token, int len)
+{
+  // Also accepts the 45GS02 Q mnemonics (LDQ, ADCQ, ...), which have no
+  // opcodes of their own
+  if ((len == 4 || len == 5) && (token[len - 1] == 'q' || token[len - 1] == 'Q'))
+    len--;
+  if (len < 3 || len > 4)
+    return false;
+  for (int i = 0; i < 256; i++)
+    if (strlen(opcode_table[i].mnemonic) == len && !strncasecmp(opcode_table[i].mnemonic, token, len))
+      return true;
+  return false;
+}
+
+int coverage_add_routine(char *name, int len)
+{
+  if (coverage_routine_count == coverage_routine_max) {
+    coverage_routine_max = coverage_routine_max ? 2 * coverage_routine_max : 1024;
+    coverage_routines = realloc(coverage_routines, coverage_routine_max * sizeof(char *));
+    if (!coverage_routines) {
+      fprintf(stderr, "ERROR: Could not allocate memory for coverage listing.\n");
+      exit(-2);
     }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0xC0: // CPY #$nn
-    v = cpu->regs.y - log->bytes[1];
-    update_cmp_flags(v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xC1: // CMP ($nn,X)
-    v = cpu->regs.a - read_memory(cpu, addr_izpx(cpu, log));
-    update_cmp_flags(v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xC4: // CPY $nn
-    v = cpu->regs.y - read_memory(cpu, addr_zp(cpu, log));
-    update_cmp_flags(v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xC5: // CMP $nn
-    v = cpu->regs.a - read_memory(cpu, addr_zp(cpu, log));
-    update_cmp_flags(v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xC6: // DEC $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_zp(cpu, log));
-    v--;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    update_nz(v);
-    break;
-  case 0xC7: // SMB4 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) | 16;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xC8: // INY
-    cpu->regs.y++;
-    update_nz(cpu->regs.y);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xC9: // CMP #$nn
-    v = cpu->regs.a - log->bytes[1];
-    update_cmp_flags(v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xCA: // DEX
-    cpu->regs.x--;
-    update_nz(cpu->regs.x);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xCC: // CPY $nnnn
-    v = cpu->regs.y - read_memory(cpu, addr_abs(log));
-    update_cmp_flags(v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0xCD: // CMP $nnnn
-    v = cpu->regs.a - read_memory(cpu, addr_abs(log));
-    update_cmp_flags(v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0xCE: // DEC $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    v = read_memory(cpu, addr_abs(log));
-    v--;
-    MEM_WRITE16(cpu, addr_abs(log), v);
-    update_nz(v);
-    break;
-  case 0xCF: // BBS4 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 16) != 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
+  }
+  coverage_routines[coverage_routine_count] = strndup(name, len);
+  return coverage_routine_count++;
+}
+
+int coverage_load_listing(char *filename, unsigned int offset)
+{
+  // Reads an ACME report file (acme -r), which has lines like
+  //
+  // ; ******** Source: dos.asm
+  //    123  8123 d003              	bne +
+  //    124                          dos_foo:
+  //
+  // Global labels (not .local or @cheap ones) start a new routine.
+  FILE *f = fopen(filename, "r");
+  if (!f) {
+    fprintf(logfile, "ERROR: Could not read listing from '%s'\n", filename);
+    return -1;
+  }
+  char line[1024];
+  int file = -1;
+  int routine = -1;
+  int lines = 0;
+  while (fgets(line, sizeof(line), f)) {
+    char source[1024];
+    int line_number, n;
+    if (sscanf(line, "; ******** Source: %1023[^\r\n]", source) == 1) {
+      file = -1;
+      for (int i = 0; i < coverage_file_count; i++)
+        if (!strcmp(coverage_files[i], source))
+          file = i;
+      if (file == -1) {
+        if (coverage_file_count == MAX_COVERAGE_FILES) {
+          fprintf(logfile, "ERROR: Too many source files. Increase MAX_COVERAGE_FILES.\n");
+          fclose(f);
+          return -1;
+        }
+        file = coverage_file_count++;
+        coverage_files[file] = strdup(source);
+      }
+      continue;
     }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0xd0: // BNE $rr
-    log->len = 2;
-    if (cpu->regs.flags & FLAG_Z)
-      cpu->regs.pc += 2;
-    else
-      cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
-    break;
-  case 0xD1: // CMP ($nn),Y
-    v = cpu->regs.a - read_memory(cpu, addr_izpy(cpu, log));
-    update_cmp_flags(v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xD2: // CMP ($nn),Z
-    v = cpu->regs.a - read_memory(cpu, addr_izpz(cpu, log));
-    update_cmp_flags(v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xD5: // CMP $nn,X
-    v = cpu->regs.a - read_memory(cpu, addr_zpx(cpu, log));
-    update_cmp_flags(v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xD6: // DEC $xx,X
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_zpx(cpu, log));
-    v--;
-    MEM_WRITE16(cpu, addr_zpx(cpu, log), v);
-    update_nz(v);
-    break;
-  case 0xD7: // SMB5 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) | 32;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xD8: // CLD
-    cpu->regs.flags &= ~FLAG_D;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xD9: // CMP $nnnn,Y
-    v = cpu->regs.a - read_memory(cpu, addr_absy(cpu, log));
-    update_cmp_flags(v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0xDA: // PHX
-    stack_push(cpu, cpu->regs.x);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xDB: // PHZ
-    stack_push(cpu, cpu->regs.z);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xDD: // CMP $nnnn,X
-    v = cpu->regs.a - read_memory(cpu, addr_absx(cpu, log));
-    update_cmp_flags(v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0xDE: // DEC $xxxx,X
-    log->len = 3;
-    cpu->regs.pc += 3;
-    v = read_memory(cpu, addr_absx(cpu, log));
-    v--;
-    MEM_WRITE16(cpu, addr_absx(cpu, log), v);
-    update_nz(v);
-    break;
-  case 0xDF: // BBS5 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 32) != 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
+    if (file == -1 || sscanf(line, "%d%n", &line_number, &n) != 1)
+      continue;
+
+    // The address and bytes follow the line number after two spaces, while
+    // lines that produced no bytes are padded out to the source column.
+    char *p = line + n;
+    int gap = strspn(p, " ");
+    p += gap;
+    char *end;
+    unsigned int addr = strtoul(p, &end, 16);
+    int hex_len = strspn(end + 1, "0123456789abcdefABCDEF");
+    bool has_bytes = gap <= 3 && end - p >= 4 && *end == ' ' && hex_len >= 2 && !(hex_len & 1);
+    unsigned char opcode = 0;
+    if (has_bytes) {
+      sscanf(end + 1, "%2hhx", &opcode);
+      p = end + 1 + hex_len;
+      if (!strncmp(p, "...", 3))
+        p += 3;
     }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0xE0: // CPX #$nn
-    v = cpu->regs.x - log->bytes[1];
-    update_cmp_flags(v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xe1: // SBC ($nn,X)
-    sbc(cpu, read_memory(cpu, addr_izpx(cpu, log)));
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xE4: // CPX $nn
-    v = cpu->regs.x - read_memory(cpu, addr_zp(cpu, log));
-    update_cmp_flags(v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xe5: // SBC $nn
-    sbc(cpu, read_memory(cpu, addr_zp(cpu, log)));
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xE6: // INC $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_zp(cpu, log));
-    v++;
-    v &= 0xff;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    update_nz(v);
-    break;
-  case 0xE7: // SMB6 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) | 64;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xE8: // INX
-    cpu->regs.x++;
-    update_nz(cpu->regs.x);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xe9: // SBC #$nn
-    sbc(cpu, log->bytes[1]);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xea: // EOM / NOP
-    cpu->regs.pc++;
-    cpu->regs.map_irq_inhibit = 0;
-    log->len = 1;
-    break;
-  case 0xEC: // CPX $nnnn
-    v = cpu->regs.x - read_memory(cpu, addr_abs(log));
-    update_cmp_flags(v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0xed: // SBC $nnnn
-    sbc(cpu, read_memory(cpu, addr_abs(log)));
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0xEE: // INC $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    v = read_memory(cpu, addr_abs(log));
-    v++;
-    MEM_WRITE16(cpu, addr_abs(log), v);
-    update_nz(v);
-    break;
-  case 0xEF: // BBS6 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 64) != 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
+
+    // Then the source line, starting with any label
+    p += strspn(p, " \t");
+    int token_len = strcspn(p, " \t:;=\r\n");
+    if (token_len && (isalpha(*p) || *p == '_') && !is_mnemonic(p, token_len)) {
+      char *after = p + token_len + strspn(p + token_len, " \t:");
+      if (*after != '=') {
+        routine = coverage_add_routine(p, token_len);
+        p = after;
+      }
     }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0xf0: // BEQ $rr
-    log->len = 2;
-    if (cpu->regs.flags & FLAG_Z)
-      cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
-    else
-      cpu->regs.pc += 2;
-    break;
-  case 0xf1: // SBC ($nn),Y
-    sbc(cpu, read_memory(cpu, addr_izpy(cpu, log)));
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xf2: // SBC ($nn),Z
-    sbc(cpu, read_memory(cpu, addr_izpz(cpu, log)));
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xf3: // BEQ $rrrr
-    log->len = 3;
-    if (cpu->regs.flags & FLAG_Z)
-      cpu->regs.pc += 3 + rel16_delta(log->bytes[1]);
-    else
-      cpu->regs.pc += 3;
-    break;
-  case 0xf5: // SBC $nn,X
-    sbc(cpu, read_memory(cpu, addr_zpx(cpu, log)));
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xf6: // INC $xx,X
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_zpx(cpu, log));
-    v++;
-    v &= 0xff;
-    MEM_WRITE16(cpu, addr_zpx(cpu, log), v);
-    update_nz(v);
-    break;
-  case 0xF7: // SMB7 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) | 128;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xf8: // SED
-    cpu->regs.flags |= FLAG_D;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xF9: // SBC $nnnn,Y
-    sbc(cpu, read_memory(cpu, addr_absy(cpu, log)));
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0xFA: // PLX
-    cpu->regs.x = stack_pop(cpu, log);
-    update_nz(cpu->regs.x);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xFB: // PLZ
-    cpu->regs.z = stack_pop(cpu, log);
-    update_nz(cpu->regs.z);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xFD: // SBC $nnnn,X
-    sbc(cpu, read_memory(cpu, addr_absx(cpu, log)));
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0xFE: // INC $xxxx,X
-    log->len = 3;
-    cpu->regs.pc += 3;
-    v = read_memory(cpu, addr_absx(cpu, log));
-    v++;
-    MEM_WRITE16(cpu, addr_absx(cpu, log), v);
-    update_nz(v);
-    break;
-  case 0xFF: // BBS7 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 128) != 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
+    else if (token_len && (*p == '.' || *p == '@'))
+      p += token_len + strspn(p + token_len, " \t:");
+
+    if (!has_bytes)
+      continue;
+    if (coverage_line_count == coverage_line_max) {
+      coverage_line_max = coverage_line_max ? 2 * coverage_line_max : 16384;
+      coverage_lines = realloc(coverage_lines, coverage_line_max * sizeof(coverage_line));
+      if (!coverage_lines) {
+        fprintf(stderr, "ERROR: Could not allocate memory for coverage listing.\n");
+        exit(-2);
+      }
     }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  default:
-    fprintf(stderr, "ERROR: Unimplemented opcode $%02X\n", log->bytes[0]);
-    log->len = 6;
-    return false;
+    coverage_line *l = &coverage_lines[coverage_line_count++];
+    l->addr = addr + offset;
+    l->file = file;
+    l->line = line_number;
+    l->routine = routine;
+    l->code = *p != '!';
+    l->branch = l->code && is_conditional_branch(opcode);
+    lines++;
   }
-  return true;
+  fclose(f);
+  fprintf(logfile, "INFO: Read %d lines with addresses from listing '%s'.\n", lines, filename);
+  return 0;
+}
+
+typedef struct coverage_count {
+  int instructions, executed;
+  int branches, both_ways;
+} coverage_count;
+
+void coverage_add(coverage_count *c, coverage_line *l)
+{
+  int i = coverage_offset(l->addr);
+  if (!l->code || i < 0)
+    return;
+  c->instructions++;
+  if (coverage_exec[i])
+    c->executed++;
+  if (l->branch) {
+    c->branches++;
+    if (coverage_taken[i] && coverage_not_taken[i])
+      c->both_ways++;
+  }
+}
+
+void coverage_print_count(FILE *f, coverage_count *c)
+{
+  fprintf(f, "%6d/%-6d %5.1f%%  %5d/%d\n", c->executed, c->instructions,
+      c->instructions ? 100.0 * c->executed / c->instructions : 0.0, c->both_ways, c->branches);
+}
+
+int coverage_report(char *filename)
+{
+  FILE *f = fopen(filename, "w");
+  if (!f) {
+    fprintf(logfile, "ERROR: Could not write coverage report to '%s'\n", filename);
+    return -1;
+  }
+
+  if (!coverage_line_count) {
+    // Without a listing, all we can show is what ran
+    fprintf(f, "Executed code (no listing loaded):\n");
+    for (int i = 0; i < COVERAGE_SIZE; i++) {
+      if (!coverage_exec[i])
+        continue;
+      int j = i;
+      while (j + 1 < COVERAGE_SIZE && coverage_exec[j + 1] && coverage_address(j + 1) == coverage_address(j) + 1)
+        j++;
+      char *label = describe_address_label28(&cpu, coverage_address(i));
+      fprintf(f, "  $%07x-$%07x  %5d bytes%s%s\n", coverage_address(i), coverage_address(j), j - i + 1,
+          label[0] ? "  " : "", label);
+      i = j;
+    }
+    fclose(f);
+    fprintf(logfile, "INFO: Wrote coverage report to '%s'\n", filename);
+    return 0;
+  }
+
+  coverage_count total = { 0 };
+  fprintf(f, "Coverage by file:                     Instructions executed  Branches both ways\n");
+  for (int file = 0; file < coverage_file_count; file++) {
+    coverage_count c = { 0 };
+    for (int i = 0; i < coverage_line_count; i++)
+      if (coverage_lines[i].file == file)
+        coverage_add(&c, &coverage_lines[i]);
+    if (!c.instructions)
+      continue;
+    fprintf(f, "  %-36s ", coverage_files[file]);
+    coverage_print_count(f, &c);
+    total.instructions += c.instructions;
+    total.executed += c.executed;
+    total.branches += c.branches;
+    total.both_ways += c.both_ways;
+  }
+  fprintf(f, "  %-36s ", "Total");
+  coverage_print_count(f, &total);
+
+  fprintf(f, "\nCoverage by routine:                  Instructions executed  Branches both ways\n");
+  for (int i = 0; i < coverage_line_count;) {
+    coverage_count c = { 0 };
+    int first = i;
+    for (; i < coverage_line_count && coverage_lines[i].routine == coverage_lines[first].routine; i++)
+      coverage_add(&c, &coverage_lines[i]);
+    if (!c.instructions)
+      continue;
+    fprintf(f, "  %-36s ", coverage_lines[first].routine < 0 ? "(none)" : coverage_routines[coverage_lines[first].routine]);
+    coverage_print_count(f, &c);
+  }
+
+  fprintf(f, "\nLines not fully covered:\n");
+  for (int i = 0; i < coverage_line_count; i++) {
+    coverage_line *l = &coverage_lines[i];
+    int o = coverage_offset(l->addr);
+    if (!l->code || o < 0)
+      continue;
+    char *what = NULL;
+    if (!coverage_exec[o])
+      what = "not executed";
+    else if (l->branch && !coverage_taken[o])
+      what = "branch never taken";
+    else if (l->branch && !coverage_not_taken[o])
+      what = "branch always taken";
+    if (what)
+      fprintf(f, "  %s:%d: $%07x %s\n", coverage_files[l->file], l->line, l->addr, what);
+  }
+
+  fclose(f);
+  fprintf(logfile, "INFO: Wrote coverage report to '%s'\n", filename);
+  return 0;
 }
 
 bool cpu_step(FILE *f)
@@ -4013,23 +4757,38 @@ bool cpu_step(FILE *f)
     return false;
   }
 
-  struct instruction_log *log = malloc(sizeof(instruction_log));
+  // Add instruction to the log
+  int log_index = cpulog_len;
+  cpu.instruction_count = log_index;
+  struct instruction_log *log = cpulog_append();
   log->regs = cpu.regs;
   log->pc = cpu.regs.pc;
   log->len = 0; // byte count of instruction
   log->count = 1;
   log->dup = 0;
 
-  // Add instruction to the log
-  cpu.instruction_count = cpulog_len;
-  cpulog[cpulog_len++] = log;
+  unsigned int pc28 = 0;
+  if (coverage)
+    pc28 = addr_to_28bit(&cpu, cpu.regs.pc, 0);
 
-  if (!execute_instruction(&cpu, log)) {
+  cpu_executing = true;
+  bool ok = execute_instruction(&cpu, log);
+  cpu_executing = false;
+  if (!ok) {
     cpu.term.error = true;
     fprintf(f, "ERROR: Exception occurred executing instruction at %s\n       Aborted.\n", describe_address(cpu.regs.pc));
     show_recent_instructions(f, "Instructions leading up to the exception", &cpu, cpulog_len - 16, 16, cpu.regs.pc);
     return false;
   }
+  unsigned int cycles = cpu_account_cycles(&cpu, log);
+  if (profiling)
+    profile_instruction(&cpu, log, cycles);
+  if (coverage)
+    coverage_instruction(&cpu, log, pc28);
+  if (trace_file)
+    trace_instruction(&cpu, log, log_index, cycles);
+  if (cpu.io_job)
+    io_tick(&cpu, cycles);
 
   // Ignore stack underflows/overflows if execution is complete, so that
   // terminal RTS doesn't cause a stack underflow error
@@ -4061,13 +4820,16 @@ bool cpu_step(FILE *f)
 
   // And to most recent instruction at this address, but only if the last instruction
   // there was not identical on all registers and instruction to this one
-  if (lastataddr[cpu.regs.pc] && identical_cpustates(lastataddr[cpu.regs.pc], log)) {
+  unsigned long long hash = cpustate_hash(log);
+  struct instruction_log *last = cpulog_entry(lastataddr[cpu.regs.pc]);
+  if (lastataddr[cpu.regs.pc] && last && lastathash[cpu.regs.pc] == hash) {
     // If identical, increase the count, so that we can keep track of infinite loops
-    lastataddr[cpu.regs.pc]->count++;
+    last->count++;
     log->dup = 1;
   }
   else {
-    lastataddr[cpu.regs.pc] = log;
+    lastataddr[cpu.regs.pc] = log_index;
+    lastathash[cpu.regs.pc] = hash;
   }
   return true;
 }
@@ -4081,7 +4843,7 @@ bool cpu_run(FILE *f)
   // Execute instructions until we empty the stack or hit a BRK
   // or various other nasty situations that we might allow, including
   // filling the CPU instruction log
-  while (cpulog_len < MAX_LOG_LENGTH) {
+  while (cpulog_len < cpulog_capacity()) {
     // Stop once the termination condition has been reached.
     if (cpu.term.done)
       break;
@@ -4089,13 +4851,15 @@ bool cpu_run(FILE *f)
     if (!cpu_step(f))
       return false;
     // Detect infinite loops
-    if (lastataddr[cpu.regs.pc]->count > INFINITE_LOOP_THRESHOLD) {
+    struct instruction_log *last = cpulog_entry(lastataddr[cpu.regs.pc]);
+    unsigned int threshold = loop_threshold[cpu.regs.pc] ? loop_threshold[cpu.regs.pc] : INFINITE_LOOP_THRESHOLD;
+    if (last && last->count > threshold) {
       cpu.term.error = true;
       fprintf(stderr, "ERROR: Infinite loop detected at %s.\n       Aborted after %d iterations.\n",
-          describe_address(cpu.regs.pc), lastataddr[cpu.regs.pc]->count);
+          describe_address(cpu.regs.pc), last->count);
       // Show upto 32 instructions prior to the infinite loop
       show_recent_instructions(stderr, "Instructions leading into the infinite loop for the first time", &cpu,
-          cpulog_len - lastataddr[cpu.regs.pc]->count - 30, 32, start_addr);
+          cpulog_len - last->count - 30, 32, start_addr);
       return false;
     }
   }
@@ -4126,14 +4890,31 @@ bool cpu_call_routine(FILE *f, unsigned int addr)
 
   // Reset the CPU instruction log
   cpu_log_reset();
+  cpu.cycles = 0;
+  cpu.time_ps = 0;
+  cpu.raster_line = 0;
+  cpu.raster_ps = 0;
+
+  if (trace_file)
+    trace_routine_call(addr);
+
+  if (profiling) {
+    // Attribute the routine to its own frame below the root
+    profile_depth = 1;
+    profile_lost_depth = 0;
+    profile_enter(addr_to_28bit(&cpu, addr, 0));
+  }
 
   cpu.regs.pc = addr;
   if (!cpu_run(f))
     return false;
 
-  if (cpulog_len == MAX_LOG_LENGTH) {
+  if (cpulog_len == cpulog_capacity()) {
     cpu.term.error = true;
-    fprintf(logfile, "ERROR: CPU instruction log filled.  Maybe a problem with the called routine?\n");
+    if (cpulog_ring)
+      fprintf(logfile, "ERROR: Routine did not return after %d instructions.\n", cpulog_len);
+    else
+      fprintf(logfile, "ERROR: CPU instruction log filled.  Maybe a problem with the called routine?\n");
     return false;
   }
   if (cpu.term.brk) {
@@ -4154,6 +4935,124 @@ bool cpu_call_routine(FILE *f, unsigned int addr)
   return true;
 }
 
+void undo_write(struct cpu *cpu, undo_entry *u)
+{
+  // Puts back what a write overwrote, without any of the side effects of
+  // the original write
+  unsigned char *mem, *dirty;
+  unsigned int *blame;
+  unsigned int offset;
+
+  if (u->addr == UNDO_FORCE_FAST) {
+    cpu->force_fast = u->value;
+    return;
+  }
+  if (u->addr >= 0xfff8000 && u->addr < 0xfffc000) {
+    offset = u->addr - 0xfff8000;
+    mem = hypporam;
+    blame = hypporam_blame;
+    dirty = hypporam_dirty;
+  }
+  else if (u->addr < CHIPRAM_SIZE) {
+    offset = u->addr;
+    mem = chipram;
+    blame = chipram_blame;
+    dirty = chipram_dirty;
+  }
+  else if (u->addr >= 0xff80000 && u->addr < (0xff80000 + COLOURRAM_SIZE)) {
+    offset = u->addr - 0xff80000;
+    mem = colourram;
+    blame = colourram_blame;
+    dirty = colourram_dirty;
+  }
+  else {
+    offset = u->addr - 0xffd0000;
+    mem = ffdram;
+    blame = ffdram_blame;
+    dirty = ffdram_dirty;
+  }
+  if (decode_pages[DECODE_PAGE(u->addr)])
+    decode_invalidate(u->addr);
+  mem[offset] = u->value;
+  blame[offset] = u->blame;
+  dirty[offset >> DIRTY_PAGE_BITS] = DIRTY_ALL;
+}
+
+bool cpu_rewind(struct cpu *cpu, int instruction)
+{
+  // Restores memory and registers to how they were just before the given
+  // instruction in the log executed, and discards the log from there on,
+  // so that stepping or running continues from that point.
+  if (instruction == cpulog_len)
+    return true;
+  struct instruction_log *log = cpulog_entry(instruction);
+  if (!log) {
+    fprintf(logfile, "ERROR: Cannot rewind to I%d, which is not in the instruction log.\n", instruction);
+    return false;
+  }
+  if (!undo_logging || instruction < undo_since) {
+    fprintf(logfile, "ERROR: Cannot rewind to I%d, which ran without 'undo log on'.\n", instruction);
+    return false;
+  }
+  if (undo_overflow) {
+    fprintf(logfile, "ERROR: Cannot rewind, because the undo log filled.\n");
+    return false;
+  }
+
+  int undone = 0;
+  while (undo_len > undo_first && undo_log_entry(undo_len - 1)->instruction >= instruction) {
+    undo_write(cpu, undo_log_entry(undo_len - 1));
+    undo_len--;
+    undone++;
+  }
+
+  cpu->regs = log->regs;
+  cpu->map_valid = false;
+  cpu->instruction_count = instruction;
+  cpulog_len = instruction;
+  for (int i = 0; i < 65536; i++)
+    if (lastataddr[i] >= instruction)
+      lastataddr[i] = 0;
+
+  fprintf(logfile, "INFO: Rewound to I%d at %s @ $%04x (%d writes undone)\n", instruction,
+      describe_address_label(cpu, cpu->regs.pc), cpu->regs.pc, undone);
+  return true;
+}
+
+bool cpu_rewind_until_changed(struct cpu *cpu, unsigned int addr)
+{
+  // Rewinds to just before the most recent instruction that changed the
+  // byte at the given 28-bit address.  Writes that stored the value that
+  // was already there don't count.
+  unsigned char value = read_memory28(cpu, addr);
+  if (!undo_logging) {
+    fprintf(logfile, "ERROR: Cannot rewind without 'undo log on'.\n");
+    return false;
+  }
+  for (int i = undo_len - 1; i >= undo_first; i--) {
+    undo_entry *u = undo_log_entry(i);
+    if (u->addr != addr)
+      continue;
+    if (u->value == value)
+      continue;
+    int instruction = u->instruction;
+    if (instruction >= cpulog_len) {
+      fprintf(logfile, "ERROR: $%07x was last changed by the test script, not by an instruction.\n", addr);
+      return false;
+    }
+    if (!cpulog_entry(instruction)) {
+      fprintf(logfile, "ERROR: $%07x was last changed by I%d, which is no longer in the log.\n", addr, instruction);
+      return false;
+    }
+    fprintf(logfile, "INFO: $%07x changed from $%02x to $%02x at I%d: ", addr, u->value, value, instruction);
+    disassemble_logged_instruction(logfile, instruction, true);
+    fprintf(logfile, "\n");
+    return cpu_rewind(cpu, instruction);
+  }
+  fprintf(logfile, "ERROR: $%07x has not changed since the instruction log began.\n", addr);
+  return false;
+}
+
 #define COMPARE_FLAG(FLAG, Flag)                                                                                            \
   if (cpu->regs.Flag != cpu_expected.regs.Flag) {                                                                           \
     fprintf(f, "ERROR: Flag %s is %s instead of %s\n", FLAG, cpu->regs.Flag ? "set" : "clear",                              \
@@ -4195,43 +5094,79 @@ bool compare_register_contents(FILE *f, struct cpu *cpu)
   return cpu->term.error;
 }
 
+void ignore_ram_change(unsigned char *mem, unsigned char *expected, unsigned char *dirty, unsigned int offset)
+{
+  if (expected[offset] != mem[offset]) {
+    expected[offset] = mem[offset];
+    dirty[offset >> DIRTY_PAGE_BITS] |= DIRTY_SNAPSHOT;
+  }
+}
+
 int ignore_ram_changes(unsigned int low, unsigned int high)
 {
   for (int i = low; i <= high; i++) {
-    if (i < CHIPRAM_SIZE) {
-      //      if (chipram_expected[i]!=chipram[i]) fprintf(logfile,"NOTE: Ignoring mutated value at $%x\n",i);
-      chipram_expected[i] = chipram[i];
-    }
+    if (i < CHIPRAM_SIZE)
+      ignore_ram_change(chipram, chipram_expected, chipram_dirty, i);
     if (i >= 0xfff8000 && i < 0xfffc000)
-      hypporam_expected[i - 0xfff8000] = hypporam[i - 0xfff8000];
+      ignore_ram_change(hypporam, hypporam_expected, hypporam_dirty, i - 0xfff8000);
+    if (i >= 0xff80000 && i < (0xff80000 + COLOURRAM_SIZE))
+      ignore_ram_change(colourram, colourram_expected, colourram_dirty, i - 0xff80000);
+    if ((i & 0xfff0000) == 0xffd0000)
+      ignore_ram_change(ffdram, ffdram_expected, ffdram_dirty, i - 0xffd0000);
   }
   return 0;
 }
 
-int compare_ram_contents(FILE *f, struct cpu *cpu)
+int count_region_differences(unsigned char *mem, unsigned char *expected, unsigned char *dirty, unsigned int size)
 {
   int errors = 0;
-
-  for (int i = 0; i < CHIPRAM_SIZE; i++) {
-    if (chipram[i] != chipram_expected[i]) {
-      errors++;
-    }
-  }
-  for (int i = 0; i < HYPPORAM_SIZE; i++) {
-    if (hypporam[i] != hypporam_expected[i]) {
-      errors++;
-    }
-  }
-  for (int i = 0; i < COLOURRAM_SIZE; i++) {
-    if (colourram[i] != colourram_expected[i]) {
-      errors++;
+  for (int page = 0; page < (size >> DIRTY_PAGE_BITS); page++) {
+    if (!(dirty[page] & DIRTY_EXPECTED))
+      continue;
+    int page_errors = 0;
+    for (int i = page << DIRTY_PAGE_BITS; i < ((page + 1) << DIRTY_PAGE_BITS); i++) {
+      if (mem[i] != expected[i])
+        page_errors++;
     }
+    // Now known to match, so it needn't be checked again until written
+    if (!page_errors)
+      dirty[page] &= ~DIRTY_EXPECTED;
+    errors += page_errors;
   }
-  for (int i = 0; i < 65536; i++) {
-    if (ffdram[i] != ffdram_expected[i]) {
-      errors++;
+  return errors;
+}
+
+void show_region_differences(FILE *f, struct cpu *cpu, unsigned char *mem, unsigned char *expected, unsigned int *blame,
+    unsigned char *dirty, unsigned int size, unsigned int base, int *displayed)
+{
+  for (int page = 0; page < (size >> DIRTY_PAGE_BITS); page++) {
+    if (!(dirty[page] & DIRTY_EXPECTED))
+      continue;
+    for (int i = page << DIRTY_PAGE_BITS; i < ((page + 1) << DIRTY_PAGE_BITS); i++) {
+      if (*displayed >= 100)
+        return;
+      if (mem[i] != expected[i]) {
+        fprintf(f, "ERROR: Saw $%02X at $%07x (%s), but expected to see $%02X\n", mem[i], i + base,
+            describe_address_label28(cpu, i + base), expected[i]);
+        int first_instruction = blame[i] - 3;
+        if (first_instruction < 0)
+          first_instruction = 0;
+        show_recent_instructions(f, "Instructions leading to this value being written", cpu, first_instruction, 4, -1);
+        (*displayed)++;
+      }
     }
   }
+}
+
+int compare_ram_contents(FILE *f, struct cpu *cpu)
+{
+  int errors = 0;
+
+  // Only pages written since they last matched can differ
+  errors += count_region_differences(chipram, chipram_expected, chipram_dirty, CHIPRAM_SIZE);
+  errors += count_region_differences(hypporam, hypporam_expected, hypporam_dirty, HYPPORAM_SIZE);
+  errors += count_region_differences(colourram, colourram_expected, colourram_dirty, COLOURRAM_SIZE);
+  errors += count_region_differences(ffdram, ffdram_expected, ffdram_dirty, 65536);
 
   if (errors) {
     fprintf(f, "ERROR: %d memory locations contained unexpected values.\n", errors);
@@ -4239,59 +5174,16 @@ int compare_ram_contents(FILE *f, struct cpu *cpu)
 
     int displayed = 0;
 
-    for (int i = 0; i < CHIPRAM_SIZE; i++) {
-      if (chipram[i] != chipram_expected[i]) {
-        fprintf(f, "ERROR: Saw $%02X at $%07x (%s), but expected to see $%02X\n", chipram[i], i,
-            describe_address_label28(cpu, i), chipram_expected[i]);
-        int first_instruction = chipram_blame[i] - 3;
-        if (first_instruction < 0)
-          first_instruction = 0;
-        show_recent_instructions(f, "Instructions leading to this value being written", cpu, first_instruction, 4, -1);
-        displayed++;
-      }
-      if (displayed >= 100)
-        break;
-    }
-    for (int i = 0; i < HYPPORAM_SIZE; i++) {
-      if (hypporam[i] != hypporam_expected[i]) {
-        fprintf(f, "ERROR: Saw $%02X at $%07x (%s), but expected to see $%02x\n", hypporam[i], i + 0xfff8000,
-            describe_address_label28(cpu, i + 0xfff8000), hypporam_expected[i]);
-        int first_instruction = hypporam_blame[i] - 3;
-        if (first_instruction < 0)
-          first_instruction = 0;
-        show_recent_instructions(f, "Instructions leading to this value being written", cpu, first_instruction, 4, -1);
-      }
-      if (displayed >= 100)
-        break;
-    }
-    for (int i = 0; i < COLOURRAM_SIZE; i++) {
-      if (colourram[i] != colourram_expected[i]) {
-        fprintf(f, "ERROR: Saw $%02X at $%07x (%s), but expected to see $%02X\n", colourram[i], i + 0xff80000,
-            describe_address_label28(cpu, i + 0xff80000), colourram_expected[i]);
-        int first_instruction = colourram_blame[i] - 3;
-        if (first_instruction < 0)
-          first_instruction = 0;
-        show_recent_instructions(f, "Instructions leading to this value being written", cpu, first_instruction, 4, -1);
-        displayed++;
-      }
-      if (displayed >= 100)
-        break;
-    }
-    for (int i = 0; i < 65536; i++) {
-      if (ffdram[i] != ffdram_expected[i]) {
-        fprintf(f, "ERROR: Saw $%02X at $%07x (%s), but expected to see $%02X\n", ffdram[i], i + 0xffd0000,
-            describe_address_label28(cpu, i + 0xffd0000), ffdram_expected[i]);
-        int first_instruction = ffdram_blame[i] - 3;
-        if (first_instruction < 0)
-          first_instruction = 0;
-        show_recent_instructions(f, "Instructions leading to this value being written", cpu, first_instruction, 4, -1);
-        displayed++;
-      }
-      if (displayed >= 100)
-        break;
-    }
-    if (displayed > 100) {
-      fprintf(f, "WARNING: Displayed only the first 100 incorrect memory contents. %d more suppressed.\n", errors - 100);
+    show_region_differences(
+        f, cpu, chipram, chipram_expected, chipram_blame, chipram_dirty, CHIPRAM_SIZE, 0, &displayed);
+    show_region_differences(
+        f, cpu, hypporam, hypporam_expected, hypporam_blame, hypporam_dirty, HYPPORAM_SIZE, 0xfff8000, &displayed);
+    show_region_differences(f, cpu, colourram, colourram_expected, colourram_blame, colourram_dirty, COLOURRAM_SIZE,
+        0xff80000, &displayed);
+    show_region_differences(f, cpu, ffdram, ffdram_expected, ffdram_blame, ffdram_dirty, 65536, 0xffd0000, &displayed);
+    if (errors > displayed) {
+      fprintf(f, "WARNING: Displayed only the first %d incorrect memory contents. %d more suppressed.\n", displayed,
+          errors - displayed);
     }
   }
   return errors;
@@ -4305,6 +5197,23 @@ unsigned char viciv_regs[0x80] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0
   0x00, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x90, 0x00, 0x00, 0xF8, 0x07, 0x00, 0x00, 0xFF, 0x00, 0x00, 0x01,
   0x00, 0x00, 0x00, 0x00, 0x00, 0x37, 0x81, 0x18, 0xC2, 0x00, 0x00, 0x7F };
 
+void reset_region(unsigned char *mem, unsigned char *expected, unsigned char *dirty, unsigned int size)
+{
+  // Clears current and expected memory, which then match.  Only pages that
+  // were not already clear count as written since the last snapshot, so that
+  // restoring one at the start of a test copies just what it needs to.
+  static const unsigned char zero[DIRTY_PAGE_SIZE];
+  for (int page = 0; page < (size >> DIRTY_PAGE_BITS); page++) {
+    unsigned int ofs = page << DIRTY_PAGE_BITS;
+    if (memcmp(&mem[ofs], zero, DIRTY_PAGE_SIZE) || memcmp(&expected[ofs], zero, DIRTY_PAGE_SIZE)) {
+      bzero(&mem[ofs], DIRTY_PAGE_SIZE);
+      bzero(&expected[ofs], DIRTY_PAGE_SIZE);
+      dirty[page] |= DIRTY_SNAPSHOT;
+    }
+    dirty[page] &= ~DIRTY_EXPECTED;
+  }
+}
+
 void machine_init(struct cpu *cpu)
 {
   // Initialise CPU staet
@@ -4324,11 +5233,14 @@ void machine_init(struct cpu *cpu)
   cpu_expected.regs.flags = FLAG_E | FLAG_I;
 
   // Clear chip RAM
-  bzero(chipram_expected, CHIPRAM_SIZE);
+  // (the actual memory as well as the expected, so that each test starts
+  // from the same state, whether it runs after other tests or in a worker)
+  reset_region(chipram, chipram_expected, chipram_dirty, CHIPRAM_SIZE);
   // Clear Hypervisor RAM
-  bzero(hypporam_expected, HYPPORAM_SIZE);
-  bzero(colourram_expected, COLOURRAM_SIZE);
-  bzero(ffdram_expected, 65536);
+  reset_region(hypporam, hypporam_expected, hypporam_dirty, HYPPORAM_SIZE);
+  reset_region(colourram, colourram_expected, colourram_dirty, COLOURRAM_SIZE);
+  reset_region(ffdram, ffdram_expected, ffdram_dirty, 65536);
+  decode_cache_flush();
 
   // Setup default VIC-IV register values
   for (int i = 0; i < 0x80; i++) {
@@ -4336,11 +5248,19 @@ void machine_init(struct cpu *cpu)
     ffdram_expected[0x3000 + i] = viciv_regs[i];
   }
 
+  // $D710 CPU timing control reset value: badline emulation with 43 cycle
+  // badlines, and taken branches charged an extra cycle
+  ffdram[0x3710] = 0x3b;
+  ffdram_expected[0x3710] = 0x3b;
+
   // Set CPU IO port $01
   chipram_expected[0] = 0x3f;
   chipram_expected[1] = 0x27;
   chipram[0] = 0x3f;
   chipram[1] = 0x27;
+  chipram_dirty[0] |= DIRTY_SNAPSHOT;
+  ffdram_dirty[0x30] |= DIRTY_SNAPSHOT;
+  ffdram_dirty[0x37] |= DIRTY_SNAPSHOT;
 
   // Reset blame for contents of memory
   bzero(chipram_blame, sizeof(chipram_blame));
@@ -4351,13 +5271,13 @@ void machine_init(struct cpu *cpu)
     free(hyppo_symbols[i].name);
   }
   hyppo_symbol_count = 0;
+  symbol_index_invalidate(&hyppo_symbol_index);
 
   // Reset instruction logs
-  for (int i = 0; i < cpulog_len; i++) {
-    free(cpulog[i]);
-  }
   cpulog_len = 0;
+  cpulog_ring = cpulog_limit;
   bzero(lastataddr, sizeof(lastataddr));
+  undo_log_reset();
 }
 
 void test_init(struct cpu *cpu)
@@ -4368,6 +5288,12 @@ void test_init(struct cpu *cpu)
   fail_on_stack_overflow = true;
   fail_on_stack_underflow = true;
   log_on_failure = false;
+  undo_logging = false;
+  expected_failure[0] = 0;
+  profiling = false;
+  profile_reset();
+  dma_job_count = 0;
+  dma_jobs_lost = 0;
 
   for (int i = 0; i < hyppo_symbol_count; i++)
     free(hyppo_symbols[i].name);
@@ -4378,15 +5304,23 @@ void test_init(struct cpu *cpu)
     free(symbols[i].name);
   bzero(symbols, sizeof(symbols));
   symbol_count = 0;
+  symbol_index_invalidate(&hyppo_symbol_index);
+  symbol_index_invalidate(&symbol_index_all);
 
   bzero(breakpoints, sizeof(breakpoints));
+  bzero(loop_threshold, sizeof(loop_threshold));
+  watch_clear_all();
+  sdcard.reads = 0;
+  sdcard.cache_hits = 0;
+  sdcard.writes = 0;
 
   // Log to temporary file, so that we can rename it to PASS.* or FAIL.*
   // after.
-  unlink(TESTLOGFILE);
-  logfile = fopen(TESTLOGFILE, "w");
+  snprintf(testlogfile, sizeof(testlogfile), TESTLOGFILE_PATTERN, (int)getpid());
+  unlink(testlogfile);
+  logfile = fopen(testlogfile, "w");
   if (!logfile) {
-    fprintf(stderr, "ERROR: Could not write to '%s'\n", TESTLOGFILE);
+    fprintf(stderr, "ERROR: Could not write to '%s'\n", testlogfile);
     exit(-2);
   }
 
@@ -4401,8 +5335,14 @@ void test_init(struct cpu *cpu)
     safe_name[strlen(test_name)] = 0;
   }
 
-  // Show starting of test
-  printf("[    ] %s", test_name);
+  // Show starting of test (workers only report the result, so that
+  // concurrent tests don't garble each other's progress lines)
+  if (!test_worker)
+    printf("[    ] %s", test_name);
+
+  in_test = true;
+  if (trace_every_test)
+    trace_open_for_test();
 }
 
 void test_conclude(struct cpu *cpu)
@@ -4415,8 +5355,28 @@ void test_conclude(struct cpu *cpu)
   snprintf(cmd, 8192, "PASS.%s", safe_name);
   unlink(cmd);
 
+  snprintf(cmd, 8192, "FAIL.%s.trace", safe_name);
+  unlink(cmd);
+  if (expected_failure[0]) {
+    bool found = false;
+    fflush(logfile);
+    FILE *f = fopen(testlogfile, "r");
+    if (f) {
+      found = output_contains(f, expected_failure);
+      fclose(f);
+    }
+    if (cpu->term.error && found)
+      fprintf(logfile, "INFO: Test failed with \"%s\", as expected\n", expected_failure);
+    else
+      fprintf(logfile, "ERROR: Test was expected to fail with \"%s\"\n", expected_failure);
+    cpu->term.error = !(cpu->term.error && found);
+  }
+  if (cpu->term.log_dma && dma_job_count)
+    dma_report(logfile);
+  trace_close(cpu->term.error);
+
   if (cpu->term.error) {
-    snprintf(cmd, 8192, "mv %s FAIL.%s", TESTLOGFILE, safe_name);
+    snprintf(cmd, 8192, "mv %s FAIL.%s", testlogfile, safe_name);
     test_fails++;
     if (log_on_failure) {
       if (cpulog_len < 500000)
@@ -4431,7 +5391,7 @@ void test_conclude(struct cpu *cpu)
     printf("\r[FAIL] %s\n", test_name);
   }
   else {
-    snprintf(cmd, 8192, "mv %s PASS.%s", TESTLOGFILE, safe_name);
+    snprintf(cmd, 8192, "mv %s PASS.%s", testlogfile, safe_name);
     test_passes++;
 
     //    show_recent_instructions(logfile,"Complete instruction log follows",cpu,1,cpulog_len,-1);
@@ -4445,6 +5405,7 @@ void test_conclude(struct cpu *cpu)
   }
 
   logfile = stderr;
+  in_test = false;
 }
 
 int load_hyppo(char *filename)
@@ -4455,6 +5416,8 @@ int load_hyppo(char *filename)
     return -1;
   }
   int b = fread(hypporam, 1, HYPPORAM_SIZE, f);
+  decode_cache_flush();
+  memset(hypporam_dirty, DIRTY_ALL, sizeof(hypporam_dirty));
   if (b != HYPPORAM_SIZE) {
     fprintf(logfile, "ERROR: Read only %d of %d bytes from HICKUP file.\n", b, HYPPORAM_SIZE);
     return -1;
@@ -4502,6 +5465,7 @@ int load_hyppo_symbols(char *filename)
       hyppo_symbols[hyppo_symbol_count].name = strdup(sym);
       hyppo_symbols[hyppo_symbol_count].addr = addr;
       sym_by_addr[addr] = &hyppo_symbols[hyppo_symbol_count];
+      symbol_index_add(&hyppo_symbol_index, hyppo_symbol_count);
       hyppo_symbol_count++;
     }
     line[0] = 0;
@@ -4535,6 +5499,7 @@ int load_symbols(char *filename, unsigned int offset)
       if (addr + offset < CHIPRAM_SIZE) {
         sym_by_addr[addr + offset] = &symbols[symbol_count];
       }
+      symbol_index_add(&symbol_index_all, symbol_count);
       symbol_count++;
     }
     else if (sscanf(line, "al %x %s", &addr, sym) == 2) {
@@ -4548,13 +5513,247 @@ int load_symbols(char *filename, unsigned int offset)
       if (addr + offset < CHIPRAM_SIZE) {
         sym_by_addr[addr + offset] = &symbols[symbol_count];
       }
+      symbol_index_add(&symbol_index_all, symbol_count);
       symbol_count++;
     }
     line[0] = 0;
     fgets(line, 1024, f);
   }
-  fclose(f);
-  fprintf(logfile, "INFO: Read %d symbols.\n", symbol_count);
+  fclose(f);
+  fprintf(logfile, "INFO: Read %d symbols.\n", symbol_count);
+  return 0;
+}
+
+// Snapshots of machine state, so that an expensive common prefix (e.g.,
+// loading and booting the hypervisor) only has to be run once.  Memory is
+// held in 4KB pages, and pages that have not been written (DIRTY_SNAPSHOT)
+// since the snapshot that was last saved or restored are shared with it
+// rather than copied.
+#define SNAPSHOT_PAGE_SIZE 4096
+typedef struct snapshot_page {
+  int refs;
+  unsigned char data[SNAPSHOT_PAGE_SIZE];
+} snapshot_page;
+
+// The current memory regions come first, then what is expected of them
+struct snapshot_region {
+  unsigned char *mem;
+  unsigned char *dirty;
+  unsigned int size;
+} snapshot_regions[] = {
+  { chipram, chipram_dirty, CHIPRAM_SIZE },
+  { hypporam, hypporam_dirty, HYPPORAM_SIZE },
+  { colourram, colourram_dirty, COLOURRAM_SIZE },
+  { ffdram, ffdram_dirty, 65536 },
+  { chipram_expected, chipram_dirty, CHIPRAM_SIZE },
+  { hypporam_expected, hypporam_dirty, HYPPORAM_SIZE },
+  { colourram_expected, colourram_dirty, COLOURRAM_SIZE },
+  { ffdram_expected, ffdram_dirty, 65536 },
+};
+#define SNAPSHOT_REGIONS (sizeof(snapshot_regions) / sizeof(snapshot_regions[0]))
+#define SNAPSHOT_PAGES ((2 * (CHIPRAM_SIZE + HYPPORAM_SIZE + COLOURRAM_SIZE + 65536)) / SNAPSHOT_PAGE_SIZE)
+#define SNAPSHOT_DIRTY_PAGES ((CHIPRAM_SIZE + HYPPORAM_SIZE + COLOURRAM_SIZE + 65536) >> DIRTY_PAGE_BITS)
+
+typedef struct snapshot {
+  char *name;
+  struct cpu cpu;
+  struct cpu cpu_expected;
+  snapshot_page *pages[SNAPSHOT_PAGES];
+  // Pages where current and expected memory might differ
+  unsigned char dirty[SNAPSHOT_DIRTY_PAGES];
+  unsigned char breakpoints[65536];
+  int hyppo_symbol_count;
+  hyppo_symbol *hyppo_symbols;
+  int symbol_count;
+  hyppo_symbol *symbols;
+} snapshot;
+
+#define MAX_SNAPSHOTS 64
+snapshot *snapshots[MAX_SNAPSHOTS];
+int snapshot_count = 0;
+snapshot *last_snapshot = NULL;
+
+hyppo_symbol *snapshot_copy_symbols(hyppo_symbol *from, int count)
+{
+  hyppo_symbol *to = malloc(count * sizeof(hyppo_symbol) + 1);
+  for (int i = 0; i < count; i++) {
+    to[i].name = strdup(from[i].name);
+    to[i].addr = from[i].addr;
+  }
+  return to;
+}
+
+bool snapshot_page_written(struct snapshot_region *region, unsigned int ofs)
+{
+  for (int page = ofs >> DIRTY_PAGE_BITS; page < (ofs + SNAPSHOT_PAGE_SIZE) >> DIRTY_PAGE_BITS; page++)
+    if (region->dirty[page] & DIRTY_SNAPSHOT)
+      return true;
+  return false;
+}
+
+void snapshot_mark_clean(void)
+{
+  // Memory now matches the last snapshot
+  for (int r = 0; r < SNAPSHOT_REGIONS / 2; r++)
+    for (int page = 0; page < (snapshot_regions[r].size >> DIRTY_PAGE_BITS); page++)
+      snapshot_regions[r].dirty[page] &= ~DIRTY_SNAPSHOT;
+}
+
+void snapshot_free(snapshot *snap)
+{
+  for (int i = 0; i < SNAPSHOT_PAGES; i++) {
+    if (!--snap->pages[i]->refs)
+      free(snap->pages[i]);
+  }
+  for (int i = 0; i < snap->hyppo_symbol_count; i++)
+    free(snap->hyppo_symbols[i].name);
+  free(snap->hyppo_symbols);
+  for (int i = 0; i < snap->symbol_count; i++)
+    free(snap->symbols[i].name);
+  free(snap->symbols);
+  free(snap->name);
+  free(snap);
+}
+
+int snapshot_save(char *name)
+{
+  snapshot *snap = calloc(1, sizeof(snapshot));
+  if (!snap) {
+    fprintf(logfile, "ERROR: Could not allocate memory for snapshot '%s'\n", name);
+    return -1;
+  }
+  snap->name = strdup(name);
+  snap->cpu = cpu;
+  snap->cpu_expected = cpu_expected;
+  bcopy(breakpoints, snap->breakpoints, sizeof(breakpoints));
+
+  int page = 0, shared = 0;
+  for (int r = 0; r < SNAPSHOT_REGIONS; r++) {
+    for (int ofs = 0; ofs < snapshot_regions[r].size; ofs += SNAPSHOT_PAGE_SIZE, page++) {
+      unsigned char *mem = &snapshot_regions[r].mem[ofs];
+      if (last_snapshot && !snapshot_page_written(&snapshot_regions[r], ofs)) {
+        snap->pages[page] = last_snapshot->pages[page];
+        shared++;
+      }
+      else {
+        snap->pages[page] = malloc(sizeof(snapshot_page));
+        if (!snap->pages[page]) {
+          fprintf(logfile, "ERROR: Could not allocate memory for snapshot '%s'\n", name);
+          exit(-2);
+        }
+        snap->pages[page]->refs = 0;
+        bcopy(mem, snap->pages[page]->data, SNAPSHOT_PAGE_SIZE);
+      }
+      snap->pages[page]->refs++;
+    }
+  }
+  page = 0;
+  for (int r = 0; r < SNAPSHOT_REGIONS / 2; r++) {
+    for (int i = 0; i < (snapshot_regions[r].size >> DIRTY_PAGE_BITS); i++)
+      snap->dirty[page++] = snapshot_regions[r].dirty[i] & DIRTY_EXPECTED;
+  }
+
+  snap->hyppo_symbol_count = hyppo_symbol_count;
+  snap->hyppo_symbols = snapshot_copy_symbols(hyppo_symbols, hyppo_symbol_count);
+  snap->symbol_count = symbol_count;
+  snap->symbols = snapshot_copy_symbols(symbols, symbol_count);
+
+  // Replace any existing snapshot of the same name
+  int i;
+  for (i = 0; i < snapshot_count; i++)
+    if (!strcmp(snapshots[i]->name, name))
+      break;
+  if (i == MAX_SNAPSHOTS) {
+    fprintf(logfile, "ERROR: Too many snapshots. Increase MAX_SNAPSHOTS.\n");
+    snapshot_free(snap);
+    return -1;
+  }
+  if (i < snapshot_count) {
+    if (last_snapshot == snapshots[i])
+      last_snapshot = NULL;
+    snapshot_free(snapshots[i]);
+  }
+  else
+    snapshot_count++;
+  snapshots[i] = snap;
+  last_snapshot = snap;
+  snapshot_mark_clean();
+
+  fprintf(logfile, "INFO: Saved snapshot '%s' (%d of %d pages shared with previous snapshot)\n", name, shared,
+      (int)SNAPSHOT_PAGES);
+  return 0;
+}
+
+int snapshot_restore(char *name)
+{
+  snapshot *snap = NULL;
+  for (int i = 0; i < snapshot_count; i++)
+    if (!strcmp(snapshots[i]->name, name))
+      snap = snapshots[i];
+  if (!snap) {
+    fprintf(logfile, "ERROR: No snapshot named '%s'\n", name);
+    return -1;
+  }
+
+  // Only pages that were written since the last snapshot, or that differ
+  // between it and this one, need to be copied back
+  int page = 0, copied = 0;
+  for (int r = 0; r < SNAPSHOT_REGIONS; r++) {
+    for (int ofs = 0; ofs < snapshot_regions[r].size; ofs += SNAPSHOT_PAGE_SIZE, page++) {
+      if (last_snapshot && last_snapshot->pages[page] == snap->pages[page]
+          && !snapshot_page_written(&snapshot_regions[r], ofs))
+        continue;
+      bcopy(snap->pages[page]->data, &snapshot_regions[r].mem[ofs], SNAPSHOT_PAGE_SIZE);
+      copied++;
+    }
+  }
+  decode_cache_flush();
+
+  // Keep any error already seen in this test
+  struct termination_conditions term = cpu.term;
+  cpu = snap->cpu;
+  cpu.term = term;
+  cpu_expected = snap->cpu_expected;
+  bcopy(snap->breakpoints, breakpoints, sizeof(breakpoints));
+
+  // Current and expected memory differ where they did when it was saved
+  page = 0;
+  for (int r = 0; r < SNAPSHOT_REGIONS / 2; r++) {
+    for (int i = 0; i < (snapshot_regions[r].size >> DIRTY_PAGE_BITS); i++)
+      snapshot_regions[r].dirty[i] = snap->dirty[page++];
+  }
+
+  // The instruction log isn't part of the snapshot, so nothing can be blamed
+  bzero(chipram_blame, sizeof(chipram_blame));
+  bzero(hypporam_blame, sizeof(hypporam_blame));
+  bzero(colourram_blame, sizeof(colourram_blame));
+  bzero(ffdram_blame, sizeof(ffdram_blame));
+  cpu_log_reset();
+
+  for (int i = 0; i < hyppo_symbol_count; i++)
+    free(hyppo_symbols[i].name);
+  for (int i = 0; i < symbol_count; i++)
+    free(symbols[i].name);
+  bzero(sym_by_addr, sizeof(sym_by_addr));
+  hyppo_symbol_count = snap->hyppo_symbol_count;
+  for (int i = 0; i < hyppo_symbol_count; i++) {
+    hyppo_symbols[i].name = strdup(snap->hyppo_symbols[i].name);
+    hyppo_symbols[i].addr = snap->hyppo_symbols[i].addr;
+    if (hyppo_symbols[i].addr < CHIPRAM_SIZE)
+      sym_by_addr[hyppo_symbols[i].addr] = &hyppo_symbols[i];
+  }
+  symbol_count = snap->symbol_count;
+  for (int i = 0; i < symbol_count; i++) {
+    symbols[i].name = strdup(snap->symbols[i].name);
+    symbols[i].addr = snap->symbols[i].addr;
+    if (symbols[i].addr < CHIPRAM_SIZE)
+      sym_by_addr[symbols[i].addr] = &symbols[i];
+  }
+  symbol_index_invalidate(&hyppo_symbol_index);
+  symbol_index_invalidate(&symbol_index_all);
+
+  last_snapshot = snap;
+  fprintf(logfile, "INFO: Restored snapshot '%s' (%d of %d pages copied)\n", name, copied, (int)SNAPSHOT_PAGES);
   return 0;
 }
 
@@ -4592,32 +5791,25 @@ int resolve_value32(char *in)
   if (label[v] == ',')
     label[v] = 0;
 
-  int i;
-  for (i = 0; i < hyppo_symbol_count; i++) {
-    if (!strcmp(label, hyppo_symbols[i].name))
-      break;
-  }
-  if (i == hyppo_symbol_count) {
+  hyppo_symbol *s = symbol_index_find(&hyppo_symbol_index, label);
+  if (!s) {
 
     // Now look for non-hyppo symbols
-    for (i = 0; i < symbol_count; i++) {
-      if (!strcmp(label, symbols[i].name))
-        break;
-    }
-    if (i == symbol_count) {
+    s = symbol_index_find(&symbol_index_all, label);
+    if (!s) {
       fprintf(logfile, "ERROR: Cannot call find non-existent symbol '%s'\n", label);
       cpu.term.error = true;
       return 0;
     }
     else {
       // Return symbol address
-      v = symbols[i].addr + delta;
+      v = s->addr + delta;
       return v;
     }
   }
   else {
     // Add HYPPO base address to HYPPO symbols
-    v = 0xfff0000 + hyppo_symbols[i].addr + delta;
+    v = 0xfff0000 + s->addr + delta;
     return v;
   }
 }
@@ -4722,15 +5914,119 @@ cleanup:
   free(sym_file_name);
 }
 
-int main(int argc, char **argv)
+void run_script(FILE *f, const char *test_target);
+
+void wait_for_test_worker(void)
+{
+  int status;
+  if (wait(&status) == -1) {
+    perror("wait");
+    exit(-2);
+  }
+  running_jobs--;
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    test_passes++;
+  else
+    test_fails++;
+}
+
+void start_test_worker(FILE *f)
 {
-  if (argc < 2 || argc > 3) {
-    fprintf(stderr, "usage: hyppotest <test script> [<test>]\n");
+  // Read the body of the test, so that the worker can interpret it
+  // from memory, while we carry on with the rest of the script.
+  char *body = NULL;
+  size_t body_len = 0;
+  FILE *b = open_memstream(&body, &body_len);
+  char line[1024];
+  while (!feof(f)) {
+    line[0] = 0;
+    fgets(line, 1024, f);
+    fputs(line, b);
+    char *line_ptr = line;
+    while (isspace(*line_ptr))
+      ++line_ptr;
+    if (strncasecmp(line_ptr, "test end", strlen("test end")) == 0
+        || strncasecmp(line_ptr, "end test", strlen("end test")) == 0)
+      break;
+  }
+  fclose(b);
+
+  while (running_jobs >= max_jobs)
+    wait_for_test_worker();
+
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
     exit(-2);
   }
+  if (!pid) {
+    test_worker = true;
+    max_jobs = 1;
+    running_jobs = 0;
+    test_passes = 0;
+    test_fails = 0;
+    test_init(&cpu);
+    FILE *bf = fmemopen(body, body_len, "r");
+    run_script(bf, NULL);
+    fclose(bf);
+    // Don't let exit() touch the stdio state we share with the parent
+    fflush(stdout);
+    fflush(stderr);
+    _exit(test_fails ? 1 : 0);
+  }
+  running_jobs++;
+  free(body);
+}
+
+void usage(void)
+{
+  fprintf(stderr, "usage: hyppotest [-j <jobs>] [-l <instructions>] <test script> [<test>]\n");
+  fprintf(stderr, "  -j <jobs>         - Run up to <jobs> tests concurrently.\n");
+  fprintf(stderr, "  -l <instructions> - Keep only the most recent <instructions> entries in the instruction log.\n");
+  fprintf(stderr, "                      (The log then wraps, so routines can run past the usual %d instructions.)\n",
+      MAX_LOG_LENGTH);
+  fprintf(stderr, "                      (Infinite loops are only detected if %d iterations fit in the log.)\n",
+      INFINITE_LOOP_THRESHOLD);
+  exit(-2);
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+  char *slash = strrchr(argv[0], '/');
+  if (slash)
+    snprintf(tool_dir, sizeof(tool_dir), "%.*s", (int)(slash - argv[0] + 1), argv[0]);
+  while ((opt = getopt(argc, argv, "j:l:")) != -1) {
+    switch (opt) {
+    case 'j':
+      max_jobs = atoi(optarg);
+      if (max_jobs < 1) {
+        fprintf(stderr, "ERROR: Number of jobs must be at least 1.\n");
+        exit(-2);
+      }
+      break;
+    case 'l':
+      cpulog_limit = strtoul(optarg, NULL, 10);
+      if (cpulog_limit < 2 * INFINITE_LOOP_THRESHOLD || cpulog_limit > MAX_LOG_LIMIT) {
+        fprintf(stderr, "ERROR: Instruction log limit must be between %d and %d.\n", 2 * INFINITE_LOOP_THRESHOLD,
+            MAX_LOG_LIMIT);
+        exit(-2);
+      }
+      break;
+    default:
+      usage();
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if (argc < 2 || argc > 3)
+    usage();
 
   // Setup for anonymous tests, if user doesn't supply any test directives
   machine_init(&cpu);
+  coverage_init();
   logfile = stderr;
 
   // Open test script, and start interpreting it
@@ -4743,6 +6039,19 @@ int main(int argc, char **argv)
   if (test_target) {
     printf("INFO: Only running test \"%s\"\n", test_target);
   }
+  run_script(f, test_target);
+  fclose(f);
+  trace_close(false);
+
+  // Collect any tests still running in workers
+  while (running_jobs)
+    wait_for_test_worker();
+
+  printf("INFO: %d tests passed, %d tests failed.\n", test_passes, test_fails);
+}
+
+void run_script(FILE *f, const char *test_target)
+{
   char line[1024];
   bool skipping_test = false;
   while (!feof(f)) {
@@ -4754,6 +6063,7 @@ int main(int argc, char **argv)
     char start[1024];
     char end[1024];
     unsigned int addr, addr2, first, last;
+    unsigned long long cycles;
     char *line_ptr = line;
     // Skip any leading whitespace
     while (isspace(*line_ptr))
@@ -4788,6 +6098,17 @@ int main(int argc, char **argv)
     else if (sscanf(line_ptr, "dump instructions %d to %d", &first, &last) == 2) {
       show_recent_instructions(logfile, line_ptr, &cpu, first, last - first + 1, -1);
     }
+    else if (sscanf(line_ptr, "screenshot %s", routine) == 1) {
+      if (do_screen_shot(routine))
+        cpu.term.error = true;
+    }
+    else if (sscanf(line_ptr, "report dma to %s", routine) == 1) {
+      if (dma_export(routine))
+        cpu.term.error = true;
+    }
+    else if (!strncasecmp(line_ptr, "report dma", strlen("report dma"))) {
+      dma_report(logfile);
+    }
     else if (!strncasecmp(line_ptr, "log dma off", strlen("log dma off"))) {
       cpu.term.log_dma = false;
       fprintf(logfile, "NOTE: DMA jobs will not be reported\n");
@@ -4796,10 +6117,73 @@ int main(int argc, char **argv)
       cpu.term.log_dma = true;
       fprintf(logfile, "NOTE: DMA jobs will be reported\n");
     }
+    else if (!strncasecmp(line_ptr, "report cycles", strlen("report cycles"))) {
+      fprintf(logfile, "INFO: %llu cycles (%.3f usec) used by %d instructions\n", cpu.cycles, cpu.time_ps / 1000000.0,
+          cpulog_len - 1);
+    }
+    else if (!strncasecmp(line_ptr, "profile on", strlen("profile on"))) {
+      profile_reset();
+      profiling = true;
+    }
+    else if (!strncasecmp(line_ptr, "profile off", strlen("profile off"))) {
+      profiling = false;
+    }
+    else if (sscanf(line_ptr, "profile report %s", routine) == 1) {
+      profile_report(logfile, routine);
+    }
+    else if (!strncasecmp(line_ptr, "profile report", strlen("profile report"))) {
+      profile_report(logfile, NULL);
+    }
+    else if (!strncasecmp(line_ptr, "coverage on", strlen("coverage on"))) {
+      coverage = true;
+    }
+    else if (!strncasecmp(line_ptr, "coverage off", strlen("coverage off"))) {
+      coverage = false;
+    }
+    else if (sscanf(line_ptr, "coverage listing %s at $%x", routine, &addr) == 2) {
+      if (coverage_load_listing(routine, addr))
+        cpu.term.error = true;
+    }
+    else if (sscanf(line_ptr, "coverage listing %s", routine) == 1) {
+      if (coverage_load_listing(routine, 0))
+        cpu.term.error = true;
+    }
+    else if (sscanf(line_ptr, "coverage report %s", routine) == 1) {
+      // Include the tests that are still running
+      if (!test_worker)
+        while (running_jobs)
+          wait_for_test_worker();
+      if (coverage_report(routine))
+        cpu.term.error = true;
+    }
+    else if (sscanf(line_ptr, "expect failure \"%1023[^\"]\"", expected_failure) == 1) {
+      // Checked by test_conclude()
+    }
     else if (!strncasecmp(line_ptr, "log on failure", strlen("log on failure"))) {
       // Dump all instructions on test failure
       log_on_failure = true;
     }
+    else if (!strncasecmp(line_ptr, "trace on failure", strlen("trace on failure"))) {
+      // Stream a binary trace, and keep it as FAIL.<test>.trace if the test fails
+      if (in_test)
+        trace_open_for_test();
+      else
+        trace_every_test = true;
+    }
+    else if (!strncasecmp(line_ptr, "trace off", strlen("trace off"))) {
+      trace_close(false);
+      if (!in_test)
+        trace_every_test = false;
+    }
+    else if (sscanf(line_ptr, "trace to %s", routine) == 1) {
+      // A named trace covers a single test: test_conclude() closes it
+      if (in_test)
+        trace_open(routine, true);
+      else {
+        fprintf(logfile, "ERROR: 'trace to' must be inside a test. Use 'trace on failure' to trace every test.\n");
+        cpu.term.error = true;
+      }
+    }
     else if (sscanf(line_ptr, "jmp %s", routine) == 1) {
       int addr32 = resolve_value32(routine);
       if (addr32 > 0) {
@@ -4871,13 +6255,44 @@ int main(int argc, char **argv)
     }
     else if (sscanf(line_ptr, "test \"%[^\"]\"", test_name) == 1) {
       if (!test_target || strcmp(test_target, test_name) == 0) {
-        // Set test name
-        test_init(&cpu);
-        fflush(stdout);
+        if (max_jobs > 1)
+          start_test_worker(f);
+        else {
+          // Set test name
+          test_init(&cpu);
+          fflush(stdout);
+        }
       }
       else
         skipping_test = true;
     }
+    else if (sscanf(line_ptr, "snapshot save %s", routine) == 1) {
+      // Snapshots saved outside of any test are inherited by -j workers.
+      // Those saved within a test only outlive it when running serially.
+      if (snapshot_save(routine))
+        cpu.term.error = true;
+    }
+    else if (sscanf(line_ptr, "snapshot restore %s", routine) == 1) {
+      if (snapshot_restore(routine))
+        cpu.term.error = true;
+    }
+    else if (sscanf(line_ptr, "sdcard create %s %u", routine, &first) == 2) {
+      if (!first || sdcard_attach(routine, true, first))
+        cpu.term.error = true;
+    }
+    else if (sscanf(line_ptr, "sdcard image %s", routine) == 1) {
+      if (sdcard_attach(routine, sscanf(line_ptr, "sdcard image %*s %s", value) == 1 && !strcmp(value, "writable"), 0))
+        cpu.term.error = true;
+    }
+    else if (sscanf(line_ptr, "sdcard latency %u", &first) == 1) {
+      sdcard.latency = first;
+    }
+    else if (!strncasecmp(line_ptr, "sdcard detach", strlen("sdcard detach"))) {
+      sdcard_detach();
+    }
+    else if (!strncasecmp(line_ptr, "sdcard report", strlen("sdcard report"))) {
+      sdcard_report(logfile);
+    }
     else if (sscanf(line_ptr, "loadhypposymbols %s", routine) == 1) {
       if (load_hyppo_symbols(routine))
         cpu.term.error = true;
@@ -4924,6 +6339,41 @@ int main(int argc, char **argv)
       fprintf(logfile, "INFO: Breakpoint set at %s ($%04x)\n", routine, addr16);
       breakpoints[addr16] = 1;
     }
+    else if (!strncasecmp(line_ptr, "clear all watchpoints", strlen("clear all watchpoints"))) {
+      fprintf(logfile, "INFO: Cleared all watchpoints\n");
+      watch_clear_all();
+    }
+    else if (sscanf(line_ptr, "watch value %s == %s", location, value) == 2) {
+      addr = resolve_value32(location);
+      if (watch_add(WATCH_VALUE, addr, addr, resolve_value8(value)))
+        cpu.term.error = true;
+    }
+    else if (sscanf(line_ptr, "watch %s %s", routine, start) == 2) {
+      // watch read|write <addr> [to <addr>]
+      int type = !strcasecmp(routine, "read") ? WATCH_READ : !strcasecmp(routine, "write") ? WATCH_WRITE : 0;
+      addr = resolve_value32(start);
+      addr2 = addr;
+      if (sscanf(line_ptr, "watch %*s %*s to %s", end) == 1)
+        addr2 = resolve_value32(end);
+      if (!type) {
+        fprintf(logfile, "ERROR: Unknown watchpoint type '%s'.  Expected read, write or value.\n", routine);
+        cpu.term.error = true;
+      }
+      else if (watch_add(type, addr, addr2, 0))
+        cpu.term.error = true;
+    }
+    else if (sscanf(line_ptr, "loop threshold %s to %s %u", start, end, &first) == 3
+             || sscanf(line_ptr, "loop threshold %s %u", start, &first) == 2) {
+      // Allow a busy-wait loop to go round this many times.  Each
+      // instruction in a loop is counted separately, so give the whole loop.
+      addr = resolve_value32(start) & 0xffff;
+      addr2 = addr;
+      if (sscanf(line_ptr, "loop threshold %*s to %s", end) == 1)
+        addr2 = resolve_value32(end) & 0xffff;
+      fprintf(logfile, "INFO: Infinite loop threshold for $%04x-$%04x set to %u iterations\n", addr, addr2, first);
+      for (unsigned int a = addr; a <= addr2; a++)
+        loop_threshold[a] = first;
+    }
     else if (sscanf(line_ptr, "clear flag %s", location) == 1) {
       if (!strcasecmp(location, "c"))
         cpu.regs.flag_c = false;
@@ -4968,6 +6418,46 @@ int main(int argc, char **argv)
         cpu.term.error = true;
       }
     }
+    else if (sscanf(line_ptr, "expect cycles < %llu", &cycles) == 1) {
+      if (cpu.cycles >= cycles) {
+        fprintf(logfile, "ERROR: Used %llu cycles, but expected fewer than %llu\n", cpu.cycles, cycles);
+        cpu.term.error = true;
+      }
+    }
+    else if (sscanf(line_ptr, "expect cycles = %llu", &cycles) == 1) {
+      if (cpu.cycles != cycles) {
+        fprintf(logfile, "ERROR: Used %llu cycles, but expected %llu\n", cpu.cycles, cycles);
+        cpu.term.error = true;
+      }
+    }
+    else if (sscanf(line_ptr, "expect screen matches %s", routine) == 1) {
+      // Optionally followed by how far each colour channel may differ
+      int tolerance = 0;
+      sscanf(line_ptr, "expect screen matches %*s %d", &tolerance);
+      if (expect_screen_image(routine, tolerance))
+        cpu.term.error = true;
+    }
+    else if (sscanf(line_ptr, "expect screen text %s", routine) == 1) {
+      if (expect_screen_text(routine))
+        cpu.term.error = true;
+    }
+    else if (sscanf(line_ptr, "expect log contains \"%1023[^\"]\"", value) == 1) {
+      // Everything so far in this test's log, such as from "profile report"
+      if (logfile == stderr) {
+        fprintf(logfile, "ERROR: 'expect log' must be inside a test.\n");
+        cpu.term.error = true;
+      }
+      else if (expect_file_contains(NULL, value))
+        cpu.term.error = true;
+    }
+    else if (sscanf(line_ptr, "expect file %s contains \"%1023[^\"]\"", routine, value) == 2) {
+      if (expect_file_contains(routine, value))
+        cpu.term.error = true;
+    }
+    else if (sscanf(line_ptr, "expect trace %s contains \"%1023[^\"]\"", routine, value) == 2) {
+      if (expect_trace_contains(routine, value))
+        cpu.term.error = true;
+    }
     else if (sscanf(line_ptr, "expect flag %s is %s", location, value) == 2) {
       bool v;
       if (strcasecmp(value, "set") == 0) {
@@ -5045,6 +6535,7 @@ int main(int argc, char **argv)
       if (addr < CHIPRAM_SIZE) {
         sym_by_addr[addr] = &symbols[symbol_count];
       }
+      symbol_index_add(&symbol_index_all, symbol_count);
       symbol_count++;
     }
     else if (sscanf(line_ptr, "poke%s%n", location, &last) == 1) {
@@ -5092,6 +6583,23 @@ int main(int argc, char **argv)
       }
       cpu.term.error |= prior_error;
     }
+    else if (!strncasecmp(line_ptr, "undo log on", strlen("undo log on"))) {
+      // Record memory writes from here on, so that "rewind" can undo them
+      if (!undo_logging)
+        undo_log_reset();
+      undo_logging = true;
+    }
+    else if (!strncasecmp(line_ptr, "undo log off", strlen("undo log off"))) {
+      undo_logging = false;
+    }
+    else if (sscanf(line_ptr, "rewind to I%u", &first) == 1) {
+      if (!cpu_rewind(&cpu, first))
+        cpu.term.error = true;
+    }
+    else if (sscanf(line_ptr, "rewind until %s changed", location) == 1) {
+      if (!cpu_rewind_until_changed(&cpu, resolve_value32(location)))
+        cpu.term.error = true;
+    }
     else if (sscanf(line_ptr, "let %s = %s", location, value) == 2) {
       if (!strcasecmp(location, "a"))
         cpu.regs.a = resolve_value8(value);
@@ -5150,7 +6658,6 @@ int main(int argc, char **argv)
   }
   if (logfile != stderr)
     test_conclude(&cpu);
-  fclose(f);
 }
 
 /* ----------------------------------------------------------------------------------------------------------
@@ -5167,6 +6674,7 @@ int main(int argc, char **argv)
 #include <string.h>
 #include <ctype.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <errno.h>
 #include <getopt.h>
 #include <inttypes.h>
@@ -5185,6 +6693,15 @@ int main(int argc, char **argv)
 
 int fetch_ram(unsigned long address, unsigned int count, unsigned char *buffer)
 {
+  const ram_region *r = ram_region_for(address, count);
+  if (r) {
+    bcopy(&r->mem[address - r->base], buffer, count);
+    return 0;
+  }
+  if ((address & 0xfff0000) == 0xffd0000 && address + count <= 0xffe0000) {
+    bcopy(&ffdram[address - 0xffd0000], buffer, count);
+    return 0;
+  }
   for (int i = 0; i < count; i++)
     buffer[i] = read_memory28(NULL, address + i);
   return 0;
@@ -5238,13 +6755,44 @@ unsigned char screen_data[MAX_SCREEN_SIZE];
 unsigned char colour_data[MAX_SCREEN_SIZE];
 unsigned char char_data[8192 * 8];
 
+// Palette as 8-bit RGB values, decoded from the nybble-swapped palette
+// registers once per frame by get_video_state()
+unsigned char palette_rgb[256][3];
+
 unsigned char mega65_rgb(int colour, int rgb)
 {
-  return ((vic_regs[0x0100 + (0x100 * rgb) + colour] & 0xf) << 4)
-       + ((vic_regs[0x0100 + (0x100 * rgb) + colour] & 0xf0) >> 4);
+  return palette_rgb[colour & 0xff][rgb];
+}
+
+// Mono glyphs decoded to one byte per pixel, keyed by charset address and
+// char ID.  An entry stays valid while the glyph's bytes in the charset are
+// unchanged, so that it can be reused across frames.
+typedef struct glyph_cache_entry {
+  bool valid;
+  unsigned int charset_address;
+  unsigned char source[8];
+  unsigned char pixels[8][8];
+} glyph_cache_entry;
+glyph_cache_entry glyph_cache[8192];
+
+glyph_cache_entry *glyph_lookup(int char_id)
+{
+  glyph_cache_entry *g = &glyph_cache[char_id];
+
+  if (!g->valid || g->charset_address != charset_address || memcmp(g->source, &char_data[char_id * 8], 8)) {
+    g->valid = true;
+    g->charset_address = charset_address;
+    bcopy(&char_data[char_id * 8], g->source, 8);
+    for (int row = 0; row < 8; row++)
+      for (int i = 0; i < 8; i++)
+        g->pixels[row][i] = (g->source[row] >> i) & 1 ? 0xff : 0;
+  }
+  return g;
 }
 
+// The frame buffer is reused for every screen shot
 png_structp png_ptr = NULL;
+png_byte frame_buffer[576][3 * 720];
 png_bytep png_rows[576];
 int is_pal_mode = 0;
 
@@ -5590,6 +7138,12 @@ void get_video_state(void)
   fetch_ram(0xffd3000, 0x0400, vic_regs);
   // printf("Got video regs\n");
 
+  for (int colour = 0; colour < 256; colour++)
+    for (int rgb = 0; rgb < 3; rgb++) {
+      unsigned char v = vic_regs[0x0100 + (0x100 * rgb) + colour];
+      palette_rgb[colour][rgb] = ((v & 0xf) << 4) + ((v & 0xf0) >> 4);
+    }
+
   screen_address = vic_regs[0x60] + (vic_regs[0x61] << 8) + (vic_regs[0x62] << 16);
   charset_address = vic_regs[0x68] + (vic_regs[0x69] << 8) + (vic_regs[0x6A] << 16);
   if (charset_address == 0x1000)
@@ -5691,7 +7245,6 @@ void get_video_state(void)
 
 void paint_screen_shot(void)
 {
-  printf("Painting rasters %d -- %d\n", min_y, max_y);
 
   // Now render the text display
   int y_position = chargen_y;
@@ -5775,6 +7328,9 @@ void paint_screen_shot(void)
       if (glyph_4bit)
         glyph_width = 16;
       glyph_width -= glyph_width_deduct;
+      glyph_cache_entry *glyph = NULL;
+      if (!glyph_full_colour && !bitmap_mode)
+        glyph = glyph_lookup(char_id);
 
       // For each row of the glyph
       for (int yy = 0; yy < 8; yy++) {
@@ -5791,13 +7347,8 @@ void paint_screen_shot(void)
         else {
           // Use existing char data we have already fetched
           // printf("Chardata for char $%03x = $%02x\n",char_id,char_data[char_id*8+glyph_row]);
-          if (!bitmap_mode) {
-            for (int i = 0; i < 8; i++)
-              if ((char_data[char_id * 8 + glyph_row] >> i) & 1)
-                glyph_data[i] = 0xff;
-              else
-                glyph_data[i] = 0;
-          }
+          if (!bitmap_mode)
+            bcopy(glyph->pixels[glyph_row], glyph_data, 8);
           else {
             int addr = charset_address & 0xfe000;
             addr += cx * 8 + cy * 320 + glyph_row;
@@ -5978,89 +7529,311 @@ void paint_screen_shot(void)
   return;
 }
 
-int do_screen_shot(char *filename)
+void render_screen_shot(void)
 {
-
   get_video_state();
 
-  //  printf("Got video state.\n");
+  int height = is_pal_mode ? 576 : 480;
+  for (int y = 0; y < 576; y++)
+    png_rows[y] = frame_buffer[y];
+
+  // Set all pixels to the border colour by default, and then draw the
+  // non-border area
+  for (int x = 0; x < 720; x++) {
+    frame_buffer[0][x * 3 + 0] = mega65_rgb(border_colour, 0);
+    frame_buffer[0][x * 3 + 1] = mega65_rgb(border_colour, 1);
+    frame_buffer[0][x * 3 + 2] = mega65_rgb(border_colour, 2);
+  }
+  for (int y = 1; y < height; y++)
+    bcopy(frame_buffer[0], frame_buffer[y], sizeof(frame_buffer[0]));
+  for (int y = top_border_y; y < bottom_border_y && (y < height); y++) {
+    for (int x = left_border; x < right_border; x++) {
+      frame_buffer[y][x * 3 + 0] = mega65_rgb(background_colour, 0);
+      frame_buffer[y][x * 3 + 1] = mega65_rgb(background_colour, 1);
+      frame_buffer[y][x * 3 + 2] = mega65_rgb(background_colour, 2);
+    }
+  }
 
-  //  printf("Got ASCII screenshot.\n");
+  {
+    //     printf("Video mode does not use raster splits. Drawing normally.\n");
+    min_y = 0;
+    max_y = height;
+    paint_screen_shot();
+  }
+}
 
+int write_png(char *filename, png_bytep *rows, int height)
+{
   FILE *f = NULL;
   f = fopen(filename, "wb");
   if (!f) {
     fprintf(stderr, "ERROR: Could not open '%s' for writing.\n", filename);
     return -1;
   }
-  // printf("Rendering pixel-exact version to %s...\n", filename);
 
   png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
   if (!png_ptr) {
     fprintf(stderr, "ERROR: Could not creat PNG structure.\n");
+    fclose(f);
     return -1;
   }
 
   png_infop info_ptr = png_create_info_struct(png_ptr);
   if (!info_ptr) {
     fprintf(stderr, "ERROR: Could not creat PNG info structure.\n");
+    png_destroy_write_struct(&png_ptr, NULL);
+    fclose(f);
     return -1;
   }
 
   png_init_io(png_ptr, f);
+  // Screen shots are mostly large flat areas, which compress well enough
+  // at the fastest level
+  png_set_compression_level(png_ptr, 1);
 
-  // Set image size based on PAL or NTSC video mode
-  png_set_IHDR(png_ptr, info_ptr, 720, is_pal_mode ? 576 : 480, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
-      PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+  png_set_IHDR(png_ptr, info_ptr, 720, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
+      PNG_FILTER_TYPE_BASE);
 
   png_write_info(png_ptr, info_ptr);
 
-  // Allocate frame buffer for image, and set all pixels to the border colour by default
-  // printf("Allocating PNG frame buffer...\n");
-  for (int y = 0; y < (is_pal_mode ? 576 : 480); y++) {
-    png_rows[y] = (png_bytep)malloc(3 * 720 * sizeof(png_byte));
-    if (!png_rows[y]) {
-      perror("malloc()");
-      return -1;
-    }
-    // Set all pixels to border colour
+  // Write out each row of the PNG
+  for (int y = 0; y < height; y++)
+    png_write_row(png_ptr, rows[y]);
+
+  png_write_end(png_ptr, NULL);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+
+  fclose(f);
+
+  return 0;
+}
+
+int do_screen_shot(char *filename)
+{
+  render_screen_shot();
+
+  // Image size is based on PAL or NTSC video mode
+  if (write_png(filename, png_rows, is_pal_mode ? 576 : 480))
+    return -1;
+
+  fprintf(logfile, "INFO: Wrote screen capture to '%s'\n", filename);
+
+  return 0;
+}
+
+// Reference image for "expect screen matches", kept loaded so that comparing
+// the screen against the same image again doesn't have to decode it again
+typedef struct golden_image {
+  char filename[1024];
+  time_t mtime;
+  unsigned int width;
+  unsigned int height;
+  unsigned char *pixels;
+} golden_image;
+golden_image golden;
+
+int load_golden_image(char *filename)
+{
+  struct stat st;
+  png_image image;
+
+  if (stat(filename, &st)) {
+    fprintf(logfile, "ERROR: Could not read reference image '%s'\n", filename);
+    return -1;
+  }
+  if (golden.pixels && !strcmp(golden.filename, filename) && golden.mtime == st.st_mtime)
+    return 0;
+
+  free(golden.pixels);
+  bzero(&golden, sizeof(golden));
+
+  bzero(&image, sizeof(image));
+  image.version = PNG_IMAGE_VERSION;
+  if (!png_image_begin_read_from_file(&image, filename)) {
+    fprintf(logfile, "ERROR: Could not read reference image '%s': %s\n", filename, image.message);
+    return -1;
+  }
+  image.format = PNG_FORMAT_RGB;
+  if (image.width != 720 || (image.height != 576 && image.height != 480)) {
+    fprintf(logfile, "ERROR: Reference image '%s' is %dx%d, but screen shots are 720x576 or 720x480\n", filename,
+        image.width, image.height);
+    png_image_free(&image);
+    return -1;
+  }
+  golden.pixels = malloc(PNG_IMAGE_SIZE(image));
+  if (!golden.pixels) {
+    fprintf(logfile, "ERROR: Could not allocate memory for reference image '%s'\n", filename);
+    png_image_free(&image);
+    return -1;
+  }
+  if (!png_image_finish_read(&image, NULL, golden.pixels, 0, NULL)) {
+    fprintf(logfile, "ERROR: Could not read reference image '%s': %s\n", filename, image.message);
+    free(golden.pixels);
+    golden.pixels = NULL;
+    return -1;
+  }
+
+  snprintf(golden.filename, sizeof(golden.filename), "%s", filename);
+  golden.mtime = st.st_mtime;
+  golden.width = image.width;
+  golden.height = image.height;
+  return 0;
+}
+
+int expect_screen_image(char *filename, int tolerance)
+{
+  // Compare the screen against a reference image, allowing each colour
+  // channel of each pixel to differ by up to tolerance.  On a mismatch, the
+  // screen and an image of the differences are saved.
+  int height, mismatches = 0, first_x = 0, first_y = 0;
+  char name[8192];
+
+  if (load_golden_image(filename))
+    return -1;
+
+  render_screen_shot();
+  height = is_pal_mode ? 576 : 480;
+  if (height != golden.height) {
+    fprintf(logfile, "ERROR: Screen is 720x%d, but reference image '%s' is 720x%d\n", height, filename, golden.height);
+    return -1;
+  }
+
+  for (int y = 0; y < height; y++) {
+    unsigned char *ref = &golden.pixels[y * 3 * 720];
+    if (!memcmp(frame_buffer[y], ref, 3 * 720))
+      continue;
     for (int x = 0; x < 720; x++) {
-      ((unsigned char *)png_rows[y])[x * 3 + 0] = mega65_rgb(border_colour, 0);
-      ((unsigned char *)png_rows[y])[x * 3 + 1] = mega65_rgb(border_colour, 1);
-      ((unsigned char *)png_rows[y])[x * 3 + 2] = mega65_rgb(border_colour, 2);
+      for (int rgb = 0; rgb < 3; rgb++) {
+        if (abs(frame_buffer[y][x * 3 + rgb] - ref[x * 3 + rgb]) > tolerance) {
+          if (!mismatches) {
+            first_x = x;
+            first_y = y;
+          }
+          mismatches++;
+          break;
+        }
+      }
     }
   }
+  if (!mismatches)
+    return 0;
 
-  printf("Rendering screen...\n");
+  fprintf(logfile, "ERROR: %d pixels differ from reference image '%s', starting at (%d,%d)\n", mismatches, filename,
+      first_x, first_y);
 
-  // Start by drawing the non-border area
-  for (int y = top_border_y; y < bottom_border_y && (y < (is_pal_mode ? 576 : 480)); y++) {
-    for (int x = left_border; x < right_border; x++) {
-      ((unsigned char *)png_rows[y])[x * 3 + 0] = mega65_rgb(background_colour, 0);
-      ((unsigned char *)png_rows[y])[x * 3 + 1] = mega65_rgb(background_colour, 1);
-      ((unsigned char *)png_rows[y])[x * 3 + 2] = mega65_rgb(background_colour, 2);
+  snprintf(name, sizeof(name), "FAIL.%s.screen.png", safe_name);
+  if (!write_png(name, png_rows, height))
+    fprintf(logfile, "INFO: Wrote screen to '%s'\n", name);
+
+  // Mark the differing pixels in red, on a darkened copy of the screen
+  for (int y = 0; y < height; y++) {
+    unsigned char *ref = &golden.pixels[y * 3 * 720];
+    for (int x = 0; x < 720; x++) {
+      bool differs = false;
+      for (int rgb = 0; rgb < 3; rgb++)
+        if (abs(frame_buffer[y][x * 3 + rgb] - ref[x * 3 + rgb]) > tolerance)
+          differs = true;
+      for (int rgb = 0; rgb < 3; rgb++) {
+        if (differs)
+          frame_buffer[y][x * 3 + rgb] = rgb ? 0x00 : 0xff;
+        else
+          frame_buffer[y][x * 3 + rgb] /= 3;
+      }
     }
   }
+  snprintf(name, sizeof(name), "FAIL.%s.diff.png", safe_name);
+  if (!write_png(name, png_rows, height))
+    fprintf(logfile, "INFO: Wrote differences to '%s'\n", name);
 
-  {
-    //     printf("Video mode does not use raster splits. Drawing normally.\n");
-    min_y = 0;
-    max_y = is_pal_mode ? 576 : 480;
-    paint_screen_shot();
-  }
+  return -1;
+}
 
-  //  printf("Writing out PNG frame buffer...\n");
-  // Write out each row of the PNG
-  for (int y = 0; y < (is_pal_mode ? 576 : 480); y++)
-    png_write_row(png_ptr, png_rows[y]);
+int do_screen_shot_text(FILE *f)
+{
+  // Plain text version of the screen, one line per row, without colours or
+  // reverse video, for comparing against reference files
+  get_video_state();
+  for (int y = 0; y < screen_rows; y++) {
+    for (int x = 0; x < screen_width; x++) {
+      int char_value = screen_data[y * screen_line_step + x * (1 + sixteenbit_mode)];
+      if (sixteenbit_mode)
+        char_value |= (screen_data[y * screen_line_step + x * (1 + sixteenbit_mode) + 1] << 8);
+      int colour_value = colour_data[y * screen_line_step + x * (1 + sixteenbit_mode)];
+      if (sixteenbit_mode)
+        colour_value |= (colour_data[y * screen_line_step + x * (1 + sixteenbit_mode) + 1] << 8);
+      int char_id = extended_background_mode ? char_value & 0x3f : char_value & 0x1fff;
 
-  png_write_end(png_ptr, NULL);
+      // As do_screen_shot_ascii() does, just mark full-colour chars
+      if (((vic_regs[0x54] & 2) && char_id < 0x100) || ((vic_regs[0x54] & 4) && char_id > 0x0ff)
+          || (colour_value & 0x0800))
+        fprintf(f, "?");
+      else
+        print_screencode(f, char_id & 0x7f, upper_case);
+    }
+    fprintf(f, "\n");
+  }
+  return 0;
+}
 
-  fclose(f);
+void trim_line_end(char *line)
+{
+  int len = strlen(line);
+  while (len && isspace((unsigned char)line[len - 1]))
+    line[--len] = 0;
+}
 
-  printf("Wrote screen capture to %s...\n", filename);
-  // start_cpu();
-  // exit(0);
+int expect_screen_text(char *filename)
+{
+  // Compare the screen text against a reference file, ignoring trailing
+  // white space on each line.  On a mismatch, the screen text is saved.
+  char expected[1024], actual[1024], name[8192];
+  int line = 0, result = 0;
+  FILE *e = fopen(filename, "r");
+  FILE *a = tmpfile();
+
+  if (!e || !a) {
+    fprintf(logfile, "ERROR: Could not read reference screen text '%s'\n", filename);
+    if (e)
+      fclose(e);
+    if (a)
+      fclose(a);
+    return -1;
+  }
+  do_screen_shot_text(a);
+  rewind(a);
 
-  return 0;
+  while (!result) {
+    bool have_expected = fgets(expected, sizeof(expected), e) != NULL;
+    bool have_actual = fgets(actual, sizeof(actual), a) != NULL;
+    if (!have_expected && !have_actual)
+      break;
+    line++;
+    if (!have_expected)
+      expected[0] = 0;
+    if (!have_actual)
+      actual[0] = 0;
+    trim_line_end(expected);
+    trim_line_end(actual);
+    if (strcmp(expected, actual) || have_expected != have_actual) {
+      fprintf(logfile, "ERROR: Screen text differs from '%s' at line %d:\n", filename, line);
+      fprintf(logfile, "       Expected: %s\n", have_expected ? expected : "(end of file)");
+      fprintf(logfile, "       Saw:      %s\n", have_actual ? actual : "(end of screen)");
+      result = -1;
+    }
+  }
+  fclose(e);
+
+  if (result) {
+    snprintf(name, sizeof(name), "FAIL.%s.screen.txt", safe_name);
+    FILE *s = fopen(name, "w");
+    if (s) {
+      rewind(a);
+      while (fgets(actual, sizeof(actual), a))
+        fputs(actual, s);
+      fclose(s);
+      fprintf(logfile, "INFO: Wrote screen text to '%s'\n", name);
+    }
+  }
+  fclose(a);
+  return result;
 }
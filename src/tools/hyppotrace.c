@@ -0,0 +1,372 @@
+// Decoder for the binary instruction traces written by hyppotest's
+// "trace on failure" and "trace to" directives.  See hyppotrace.h.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include "hyppotrace.h"
+
+trace_opcode opcodes[256];
+
+typedef struct symbol {
+  char *name;
+  unsigned int addr;
+  int order; // Position in the trace
+} symbol;
+symbol *symbols = NULL;
+int symbol_count = 0;
+int symbol_space = 0;
+bool symbols_sorted = false;
+bool use_symbols = true;
+
+unsigned long instruction_count = 0;
+
+// Filters
+unsigned long first_instruction = 0;
+unsigned long last_instruction = ~0UL;
+unsigned long tail_count = 0;
+unsigned int pc_lo = 0, pc_hi = ~0U;
+unsigned int ea_lo = 0, ea_hi = ~0U;
+bool filter_ea = false;
+
+void usage(void)
+{
+  fprintf(stderr, "usage: hyppotrace [-f <first>] [-l <last>] [-t <count>] [-p <addr>[-<addr>]] [-e <addr>[-<addr>]] [-n] "
+                  "<trace file>\n");
+  fprintf(stderr, "  -f <first>           - Skip instructions before instruction number <first>.\n");
+  fprintf(stderr, "  -l <last>            - Stop after instruction number <last>.\n");
+  fprintf(stderr, "  -t <count>           - Show only the last <count> instructions.\n");
+  fprintf(stderr, "  -p <addr>[-<addr>]   - Show only instructions at these 28-bit addresses (hex).\n");
+  fprintf(stderr, "  -e <addr>[-<addr>]   - Show only instructions that access these 28-bit addresses (hex).\n");
+  fprintf(stderr, "  -n                   - Don't show symbols.\n");
+  exit(-2);
+}
+
+int parse_range(char *arg, unsigned int *lo, unsigned int *hi)
+{
+  char *end;
+
+  if (arg[0] == '$')
+    arg++;
+  *lo = strtoul(arg, &end, 16);
+  if (end == arg)
+    return -1;
+  if (!*end) {
+    *hi = *lo;
+    return 0;
+  }
+  if (*end != '-')
+    return -1;
+  arg = end + 1;
+  if (arg[0] == '$')
+    arg++;
+  *hi = strtoul(arg, &end, 16);
+  if (end == arg || *end || *hi < *lo)
+    return -1;
+  return 0;
+}
+
+int compare_symbols(const void *a, const void *b)
+{
+  const symbol *sa = a;
+  const symbol *sb = b;
+
+  if (sa->addr != sb->addr)
+    return sa->addr < sb->addr ? -1 : 1;
+  return sa->order - sb->order;
+}
+
+char *describe_address_label28(unsigned int addr)
+{
+  static char description[8192];
+  int lo = 0, hi = symbol_count;
+
+  description[0] = 0;
+  if (!use_symbols)
+    return description;
+  if (!symbols_sorted) {
+    // The first symbol at an address wins, as in hyppotest
+    qsort(symbols, symbol_count, sizeof(symbol), compare_symbols);
+    symbols_sorted = true;
+  }
+
+  // Find the first symbol above addr, and then the first one at the address
+  // of the symbol before it
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (symbols[mid].addr <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (!lo)
+    return description;
+  lo--;
+  while (lo && symbols[lo - 1].addr == symbols[lo].addr)
+    lo--;
+
+  if (symbols[lo].addr == addr)
+    snprintf(description, sizeof(description), "%s", symbols[lo].name);
+  else {
+    const int delta = addr - symbols[lo].addr;
+    const char *const fmt = delta > 0xff ? "%s+$%x" : "%s+%d";
+    snprintf(description, sizeof(description), fmt, symbols[lo].name, delta);
+  }
+  return description;
+}
+
+void disassemble_instruction(FILE *f, trace_insn *t)
+{
+  trace_opcode *op = &opcodes[t->bytes[0]];
+  unsigned int arg8 = t->bytes[1];
+  unsigned int arg16 = t->bytes[1] + (t->bytes[2] << 8);
+
+  fprintf(f, "%-4.4s ", op->mnemonic);
+  switch (op->mode) {
+  case MODE_ACC:
+    fprintf(f, "A");
+    break;
+  case MODE_IMM:
+    fprintf(f, "#$%02X", arg8);
+    break;
+  case MODE_IMM16:
+    fprintf(f, "#$%04X", arg16);
+    break;
+  case MODE_ZP:
+    fprintf(f, "$%02X", arg8);
+    break;
+  case MODE_ZPX:
+    fprintf(f, "$%02X,X", arg8);
+    break;
+  case MODE_ZPY:
+    fprintf(f, "$%02X,Y", arg8);
+    break;
+  case MODE_ABS:
+    fprintf(f, "$%04X", arg16);
+    break;
+  case MODE_ABSX:
+    fprintf(f, "$%04X,X", arg16);
+    break;
+  case MODE_ABSY:
+    fprintf(f, "$%04X,Y", arg16);
+    break;
+  case MODE_IZPX:
+    fprintf(f, "($%02X,X)", arg8);
+    break;
+  case MODE_IZPY:
+    fprintf(f, "($%02X),Y", arg8);
+    break;
+  case MODE_IZPZ:
+    fprintf(f, t->flags & TRACE_ZP32 ? "[$%02X],Z" : "($%02X),Z", arg8);
+    break;
+  case MODE_ISPY:
+    fprintf(f, "($%02X,SP),Y", arg8);
+    break;
+  case MODE_IABS:
+    fprintf(f, "($%04X)", arg16);
+    break;
+  case MODE_IABSX:
+    fprintf(f, "($%04X,X)", arg16);
+    break;
+  case MODE_REL8:
+    fprintf(f, "$%04X", (t->pc + 2 + (signed char)arg8) & 0xffff);
+    break;
+  case MODE_REL16:
+    fprintf(f, "$%04X", (t->pc + 2 + (signed short)arg16) & 0xffff);
+    break;
+  case MODE_ZPREL8:
+    fprintf(f, "$%02X,$%04X", arg8, (t->pc + 3 + (signed char)t->bytes[2]) & 0xffff);
+    break;
+  }
+  if (t->ea28 != TRACE_NO_EA) {
+    char *label = describe_address_label28(t->ea28);
+    fprintf(f, " {EA=$%07X%s%s}", t->ea28, label[0] ? " " : "", label);
+  }
+}
+
+void show_instruction(FILE *f, trace_insn *t)
+{
+  fprintf(f, "I%-7u ", t->instruction);
+  fprintf(f, "$%04X %3dc : ", t->pc, t->cycles);
+  fprintf(f, "A:%02X ", t->a);
+  fprintf(f, "X:%02X ", t->x);
+  fprintf(f, "Y:%02X ", t->y);
+  fprintf(f, "Z:%02X ", t->z);
+  fprintf(f, "SP:%04X ", t->sp);
+  fprintf(f, "B:%02X ", t->b);
+  fprintf(f, "M:%04x+%02x/%04x+%02x ", t->maplo, t->maplomb, t->maphi, t->maphimb);
+  fprintf(f, "%c%c%c%c%c%c%c%c ", t->p & 0x80 ? 'N' : '.', t->p & 0x40 ? 'V' : '.', t->p & 0x20 ? 'E' : '.',
+      t->p & 0x10 ? 'B' : '.', t->p & 0x08 ? 'D' : '.', t->p & 0x04 ? 'I' : '.', t->p & 0x02 ? 'Z' : '.',
+      t->p & 0x01 ? 'C' : '.');
+  fprintf(f, "%c: ", t->flags & TRACE_IN_HYPER ? 'H' : ' ');
+
+  fprintf(f, "%32s : ", describe_address_label28(t->pc28));
+
+  for (int j = 0; j < 3; j++) {
+    if (j < t->len)
+      fprintf(f, "%02X ", t->bytes[j]);
+    else
+      fprintf(f, "   ");
+  }
+  fprintf(f, " : ");
+  disassemble_instruction(f, t);
+  fprintf(f, "\n");
+}
+
+bool instruction_wanted(trace_insn *t, unsigned long n)
+{
+  if (n < first_instruction || n > last_instruction)
+    return false;
+  if (tail_count && n + tail_count < instruction_count)
+    return false;
+  if (t->pc28 < pc_lo || t->pc28 > pc_hi)
+    return false;
+  if (filter_ea && (t->ea28 == TRACE_NO_EA || t->ea28 < ea_lo || t->ea28 > ea_hi))
+    return false;
+  return true;
+}
+
+// Reads the trace.  The first pass only collects the symbols and counts the
+// instructions, and the second shows the wanted instructions.
+int read_trace(FILE *f, char *filename, bool show)
+{
+  trace_header header;
+  trace_insn t;
+  trace_call call;
+  trace_symbol s;
+  unsigned long n = 0;
+  int type;
+
+  if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))) {
+    fprintf(stderr, "ERROR: '%s' is not an instruction trace\n", filename);
+    return -1;
+  }
+  if (header.version != TRACE_VERSION) {
+    fprintf(stderr, "ERROR: '%s' is a version %u trace, but I only understand version %d\n", filename, header.version,
+        TRACE_VERSION);
+    return -1;
+  }
+
+  while ((type = fgetc(f)) != EOF) {
+    switch (type) {
+    case TRACE_OPCODES:
+      if (fread(opcodes, sizeof(opcodes), 1, f) != 1)
+        goto truncated;
+      break;
+    case TRACE_CALL:
+      if (fread(&call, sizeof(call), 1, f) != 1)
+        goto truncated;
+      if (show && !filter_ea && n >= first_instruction && n <= last_instruction
+          && !(tail_count && n + tail_count < instruction_count))
+        printf(">>> Calling routine %s @ $%04x\n", describe_address_label28(call.addr), call.addr);
+      break;
+    case TRACE_INSN:
+      if (fread(&t, sizeof(t), 1, f) != 1)
+        goto truncated;
+      if (show && instruction_wanted(&t, n))
+        show_instruction(stdout, &t);
+      n++;
+      break;
+    case TRACE_SYMBOL:
+      if (fread(&s, sizeof(s), 1, f) != 1)
+        goto truncated;
+      if (show) {
+        fseek(f, s.name_len, SEEK_CUR);
+        break;
+      }
+      if (symbol_count == symbol_space) {
+        symbol_space = symbol_space ? symbol_space * 2 : 1024;
+        symbols = realloc(symbols, symbol_space * sizeof(symbol));
+        if (!symbols) {
+          fprintf(stderr, "ERROR: Could not allocate memory for symbols\n");
+          exit(-2);
+        }
+      }
+      symbols[symbol_count].name = malloc(s.name_len + 1);
+      if (!symbols[symbol_count].name) {
+        fprintf(stderr, "ERROR: Could not allocate memory for symbols\n");
+        exit(-2);
+      }
+      if (fread(symbols[symbol_count].name, s.name_len, 1, f) != 1 && s.name_len)
+        goto truncated;
+      symbols[symbol_count].name[s.name_len] = 0;
+      symbols[symbol_count].addr = s.addr;
+      symbols[symbol_count].order = symbol_count;
+      symbol_count++;
+      break;
+    case TRACE_END:
+      if (!show)
+        instruction_count = n;
+      return 0;
+    default:
+      fprintf(stderr, "ERROR: Unknown record type $%02X in '%s'\n", type, filename);
+      return -1;
+    }
+  }
+
+truncated:
+  // A trace from a crashed run has no end record (and maybe a partial
+  // record), but everything before that is still worth showing.
+  if (!show) {
+    fprintf(stderr, "WARNING: '%s' is truncated after %lu instructions\n", filename, n);
+    instruction_count = n;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "f:l:t:p:e:n")) != -1) {
+    switch (opt) {
+    case 'f':
+      first_instruction = strtoul(optarg, NULL, 10);
+      break;
+    case 'l':
+      last_instruction = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      tail_count = strtoul(optarg, NULL, 10);
+      break;
+    case 'p':
+      if (parse_range(optarg, &pc_lo, &pc_hi)) {
+        fprintf(stderr, "ERROR: Could not parse address range '%s'\n", optarg);
+        exit(-2);
+      }
+      break;
+    case 'e':
+      if (parse_range(optarg, &ea_lo, &ea_hi)) {
+        fprintf(stderr, "ERROR: Could not parse address range '%s'\n", optarg);
+        exit(-2);
+      }
+      filter_ea = true;
+      break;
+    case 'n':
+      use_symbols = false;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc - 1)
+    usage();
+
+  FILE *f = fopen(argv[optind], "rb");
+  if (!f) {
+    fprintf(stderr, "ERROR: Could not read instruction trace from '%s'\n", argv[optind]);
+    exit(-2);
+  }
+  if (read_trace(f, argv[optind], false)) {
+    fclose(f);
+    exit(-1);
+  }
+  rewind(f);
+  read_trace(f, argv[optind], true);
+  fclose(f);
+
+  return 0;
+}
@@ -0,0 +1,91 @@
+// Binary instruction trace format, written by hyppotest and read by hyppotrace.
+//
+// A trace is a trace_header followed by a stream of records, each introduced
+// by one of the TRACE_* type bytes below.  Records are written in host byte
+// order, which is little-endian on every machine we build on.  The opcode table
+// comes first and the symbol table last, so that hyppotest only has to look
+// things up when it is asked to, and the decoder can do the disassembly and
+// symbolisation for just the instructions it shows.
+
+#ifndef HYPPOTRACE_H
+#define HYPPOTRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "HYPTRACE"
+#define TRACE_VERSION 1
+
+// Addressing modes of the 45GS02, as used in the opcode table
+#define MODE_IMP 0      // Implied
+#define MODE_ACC 1      // Accumulator
+#define MODE_IMM 2      // #$nn
+#define MODE_IMM16 3    // #$nnnn
+#define MODE_ZP 4       // $nn
+#define MODE_ZPX 5      // $nn,X
+#define MODE_ZPY 6      // $nn,Y
+#define MODE_ABS 7      // $nnnn
+#define MODE_ABSX 8     // $nnnn,X
+#define MODE_ABSY 9     // $nnnn,Y
+#define MODE_IZPX 10    // ($nn,X)
+#define MODE_IZPY 11    // ($nn),Y
+#define MODE_IZPZ 12    // ($nn),Z
+#define MODE_ISPY 13    // ($nn,SP),Y
+#define MODE_IABS 14    // ($nnnn)
+#define MODE_IABSX 15   // ($nnnn,X)
+#define MODE_REL8 16    // $rr
+#define MODE_REL16 17   // $rrrr
+#define MODE_ZPREL8 18  // $nn,$rr
+
+// Record types
+#define TRACE_OPCODES 'O' // 256 trace_opcode entries
+#define TRACE_CALL 'C'    // trace_call
+#define TRACE_INSN 'I'    // trace_insn
+#define TRACE_SYMBOL 'S'  // trace_symbol, followed by the name
+#define TRACE_END 'E'     // No payload
+
+// trace_insn.flags
+#define TRACE_IN_HYPER 0x01
+#define TRACE_ZP32 0x02
+
+// trace_insn.ea28 for instructions without a memory operand
+#define TRACE_NO_EA 0xffffffff
+
+typedef struct __attribute__((__packed__)) trace_header {
+  char magic[8];
+  uint32_t version;
+} trace_header;
+
+typedef struct __attribute__((__packed__)) trace_opcode {
+  char mnemonic[4]; // Not NUL terminated if 4 characters long
+  uint8_t mode;
+  uint8_t len;
+} trace_opcode;
+
+// The test script called a routine
+typedef struct __attribute__((__packed__)) trace_call {
+  uint16_t addr;
+} trace_call;
+
+// One executed instruction.  Registers are as they were before it ran.
+typedef struct __attribute__((__packed__)) trace_insn {
+  uint32_t instruction; // Index in the instruction log
+  uint32_t pc28;
+  uint32_t ea28; // 28-bit effective address of the operand, as read
+  uint16_t pc;
+  uint8_t bytes[3];
+  uint8_t len;
+  uint8_t flags;
+  uint8_t cycles;
+  uint8_t a, x, y, z, b, p;
+  uint16_t sp;
+  uint16_t maplo, maphi;
+  uint8_t maplomb, maphimb;
+} trace_insn;
+
+// 28-bit address of a symbol, followed by name_len bytes of its name
+typedef struct __attribute__((__packed__)) trace_symbol {
+  uint32_t addr;
+  uint16_t name_len;
+} trace_symbol;
+
+#endif
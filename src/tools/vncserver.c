@@ -11,14 +11,17 @@
 #include <netinet/if_ether.h>
 #include <netinet/tcp.h>
 #include <netinet/ip.h>
+#include <stdint.h>
 #include <string.h>
 #include <signal.h>
 #include <netdb.h>
 #include <time.h>
 #include <poll.h>
 #include <termios.h>
+#include <semaphore.h>
 
 int sendScanCode(int scan_code);
+int initDirtyTracking(unsigned char *buffer);
 
 int raster_line_number = -1;
 unsigned int raster_line[800];
@@ -29,6 +32,8 @@ int image_offset = 0;
 int drawing = 0;
 int y;
 
+int debug = 0; // x806; //0x21b;
+
 #ifdef WIN32
 #define sleep Sleep
 #else
@@ -41,9 +46,16 @@ int y;
 static const int bpp = 4;
 static int maxx = 800, maxy = 600;
 
+// Largest frame we will resize to.  Raster numbers in the stream are 10 bits.
+#define MAX_WIDTH 2048
+#define MAX_HEIGHT 1024
+
+// Set by --geometry, otherwise the frame size follows the video stream
+int fixed_geometry = 0;
+
 static void initBuffer(unsigned char *buffer)
 {
-  bzero(buffer, maxx * maxy);
+  bzero(buffer, maxx * maxy * bpp);
 }
 
 /* Here we create a structure so that every client has it's own pointer */
@@ -65,7 +77,6 @@ static enum rfbNewClientAction newclient(rfbClientPtr cl)
   return RFB_CLIENT_ACCEPT;
 }
 
-#if 0
 /* switch to new framebuffer contents */
 static void newframebuffer(rfbScreenInfoPtr screen, int width, int height)
 {
@@ -73,13 +84,46 @@ static void newframebuffer(rfbScreenInfoPtr screen, int width, int height)
 
   maxx = width;
   maxy = height;
-  oldfb = (unsigned char*)screen->frameBuffer;
-  newfb = (unsigned char*)malloc(maxx * maxy * bpp);
+  oldfb = (unsigned char *)screen->frameBuffer;
+  newfb = (unsigned char *)malloc(maxx * maxy * bpp);
+  if (!newfb) {
+    fprintf(stderr, "Could not allocate %dx%d framebuffer.\n", maxx, maxy);
+    exit(-1);
+  }
   initBuffer(newfb);
-  rfbNewFramebuffer(screen, (char*)newfb, maxx, maxy, 8, 3, bpp);
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  // The client output threads read the framebuffer while they hold their
+  // sendMutex, so hold all of those while swapping, so that none of them can
+  // still be using the old framebuffer when we free it
+  rfbClientPtr *locked = NULL;
+  int locked_count = 0;
+  rfbClientIteratorPtr clients = rfbGetClientIterator(screen);
+  rfbClientPtr cl;
+  while ((cl = rfbClientIteratorNext(clients))) {
+    locked = realloc(locked, (locked_count + 1) * sizeof(rfbClientPtr));
+    if (!locked) {
+      fprintf(stderr, "Could not allocate memory to resize the framebuffer.\n");
+      exit(-1);
+    }
+    rfbIncrClientRef(cl);
+    LOCK(cl->sendMutex);
+    locked[locked_count++] = cl;
+  }
+  rfbReleaseClientIterator(clients);
+  rfbNewFramebuffer(screen, (char *)newfb, maxx, maxy, 8, 3, bpp);
+  for (int i = 0; i < locked_count; i++) {
+    UNLOCK(locked[i]->sendMutex);
+    rfbDecrClientRef(locked[i]);
+  }
+  free(locked);
+#else
+  rfbNewFramebuffer(screen, (char *)newfb, maxx, maxy, 8, 3, bpp);
+#endif
   free(oldfb);
+  if (initDirtyTracking(newfb))
+    exit(-1);
+  printf("Frame geometry is now %dx%d.\n", maxx, maxy);
 }
-#endif
 
 /* Here the key events are handled */
 
@@ -362,11 +406,72 @@ static void dokey(rfbBool down, rfbKeySym key, rfbClientPtr cl)
   }
 }
 
-int updateFrameBuffer(rfbScreenInfoPtr screen)
+// Rasters drawn since the last frame, and the hash of each raster as it was
+// at the end of the last frame.  At the end of each frame, only the rasters
+// whose contents have changed are marked as modified, so that libvncserver
+// only has to encode and send those.
+unsigned char *raster_touched = NULL;
+uint64_t *raster_hash = NULL;
+
+uint64_t hashRaster(unsigned char *raster)
 {
-  // Tell VNC that everything has changed, and let it do the optimisation.
+  // FNV-1a over 64 bit words, then over any remaining bytes
+  uint64_t h = 0xcbf29ce484222325ULL;
+  int len = maxx * bpp;
+  int i;
+  for (i = 0; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, &raster[i], 8);
+    h = (h ^ w) * 0x100000001b3ULL;
+  }
+  for (; i < len; i++)
+    h = (h ^ raster[i]) * 0x100000001b3ULL;
+  return h;
+}
 
-  rfbMarkRectAsModified(screen, 0, 0, maxx - 1, maxy - 1);
+int initDirtyTracking(unsigned char *buffer)
+{
+  free(raster_touched);
+  free(raster_hash);
+  raster_touched = calloc(maxy, 1);
+  raster_hash = calloc(maxy, sizeof(uint64_t));
+  if (!raster_touched || !raster_hash) {
+    fprintf(stderr, "Could not allocate dirty raster tracking.\n");
+    return -1;
+  }
+  for (int row = 0; row < maxy; row++)
+    raster_hash[row] = hashRaster(&buffer[row * maxx * bpp]);
+  return 0;
+}
+
+int updateFrameBuffer(rfbScreenInfoPtr screen)
+{
+  // Tell VNC which rasters have changed since the last frame, coalescing
+  // runs of adjacent changed rasters into single rectangles.
+  unsigned char *buffer = (unsigned char *)screen->frameBuffer;
+  int first_changed = -1;
+  int changed = 0;
+
+  for (int row = 0; row <= maxy; row++) {
+    int is_changed = 0;
+    if (row < maxy && raster_touched[row]) {
+      raster_touched[row] = 0;
+      uint64_t h = hashRaster(&buffer[row * maxx * bpp]);
+      if (h != raster_hash[row]) {
+        raster_hash[row] = h;
+        is_changed = 1;
+        changed++;
+      }
+    }
+    if (is_changed && first_changed == -1)
+      first_changed = row;
+    else if (!is_changed && first_changed != -1) {
+      rfbMarkRectAsModified(screen, 0, first_changed, maxx, row);
+      first_changed = -1;
+    }
+  }
+  if (debug & 0x1000)
+    printf("%d rasters changed.\n", changed);
 
   return 0;
 }
@@ -612,27 +717,59 @@ int openSerialPort(char *port)
   return 0;
 }
 
-int setPixel(rfbScreenInfoPtr screen, int x, int y, uint32_t v)
+// Start of raster y in the framebuffer, or NULL if y is not on screen, so that
+// drawing a pixel only needs to check x.
+unsigned char *raster_ptr = NULL;
+
+void selectRaster(rfbScreenInfoPtr screen, int y)
 {
-  //  printf("(%d,%d) = %08x\n",x,y,v);
-  if (y >= 0 && y < maxy && x >= 0 && x < maxx) {
-    ((unsigned char *)screen->frameBuffer)[(y * maxx * 4) + x * 4 + 3] = 0;
-    ((unsigned char *)screen->frameBuffer)[(y * maxx * 4) + x * 4 + 2] = v & 0xff;
-    ((unsigned char *)screen->frameBuffer)[(y * maxx * 4) + x * 4 + 1] = (v >> 8) & 0xff;
-    ((unsigned char *)screen->frameBuffer)[(y * maxx * 4) + x * 4 + 0] = (v >> 16) & 0xff;
+  if (y >= 0 && y < maxy) {
+    raster_touched[y] = 1;
+    raster_ptr = &((unsigned char *)screen->frameBuffer)[y * maxx * 4];
   }
-  return 0;
+  else
+    raster_ptr = NULL;
+}
+
+static inline void setPixel(int x, uint32_t v)
+{
+  if (raster_ptr && (unsigned int)x < (unsigned int)maxx) {
+    unsigned char *p = &raster_ptr[x * 4];
+    p[3] = 0;
+    p[2] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[0] = (v >> 16) & 0xff;
+  }
+}
+
+static inline void setPixels(int x, int run, uint32_t v)
+{
+  // Clips the run to the raster once, instead of checking every pixel
+  if (!raster_ptr || x < 0 || x >= maxx)
+    return;
+  if (run > maxx - x)
+    run = maxx - x;
+  uint32_t pixel;
+  unsigned char *p = (unsigned char *)&pixel;
+  p[3] = 0;
+  p[2] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  p[0] = (v >> 16) & 0xff;
+  uint32_t *dest = (uint32_t *)&raster_ptr[x * 4];
+  for (int i = 0; i < run; i++)
+    dest[i] = pixel;
 }
 
 int setRaster(rfbScreenInfoPtr screen, int y, uint32_t v)
 {
   if (y >= 0 && y < maxy) {
+    raster_touched[y] = 1;
     unsigned char *raster = &((unsigned char *)screen->frameBuffer)[y * maxx * 4];
     raster[3] = 0;
     raster[2] = v & 0xff;
     raster[1] = (v >> 8) & 0xff;
     raster[0] = (v >> 16) & 0xff;
-    bcopy(&raster[0], &raster[4], maxx * 4 - 1);
+    bcopy(&raster[0], &raster[4], (maxx - 1) * 4);
   }
   return 0;
 }
@@ -650,16 +787,687 @@ int dump_bytes(char *msg, unsigned char *bytes, int length)
   return 0;
 }
 
+// The framepacker.vhdl bit stream is a sequence of prefix-coded tokens, most
+// significant bit first.  No prefix is longer than 8 bits, so the next byte of
+// the stream is enough to look up which token comes next, and how many bits of
+// argument follow its prefix.
+#define TOKEN_SAME 0      // 0: Repeat the current colour
+#define TOKEN_COLOUR1 1   // 10: Swap to the previous colour
+#define TOKEN_COLOUR2 2   // 1100: Rotate to the 3rd most recent colour
+#define TOKEN_COLOUR3 3   // 1101: ... 4th
+#define TOKEN_COLOUR4 4   // 1110: ... 5th
+#define TOKEN_EXPLICIT 5  // 11110 + 12 bit colour
+#define TOKEN_RASTER 6    // 111110 + 10 bit raster number
+#define TOKEN_NEW_FRAME 7 // 11111100
+#define TOKEN_RESERVED 8  // 11111101
+#define TOKEN_RUN 9       // 11111110 + 8 bit run length
+#define TOKEN_INVALID 10  // 11111111: Skipped a bit at a time
+
+// Tokens can only be decoded once this many bits of the packet are in hand,
+// which means that the last 19 bits of each packet are never decoded.
+#define TOKEN_WINDOW_BITS 20
+
+typedef struct token_code {
+  unsigned char type;
+  unsigned char len;      // Prefix length
+  unsigned char arg_bits; // Bits of argument after the prefix
+} token_code;
+
+token_code token_table[256];
+
+void build_token_table(void)
+{
+  for (int i = 0; i < 256; i++) {
+    token_code *t = &token_table[i];
+    t->arg_bits = 0;
+    if (!(i & 0x80)) {
+      t->type = TOKEN_SAME;
+      t->len = 1;
+    }
+    else if ((i & 0xc0) == 0x80) {
+      t->type = TOKEN_COLOUR1;
+      t->len = 2;
+    }
+    else if ((i & 0xf0) == 0xc0) {
+      t->type = TOKEN_COLOUR2;
+      t->len = 4;
+    }
+    else if ((i & 0xf0) == 0xd0) {
+      t->type = TOKEN_COLOUR3;
+      t->len = 4;
+    }
+    else if ((i & 0xf0) == 0xe0) {
+      t->type = TOKEN_COLOUR4;
+      t->len = 4;
+    }
+    else if ((i & 0xf8) == 0xf0) {
+      t->type = TOKEN_EXPLICIT;
+      t->len = 5;
+      t->arg_bits = 12;
+    }
+    else if ((i & 0xfc) == 0xf8) {
+      t->type = TOKEN_RASTER;
+      t->len = 6;
+      t->arg_bits = 10;
+    }
+    else if (i == 0xfc) {
+      t->type = TOKEN_NEW_FRAME;
+      t->len = 8;
+    }
+    else if (i == 0xfd) {
+      t->type = TOKEN_RESERVED;
+      t->len = 8;
+    }
+    else if (i == 0xfe) {
+      t->type = TOKEN_RUN;
+      t->len = 8;
+      t->arg_bits = 8;
+    }
+    else {
+      t->type = TOKEN_INVALID;
+      t->len = 1;
+    }
+  }
+}
+
+// Reads the packet most significant bit first, through a 64 bit accumulator
+// that holds the next bits left aligned.
+typedef struct bit_reader {
+  const unsigned char *data;
+  int len;
+  int next_byte;
+  uint64_t bits;
+  int bit_count;
+} bit_reader;
+
+static inline void bits_refill(bit_reader *r)
+{
+  // Past the end of the data, zeroes are shifted in
+  while (r->bit_count <= 56) {
+    uint64_t byte = r->next_byte < r->len ? r->data[r->next_byte] : 0;
+    r->next_byte++;
+    r->bits |= byte << (56 - r->bit_count);
+    r->bit_count += 8;
+  }
+}
+
+static inline unsigned int bits_peek(bit_reader *r, int n)
+{
+  return r->bits >> (64 - n);
+}
+
+static inline void bits_skip(bit_reader *r, int n)
+{
+  r->bits <<= n;
+  r->bit_count -= n;
+}
+
+int x = 0;
+
+// For following the size of the video stream: how many complete rasters of
+// each width the current frame has had, and from how many packets, and the
+// highest raster number seen in sequence.  A raster is only complete if both
+// of the markers around it are in the same packet.
+#define GEOMETRY_FRAMES 3
+int raster_widths[MAX_WIDTH + 1];
+int raster_width_packets[MAX_WIDTH + 1];
+unsigned long long raster_width_last_packet[MAX_WIDTH + 1];
+int frame_height = 0;
+// The size that the last frames agreed on, and how many did
+int geometry_width = 0;
+int geometry_height = 0;
+int geometry_frames = 0;
+
+void countRaster(int y, int width, unsigned long long packet)
+{
+  // Called at the end of raster y (or -1 if we are not in sync)
+  if (y < 0 || width < 1 || width > MAX_WIDTH)
+    return;
+  if (y + 1 > frame_height)
+    frame_height = y + 1;
+  raster_widths[width]++;
+  if (raster_width_last_packet[width] != packet) {
+    raster_width_last_packet[width] = packet;
+    raster_width_packets[width]++;
+  }
+}
+
+void checkGeometry(rfbScreenInfoPtr screen)
+{
+  // Called at the start of each frame.  The width of the last frame is that
+  // of most of its complete rasters, as long as they came from more than one
+  // packet, so that a padded packet can't change it.  Resizes once
+  // GEOMETRY_FRAMES frames in a row agree on a new size, so that a frame cut
+  // short by a lost packet doesn't either.
+  int width = 0;
+  for (int w = 1; w <= MAX_WIDTH; w++)
+    if (raster_width_packets[w] > 1 && raster_widths[w] > raster_widths[width])
+      width = w;
+  int height = frame_height;
+  bzero(raster_widths, sizeof(raster_widths));
+  bzero(raster_width_packets, sizeof(raster_width_packets));
+  frame_height = 0;
+
+  if (fixed_geometry || !width || height < 1) {
+    geometry_frames = 0;
+    return;
+  }
+  if (width != geometry_width || height != geometry_height) {
+    geometry_width = width;
+    geometry_height = height;
+    geometry_frames = 0;
+  }
+  if (++geometry_frames == GEOMETRY_FRAMES && (width != maxx || height != maxy))
+    newframebuffer(screen, width, height);
+}
+
+void reset_colours(void)
+{
+  colour0 = 0x000000;
+  colour1 = 0xf0f0f0;
+  colour2 = 0x303030;
+  colour3 = 0x707070;
+  colour4 = 0xb0b0b0;
+}
+
+// What the decoder has made of the packets so far, for the replay statistics
+struct decode_stats {
+  unsigned long long packets;
+  unsigned long long frames;
+  unsigned long long rasters;
+  unsigned long long rasters_unsynced; // First raster of each packet, which we skip
+  unsigned long long rasters_dropped;  // Non successive raster lines
+} stats;
+
+int decode_packet(rfbScreenInfoPtr screen, unsigned char *packet, int len)
+{
+  // Decodes the bit-packed video data that follows the header of a packet.
+  // Each packet starts outside a frame, so that we can synchronise without
+  // visible artefacts.
+  bit_reader r = { packet, len, 0x56, 0, 0 };
+  long long bits_left = (long long)(len - 0x56) * 8;
+  int lasty = -1;
+  int frame_started = 0;
+  int t, c, run;
+  y = -1;
+  selectRaster(screen, y);
+  stats.packets++;
+
+  while (bits_left >= TOKEN_WINDOW_BITS) {
+    bits_refill(&r);
+    const token_code *code = &token_table[bits_peek(&r, 8)];
+    bits_skip(&r, code->len);
+    int arg = code->arg_bits ? bits_peek(&r, code->arg_bits) : 0;
+    bits_skip(&r, code->arg_bits);
+    bits_left -= code->len + code->arg_bits;
+    if (debug & 0x200)
+      printf(">> token %d, arg $%x\n", code->type, arg);
+
+    switch (code->type) {
+    case TOKEN_EXPLICIT:
+      colour4 = colour3;
+      colour3 = colour2;
+      colour2 = colour1;
+      colour1 = colour0;
+      colour0 = ((arg & 0xf) << 4) | ((arg & 0xf0) << 8) | ((arg & 0xf00) << 12);
+      if (debug & 0x800)
+        printf("Saw new colour #%06x at (%d,%d)\n", colour0, x, y);
+      setPixel(x++, colour0);
+      break;
+    case TOKEN_RASTER:
+      setRaster(screen, y, colour0);
+      countRaster(y, x, stats.packets);
+      y = arg;
+      stats.rasters++;
+      if (lasty == -1) {
+        lasty = y;
+        y = -1;
+        stats.rasters_unsynced++;
+      }
+      else {
+        // Raster 0 after a frame marker is where the next frame starts, and
+        // so is successive too
+        if ((y != (1 + lasty)) && (y != lasty) && (y || !frame_started)) {
+          // Non successive raster lines, block drawing
+          if (debug & 2)
+            printf("lasty was %d, new y = %d\n", lasty, y);
+          lasty = y;
+          y = -1;
+          stats.rasters_dropped++;
+        }
+        else
+          lasty = y;
+      }
+      frame_started = 0;
+      if (debug & 2)
+        printf("Raster #%d (MAX X value seen was %d)\n", y, x);
+      selectRaster(screen, y);
+      x = 0;
+      reset_colours();
+      break;
+    case TOKEN_RUN:
+      // RLE run of 0 - 255 pixels
+      run = arg;
+      if (debug & 8)
+        printf("Run of %d at %d,%d\n", run, x, y);
+      // Pixels past the edge of the framebuffer are counted, so that we can
+      // tell how wide the rasters really are, but not drawn
+      if (x != -1 && x < MAX_WIDTH) {
+        if (run > MAX_WIDTH - x)
+          run = MAX_WIDTH - x;
+        setPixels(x, run, colour0);
+        x += run;
+      }
+      if (debug & 8)
+        printf("After run, x=%d\n", x);
+      break;
+    case TOKEN_NEW_FRAME:
+      if (debug & 1)
+        printf("New frame (y got to %d)\n", y);
+      stats.frames++;
+      if (y != -1)
+        setRaster(screen, y, colour0);
+      countRaster(y, x, stats.packets);
+      y = -1;
+      x = -1;
+      frame_started = 1;
+      selectRaster(screen, y);
+      reset_colours();
+      updateFrameBuffer(screen);
+      checkGeometry(screen);
+      break;
+    case TOKEN_RESERVED:
+      // Reserved -- this is an error for now
+      if (debug & 0x100)
+        printf("Reserved token.\n");
+      break;
+    case TOKEN_COLOUR2:
+      t = colour2;
+      colour2 = colour1;
+      colour1 = colour0;
+      colour0 = t;
+      if (debug & 4)
+        printf("Colour 2 @ x=%d (colour=#%06x)\n", x, colour0);
+      if (x != -1)
+        setPixel(x++, colour0);
+      break;
+    case TOKEN_COLOUR3:
+      t = colour3;
+      colour3 = colour2;
+      colour2 = colour1;
+      colour1 = colour0;
+      colour0 = t;
+      if (debug & 4)
+        printf("Colour 3\n");
+      if (x != -1)
+        setPixel(x++, colour0);
+      break;
+    case TOKEN_COLOUR4:
+      t = colour4;
+      colour4 = colour3;
+      colour3 = colour2;
+      colour2 = colour1;
+      colour1 = colour0;
+      colour0 = t;
+      if (debug & 4)
+        printf("Colour 4 @ %d,%d\n", x, y);
+      if (x != -1)
+        setPixel(x++, colour0);
+      break;
+    case TOKEN_COLOUR1:
+      c = colour1;
+      colour1 = colour0;
+      colour0 = c;
+      if (debug & 4)
+        printf("Previous colour @ %d,%d\n", x, y);
+      if (x != -1)
+        setPixel(x++, colour0);
+      break;
+    case TOKEN_SAME:
+      if (debug & 4)
+        printf("Same colour at %d,%d\n", x, y);
+      if (x != -1)
+        setPixel(x++, colour0);
+      break;
+    case TOKEN_INVALID:
+      break;
+    }
+  }
+  return 0;
+}
+
+// Packets are read from the video proxy by ingestThread, and handed to the
+// decoder through a single producer, single consumer ring of preallocated
+// slots.  head is only written by the producer and tail only by the consumer,
+// so no locks are needed.  If the decoder falls behind and the ring fills,
+// packets are still read from the socket, so that the kernel socket buffer
+// never overflows, but are dropped and counted.  ring_filled is posted for
+// each packet published, so that the decoder can sleep while the ring is
+// empty.
+#define PACKET_SLOT_SIZE 8192
+#define RING_SLOTS 256 // Must be a power of 2
+
+typedef struct packet_slot {
+  int len;
+  unsigned char data[PACKET_SLOT_SIZE];
+} packet_slot;
+
+typedef struct packet_ring {
+  packet_slot slots[RING_SLOTS];
+  unsigned int head __attribute__((aligned(64)));
+  unsigned int tail __attribute__((aligned(64)));
+  // Written by the producer only
+  unsigned long long received __attribute__((aligned(64)));
+  unsigned long long dropped;
+} packet_ring;
+
+packet_ring ring;
+sem_t ring_filled;
+
+int do_dummy = 0;
+int video_sock = -1;
+pthread_t ingestThread;
+
+packet_slot *ring_next_free(void)
+{
+  // Returns the slot for the producer to fill, or NULL if the ring is full
+  unsigned int head = ring.head;
+  unsigned int tail = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+  if (head - tail == RING_SLOTS)
+    return NULL;
+  return &ring.slots[head & (RING_SLOTS - 1)];
+}
+
+void ring_publish(void)
+{
+  __atomic_store_n(&ring.head, ring.head + 1, __ATOMIC_RELEASE);
+  sem_post(&ring_filled);
+}
+
+packet_slot *ring_next_full(void)
+{
+  // Returns the oldest packet for the consumer, or NULL if the ring is empty
+  unsigned int tail = ring.tail;
+  unsigned int head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+  if (head == tail)
+    return NULL;
+  return &ring.slots[tail & (RING_SLOTS - 1)];
+}
+
+void ring_release(void)
+{
+  __atomic_store_n(&ring.tail, ring.tail + 1, __ATOMIC_RELEASE);
+}
+
+int read_dummy_packet(unsigned char *packet)
+{
+  // Feed dummy data (from simulation) to test
+  int len = 0;
+  FILE *f = fopen("dummy.dat", "r");
+  if (f) {
+    char line[1024];
+    len = 0x56;
+    line[0] = 0;
+    fgets(line, 1024, f);
+    while (line[0] && (len < 8000)) {
+      packet[len++] = strtoll(line, NULL, 16);
+      line[0] = 0;
+      fgets(line, 1024, f);
+    }
+    fclose(f);
+  }
+  return len;
+}
+
+void *ingest_handler(void *arg)
+{
+  unsigned char scratch[PACKET_SLOT_SIZE];
+
+  while (1) {
+    packet_slot *slot = ring_next_free();
+    unsigned char *packet = slot ? slot->data : scratch;
+    int len;
+
+    if (do_dummy) {
+      // Repeat the dummy packet at about the frame rate
+      len = read_dummy_packet(packet);
+      usleep(20000);
+    }
+    else {
+      len = read(video_sock, packet, 2132);
+      if (len < 1)
+        usleep(10000);
+    }
+
+    // Only full packets are probably C65GS compressed video frames
+    if (len <= 2100)
+      continue;
+    __atomic_store_n(&ring.received, ring.received + 1, __ATOMIC_RELAXED);
+    if (!slot) {
+      __atomic_store_n(&ring.dropped, ring.dropped + 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    slot->len = len;
+    ring_publish();
+  }
+  return NULL;
+}
+
+// Replay of recorded video packets, either from a pcap capture of the
+// Ethernet frames, or from a raw capture of the stream that the video proxy
+// serves on port 6565, i.e., back to back 2132 byte packets.
+#define REPLAY_MAX_SPEED 0
+#define REPLAY_REAL_TIME -1
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+
+typedef struct pcap_file_header {
+  uint32_t magic;
+  uint16_t version_major, version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs, snaplen, linktype;
+} pcap_file_header;
+
+typedef struct pcap_record_header {
+  uint32_t ts_sec, ts_frac, incl_len, orig_len;
+} pcap_record_header;
+
+char *replay_file = NULL;
+int replay_rate = REPLAY_MAX_SPEED; // Packets per second, if positive
+FILE *replay_f = NULL;
+int replay_pcap = 0;
+int replay_swapped = 0;
+double replay_tick = 1e-6; // Seconds per unit of ts_frac
+int replay_done = 0;
+
+uint32_t replay_u32(uint32_t v)
+{
+  return replay_swapped ? __builtin_bswap32(v) : v;
+}
+
+int replay_open(void)
+{
+  pcap_file_header h;
+
+  replay_f = fopen(replay_file, "rb");
+  if (!replay_f) {
+    fprintf(stderr, "Could not open '%s' for replay: %s\n", replay_file, strerror(errno));
+    return -1;
+  }
+  if (fread(&h, sizeof(h), 1, replay_f) == 1) {
+    if (h.magic == PCAP_MAGIC || h.magic == PCAP_MAGIC_NSEC)
+      replay_pcap = 1;
+    else if (h.magic == __builtin_bswap32(PCAP_MAGIC) || h.magic == __builtin_bswap32(PCAP_MAGIC_NSEC)) {
+      replay_pcap = 1;
+      replay_swapped = 1;
+    }
+  }
+  if (replay_pcap) {
+    if (replay_u32(h.magic) == PCAP_MAGIC_NSEC)
+      replay_tick = 1e-9;
+    if (replay_u32(h.linktype) != PCAP_LINKTYPE_ETHERNET) {
+      fprintf(stderr, "'%s' is not a capture of Ethernet frames (link type %u).\n", replay_file,
+          replay_u32(h.linktype));
+      return -1;
+    }
+  }
+  else {
+    if (replay_rate == REPLAY_REAL_TIME) {
+      fprintf(stderr, "'%s' is a raw capture with no timestamps: use --rate max or --rate N.\n", replay_file);
+      return -1;
+    }
+    rewind(replay_f);
+  }
+  fprintf(stderr, "Replaying %s capture '%s'.\n", replay_pcap ? "pcap" : "raw", replay_file);
+  return 0;
+}
+
+int replay_next(unsigned char *packet, double *timestamp)
+{
+  // Reads the next recorded packet, returning its length, or 0 at the end of
+  // the file
+  if (!replay_pcap)
+    return fread(packet, 1, 2132, replay_f);
+
+  pcap_record_header r;
+  while (fread(&r, sizeof(r), 1, replay_f) == 1) {
+    uint32_t len = replay_u32(r.incl_len);
+    *timestamp = replay_u32(r.ts_sec) + replay_u32(r.ts_frac) * replay_tick;
+    if (len > PACKET_SLOT_SIZE) {
+      // Too big to be one of ours
+      if (fseek(replay_f, len, SEEK_CUR))
+        break;
+      continue;
+    }
+    if (fread(packet, 1, len, replay_f) != len)
+      break;
+    return len;
+  }
+  return 0;
+}
+
+double now_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void *replay_handler(void *arg)
+{
+  // Stands in for ingest_handler.  At maximum speed we wait for the decoder
+  // rather than dropping packets, so that every run decodes the same stream.
+  unsigned char packet[PACKET_SLOT_SIZE];
+  double start = now_seconds(), first_timestamp = -1, timestamp = 0;
+  unsigned long long n = 0;
+  int len;
+
+  while ((len = replay_next(packet, &timestamp)) > 0) {
+    // Only full packets are probably C65GS compressed video frames
+    if (len <= 2100)
+      continue;
+
+    double due = start;
+    if (replay_rate == REPLAY_REAL_TIME) {
+      if (first_timestamp < 0)
+        first_timestamp = timestamp;
+      due += timestamp - first_timestamp;
+    }
+    else if (replay_rate > 0)
+      due += (double)n / replay_rate;
+    n++;
+    double wait = due - now_seconds();
+    if (wait > 0)
+      usleep(wait * 1e6);
+
+    packet_slot *slot = ring_next_free();
+    if (replay_rate == REPLAY_MAX_SPEED)
+      while (!slot) {
+        usleep(50);
+        slot = ring_next_free();
+      }
+    __atomic_store_n(&ring.received, ring.received + 1, __ATOMIC_RELAXED);
+    if (!slot) {
+      __atomic_store_n(&ring.dropped, ring.dropped + 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    memcpy(slot->data, packet, len);
+    slot->len = len;
+    ring_publish();
+  }
+  fclose(replay_f);
+  __atomic_store_n(&replay_done, 1, __ATOMIC_RELEASE);
+  sem_post(&ring_filled);
+  return NULL;
+}
+
+void replay_report(double seconds)
+{
+  unsigned long long received = __atomic_load_n(&ring.received, __ATOMIC_RELAXED);
+  unsigned long long dropped = __atomic_load_n(&ring.dropped, __ATOMIC_RELAXED);
+
+  if (seconds <= 0)
+    seconds = 1e-9;
+  printf("Replayed %llu packets in %.3f seconds, %llu dropped before decoding.\n", received, seconds, dropped);
+  printf("Decoded %llu packets (%.1f packets/s) and %llu frames (%.1f frames/s).\n", stats.packets,
+      stats.packets / seconds, stats.frames, stats.frames / seconds);
+  printf("Saw %llu rasters: skipped %llu at the start of packets, dropped %llu non successive (%.2f%%).\n",
+      stats.rasters, stats.rasters_unsynced, stats.rasters_dropped,
+      stats.rasters ? 100.0 * stats.rasters_dropped / stats.rasters : 0.0);
+  fflush(stdout);
+}
+
+void parseOptions(int *argc, char **argv)
+{
+  // Takes our own options out of argv, leaving the serial port and any
+  // libvncserver options
+  int out = 1;
+  for (int i = 1; i < *argc; i++) {
+    if (!strcmp(argv[i], "--geometry") && i + 1 < *argc) {
+      i++;
+      if (sscanf(argv[i], "%dx%d", &maxx, &maxy) != 2 || maxx < 1 || maxy < 1 || maxx > MAX_WIDTH
+          || maxy > MAX_HEIGHT) {
+        fprintf(stderr, "Invalid geometry '%s': expected WIDTHxHEIGHT, up to %dx%d.\n", argv[i], MAX_WIDTH, MAX_HEIGHT);
+        exit(-1);
+      }
+      fixed_geometry = 1;
+    }
+    else if (!strcmp(argv[i], "--replay") && i + 1 < *argc)
+      replay_file = argv[++i];
+    else if (!strcmp(argv[i], "--rate") && i + 1 < *argc) {
+      i++;
+      if (!strcmp(argv[i], "max"))
+        replay_rate = REPLAY_MAX_SPEED;
+      else if (!strcmp(argv[i], "real"))
+        replay_rate = REPLAY_REAL_TIME;
+      else if ((replay_rate = atoi(argv[i])) < 1) {
+        fprintf(stderr, "Invalid rate '%s': expected max, real or a number of packets per second.\n", argv[i]);
+        exit(-1);
+      }
+    }
+    else
+      argv[out++] = argv[i];
+  }
+  *argc = out;
+  argv[out] = NULL;
+}
+
 int main(int argc, char **argv)
 {
-  int do_dummy = 0;
-  int debug = 0; // x806; //0x21b;
+  parseOptions(&argc, argv);
+
+  if (replay_file && replay_open())
+    exit(-1);
 
   if (!do_dummy) {
     if (argc > 1)
       openSerialPort(argv[1]);
   }
 
+  build_token_table();
+
   rfbScreenInfoPtr rfbScreen = rfbGetScreen(&argc, argv, maxx, maxy, 8, 3, bpp);
   if (!rfbScreen)
     return 0;
@@ -672,6 +1480,8 @@ int main(int argc, char **argv)
   rfbScreen->httpEnableProxyConnect = TRUE;
 
   initBuffer((unsigned char *)rfbScreen->frameBuffer);
+  if (initDirtyTracking((unsigned char *)rfbScreen->frameBuffer))
+    exit(-1);
 
   /* initialize the server */
   rfbInitServer(rfbScreen);
@@ -680,248 +1490,68 @@ int main(int argc, char **argv)
   rfbRunEventLoop(rfbScreen, -1, TRUE);
   fprintf(stderr, "Running background loop...\n");
 
-  int sock = connect_to_port(6565);
-  if (!do_dummy) {
-    if (sock == -1) {
+  if (!do_dummy && !replay_file) {
+    video_sock = connect_to_port(6565);
+    if (video_sock == -1) {
       fprintf(stderr, "Could not connect to video proxy on port 6565.\n");
       exit(-1);
     }
   }
 
+  double replay_start = now_seconds();
+  sem_init(&ring_filled, 0, 0);
+  int err = pthread_create(&ingestThread, NULL, replay_file ? replay_handler : ingest_handler, NULL);
+  if (err) {
+    fprintf(stderr, "Could not start the video packet thread: %s\n", strerror(err));
+    rfbShutdownServer(rfbScreen, TRUE);
+    exit(-1);
+  }
+
   printf("Started.\n");
   fflush(stdout);
 
-  int y = -1;
-  int x = 0;
-
-  char bit_sequence[21];
-
-  // Put end of string marker in place
-  bit_sequence[20] = 0;
+  unsigned long long last_dropped = 0;
+  time_t last_report = time(0);
 
   while (1) {
-    unsigned char packet[8192];
-    int len;
-
-    if (do_dummy) {
-      // Feed dummy data (from simulation) to test
-      FILE *f = fopen("dummy.dat", "r");
-      if (f) {
-        char line[1024];
-        len = 0x56;
-        line[0] = 0;
-        fgets(line, 1024, f);
-        while (line[0] && (len < 8000)) {
-          packet[len++] = strtoll(line, NULL, 16);
-          line[0] = 0;
-          fgets(line, 1024, f);
-        }
-        fclose(f);
+    // Sleep until there is a packet, but wake each second to report drops
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec++;
+    sem_timedwait(&ring_filled, &deadline);
+
+    packet_slot *slot = ring_next_full();
+    if (!slot) {
+      if (__atomic_load_n(&replay_done, __ATOMIC_ACQUIRE) && !ring_next_full()) {
+        replay_report(now_seconds() - replay_start);
+        if (replay_rate == REPLAY_MAX_SPEED)
+          break;
+        // Keep showing the last frame until we are stopped
+        replay_done = 0;
       }
     }
     else {
-      len = read(sock, packet, 2132);
-      if (len < 1)
-        usleep(10000);
-    }
-
-    if (len > 2100) {
-      // probably a C65GS compressed video frame.
-      // printf("."); fflush(stdout);
-
       if (debug & 2) {
         printf("--------------- Packet.\n");
-        dump_bytes("packet", packet, len);
+        dump_bytes("packet", slot->data, slot->len);
       }
 
-      // Packet consists solely of bit-packed data
-
-      // Erase any banked up bits before starting decode of next packet
-      memset(bit_sequence, '.', 20);
-
-      // Start from beginning of data
-      int offset = 0x56;
-      int bn = 0;
-
-      int counter = 0;
-
-      // Process all bits in packet
-
-      // Start outside frame so that we can synchronise without visible artefacts
-      int lasty = -1;
-      y = -1;
+      decode_packet(rfbScreen, slot->data, slot->len);
+      ring_release();
+    }
 
-      for (; offset < len; offset++) {
-        if (debug & 0x200)
-          printf("> 0x%02x\n", packet[offset]);
-        for (bn = 7; bn >= 0; bn--) {
-          counter++;
-
-          int bit = (packet[offset] >> bn) & 1;
-          // Shuffle bits down
-          bcopy(&bit_sequence[1], &bit_sequence[0], 19);
-          bit_sequence[19] = '0' + bit;
-          if (debug & 0x200) {
-            if (bit_sequence[0] != '.')
-              printf(">> %-8d %s\n", counter, bit_sequence);
-          }
-
-          if (!strncmp("11110", bit_sequence, 5)) {
-            // Explcit colour (12 bits)
-            int s = bit_sequence[17];
-            bit_sequence[17] = 0;
-            int c = strtol(&bit_sequence[5], NULL, 2);
-            colour4 = colour3;
-            colour3 = colour2;
-            colour2 = colour1;
-            colour1 = colour0;
-            colour0 = ((c & 0xf) << 4) | ((c & 0xf0) << 8) | ((c & 0xf00) << 12);
-            if (debug & 0x800)
-              printf("Saw new colour #%06x at (%d,%d)\n", colour0, x, y);
-            bit_sequence[17] = s;
-            memset(bit_sequence, '.', 17);
-            setPixel(rfbScreen, x++, y, colour0);
-          }
-          else if (!strncmp("111110", bit_sequence, 6)) {
-            // Indicate raster (10 bits)
-            int s = bit_sequence[16];
-            bit_sequence[16] = 0;
-            setRaster(rfbScreen, y, colour0);
-            // if (x!=-1) for(;x<maxx;x++) setPixel(rfbScreen,x,y,colour0);
-            y = strtol(&bit_sequence[6], NULL, 2);
-            if (lasty == -1) {
-              lasty = y;
-              y = -1;
-            }
-            else {
-              if ((y != (1 + lasty)) && (y != lasty)) {
-                // Non successive raster lines, block drawing
-                if (debug & 2)
-                  printf("lasty was %d, new y = %d\n", lasty, y);
-                lasty = y;
-                y = -1;
-              }
-              else
-                lasty = y;
-            }
-
-            bit_sequence[16] = s;
-            if (debug & 2)
-              printf("Raster #%d (MAX X value seen was %d)\n", y, x);
-            x = 0;
-            colour0 = 0x000000;
-            colour1 = 0xf0f0f0;
-            colour2 = 0x303030;
-            colour3 = 0x707070;
-            colour4 = 0xb0b0b0;
-            memset(bit_sequence, '.', 16);
-          }
-          else if (!strncmp("11111110", bit_sequence, 8)) {
-            // RLE run of 0 - 255 pixels
-            int s = bit_sequence[16];
-            bit_sequence[16] = 0;
-            int r = strtol(&bit_sequence[8], NULL, 2);
-            bit_sequence[16] = s;
-            if (debug & 8)
-              printf("Run of %d at %d,%d\n", r, x, y);
-            if (x != -1)
-              for (; r && (x < 800); r--) {
-                setPixel(rfbScreen, x++, y, colour0);
-              }
-            memset(bit_sequence, '.', 16);
-            if (debug & 8)
-              printf("After run, x=%d\n", x);
-          }
-          else if (!strncmp("11111100", bit_sequence, 8)) {
-            // New frame
-            if (debug & 1)
-              printf("New frame (y got to %d)\n", y);
-            if (y != -1)
-              setRaster(rfbScreen, y, colour0);
-            // if (x!=-1) for(;x<maxx;x++) setPixel(rfbScreen,x,y,colour0);
-            y = -1;
-            x = -1;
-            memset(bit_sequence, '.', 8);
-            colour0 = 0x000000;
-            colour1 = 0xf0f0f0;
-            colour2 = 0x303030;
-            colour3 = 0x707070;
-            colour4 = 0xb0b0b0;
-            updateFrameBuffer(rfbScreen);
-          }
-          else if (!strncmp("11111101", bit_sequence, 8)) {
-            // Reserved -- this is an error for now
-            if (debug & 0x100)
-              printf("Reserved token.\n");
-            memset(bit_sequence, '.', 8);
-          }
-          else if (!strncmp("1100", bit_sequence, 4)) {
-            // Colour 2
-            int t = colour2;
-            colour2 = colour1;
-            colour1 = colour0;
-            colour0 = t;
-            if (debug & 4)
-              printf("Colour 2 @ x=%d (colour=#%06x)\n", x, colour0);
-            if (x != -1)
-              setPixel(rfbScreen, x++, y, colour0);
-            memset(bit_sequence, '.', 4);
-          }
-          else if (!strncmp("1101", bit_sequence, 4)) {
-            // Colour 3
-            int t = colour3;
-            colour3 = colour2;
-            colour2 = colour1;
-            colour1 = colour0;
-            colour0 = t;
-            if (debug & 4)
-              printf("Colour 3\n");
-            if (x != -1)
-              setPixel(rfbScreen, x++, y, colour0);
-            memset(bit_sequence, '.', 4);
-          }
-          else if (!strncmp("1110", bit_sequence, 4)) {
-            // Colour 4
-            int t = colour4;
-            colour4 = colour3;
-            colour3 = colour2;
-            colour2 = colour1;
-            colour1 = colour0;
-            colour0 = t;
-            if (debug & 4)
-              printf("Colour 4 @ %d,%d\n", x, y);
-            if (x != -1)
-              setPixel(rfbScreen, x++, y, colour0);
-            memset(bit_sequence, '.', 4);
-          }
-          else if (!strncmp("10", bit_sequence, 2)) {
-            // Colour 1
-            int t = colour1;
-            colour1 = colour0;
-            colour0 = t;
-            if (debug & 4)
-              printf("Previous colour @ %d,%d\n", x, y);
-            if (x != -1)
-              setPixel(rfbScreen, x++, y, colour0);
-            //	    if (debug&4)
-            memset(bit_sequence, '.', 2);
-          }
-          else if (!strncmp("0", bit_sequence, 1)) {
-            // Repeat last colour
-            if (debug & 4)
-              printf("Same colour at %d,%d\n", x, y);
-            if (x != -1)
-              setPixel(rfbScreen, x++, y, colour0);
-            memset(bit_sequence, '.', 1);
-          }
-          //	  if (debug&0x800)
-          if (0)
-            printf("Colours = #%06x, #%06x, #%06x, #%06x, #%06x\n", colour0, colour1, colour2, colour3, colour4);
-        }
+    // Report any packets dropped because decoding fell behind
+    if (time(0) != last_report) {
+      last_report = time(0);
+      unsigned long long dropped = __atomic_load_n(&ring.dropped, __ATOMIC_RELAXED);
+      if (dropped != last_dropped) {
+        printf("Dropped %llu of %llu video packets.\n", dropped, __atomic_load_n(&ring.received, __ATOMIC_RELAXED));
+        last_dropped = dropped;
       }
     }
   }
 
+  rfbShutdownServer(rfbScreen, TRUE);
   free(rfbScreen->frameBuffer);
   rfbScreenCleanup(rfbScreen);
 